@@ -0,0 +1,343 @@
+/*
+ * adapt.c - Size the buffer after the memory pressure of the system
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include "print.h"
+#include "adapt.h"
+
+/* Files read */
+#define PSI_FILE		"/proc/pressure/memory"
+#define CGROUP_FILE		"/proc/self/cgroup"
+#define CGROUP_ROOT		"/sys/fs/cgroup"
+#define MEMINFO_FILE	"/proc/meminfo"
+
+/* Local routines */
+static int read_psi(double *);
+static int read_cgvalue(const char *, const char *, size_t *);
+static int read_cgroup(struct adapt *);
+static int read_meminfo(size_t *, size_t *);
+
+
+/*
+ * Read the share of the last ten seconds where some task 
+ * stalled on memory, in percent.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_psi(double *psi)
+{
+	char line[256];
+	FILE *f;
+	int ret;
+
+	if ( (f = fopen(PSI_FILE, "r")) == NULL)
+		return(-1);
+
+	ret = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "some avg10=%lf", psi) == 1) {
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return(ret);
+}
+
+
+/*
+ * Read a value of the cgroup directory dir, "max" is read as 0.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_cgvalue(const char *dir, const char *name, size_t *val)
+{
+	char path[PATH_MAX];
+	char buf[64];
+	unsigned long long ull;
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ( (f = fopen(path, "r")) == NULL)
+		return(-1);
+
+	ret = -1;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		if (!strncmp(buf, "max", 3)) {
+			*val = 0;
+			ret = 0;
+		}
+		else if (sscanf(buf, "%llu", &ull) == 1) {
+			*val = ull;
+			ret = 0;
+		}
+	}
+	fclose(f);
+	return(ret);
+}
+
+
+/*
+ * Read the memory charged to our cgroup and its limit. The soft 
+ * limit memory.high is where the kernel starts to reclaim, it is
+ * used before the hard limit memory.max.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_cgroup(struct adapt *ad)
+{
+	size_t high, max;
+
+	if (read_cgvalue(ad->ad_cgroup, "memory.current", &ad->ad_cg_current) < 0)
+		return(-1);
+	if (read_cgvalue(ad->ad_cgroup, "memory.high", &high) < 0)
+		high = 0;
+	if (read_cgvalue(ad->ad_cgroup, "memory.max", &max) < 0)
+		max = 0;
+
+	ad->ad_cg_limit = high ? high : max;
+	return(0);
+}
+
+
+/*
+ * Read the total and the available memory of the system.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_meminfo(size_t *total, size_t *available)
+{
+	char line[256];
+	unsigned long long kb;
+	FILE *f;
+	int found;
+
+	if ( (f = fopen(MEMINFO_FILE, "r")) == NULL)
+		return(-1);
+
+	found = 0;
+	while ((found != 3) && (fgets(line, sizeof(line), f) != NULL)) {
+		if (sscanf(line, "MemTotal: %llu kB", &kb) == 1) {
+			*total = kb * 1024;
+			found |= 1;
+		}
+		else if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+			*available = kb * 1024;
+			found |= 2;
+		}
+	}
+	fclose(f);
+	return((found == 3) ? 0 : -1);
+}
+
+
+/*
+ * Set up adaptive sizing between floor and ceil bytes, 
+ * and find the sources of memory pressure.
+ * Returns an adapt pointer on success, NULL on error.
+ */
+struct adapt *
+adapt_init(size_t floor, size_t ceil)
+{
+	struct adapt *ad;
+	char line[PATH_MAX - sizeof(CGROUP_ROOT)];
+	size_t val;
+	FILE *f;
+
+	if ( (ad = calloc(1, sizeof(struct adapt))) == NULL) {
+		err_errno("adapt_init: calloc()");
+		return(NULL);
+	}
+	ad->ad_floor = floor;
+	ad->ad_ceil = ceil;
+	ad->ad_reason = "starting";
+
+	if (read_psi(&ad->ad_psi) == 0)
+		ad->ad_sources |= ADAPT_PSI;
+
+	/* The cgroup v2 entry is "0::<path>", the root has no limit */
+	if ( (f = fopen(CGROUP_FILE, "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if (strncmp(line, "0::/", 4) || (line[4] == '\0'))
+				continue;
+
+			snprintf(ad->ad_cgroup, sizeof(ad->ad_cgroup), "%s%s", 
+				CGROUP_ROOT, &line[3]);
+			if (read_cgvalue(ad->ad_cgroup, "memory.current", &val) == 0)
+				ad->ad_sources |= ADAPT_CGROUP;
+			else
+				ad->ad_cgroup[0] = '\0';
+			break;
+		}
+		fclose(f);
+	}
+
+	if (read_meminfo(&ad->ad_total, &ad->ad_available) == 0)
+		ad->ad_sources |= ADAPT_MEMINFO;
+
+	if (ad->ad_sources == 0) {
+		err("No source of memory pressure found, tried %s, %s and %s\n",
+			PSI_FILE, CGROUP_FILE, MEMINFO_FILE);
+		free(ad);
+		return(NULL);
+	}
+	return(ad);
+}
+
+
+/*
+ * Read memory pressure and decide the size of a buffer of size
+ * bytes, with memory bytes resident, at time now. Full is non-zero
+ * if the buffer has reached its size, growing an empty buffer 
+ * would only let it take memory later without asking.
+ * Returns the new size, which is size if it should be kept.
+ */
+size_t
+adapt_size(struct adapt *ad, time_t now, size_t size, size_t memory, int full)
+{
+	long long spare, s;
+	size_t step;
+	int read;
+
+	ad->ad_next = now + ADAPT_SEC;
+	ad->ad_state = ADAPT_HOLD;
+
+	/* Memory that can still be used before the margin is reached,
+	 * the tightest of the system and the cgroup */
+	read = 0;
+	spare = LLONG_MAX;
+	if ((ad->ad_sources & ADAPT_MEMINFO) && 
+			(read_meminfo(&ad->ad_total, &ad->ad_available) == 0)) {
+		ad->ad_headroom = ad->ad_available;
+		ad->ad_margin = ad->ad_total / 100 * ADAPT_MARGIN;
+		spare = (long long)ad->ad_headroom - ad->ad_margin;
+		read++;
+	}
+	if ((ad->ad_sources & ADAPT_CGROUP) && (read_cgroup(ad) == 0)) {
+		read++;
+		if (ad->ad_cg_limit > 0) {
+			s = (long long)ad->ad_cg_limit - ad->ad_cg_current - 
+				ad->ad_cg_limit / 100 * ADAPT_MARGIN;
+			if (s < spare) {
+				ad->ad_headroom = (ad->ad_cg_limit > ad->ad_cg_current) ?
+					ad->ad_cg_limit - ad->ad_cg_current : 0;
+				ad->ad_margin = ad->ad_cg_limit / 100 * ADAPT_MARGIN;
+				spare = s;
+			}
+		}
+	}
+	ad->ad_psi = 0;
+	if ((ad->ad_sources & ADAPT_PSI) && (read_psi(&ad->ad_psi) == 0))
+		read++;
+
+	if (read == 0) {
+		ad->ad_reason = "no reading";
+		return(size);
+	}
+
+	/* Shrink quickly under pressure */
+	if ((ad->ad_psi > ADAPT_PSI_HIGH) || (spare < 0)) {
+		ad->ad_reason = (spare < 0) ? "low memory" : "memory stalls";
+		if (size <= ad->ad_floor)
+			return(size);
+
+		/* Memory below the margin is given back at once, if we hold it */
+		step = size / ADAPT_SHRINK;
+		if ((spare < 0) && ((size_t)-spare > step) && (memory > step))
+			step = ((size_t)-spare < memory) ? (size_t)-spare : memory;
+
+		ad->ad_state = ADAPT_SHRUNK;
+		ad->ad_shrinks++;
+		ad->ad_shrunk = now;
+		return((size - ad->ad_floor > step) ? size - step : ad->ad_floor);
+	}
+
+	/* Grow slowly while memory is left and nothing stalls */
+	step = ad->ad_ceil / ADAPT_GROW;
+	if (size >= ad->ad_ceil)
+		ad->ad_reason = "at ceiling";
+	else if (ad->ad_psi > ADAPT_PSI_LOW)
+		ad->ad_reason = "some stalls";
+	else if (now - ad->ad_shrunk < ADAPT_HOLDOFF)
+		ad->ad_reason = "recently shrunk";
+	else if (!full)
+		ad->ad_reason = "not full";
+	else if (spare < (long long)step)
+		ad->ad_reason = "little memory left";
+	else {
+		ad->ad_reason = "memory available";
+		ad->ad_state = ADAPT_GROWN;
+		ad->ad_grows++;
+		return((ad->ad_ceil - size > step) ? size + step : ad->ad_ceil);
+	}
+	return(size);
+}
+
+
+/*
+ * Returns the names of the sources of memory pressure in
+ * a static buffer
+ */
+const char *
+adapt_sources(int sources)
+{
+	static char buf[64];
+
+	buf[0] = '\0';
+	if (sources & ADAPT_PSI)
+		strcat(buf, "psi,");
+	if (sources & ADAPT_CGROUP)
+		strcat(buf, "cgroup,");
+	if (sources & ADAPT_MEMINFO)
+		strcat(buf, "meminfo,");
+	if (buf[0] != '\0')
+		buf[strlen(buf) - 1] = '\0';
+	return(buf);
+}
+
+
+/*
+ * Free adaptive sizing
+ */
+void
+adapt_free(struct adapt *ad)
+{
+	free(ad);
+}
@@ -0,0 +1,106 @@
+/*
+ * adapt.h - Size the buffer after the memory pressure of the system
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _ADAPT_H
+#define _ADAPT_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <time.h>
+
+/* Seconds between readings of memory pressure */
+#define ADAPT_SEC		2
+
+/* Seconds after shrinking before the buffer may grow again */
+#define ADAPT_HOLDOFF	60
+
+/* Percent of the last ten seconds some task stalled on memory,
+ * shrink above high, grow only below low */
+#define ADAPT_PSI_HIGH	10.0
+#define ADAPT_PSI_LOW	1.0
+
+/* Percent of memory, or of the cgroup limit, to leave free */
+#define ADAPT_MARGIN	10
+
+/* Grow by this part of the ceiling, shrink by this part of the size */
+#define ADAPT_GROW		32
+#define ADAPT_SHRINK	4
+
+/* Sources of memory pressure */
+#define ADAPT_PSI		0x01	/* /proc/pressure/memory */
+#define ADAPT_CGROUP	0x02	/* cgroup v2 memory.current and memory.high */
+#define ADAPT_MEMINFO	0x04	/* MemAvailable of /proc/meminfo */
+
+/* Last decision */
+#define ADAPT_HOLD		0
+#define ADAPT_GROWN		1
+#define ADAPT_SHRUNK	2
+
+/*
+ * Adaptive size of the buffer. The buffer grows from its size toward
+ * the ceiling while memory is available and nothing stalls, one step 
+ * at a time and only when full, and shrinks quickly toward the floor
+ * under pressure. Pressure is read from every source that is found.
+ */
+struct adapt {
+	size_t ad_floor;
+	size_t ad_ceil;
+	int ad_sources;			/* ADAPT_* sources found */
+	char ad_cgroup[PATH_MAX];	/* cgroup v2 directory, empty if none */
+	time_t ad_next;			/* Time of next reading */
+	time_t ad_shrunk;		/* Time of last shrink */
+
+	/* Last reading */
+	double ad_psi;			/* PSI some avg10 in percent */
+	size_t ad_cg_current;	/* Memory charged to the cgroup */
+	size_t ad_cg_limit;		/* memory.high, or memory.max, 0 for none */
+	size_t ad_total;		/* MemTotal */
+	size_t ad_available;	/* MemAvailable */
+	size_t ad_headroom;		/* Memory that can still be used */
+	size_t ad_margin;		/* Memory to leave free */
+
+	int ad_state;			/* Last decision, ADAPT_HOLD, GROWN or SHRUNK */
+	const char *ad_reason;	/* Why */
+	size_t ad_grows;
+	size_t ad_shrinks;
+};
+
+/* Returns non-zero if it is time to read the pressure */
+#define adapt_due(a, now)	((now) >= (a)->ad_next)
+
+/* adapt.c */
+extern struct adapt *adapt_init(size_t, size_t);
+extern size_t adapt_size(struct adapt *, time_t, size_t, size_t, int);
+extern const char *adapt_sources(int);
+extern void adapt_free(struct adapt *);
+
+#endif /* _ADAPT_H */
@@ -0,0 +1,202 @@
+/*
+ * bloom.c - Bloom filter index of the addresses in each time segment of the buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "print.h"
+#include "pkt.h"
+#include "bloom.h"
+
+/* Set and test bits */
+#define BIT_SET(b, n)	((b)[(n) >> 5] |= (1U << ((n) & 31)))
+#define BIT_ISSET(b, n)	((b)[(n) >> 5] & (1U << ((n) & 31)))
+
+/* Local routines */
+static void bloom_insert(struct bloomseg *, const u_char *, int);
+static int bloom_test(struct bloomseg *, const u_char *, int);
+
+
+/*
+ * Add address to segment filter
+ */
+static void
+bloom_insert(struct bloomseg *bs, const u_char *addr, int alen)
+{
+	u_int64_t h;
+	u_int32_t h1, h2, n;
+	int i;
+
+	h = pkt_hash(addr, alen);
+	h1 = (u_int32_t)h;
+	h2 = (u_int32_t)(h >> 32) | 1;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		n = (h1 + i*h2) & (BLOOM_BITS - 1);
+		if (!BIT_ISSET(bs->bs_bits, n)) {
+			BIT_SET(bs->bs_bits, n);
+			bs->bs_bitsset++;
+		}
+	}
+}
+
+
+/*
+ * Returns non-zero if address might be in segment, 
+ * zero if it is definitely not.
+ */
+static int
+bloom_test(struct bloomseg *bs, const u_char *addr, int alen)
+{
+	u_int64_t h;
+	u_int32_t h1, h2, n;
+	int i;
+
+	h = pkt_hash(addr, alen);
+	h1 = (u_int32_t)h;
+	h2 = (u_int32_t)(h >> 32) | 1;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		n = (h1 + i*h2) & (BLOOM_BITS - 1);
+		if (!BIT_ISSET(bs->bs_bits, n))
+			return(0);
+	}
+	return(1);
+}
+
+
+/*
+ * Initialize an address index with seglen seconds per segment.
+ * Returns a bloomidx pointer on success, NULL on error.
+ */
+struct bloomidx *
+bloomidx_init(time_t seglen)
+{
+	struct bloomidx *bi;
+
+	if (seglen <= 0) {
+		err("bloomidx_init: Got bad segment length (%ld)\n", (long)seglen);
+		return(NULL);
+	}
+
+	if ( (bi = calloc(1, sizeof(struct bloomidx))) == NULL) {
+		err_errno("bloomidx_init: Failed to allocate index structure");
+		return(NULL);
+	}
+
+	seglist_init(&bi->bi_list, seglen, sizeof(struct bloomseg));
+	verbose(1, "Initiated address index with %u seconds per segment\n", 
+		(u_int)seglen);
+	return(bi);
+}
+
+
+/*
+ * Index a packet that was added to the ring buffer.
+ * Packets that are not IP should be given with NULL addresses,
+ * they still have to be counted to keep the index in sync with the buffer.
+ * Returns 0 on success, -1 on error.
+ */
+int
+bloomidx_add(struct bloomidx *bi, const struct timeval *ts,
+	const u_char *src, const u_char *dst, int alen)
+{
+	struct bloomseg *bs;
+	int full;
+
+	/* Start a new segment when the current filter is too
+	 * full to be useful */
+	bs = (struct bloomseg *)bi->bi_list.sl_last;
+	full = (bs != NULL) && (bs->bs_bitsset > (BLOOM_BITS / 100) * BLOOM_MAXFILL);
+	if ( (bs = (struct bloomseg *)seglist_add(&bi->bi_list, ts, full)) == NULL)
+		return(-1);
+
+	if (src != NULL) {
+		bloom_insert(bs, src, alen);
+		bloom_insert(bs, dst, alen);
+	}
+	return(0);
+}
+
+
+/*
+ * Drop segments whose packets have all left the buffer
+ */
+void
+bloomidx_trim(struct bloomidx *bi, size_t live)
+{
+	seglist_trim(&bi->bi_list, live);
+}
+
+
+/*
+ * Drop segments that ended before the oldest packet still held
+ */
+void
+bloomidx_expire(struct bloomidx *bi, const struct timeval *oldest)
+{
+	seglist_expire(&bi->bi_list, oldest);
+}
+
+
+/*
+ * Find the segments that might contain packets to or from addr.
+ * At most max matching segments, oldest first, are stored in segv.
+ * Returns the number of segments stored.
+ */
+size_t
+bloomidx_query(struct bloomidx *bi, const u_char *addr, int alen,
+	struct bloomseg **segv, size_t max)
+{
+	struct bloomseg *bs;
+	size_t n;
+
+	for (n = 0, bs = (struct bloomseg *)bi->bi_list.sl_first; (bs != NULL) && (n < max);
+			bs = (struct bloomseg *)bs->bs_seg.sg_next) {
+		if (bloom_test(bs, addr, alen))
+			segv[n++] = bs;
+	}
+	return(n);
+}
+
+
+/*
+ * Free index and all segments
+ */
+void
+bloomidx_free(struct bloomidx *bi)
+{
+	bloomidx_trim(bi, 0);
+	free(bi);
+}
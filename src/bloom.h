@@ -0,0 +1,86 @@
+/*
+ * bloom.h - Per segment address index
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include "seg.h"
+
+/* Default number of seconds covered by each index segment */
+#define BLOOM_SEG_SEC	60
+
+/* Bits in the filter of each segment, must be a power of two */
+#define BLOOM_BITS		(1 << 17)
+
+/* Number of hash functions */
+#define BLOOM_HASHES	4
+
+/* Start a new segment when this many percent of the bits are set,
+ * the false positive rate grows quickly beyond this point */
+#define BLOOM_MAXFILL	50
+
+/*
+ * A Bloom filter of the source and destination addresses
+ * of the packets received during one time segment.
+ */
+struct bloomseg {
+	struct seg bs_seg;			/* Time and packets, must be first */
+	size_t bs_bitsset;			/* Number of bits set in filter */
+	u_int32_t bs_bits[BLOOM_BITS / 32];
+};
+
+/*
+ * Filters of the segments of the buffer, see seg.h
+ */
+struct bloomidx {
+	struct seglist bi_list;
+};
+
+/* Number of segments */
+#define bloomidx_segs(b)	((b)->bi_list.sl_segs)
+
+/* Memory used by index */
+#define bloomidx_memsize(b)	(bloomidx_segs(b) * sizeof(struct bloomseg))
+
+/* bloom.c */
+extern struct bloomidx *bloomidx_init(time_t);
+extern int bloomidx_add(struct bloomidx *, const struct timeval *,
+	const u_char *, const u_char *, int);
+extern void bloomidx_trim(struct bloomidx *, size_t);
+extern void bloomidx_expire(struct bloomidx *, const struct timeval *);
+extern size_t bloomidx_query(struct bloomidx *, const u_char *, int,
+	struct bloomseg **, size_t);
+extern void bloomidx_free(struct bloomidx *);
+
+#endif /* _BLOOM_H */
@@ -58,6 +58,7 @@ cap_open(char *dev, int promisc)
 	struct capture *pt;
     struct stat sb;
 
+	memset(&cap, 0x00, sizeof(cap));
 
 	/* Open file */
 	if ( (stat(dev, &sb) == 0) && S_ISREG(sb.st_mode)) {
@@ -258,23 +259,25 @@ cap_open(char *dev, int promisc)
 
 
 /*
- * Set capture filter.
+ * Set capture filter, it can be changed while capturing.
  * Returns -1 on error and 0 on success.
  */
 int
-cap_setfilter(struct capture *cap, char *filter)
+cap_setfilter(struct capture *cap, const char *filter)
 {
     struct bpf_program fp; /* Holds compiled program */
 
     /* Compile filter string into a program and optimize the code */
-    if (pcap_compile(cap->c_pcapd, &fp, filter, 1, cap->c_net) == -1) {
+    if (pcap_compile(cap->c_pcapd, &fp, (char *)filter, 1, cap->c_net) == -1) {
         err("Filter: %s\n", pcap_geterr(cap->c_pcapd));
         return(-1);
     }
 
-    /* Set filter */
+    /* Set filter, the kernel swaps it in one step and 
+	 * pcap filters what was queued under the old one */
     if (pcap_setfilter(cap->c_pcapd, &fp) == -1) {
-        err("Failed to set pcap filter\n");
+        err("Failed to set pcap filter: %s\n", pcap_geterr(cap->c_pcapd));
+		pcap_freecode(&fp);
         return(-1);
     }
 
@@ -44,6 +44,9 @@
 #define CAP_SNAPLEN        65535 
 #define CAP_TIMEOUT        1000
 
+/* Packets to read from a capture file at a time */
+#define CAP_FILE_BATCH     1024
+
 /*
  * "Need to know" when using the capture functions
  */
@@ -54,11 +57,17 @@ struct capture {
 	char *c_dev;
     bpf_u_int32 c_net;     /* Local network address */
     bpf_u_int32 c_mask;    /* Netmask of local network */
+
+	/* While switching handles both see the same packets, 
+	 * each keeps those on its side of the switch */
+	struct timeval c_from;	/* Skip packets before this, if set */
+	struct timeval c_until;	/* Skip packets from this on, if set */
+	int c_done;				/* A packet from c_until on was seen */
 };
 
 /* capture.c */
 extern struct capture *cap_open(char *, int);
-extern int cap_setfilter(struct capture *, char *);
+extern int cap_setfilter(struct capture *, const char *);
 extern long cap_iface_ipv4(const char *);
 extern void cap_close(struct capture *);
 #endif /* _CMN_CAPTURE_H */
@@ -0,0 +1,439 @@
+/*
+ * ckpt.c - Incremental checkpoints of the buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "dump.h"
+#include "ckpt.h"
+
+/* Local routines */
+static void *ckpt_writer(void *);
+static void ckpt_write(struct ckpt *);
+static int ckpt_open(struct ckpt *, time_t);
+static void ckpt_fail(struct ckpt *, const char *);
+static void ckpt_stop(struct ckpt *);
+static void ckpt_free(struct ckpt *);
+
+
+/*
+ * Start writing checkpoints of a shared buffer to files in dir, 
+ * named after dev, every sec seconds with a new file every rotate 
+ * seconds of packet time. Writing starts at the oldest packet, or 
+ * at from when the buffer was taken over from a process that wrote
+ * checkpoints up to there.
+ * Returns a pointer on success, NULL on error.
+ */
+struct ckpt *
+ckpt_init(struct ringbuf *rbuf, const char *dir, const char *dev, 
+	int sec, int rotate, const struct rcap_cursor *from)
+{
+	sigset_t all, old;
+	struct ckpt *ck;
+	int ret;
+
+	if (rbuf->shm == NULL) {
+		err("ckpt_init: Checkpoints need a shared buffer\n");
+		return(NULL);
+	}
+
+	if ( (ck = calloc(1, sizeof(struct ckpt))) == NULL) {
+		err_errno("ckpt_init: calloc()");
+		return(NULL);
+	}
+	ck->ck_sec = sec;
+	ck->ck_rotate = rotate;
+	ck->ck_pktlen = rbuf->shm->h_snaplen;
+	
+	if (((ck->ck_dir = strdup(dir)) == NULL) || 
+			((ck->ck_dev = strdup(dev)) == NULL) ||
+			((ck->ck_pkt = malloc(ck->ck_pktlen)) == NULL)) {
+		err_errno("ckpt_init: Out of memory");
+		goto fail;
+	}
+
+	if ( (ck->ck_rcap = rcap_attach(rbuf->shm_fd)) == NULL) {
+		err_errno("ckpt_init: Failed to attach to buffer");
+		goto fail;
+	}
+	if (from != NULL)
+		ck->ck_cur = *from;
+	else
+		rcap_first(ck->ck_rcap, &ck->ck_cur);
+
+	/* Blocks are numbered from 1 */
+	ck->ck_seq = 1;
+
+	if ( (ck->ck_pcapd = pcap_open_dead(rbuf->shm->h_linktype, 
+			rbuf->shm->h_snaplen)) == NULL) {
+		err("ckpt_init: pcap_open_dead() failed\n");
+		goto fail;
+	}
+
+	pthread_mutex_init(&ck->ck_lock, NULL);
+	pthread_cond_init(&ck->ck_cond, NULL);
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&ck->ck_tid, NULL, ckpt_writer, ck);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if (ret != 0) {
+		errno = ret;
+		err_errno("ckpt_init: pthread_create()");
+		pthread_cond_destroy(&ck->ck_cond);
+		pthread_mutex_destroy(&ck->ck_lock);
+		goto fail;
+	}
+	return(ck);
+
+fail:
+	if (ck->ck_pcapd != NULL)
+		pcap_close(ck->ck_pcapd);
+	if (ck->ck_rcap != NULL)
+		rcap_close(ck->ck_rcap);
+	free(ck->ck_pkt);
+	free(ck->ck_dev);
+	free(ck->ck_dir);
+	free(ck);
+	return(NULL);
+}
+
+
+/*
+ * Thread making a checkpoint every interval, or when asked to
+ */
+static void *
+ckpt_writer(void *arg)
+{
+	struct ckpt *ck = arg;
+	struct timespec until;
+	u_long want;
+
+	pthread_mutex_lock(&ck->ck_lock);
+	while (!ck->ck_stop) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += ck->ck_sec;
+		
+		while (!ck->ck_stop && (ck->ck_paused || (ck->ck_want == ck->ck_done))) {
+			if (ck->ck_paused)
+				pthread_cond_wait(&ck->ck_cond, &ck->ck_lock);
+			else if (pthread_cond_timedwait(&ck->ck_cond, 
+					&ck->ck_lock, &until) == ETIMEDOUT)
+				break;
+		}
+		if (ck->ck_stop)
+			break;
+		want = ck->ck_want;
+		ck->ck_busy = 1;
+		pthread_mutex_unlock(&ck->ck_lock);
+
+		ckpt_write(ck);
+
+		pthread_mutex_lock(&ck->ck_lock);
+		ck->ck_busy = 0;
+		ck->ck_done = want;
+		pthread_cond_broadcast(&ck->ck_cond);
+	}
+	pthread_mutex_unlock(&ck->ck_lock);
+	return(NULL);
+}
+
+
+/*
+ * Append the packets added since the last checkpoint
+ */
+static void
+ckpt_write(struct ckpt *ck)
+{
+	struct rcap_pkthdr hdr;
+	struct pcap_pkthdr ph;
+	struct timeval start, end;
+	size_t packets, bytes;
+	u_int64_t lost;
+
+	gettimeofday(&start, NULL);
+	lost = ck->ck_cur.c_lost;
+	packets = bytes = 0;
+
+	while (!__atomic_load_n(&ck->ck_abort, __ATOMIC_RELAXED) && 
+			(rcap_copy(ck->ck_rcap, &ck->ck_cur, &hdr, ck->ck_pkt, 
+			ck->ck_pktlen) != 0)) {
+		
+		if ((ck->ck_pcd == NULL) || 
+				(hdr.ts.tv_sec >= ck->ck_start + ck->ck_rotate)) {
+			if (ckpt_open(ck, hdr.ts.tv_sec) < 0)
+				break;
+		}
+
+		ph.ts = hdr.ts;
+		ph.caplen = hdr.caplen;
+		ph.len = hdr.len;
+		pcap_dump((u_char *)ck->ck_pcd, &ph, ck->ck_pkt);
+		packets++;
+		bytes += sizeof(struct pcap_pkthdr) + hdr.caplen;
+	}
+
+	if ((ck->ck_pcd != NULL) && (fflush(pcap_dump_file(ck->ck_pcd)) != 0))
+		ckpt_fail(ck, ck->ck_path);
+	
+	gettimeofday(&end, NULL);
+	__atomic_add_fetch(&ck->ck_packets, packets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ck->ck_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ck->ck_overruns, ck->ck_cur.c_lost - lost, 
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&ck->ck_runs, 1, __ATOMIC_RELAXED);
+	if (ck->ck_cur.c_seq > ck->ck_seq)
+		__atomic_store_n(&ck->ck_seq, ck->ck_cur.c_seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ck->ck_last, end.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&ck->ck_usec, (end.tv_sec - start.tv_sec) * 1000000 + 
+		(end.tv_usec - start.tv_usec), __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Close the current file and start a new one for packets from first,
+ * files of an earlier run starting the same second are not replaced.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+ckpt_open(struct ckpt *ck, time_t first)
+{
+	char path[sizeof(ck->ck_path)];
+	char date[64];
+	FILE *fp;
+	int fd, i;
+
+	if (ck->ck_pcd != NULL) {
+		pcap_dump_close(ck->ck_pcd);
+		ck->ck_pcd = NULL;
+	}
+
+	snprintf(date, sizeof(date), "%s", str_time(first, DUMP_DATE));
+	snprintf(path, sizeof(path), "%s/%s_%s%s", ck->ck_dir, ck->ck_dev, 
+		date, CKPT_SUFFIX);
+	
+	for (i = 1; (fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0; i++) {
+		if ((errno != EEXIST) || (i > 99)) {
+			ckpt_fail(ck, path);
+			return(-1);
+		}
+		snprintf(path, sizeof(path), "%s/%s_%s.%d%s", ck->ck_dir, ck->ck_dev, 
+			date, i, CKPT_SUFFIX);
+	}
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		ckpt_fail(ck, path);
+		close(fd);
+		unlink(path);
+		return(-1);
+	}
+
+	if ( (ck->ck_pcd = pcap_dump_fopen(ck->ck_pcapd, fp)) == NULL) {
+		ckpt_fail(ck, path);
+		fclose(fp);
+		unlink(path);
+		return(-1);
+	}
+
+	pthread_mutex_lock(&ck->ck_lock);
+	snprintf(ck->ck_path, sizeof(ck->ck_path), "%s", path);
+	pthread_mutex_unlock(&ck->ck_lock);
+	ck->ck_start = first;
+	__atomic_add_fetch(&ck->ck_files, 1, __ATOMIC_RELAXED);
+	return(0);
+}
+
+
+/*
+ * Note a failed file for ckpt_check(), with errno
+ */
+static void
+ckpt_fail(struct ckpt *ck, const char *path)
+{
+	int saved = errno;
+
+	pthread_mutex_lock(&ck->ck_lock);
+	snprintf(ck->ck_errpath, sizeof(ck->ck_errpath), "%s", path);
+	ck->ck_errno = saved;
+	ck->ck_errors++;
+	pthread_mutex_unlock(&ck->ck_lock);
+}
+
+
+/*
+ * Make a checkpoint now and wait for it, then stop making them until
+ * ckpt_resume(). Called before the buffer is emptied by other means
+ * than eviction, so that no packet is lost.
+ */
+void
+ckpt_pause(struct ckpt *ck)
+{
+	u_long want;
+
+	pthread_mutex_lock(&ck->ck_lock);
+	want = ++ck->ck_want;
+	pthread_cond_broadcast(&ck->ck_cond);
+	while (!ck->ck_stop && (((long)(ck->ck_done - want) < 0) || ck->ck_busy))
+		pthread_cond_wait(&ck->ck_cond, &ck->ck_lock);
+	ck->ck_paused = 1;
+	pthread_mutex_unlock(&ck->ck_lock);
+}
+
+
+/*
+ * Make checkpoints again after ckpt_pause(). A buffer emptied
+ * meanwhile had all its packets written, so reading starts over
+ * at the oldest packet without counting an overrun.
+ */
+void
+ckpt_resume(struct ckpt *ck)
+{
+	u_int64_t lost;
+
+	pthread_mutex_lock(&ck->ck_lock);
+	if (!rcap_valid(ck->ck_rcap, &ck->ck_cur)) {
+		lost = ck->ck_cur.c_lost;
+		rcap_first(ck->ck_rcap, &ck->ck_cur);
+		ck->ck_cur.c_lost = lost;
+	}
+	ck->ck_paused = 0;
+	pthread_cond_broadcast(&ck->ck_cond);
+	pthread_mutex_unlock(&ck->ck_lock);
+}
+
+
+/*
+ * Report new files and errors of the writer thread,
+ * called from the main loop.
+ */
+void
+ckpt_check(struct ckpt *ck)
+{
+	size_t files, overruns;
+	
+	pthread_mutex_lock(&ck->ck_lock);
+	if (ck->ck_errors != ck->ck_reported_errors) {
+		errno = ck->ck_errno;
+		err_errno("Failed to write checkpoint '%s'", ck->ck_errpath);
+		ck->ck_reported_errors = ck->ck_errors;
+	}
+	
+	files = __atomic_load_n(&ck->ck_files, __ATOMIC_RELAXED);
+	if (files != ck->ck_reported_files) {
+		verbose(1, "Writing checkpoints to %s\n", ck->ck_path);
+		ck->ck_reported_files = files;
+	}
+	pthread_mutex_unlock(&ck->ck_lock);
+
+	overruns = __atomic_load_n(&ck->ck_overruns, __ATOMIC_RELAXED);
+	if (overruns != ck->ck_reported_overruns) {
+		warn("Packets were evicted before they were checkpointed\n");
+		ck->ck_reported_overruns = overruns;
+	}
+}
+
+
+/*
+ * Stop the writer thread, write what is left of the buffer and 
+ * close the current file. Called before the buffer is freed.
+ */
+void
+ckpt_close(struct ckpt *ck)
+{
+	ckpt_stop(ck);
+	ckpt_write(ck);
+	ckpt_free(ck);
+}
+
+
+/*
+ * Stop the writer thread at once and close the current file, 
+ * the position reached is stored in cur. Called before the buffer
+ * is handed over to a process that goes on from there.
+ */
+void
+ckpt_detach(struct ckpt *ck, struct rcap_cursor *cur)
+{
+	__atomic_store_n(&ck->ck_abort, 1, __ATOMIC_RELAXED);
+	ckpt_stop(ck);
+	*cur = ck->ck_cur;
+	ckpt_free(ck);
+}
+
+
+/*
+ * Wait for the writer thread to exit
+ */
+static void
+ckpt_stop(struct ckpt *ck)
+{
+	pthread_mutex_lock(&ck->ck_lock);
+	ck->ck_stop = 1;
+	pthread_cond_broadcast(&ck->ck_cond);
+	pthread_mutex_unlock(&ck->ck_lock);
+	pthread_join(ck->ck_tid, NULL);
+}
+
+
+/*
+ * Close the current file and free everything, 
+ * after the writer thread has exited
+ */
+static void
+ckpt_free(struct ckpt *ck)
+{
+	if (ck->ck_pcd != NULL)
+		pcap_dump_close(ck->ck_pcd);
+	ckpt_check(ck);
+
+	pthread_cond_destroy(&ck->ck_cond);
+	pthread_mutex_destroy(&ck->ck_lock);
+	pcap_close(ck->ck_pcapd);
+	rcap_close(ck->ck_rcap);
+	free(ck->ck_pkt);
+	free(ck->ck_dev);
+	free(ck->ck_dir);
+	free(ck);
+}
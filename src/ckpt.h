@@ -0,0 +1,118 @@
+/*
+ * ckpt.h - Incremental checkpoints of the buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _CKPT_H
+#define _CKPT_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <pcap.h>
+#include "ringbuf.h"
+#include "ringcap.h"
+
+/* Default seconds between checkpoints */
+#define CKPT_SEC		10
+
+/* Default seconds of packet time per file */
+#define CKPT_ROTATE		3600
+
+/* Checkpoint files are named <device>_<time of first packet><suffix> */
+#define CKPT_SUFFIX		".pcap"
+
+/*
+ * Packets added to a shared buffer are appended to pcap files by a
+ * thread of their own, every interval seconds. The thread reads the
+ * buffer like any other reader, nothing is removed from it and the
+ * capture never waits for the disk. Each packet is written once,
+ * packets evicted before they were written are lost, which is
+ * counted as an overrun. A new file is started when the first
+ * packet of the current one is rotate seconds old. 
+ * The thread does not print, new files and errors are reported by
+ * ckpt_check() from the main loop. Strings are changed under ck_lock.
+ */
+struct ckpt {
+	char *ck_dir;			/* Directory of checkpoint files */
+	char *ck_dev;			/* Device files are named after */
+	int ck_sec;				/* Seconds between checkpoints */
+	int ck_rotate;			/* Seconds of packet time per file */
+
+	struct rcap *ck_rcap;	/* The buffer as seen by a reader */
+	struct rcap_cursor ck_cur;	/* Next packet to write */
+	pcap_t *ck_pcapd;		/* Handle files are opened with */
+	pcap_dumper_t *ck_pcd;	/* Current file, NULL if none */
+	char ck_path[2048];
+	time_t ck_start;		/* Time of first packet in current file */
+	u_char *ck_pkt;			/* Packet being written */
+	size_t ck_pktlen;
+
+	pthread_t ck_tid;
+	pthread_mutex_t ck_lock;
+	pthread_cond_t ck_cond;
+	int ck_stop;			/* Thread should exit */
+	int ck_abort;			/* Leave the rest unwritten, read with __atomic */
+	int ck_paused;			/* No checkpoints until resumed */
+	int ck_busy;			/* Checkpoint being made */
+	u_long ck_want;			/* Checkpoints asked for */
+	u_long ck_done;			/* Checkpoints completed */
+
+	/* Updated by the thread, read with __atomic */
+	size_t ck_packets;		/* Packets written */
+	size_t ck_bytes;		/* Bytes written, headers included */
+	size_t ck_files;		/* Files opened */
+	size_t ck_runs;			/* Checkpoints made */
+	size_t ck_overruns;		/* Times unwritten packets were evicted */
+	size_t ck_errors;		/* Files that could not be written */
+	u_int64_t ck_seq;		/* Blocks numbered before this are written */
+	time_t ck_last;			/* Wall clock time of last checkpoint */
+	long ck_usec;			/* Time spent on last checkpoint */
+
+	/* Seen by ckpt_check() */
+	size_t ck_reported_files;
+	size_t ck_reported_overruns;
+	size_t ck_reported_errors;
+	int ck_errno;			/* Error of last failed file */
+	char ck_errpath[2048];
+};
+
+/* Blocks numbered from this on may not be written yet */
+#define ckpt_written(c)	__atomic_load_n(&(c)->ck_seq, __ATOMIC_ACQUIRE)
+
+/* ckpt.c */
+extern struct ckpt *ckpt_init(struct ringbuf *, const char *, const char *, 
+	int, int, const struct rcap_cursor *);
+extern void ckpt_pause(struct ckpt *);
+extern void ckpt_resume(struct ckpt *);
+extern void ckpt_check(struct ckpt *);
+extern void ckpt_close(struct ckpt *);
+extern void ckpt_detach(struct ckpt *, struct rcap_cursor *);
+
+#endif /* _CKPT_H */
@@ -0,0 +1,253 @@
+/*
+ * class.c - Packet classes with buffers of their own
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "ringbuf.h"
+#include "pkt.h"
+#include "class.h"
+
+
+/*
+ * Create an empty set of classes.
+ * Returns a classes pointer on success, NULL on error.
+ */
+struct classes *
+class_init(void)
+{
+	struct classes *cl;
+
+	if ( (cl = calloc(1, sizeof(struct classes))) == NULL) {
+		err_errno("class_init: calloc()");
+		return(NULL);
+	}
+	return(cl);
+}
+
+
+/*
+ * Add a class given as <name>:<size>[:<age>]:<expression>, 
+ * where age is in seconds. The buffer of the class is created
+ * here, the filter is compiled later by class_compile().
+ * Returns 0 on success, -1 on error.
+ */
+int
+class_add(struct classes *cl, const char *spec)
+{
+	struct pktclass *pc;
+	unsigned long ul;
+	char *copy, *field[3];
+	char *p;
+	int i, n;
+
+	if (cl->cl_n >= CLASS_MAX) {
+		err("Too many classes, maximum is %u\n", CLASS_MAX);
+		return(-1);
+	}
+	pc = &cl->cl_class[cl->cl_n];
+	memset(pc, 0x00, sizeof(struct pktclass));
+
+	if ( (copy = strdup(spec)) == NULL) {
+		err_errno("class_add: strdup()");
+		return(-1);
+	}
+
+	/* The expression may contain colons itself, an age 
+	 * is only taken if the third field is a number */
+	p = copy;
+	for (n = 0; n < 3; n++) {
+		field[n] = p;
+		if ( (p = strchr(p, ':')) == NULL)
+			break;
+		*p++ = '\0';
+	}
+
+	if ((n < 2) || (*field[0] == '\0')) {
+		err("Bad class '%s'\n", spec);
+		free(copy);
+		return(-1);
+	}
+
+	if (n == 3) {
+		if (str_isnum(field[2], &ul))
+			pc->pc_age = ul;
+		else {
+			/* Third field starts the expression */
+			field[2][strlen(field[2])] = ':';
+			p = field[2];
+		}
+	}
+	else
+		p = field[2];
+
+	for (i = 0; i < cl->cl_n; i++) {
+		if (!strcmp(cl->cl_class[i].pc_name, field[0])) {
+			err("Class '%s' given twice\n", field[0]);
+			free(copy);
+			return(-1);
+		}
+	}
+
+	if ( (pc->pc_size = str_to_size(field[1])) == 0) {
+		err("Bad size in class '%s'\n", spec);
+		free(copy);
+		return(-1);
+	}
+
+	while (isspace((int)*p))
+		p++;
+	if (*p == '\0') {
+		err("Missing filter expression in class '%s'\n", spec);
+		free(copy);
+		return(-1);
+	}
+
+	if (((pc->pc_name = strdup(field[0])) == NULL) || 
+			((pc->pc_filter = strdup(p)) == NULL)) {
+		err_errno("class_add: strdup()");
+		free(pc->pc_name);
+		free(copy);
+		return(-1);
+	}
+	free(copy);
+
+	/* A fixed budget, no room to grow */
+	if ( (pc->pc_rbuf = ringbuf_init(pc->pc_size, pc->pc_size, 0)) == NULL) {
+		free(pc->pc_name);
+		free(pc->pc_filter);
+		return(-1);
+	}
+	cl->cl_n++;
+	return(0);
+}
+
+
+/*
+ * Compile the filters of the classes for the open capture.
+ * Returns 0 on success, -1 on error.
+ */
+int
+class_compile(struct classes *cl, pcap_t *p, bpf_u_int32 net)
+{
+	struct pktclass *pc;
+	int i;
+
+	for (i = 0; i < cl->cl_n; i++) {
+		pc = &cl->cl_class[i];
+
+		if (pcap_compile(p, &pc->pc_bpf, pc->pc_filter, 1, net) < 0) {
+			err("Class '%s': %s\n", pc->pc_name, pcap_geterr(p));
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+
+/*
+ * Classify a packet, filters are tried in the order given.
+ * Returns the first matching class, or NULL if the packet
+ * belongs in the default buffer.
+ */
+struct pktclass *
+class_match(struct classes *cl, const struct pcap_pkthdr *pkthdr, 
+	const u_char *packet)
+{
+	struct pktclass *pc;
+	int i;
+
+	for (i = 0; i < cl->cl_n; i++) {
+		pc = &cl->cl_class[i];
+		
+		if (bpf_filter(pc->pc_bpf.bf_insns, (u_char *)packet, 
+				pkthdr->len, pkthdr->caplen) != 0) {
+			pc->pc_packets++;
+			pc->pc_bytes += pkthdr->len;
+			return(pc);
+		}
+	}
+	return(NULL);
+}
+
+
+/*
+ * Remove packets past the age budget of their class, now is the time 
+ * of the newest packet. Checked once a second of packet time.
+ */
+void
+class_expire(struct classes *cl, time_t now)
+{
+	struct pktclass *pc;
+	int i;
+
+	if (now == cl->cl_sec)
+		return;
+	cl->cl_sec = now;
+
+	for (i = 0; i < cl->cl_n; i++) {
+		pc = &cl->cl_class[i];
+		if (pc->pc_age == 0)
+			continue;
+
+		pc->pc_expired += pkt_expire(pc->pc_rbuf, now - pc->pc_age);
+	}
+}
+
+
+/*
+ * Free classes and their buffers
+ */
+void
+class_free(struct classes *cl)
+{
+	struct pktclass *pc;
+	int i;
+
+	for (i = 0; i < cl->cl_n; i++) {
+		pc = &cl->cl_class[i];
+		
+		if (pc->pc_bpf.bf_insns != NULL)
+			pcap_freecode(&pc->pc_bpf);
+		ringbuf_free(pc->pc_rbuf);
+		free(pc->pc_name);
+		free(pc->pc_filter);
+	}
+	free(cl);
+}
@@ -0,0 +1,84 @@
+/*
+ * class.h - Packet classes with buffers of their own
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _CLASS_H
+#define _CLASS_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "ringbuf.h"
+
+/* Maximum number of classes, not counting the default buffer */
+#define CLASS_MAX		8
+
+/*
+ * A class keeps the packets matching its filter in a buffer of
+ * its own, so that bulk traffic in the default buffer can not 
+ * push them out. Packets older than the age budget are removed 
+ * even if there is room left.
+ */
+struct pktclass {
+	char *pc_name;
+	char *pc_filter;		/* Filter expression */
+	size_t pc_size;			/* Byte budget */
+	time_t pc_age;			/* Age budget in seconds, 0 for none */
+	struct bpf_program pc_bpf;
+	struct ringbuf *pc_rbuf;
+	size_t pc_packets;		/* Packets classified */
+	size_t pc_bytes;		/* Bytes classified */
+	size_t pc_expired;		/* Packets removed for their age */
+};
+
+/*
+ * Packets go to the first class with a matching filter,
+ * or to the default buffer if none match.
+ */
+struct classes {
+	int cl_n;
+	time_t cl_sec;			/* Second of last age check */
+	struct pktclass cl_class[CLASS_MAX];
+};
+
+/* Returns non-zero if there are classes */
+#define class_active(c)	((c)->cl_n > 0)
+
+/* class.c */
+extern struct classes *class_init(void);
+extern int class_add(struct classes *, const char *);
+extern int class_compile(struct classes *, pcap_t *, bpf_u_int32);
+extern struct pktclass *class_match(struct classes *, 
+	const struct pcap_pkthdr *, const u_char *);
+extern void class_expire(struct classes *, time_t);
+extern void class_free(struct classes *);
+
+#endif /* _CLASS_H */
@@ -0,0 +1,425 @@
+/*
+ * ctl.c - Request/response protocol over a local UNIX domain socket
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "print.h"
+#include "str.h"
+#include "ctl.h"
+
+/* Clients that hang up should not kill us with SIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+/* Local routines */
+static void ctl_accept(struct ctl *);
+static void ctl_read(struct ctl *, struct ctl_client *);
+static void ctl_dispatch(struct ctl *, struct ctl_client *);
+static void ctl_drop(struct ctl_client *);
+static void ctl_write(struct ctl_req *, const char *, size_t);
+
+
+/*
+ * Open control socket at path.
+ * Requests are served with the commands in cmds.
+ * Returns a ctl pointer on success, NULL on error.
+ */
+struct ctl *
+ctl_open(const char *path, const struct ctl_cmd *cmds)
+{
+	struct sockaddr_un sun;
+	struct ctl *ctl;
+	int i;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		err("ctl_open: Socket path '%s' is to long\n", path);
+		return(NULL);
+	}
+
+	if ( (ctl = calloc(1, sizeof(struct ctl))) == NULL) {
+		err_errno("ctl_open: Failed to allocate control structure");
+		return(NULL);
+	}
+
+	for (i = 0; i < CTL_MAXCLIENTS; i++)
+		ctl->ctl_clients[i].cl_fd = -1;
+	ctl->ctl_cmds = cmds;
+
+	if ( (ctl->ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		err_errno("ctl_open: socket()");
+		free(ctl);
+		return(NULL);
+	}
+
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+
+	/* Remove stale socket from a previous run */
+	unlink(path);
+
+	if (bind(ctl->ctl_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		err_errno("ctl_open: Failed to bind '%s'", path);
+		goto fail;
+	}
+
+	if (listen(ctl->ctl_fd, CTL_MAXCLIENTS) < 0) {
+		err_errno("ctl_open: listen()");
+		goto fail;
+	}
+
+	if (fcntl(ctl->ctl_fd, F_SETFL, O_NONBLOCK) < 0) {
+		err_errno("ctl_open: fcntl()");
+		goto fail;
+	}
+
+	ctl->ctl_path = strdup(path);
+	verbose(1, "Control socket listening on %s\n", path);
+	return(ctl);
+
+fail:
+	close(ctl->ctl_fd);
+	free(ctl);
+	return(NULL);
+}
+
+
+/*
+ * Store the descriptors to poll in pfd, which must have
+ * room for CTL_MAXCLIENTS + 1 entries.
+ * Returns the number of entries stored.
+ */
+int
+ctl_setpoll(struct ctl *ctl, struct pollfd *pfd)
+{
+	int i, n;
+
+	n = 0;
+	pfd[n].fd = ctl->ctl_fd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+
+	for (i = 0; i < CTL_MAXCLIENTS; i++) {
+		if (ctl->ctl_clients[i].cl_fd < 0)
+			continue;
+		pfd[n].fd = ctl->ctl_clients[i].cl_fd;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+	return(n);
+}
+
+
+/*
+ * Serve the descriptors from ctl_setpoll() that are ready.
+ */
+void
+ctl_handle(struct ctl *ctl, struct pollfd *pfd, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		
+		if (pfd[i].revents == 0)
+			continue;
+
+		if (pfd[i].fd == ctl->ctl_fd) {
+			ctl_accept(ctl);
+			continue;
+		}
+
+		for (j = 0; j < CTL_MAXCLIENTS; j++) {
+			if (ctl->ctl_clients[j].cl_fd == pfd[i].fd) {
+				ctl_read(ctl, &ctl->ctl_clients[j]);
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * Accept new client
+ */
+static void
+ctl_accept(struct ctl *ctl)
+{
+	struct ctl_client *cl;
+	struct timeval tv;
+	int fd, i;
+
+	if ( (fd = accept(ctl->ctl_fd, NULL, NULL)) < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			err_errno("ctl_accept: accept()");
+		return;
+	}
+
+	for (cl = NULL, i = 0; i < CTL_MAXCLIENTS; i++) {
+		if (ctl->ctl_clients[i].cl_fd < 0) {
+			cl = &ctl->ctl_clients[i];
+			break;
+		}
+	}
+
+	if (cl == NULL) {
+		warn("Control socket: To many clients, dropping connection\n");
+		close(fd);
+		return;
+	}
+
+	/* Never let a client block capture for long */
+	tv.tv_sec = CTL_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	cl->cl_fd = fd;
+	cl->cl_len = 0;
+	verbose(3, "Control socket: Accepted client on fd %d\n", fd);
+}
+
+
+/*
+ * Read from client, dispatch once a full line has been received
+ */
+static void
+ctl_read(struct ctl *ctl, struct ctl_client *cl)
+{
+	ssize_t n;
+
+	n = read(cl->cl_fd, &cl->cl_buf[cl->cl_len], 
+		sizeof(cl->cl_buf) - cl->cl_len - 1);
+
+	if (n < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR))
+			return;
+		ctl_drop(cl);
+		return;
+	}
+	
+	if (n == 0) {
+		ctl_drop(cl);
+		return;
+	}
+
+	cl->cl_len += n;
+	cl->cl_buf[cl->cl_len] = '\0';
+
+	if (strchr(cl->cl_buf, '\n') != NULL)
+		ctl_dispatch(ctl, cl);
+	else if (cl->cl_len >= sizeof(cl->cl_buf) - 1) {
+		warn("Control socket: Request to long, dropping client\n");
+		ctl_drop(cl);
+	}
+}
+
+
+/*
+ * Run the request in the client buffer and close the connection
+ */
+static void
+ctl_dispatch(struct ctl *ctl, struct ctl_client *cl)
+{
+	struct ctl_req req;
+	const struct ctl_cmd *cmd;
+	char *argv[CTL_MAXARGS + 1];
+	unsigned int argc;
+	char *pt;
+	int ret;
+
+	if ( (pt = strpbrk(cl->cl_buf, "\r\n")) != NULL)
+		*pt = '\0';
+
+	memset(&req, 0x00, sizeof(req));
+	req.cr_fd = cl->cl_fd;
+	
+	/* The reply is written in blocking mode, bounded by SO_SNDTIMEO */
+	fcntl(cl->cl_fd, F_SETFL, 0);
+	
+	argc = str_to_argv(cl->cl_buf, argv, CTL_MAXARGS + 1);
+	ret = -1;
+
+	if (argc == 0)
+		ctl_error(&req, "Empty request");
+	else if (!strcmp(argv[0], "help")) {
+		for (cmd = ctl->ctl_cmds; cmd->cc_name != NULL; cmd++)
+			ctl_reply(&req, "usage=\"%s\"\n", cmd->cc_usage);
+		ret = 0;
+	}
+	else {
+		for (cmd = ctl->ctl_cmds; cmd->cc_name != NULL; cmd++) {
+			if (!strcmp(cmd->cc_name, argv[0]))
+				break;
+		}
+
+		if (cmd->cc_name == NULL)
+			ctl_error(&req, "Unknown command '%s'", argv[0]);
+		else {
+			verbose(2, "Control socket: Request '%s'\n", argv[0]);
+			ret = cmd->cc_func(&req, argc, argv);
+		}
+	}
+
+	/* Handler took over the connection */
+	if (req.cr_fd < 0) {
+		cl->cl_fd = -1;
+		return;
+	}
+
+	ctl_result(&req, ret);
+	ctl_drop(cl);
+}
+
+
+/*
+ * Close client connection
+ */
+static void
+ctl_drop(struct ctl_client *cl)
+{
+	verbose(3, "Control socket: Closing client on fd %d\n", cl->cl_fd);
+	close(cl->cl_fd);
+	cl->cl_fd = -1;
+	cl->cl_len = 0;
+}
+
+
+/*
+ * Write all of buf to client, give up on error or timeout
+ */
+static void
+ctl_write(struct ctl_req *req, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while ((len > 0) && (req->cr_fd >= 0)) {
+		if ( (n = send(req->cr_fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			verbose(1, "Control socket: Failed to write reply\n");
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * Write a line of reply data to client.
+ * The format should end with a newline.
+ */
+void
+ctl_reply(struct ctl_req *req, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+	if (n >= sizeof(buf))
+		n = sizeof(buf) - 1;
+	ctl_write(req, buf, n);
+}
+
+
+/*
+ * End the reply with "OK", or "ERR" and the error message,
+ * after ret as returned by the handler. Also for handlers
+ * that took over the connection and answer later.
+ */
+void
+ctl_result(struct ctl_req *req, int ret)
+{
+	char buf[sizeof(req->cr_err) + 8];
+
+	if (ret == 0)
+		ctl_write(req, "OK\n", 3);
+	else {
+		snprintf(buf, sizeof(buf), "ERR %s\n", req->cr_err);
+		ctl_write(req, buf, strlen(buf));
+	}
+}
+
+
+/*
+ * Set error message of request, without trailing newline.
+ * Returns -1, for handlers to return.
+ */
+int
+ctl_error(struct ctl_req *req, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(req->cr_err, sizeof(req->cr_err), fmt, ap);
+	va_end(ap);
+	return(-1);
+}
+
+
+/*
+ * Close control socket and all clients
+ */
+void
+ctl_close(struct ctl *ctl)
+{
+	int i;
+
+	for (i = 0; i < CTL_MAXCLIENTS; i++) {
+		if (ctl->ctl_clients[i].cl_fd >= 0)
+			ctl_drop(&ctl->ctl_clients[i]);
+	}
+
+	close(ctl->ctl_fd);
+	if (ctl->ctl_path != NULL) {
+		unlink(ctl->ctl_path);
+		free(ctl->ctl_path);
+	}
+	free(ctl);
+}
@@ -0,0 +1,95 @@
+/*
+ * ctl.h - Control socket
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _CTL_H
+#define _CTL_H
+
+#include <sys/types.h>
+#include <poll.h>
+
+/* Maximum number of concurrently connected clients */
+#define CTL_MAXCLIENTS	8
+
+/* Maximum length of a request line */
+#define CTL_LINEMAX		1024
+
+/* Maximum number of arguments in a request */
+#define CTL_MAXARGS		64
+
+/* Time format in requests and replies */
+#define CTL_DATE		"%Y-%m-%dT%H:%M:%S"
+
+/* Seconds to wait for a client to accept a reply */
+#define CTL_TIMEOUT		2
+
+/*
+ * A request being served.
+ * The reply is written to the client as lines of key=value pairs, 
+ * followed by a single line with "OK" or "ERR <message>".
+ */
+struct ctl_req {
+	int cr_fd;
+	char cr_err[256];
+};
+
+/* 
+ * Commands are looked up by name, the handler gets the request
+ * split into arguments and returns 0 on success and -1 on error.
+ */
+struct ctl_cmd {
+	const char *cc_name;
+	int (*cc_func)(struct ctl_req *, int, char **);
+	const char *cc_usage;
+};
+
+struct ctl {
+	int ctl_fd;						/* Listening socket */
+	char *ctl_path;					/* Path to socket */
+	const struct ctl_cmd *ctl_cmds;	/* Terminated by a NULL name */
+
+	struct ctl_client {
+		int cl_fd;
+		size_t cl_len;
+		char cl_buf[CTL_LINEMAX];
+	} ctl_clients[CTL_MAXCLIENTS];
+};
+
+/* ctl.c */
+extern struct ctl *ctl_open(const char *, const struct ctl_cmd *);
+extern int ctl_setpoll(struct ctl *, struct pollfd *);
+extern void ctl_handle(struct ctl *, struct pollfd *, int);
+extern void ctl_reply(struct ctl_req *, const char *, ...);
+extern int ctl_error(struct ctl_req *, const char *, ...);
+extern void ctl_result(struct ctl_req *, int);
+extern void ctl_close(struct ctl *);
+
+#endif /* _CTL_H */
@@ -0,0 +1,188 @@
+/*
+ * dump.c - Write packets from the buffer to pcap files
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "dump.h"
+
+
+/* Position in one of the buffers being merged */
+struct dumppos {
+	struct ringbuf_cursor dp_rc;
+	struct pcap_pkthdr *dp_pkthdr;	/* Next packet, NULL when done */
+	size_t dp_size;
+};
+
+
+/*
+ * Write packets from the buffers to a pcap file in dir, merged
+ * into time order. Packets with the same time are taken from
+ * the buffers in the order given.
+ * The file is written under a temporary name and then renamed 
+ * to <iface>_<first packet time>-<last packet time>.pcap.
+ * Returns 0 on success, -1 on error.
+ */
+int
+dump_ring(struct ringbuf **rbufs, int nrbufs, struct capture *cap, 
+	const char *dir, const struct dumpreq *dreq, struct dumpres *dres)
+{
+	char first_pkt_time[128];
+	char last_pkt_time[128];
+	char path[2048];
+	struct dumppos *dp;
+	struct pcap_pkthdr *pkthdr;
+	struct timeval start, end;
+	pcap_dumper_t *pcd;
+	const char *dev;
+	size_t elems;
+	int drain;
+	size_t size;
+	int i, n;
+
+	memset(dres, 0x00, sizeof(struct dumpres));
+	gettimeofday(&start, NULL);
+
+	if (cap == NULL) {
+		err("dump_ring: No capture device open\n");
+		return(-1);
+	}
+
+	/* Nothing to do */
+	for (elems = 0, i = 0; i < nrbufs; i++)
+		elems += ringbuf_elements(rbufs[i]);
+	if (elems == 0)
+		return(0);
+
+	drain = !dreq->dr_keep && (dreq->dr_from == 0) && (dreq->dr_to == 0) &&
+		(dreq->dr_filter == NULL);
+	
+	/* Name after the device, or the file we are reading */
+	if ( (dev = cap->c_dev) == NULL)
+		dev = "any";
+	else if (strrchr(dev, '/') != NULL)
+		dev = strrchr(dev, '/') + 1;
+
+	/* Temporary file */
+	snprintf(path, sizeof(path), "%s/%s_%s.%d", dir, dev,
+		str_time(time(NULL), DUMP_DATE), getpid());
+
+	if ( (dp = calloc(nrbufs, sizeof(struct dumppos))) == NULL) {
+		err_errno("dump_ring: calloc()");
+		return(-1);
+	}
+
+	if ( (pcd = pcap_dump_open(cap->c_pcapd, path)) == NULL) {
+		err("Failed to open dump file: %s\n", pcap_geterr(cap->c_pcapd));
+		free(dp);
+		return(-1);
+	}
+	
+	for (i = 0; i < nrbufs; i++) {
+		ringbuf_cursor_init(rbufs[i], &dp[i].dp_rc);
+		dp[i].dp_pkthdr = (struct pcap_pkthdr *)ringbuf_cursor_next(
+			&dp[i].dp_rc, &dp[i].dp_size);
+	}
+
+	for (;;) {
+		
+		/* Oldest packet not yet written */
+		for (n = -1, i = 0; i < nrbufs; i++) {
+			if ((dp[i].dp_pkthdr != NULL) && ((n < 0) || 
+					timercmp(&dp[i].dp_pkthdr->ts, &dp[n].dp_pkthdr->ts, <)))
+				n = i;
+		}
+		if (n < 0)
+			break;
+
+		pkthdr = dp[n].dp_pkthdr;
+		size = dp[n].dp_size;
+		dp[n].dp_pkthdr = (struct pcap_pkthdr *)ringbuf_cursor_next(
+			&dp[n].dp_rc, &dp[n].dp_size);
+		
+		if (((dreq->dr_from != 0) && (pkthdr->ts.tv_sec < dreq->dr_from)) ||
+				((dreq->dr_to != 0) && (pkthdr->ts.tv_sec > dreq->dr_to)))
+			continue;
+		if ((dreq->dr_filter != NULL) && (bpf_filter(dreq->dr_filter->bf_insns,
+				(u_char *)pkthdr + sizeof(struct pcap_pkthdr), pkthdr->len, 
+				pkthdr->caplen) == 0))
+			continue;
+		
+		pcap_dump((u_char *)pcd, pkthdr, (u_char *)((char *)pkthdr + 
+			sizeof(struct pcap_pkthdr)) );
+#ifdef HAVE_PCAP_DUMP_FLUSH
+		pcap_dump_flush(pcd);
+#endif
+		if (dres->dr_packets++ == 0)
+			dres->dr_first = pkthdr->ts;
+		dres->dr_last = pkthdr->ts;
+		dres->dr_bytes += size;
+	}
+	pcap_dump_close(pcd);
+	free(dp);
+
+	/* Dumped packets are not kept */
+	if (drain) {
+		for (i = 0; i < nrbufs; i++)
+			ringbuf_clear(rbufs[i]);
+	}
+
+	if (dres->dr_packets == 0) {
+		unlink(path);
+		return(0);
+	}
+
+	/* Real file name, start and end time */
+	snprintf(first_pkt_time, sizeof(first_pkt_time), "%s", 
+		str_time(dres->dr_first.tv_sec, DUMP_DATE));
+	snprintf(last_pkt_time, sizeof(last_pkt_time), "%s", 
+		str_time(dres->dr_last.tv_sec, DUMP_DATE));
+	snprintf(dres->dr_path, sizeof(dres->dr_path), "%s/%s_%s-%s.pcap", dir,
+		dev, first_pkt_time, last_pkt_time);
+	
+	if (rename(path, dres->dr_path) < 0) {
+		err_errno("Failed to rename '%s' to '%s'\n", path, dres->dr_path);
+		return(-1);
+	}
+
+	gettimeofday(&end, NULL);
+	dres->dr_usec = (end.tv_sec - start.tv_sec) * 1000000 + 
+		(end.tv_usec - start.tv_usec);
+	return(0);
+}
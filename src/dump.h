@@ -0,0 +1,73 @@
+/*
+ * dump.h - Write packets from the buffer to pcap files
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _DUMP_H
+#define _DUMP_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include "ringbuf.h"
+#include "capture.h"
+
+/* Time format used in dump file names */
+#define DUMP_DATE	"%Y%m%d_%H:%M:%S"
+
+/*
+ * What to dump.
+ * Packets are only removed from the buffer when all of it is dumped
+ * and dr_keep is not set.
+ */
+struct dumpreq {
+	int dr_keep;		/* Leave packets in buffer */
+	time_t dr_from;		/* Skip packets before this time, 0 for oldest */
+	time_t dr_to;		/* Skip packets after this time, 0 for newest */
+	const struct bpf_program *dr_filter;	/* Skip packets not matching, NULL for all */
+};
+
+/*
+ * Outcome of a dump.
+ * No file is created if no packets matched.
+ */
+struct dumpres {
+	char dr_path[2048];		/* Dump file */
+	size_t dr_packets;		/* Packets written */
+	size_t dr_bytes;		/* Buffer bytes written */
+	struct timeval dr_first;	/* Time of first packet */
+	struct timeval dr_last;		/* Time of last packet */
+	long dr_usec;			/* Time spent writing */
+};
+
+/* dump.c */
+extern int dump_ring(struct ringbuf **, int, struct capture *, const char *,
+	const struct dumpreq *, struct dumpres *);
+
+#endif /* _DUMP_H */
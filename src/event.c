@@ -0,0 +1,272 @@
+/*
+ * event.c - Signals and timers as descriptors of the main loop
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <poll.h>
+#include "print.h"
+#include "event.h"
+
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#define HAVE_SIGNALFD
+#define HAVE_TIMERFD
+#endif
+
+/* Local routines */
+static int event_ready(const struct pollfd *, int, int);
+
+#ifndef HAVE_SIGNALFD
+static void event_handler(int);
+
+/* Write end of the signal pipe */
+static int event_pipe = -1;
+
+
+/*
+ * Pass a signal on to the main loop, nothing else 
+ * is safe to do from a signal handler.
+ */
+static void
+event_handler(int signo)
+{
+	u_char c = signo;
+	int saved = errno;
+
+	write(event_pipe, &c, 1);
+	errno = saved;
+}
+#endif
+
+
+/*
+ * Deliver the signals in the 0 terminated list to the main loop.
+ * The signals are blocked, so call this before any thread is 
+ * started to keep them from being delivered elsewhere.
+ * Returns a pointer on success, NULL on error.
+ */
+struct events *
+event_init(const int *signals)
+{
+	struct events *ev;
+	int i;
+
+	if ( (ev = calloc(1, sizeof(struct events))) == NULL) {
+		err_errno("event_init: calloc()");
+		return(NULL);
+	}
+	ev->ev_sigfd = -1;
+	ev->ev_timerfd = -1;
+
+	sigemptyset(&ev->ev_mask);
+	for (i = 0; signals[i] != 0; i++)
+		sigaddset(&ev->ev_mask, signals[i]);
+
+#ifdef HAVE_SIGNALFD
+	if (sigprocmask(SIG_BLOCK, &ev->ev_mask, NULL) < 0) {
+		err_errno("event_init: sigprocmask()");
+		free(ev);
+		return(NULL);
+	}
+
+	if ( (ev->ev_sigfd = signalfd(-1, &ev->ev_mask, 
+			SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		err_errno("event_init: signalfd()");
+		sigprocmask(SIG_UNBLOCK, &ev->ev_mask, NULL);
+		free(ev);
+		return(NULL);
+	}
+#else
+	{
+		int p[2];
+
+		if (pipe(p) < 0) {
+			err_errno("event_init: pipe()");
+			free(ev);
+			return(NULL);
+		}
+		fcntl(p[0], F_SETFL, O_NONBLOCK);
+		fcntl(p[1], F_SETFL, O_NONBLOCK);
+		ev->ev_sigfd = p[0];
+		event_pipe = p[1];
+	}
+
+	for (i = 0; signals[i] != 0; i++)
+		signal(signals[i], event_handler);
+#endif
+	return(ev);
+}
+
+
+/*
+ * Let the timer expire every interval seconds, at multiples of 
+ * interval since the epoch. An interval of 0 stops the timer.
+ * Returns 0 on success, -1 on error.
+ */
+int
+event_timer(struct events *ev, time_t interval)
+{
+	time_t now;
+
+	now = time(NULL);
+	ev->ev_interval = interval;
+	ev->ev_next = (interval > 0) ? now - (now % interval) + interval : 0;
+
+#ifdef HAVE_TIMERFD
+	{
+		struct itimerspec its;
+
+		if ((ev->ev_timerfd < 0) && ((ev->ev_timerfd = timerfd_create(
+				CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)) {
+			err_errno("event_timer: timerfd_create()");
+			return(-1);
+		}
+
+		memset(&its, 0x00, sizeof(its));
+		its.it_value.tv_sec = ev->ev_next;
+		its.it_interval.tv_sec = interval;
+		if (timerfd_settime(ev->ev_timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+			err_errno("event_timer: timerfd_settime()");
+			return(-1);
+		}
+	}
+#endif
+	return(0);
+}
+
+
+/*
+ * Store the descriptors to poll in pfd, which must have
+ * room for EVENT_MAXFDS entries.
+ * Returns the number of entries stored.
+ */
+int
+event_setpoll(struct events *ev, struct pollfd *pfd)
+{
+	int n;
+
+	n = 0;
+	pfd[n].fd = ev->ev_sigfd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+
+	if (ev->ev_timerfd >= 0) {
+		pfd[n].fd = ev->ev_timerfd;
+		pfd[n].events = POLLIN;
+		pfd[n++].revents = 0;
+	}
+	return(n);
+}
+
+
+/*
+ * Returns non-zero if fd is among the n ready descriptors of pfd
+ */
+static int
+event_ready(const struct pollfd *pfd, int n, int fd)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (pfd[i].fd == fd)
+			return(pfd[i].revents != 0);
+	}
+	return(0);
+}
+
+
+/*
+ * Get the next pending signal, once the descriptors 
+ * from event_setpoll() have been polled.
+ * Returns the signal number, or 0 if none is pending.
+ */
+int
+event_signal(struct events *ev, const struct pollfd *pfd, int n)
+{
+#ifdef HAVE_SIGNALFD
+	struct signalfd_siginfo si;
+
+	if (!event_ready(pfd, n, ev->ev_sigfd))
+		return(0);
+	if (read(ev->ev_sigfd, &si, sizeof(si)) != sizeof(si))
+		return(0);
+	return(si.ssi_signo);
+#else
+	u_char c;
+
+	if (!event_ready(pfd, n, ev->ev_sigfd))
+		return(0);
+	if (read(ev->ev_sigfd, &c, 1) != 1)
+		return(0);
+	return(c);
+#endif
+}
+
+
+/*
+ * Check if the timer has expired since last time, once the
+ * descriptors from event_setpoll() have been polled.
+ * Returns non-zero if so.
+ */
+int
+event_expired(struct events *ev, const struct pollfd *pfd, int n)
+{
+	if (ev->ev_interval == 0)
+		return(0);
+
+#ifdef HAVE_TIMERFD
+	{
+		u_int64_t count;
+
+		if (!event_ready(pfd, n, ev->ev_timerfd))
+			return(0);
+		return((read(ev->ev_timerfd, &count, sizeof(count)) == 
+			sizeof(count)) && (count > 0));
+	}
+#else
+	/* The loop polls at least once a second */
+	if (time(NULL) < ev->ev_next)
+		return(0);
+	while (ev->ev_next <= time(NULL))
+		ev->ev_next += ev->ev_interval;
+	return(1);
+#endif
+}
+
@@ -0,0 +1,65 @@
+/*
+ * event.h - Signals and timers as descriptors of the main loop
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+
+/* Most descriptors stored by event_setpoll() */
+#define EVENT_MAXFDS	2
+
+/*
+ * Signals and a periodic timer are read from descriptors polled by 
+ * the main loop, so they are acted on between packets rather than in
+ * signal handlers. Without signalfd(2) and timerfd_create(2) a pipe 
+ * written by the signal handler and the clock are used instead.
+ */
+struct events {
+	sigset_t ev_mask;		/* Signals handled by the loop */
+	int ev_sigfd;			/* Readable when a signal is pending */
+	int ev_timerfd;			/* Readable when the timer expired, -1 if none */
+	time_t ev_interval;		/* Seconds between timer expirations, 0 if off */
+	time_t ev_next;			/* Next expiration without timerfd */
+};
+
+/* event.c */
+extern struct events *event_init(const int *);
+extern int event_timer(struct events *, time_t);
+extern int event_setpoll(struct events *, struct pollfd *);
+extern int event_signal(struct events *, const struct pollfd *, int);
+extern int event_expired(struct events *, const struct pollfd *, int);
+
+#endif /* _EVENT_H */
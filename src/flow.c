@@ -0,0 +1,372 @@
+/*
+ * flow.c - Flow records of packets evicted from the buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "pkt.h"
+#include "flow.h"
+
+/* Local routines */
+static u_int32_t flow_hash(const struct flowkey *);
+static int flow_open(struct flowtab *);
+static void flow_prune(struct flowtab *);
+static int flow_swap(struct flowtab *);
+static void flow_writeset(struct flowtab *, struct flowset *);
+
+
+/*
+ * Create an empty flow table writing files to dir, 
+ * which are kept for keep seconds.
+ * Returns a flowtab pointer on success, NULL on error.
+ */
+struct flowtab *
+flow_init(const char *dir, time_t keep, int datalink, int offset)
+{
+	struct flowtab *ft;
+
+	if ( (ft = calloc(1, sizeof(struct flowtab))) == NULL) {
+		err_errno("flow_init: calloc()");
+		return(NULL);
+	}
+
+	if ( (ft->ft_dir = strdup(dir)) == NULL) {
+		err_errno("flow_init: strdup()");
+		free(ft);
+		return(NULL);
+	}
+	ft->ft_keep = keep;
+	ft->ft_datalink = datalink;
+	ft->ft_offset = offset;
+	ft->ft_cur = &ft->ft_sets[0];
+	return(ft);
+}
+
+
+/*
+ * FNV-1a hash of a flow key
+ */
+static u_int32_t
+flow_hash(const struct flowkey *key)
+{
+	const u_char *p;
+	u_int32_t h;
+	size_t i;
+
+	p = (const u_char *)key;
+	h = 2166136261U;
+	for (i = 0; i < sizeof(struct flowkey); i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return(h);
+}
+
+
+/*
+ * Fold a packet leaving the buffer into its flow, called by the 
+ * buffer with the stored packet header and data. Non-IP packets 
+ * are counted as one flow without addresses. This runs while the
+ * buffer evicts, so it only works in memory.
+ */
+void
+flow_evicted(const void *elem, size_t size, void *arg)
+{
+	const struct pcap_pkthdr *pkthdr;
+	struct flowtab *ft;
+	struct flowset *fs;
+	struct pktinfo pi;
+	struct flowkey key;
+	struct flow *f;
+	u_int32_t h;
+	time_t sec;
+
+	ft = (struct flowtab *)arg;
+	pkthdr = (const struct pcap_pkthdr *)elem;
+	sec = pkthdr->ts.tv_sec;
+
+	/* Hand the table to the main loop once per interval of packet time */
+	if (sec >= ft->ft_flushat) {
+		if (ft->ft_cur->fs_nflows > 0)
+			flow_swap(ft);
+		ft->ft_flushat = sec - (sec % FLOW_INTERVAL) + FLOW_INTERVAL;
+	}
+
+	memset(&key, 0x00, sizeof(key));
+	pi.pi_tcpflags = 0;
+	if (pkt_parse(ft->ft_datalink, ft->ft_offset, (const u_char *)elem + 
+			sizeof(struct pcap_pkthdr), pkthdr->caplen, &pi) == 0) {
+		memcpy(key.fk_src, pi.pi_src, pi.pi_alen);
+		memcpy(key.fk_dst, pi.pi_dst, pi.pi_alen);
+		key.fk_sport = pi.pi_sport;
+		key.fk_dport = pi.pi_dport;
+		key.fk_proto = pi.pi_proto;
+		key.fk_alen = pi.pi_alen;
+	}
+
+	/* Swap early when filling up. If the other table is still not 
+	 * written, this one is filled further, always leaving a free
+	 * slot to end the probing below. */
+	if ((ft->ft_cur->fs_nflows >= FLOW_TABLE / 4 * 3) && (flow_swap(ft) < 0) &&
+			(ft->ft_cur->fs_nflows >= FLOW_TABLE - 1)) {
+		ft->ft_lost++;
+		return;
+	}
+	fs = ft->ft_cur;
+
+	h = flow_hash(&key) & (FLOW_TABLE - 1);
+	while (fs->fs_flows[h].f_used && 
+			memcmp(&fs->fs_flows[h].f_key, &key, sizeof(key)))
+		h = (h + 1) & (FLOW_TABLE - 1);
+	f = &fs->fs_flows[h];
+
+	if (!f->f_used) {
+		f->f_used = 1;
+		f->f_key = key;
+		f->f_first = sec;
+		f->f_last = sec;
+		f->f_packets = 0;
+		f->f_bytes = 0;
+		f->f_tcpflags = 0;
+		fs->fs_nflows++;
+	}
+
+	if (sec < f->f_first)
+		f->f_first = sec;
+	if (sec > f->f_last)
+		f->f_last = sec;
+	f->f_packets++;
+	f->f_bytes += pkthdr->len;
+	f->f_tcpflags |= pi.pi_tcpflags;
+	ft->ft_packets++;
+}
+
+
+/*
+ * Hand the current table to the main loop to be written.
+ * Returns 0 on success, -1 if the other table is not written yet.
+ */
+static int
+flow_swap(struct flowtab *ft)
+{
+	if (ft->ft_full != NULL)
+		return(-1);
+
+	ft->ft_full = ft->ft_cur;
+	ft->ft_cur = (ft->ft_cur == &ft->ft_sets[0]) ? 
+		&ft->ft_sets[1] : &ft->ft_sets[0];
+	return(0);
+}
+
+
+/*
+ * Start a new flow file, and remove old ones.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+flow_open(struct flowtab *ft)
+{
+	u_int32_t version;
+
+	if (ft->ft_file != NULL) {
+		fclose(ft->ft_file);
+		ft->ft_file = NULL;
+	}
+
+	ft->ft_opened = time(NULL);
+	snprintf(ft->ft_path, sizeof(ft->ft_path), "%s/%s%s%s", ft->ft_dir,
+		FLOW_PREFIX, str_time(ft->ft_opened, FLOW_DATE), FLOW_SUFFIX);
+
+	if ( (ft->ft_file = fopen(ft->ft_path, "a")) == NULL) {
+		err_errno("Failed to open flow file '%s'", ft->ft_path);
+		return(-1);
+	}
+
+	/* Header, unless appending to a file of the same second */
+	if (ftell(ft->ft_file) == 0) {
+		version = htonl(FLOW_VERSION);
+		fwrite(FLOW_MAGIC, 1, 4, ft->ft_file);
+		fwrite(&version, 1, sizeof(version), ft->ft_file);
+	}
+	ft->ft_files++;
+	verbose(1, "Writing flow records to %s\n", ft->ft_path);
+	
+	flow_prune(ft);
+	return(0);
+}
+
+
+/*
+ * Remove flow files not modified within the retention time
+ */
+static void
+flow_prune(struct flowtab *ft)
+{
+	char path[2048];
+	struct dirent *de;
+	struct stat sb;
+	size_t len;
+	DIR *dir;
+
+	if ( (dir = opendir(ft->ft_dir)) == NULL) {
+		err_errno("Failed to open flow directory '%s'", ft->ft_dir);
+		return;
+	}
+
+	while ( (de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (strncmp(de->d_name, FLOW_PREFIX, strlen(FLOW_PREFIX)) || 
+				(len < strlen(FLOW_SUFFIX)) || 
+				strcmp(&de->d_name[len - strlen(FLOW_SUFFIX)], FLOW_SUFFIX))
+			continue;
+		
+		snprintf(path, sizeof(path), "%s/%s", ft->ft_dir, de->d_name);
+		if ((stat(path, &sb) < 0) || !strcmp(path, ft->ft_path) ||
+				(sb.st_mtime + ft->ft_keep >= ft->ft_opened))
+			continue;
+
+		if (unlink(path) < 0) {
+			err_errno("Failed to remove flow file '%s'", path);
+			continue;
+		}
+		verbose(1, "Removed flow file %s\n", path);
+		ft->ft_removed++;
+	}
+	closedir(dir);
+}
+
+
+/*
+ * Append all flows in a table to the current file, 
+ * and empty the table
+ */
+static void
+flow_writeset(struct flowtab *ft, struct flowset *fs)
+{
+	struct flowrec fr;
+	struct flow *f;
+	size_t i;
+
+	if ((ft->ft_file == NULL) || (time(NULL) >= ft->ft_opened + FLOW_ROTATE))
+		flow_open(ft);
+
+	for (i = 0; (i < FLOW_TABLE) && (fs->fs_nflows > 0); i++) {
+		f = &fs->fs_flows[i];
+		if (!f->f_used)
+			continue;
+		f->f_used = 0;
+		fs->fs_nflows--;
+		
+		if (ft->ft_file == NULL) {
+			ft->ft_errors++;
+			continue;
+		}
+
+		memset(&fr, 0x00, sizeof(fr));
+		fr.fr_first = htonl((u_int32_t)f->f_first);
+		fr.fr_last = htonl((u_int32_t)f->f_last);
+		fr.fr_packets = htonl(f->f_packets);
+		fr.fr_bytes_hi = htonl((u_int32_t)(f->f_bytes >> 32));
+		fr.fr_bytes_lo = htonl((u_int32_t)f->f_bytes);
+		fr.fr_sport = htons(f->f_key.fk_sport);
+		fr.fr_dport = htons(f->f_key.fk_dport);
+		fr.fr_proto = f->f_key.fk_proto;
+		fr.fr_tcpflags = f->f_tcpflags;
+		fr.fr_alen = f->f_key.fk_alen;
+		memcpy(fr.fr_src, f->f_key.fk_src, sizeof(fr.fr_src));
+		memcpy(fr.fr_dst, f->f_key.fk_dst, sizeof(fr.fr_dst));
+
+		if (fwrite(&fr, sizeof(fr), 1, ft->ft_file) != 1)
+			ft->ft_errors++;
+		else
+			ft->ft_records++;
+	}
+
+	if ((ft->ft_file != NULL) && (fflush(ft->ft_file) != 0))
+		err_errno("Failed to write flow file '%s'", ft->ft_path);
+}
+
+
+/*
+ * Write a table that was swapped out while packets were evicted,
+ * called from the main loop
+ */
+void
+flow_write(struct flowtab *ft)
+{
+	if (ft->ft_full != NULL) {
+		flow_writeset(ft, ft->ft_full);
+		ft->ft_full = NULL;
+	}
+
+	if (ft->ft_lost != ft->ft_reported_lost) {
+		warn("Flow tables were full, %lu evicted packets not recorded\n",
+			(u_long)(ft->ft_lost - ft->ft_reported_lost));
+		ft->ft_reported_lost = ft->ft_lost;
+	}
+}
+
+
+/*
+ * Write all flows, the table swapped out first since it is older
+ */
+void
+flow_flush(struct flowtab *ft)
+{
+	flow_write(ft);
+	if (ft->ft_cur->fs_nflows > 0)
+		flow_writeset(ft, ft->ft_cur);
+}
+
+
+/*
+ * Write remaining flows and close the current file
+ */
+void
+flow_close(struct flowtab *ft)
+{
+	flow_flush(ft);
+	if (ft->ft_file != NULL)
+		fclose(ft->ft_file);
+	free(ft->ft_dir);
+	free(ft);
+}
@@ -0,0 +1,151 @@
+/*
+ * flow.h - Flow records of packets evicted from the buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _FLOW_H
+#define _FLOW_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+
+/* Flow files start with the magic and the version */
+#define FLOW_MAGIC		"RCFL"
+#define FLOW_VERSION	1
+
+/* Flow files are named <prefix><time of first record><suffix> */
+#define FLOW_PREFIX		"flows_"
+#define FLOW_SUFFIX		".rcf"
+#define FLOW_DATE		"%Y%m%d_%H:%M:%S"
+
+/* Flows in the table, written early when three quarters are used */
+#define FLOW_TABLE		8192
+
+/* Seconds of packet time between writing the table */
+#define FLOW_INTERVAL	60
+
+/* Seconds of wall clock time per file */
+#define FLOW_ROTATE		3600
+
+/* Default hours to keep flow files */
+#define FLOW_KEEP		72
+
+/*
+ * Record in a flow file, 60 bytes with all fields in network byte
+ * order. A flow that spans several intervals gets one record each.
+ * Addresses shorter than 16 bytes are padded with zeroes.
+ */
+struct flowrec {
+	u_int32_t fr_first;		/* Time of first packet, seconds since epoch */
+	u_int32_t fr_last;		/* Time of last packet */
+	u_int32_t fr_packets;
+	u_int32_t fr_bytes_hi;	/* Bytes on the wire, upper 32 bits */
+	u_int32_t fr_bytes_lo;	/* Bytes on the wire, lower 32 bits */
+	u_int16_t fr_sport;		/* Source port, 0 if none */
+	u_int16_t fr_dport;		/* Destination port, 0 if none */
+	u_int8_t fr_proto;		/* Transport protocol */
+	u_int8_t fr_tcpflags;	/* TCP flags seen, 0 if not TCP */
+	u_int8_t fr_alen;		/* Address length, 4 or 16, 0 if not IP */
+	u_int8_t fr_pad;
+	u_char fr_src[16];
+	u_char fr_dst[16];
+};
+
+/* Flow key, kept zeroed where unused so it can be compared with memcmp */
+struct flowkey {
+	u_char fk_src[16];
+	u_char fk_dst[16];
+	u_int16_t fk_sport;
+	u_int16_t fk_dport;
+	u_char fk_proto;
+	u_char fk_alen;
+};
+
+struct flow {
+	struct flowkey f_key;
+	time_t f_first;
+	time_t f_last;
+	u_int32_t f_packets;
+	u_int64_t f_bytes;
+	u_char f_tcpflags;
+	u_char f_used;
+};
+
+/* Open addressed table of flows */
+struct flowset {
+	size_t fs_nflows;		/* Flows in table */
+	struct flow fs_flows[FLOW_TABLE];
+};
+
+/*
+ * Packets evicted from the buffer are folded into a table of flows.
+ * Once an interval of packet time has passed, or the table is filling
+ * up, it is swapped with the other table and appended to the current 
+ * flow file from the main loop, no file is touched while packets are 
+ * evicted. A new file is started every FLOW_ROTATE seconds, files 
+ * older than the retention time are removed.
+ */
+struct flowtab {
+	char *ft_dir;			/* Directory of flow files */
+	time_t ft_keep;			/* Seconds to keep files */
+	int ft_datalink;
+	int ft_offset;
+
+	FILE *ft_file;			/* Current file, NULL if none */
+	char ft_path[2048];
+	time_t ft_opened;		/* Wall clock time current file was opened */
+	time_t ft_flushat;		/* Packet time to write table */
+
+	struct flowset *ft_cur;	/* Table packets are folded into */
+	struct flowset *ft_full;	/* Table waiting to be written, NULL if none */
+	struct flowset ft_sets[2];
+
+	size_t ft_packets;		/* Packets folded into flows */
+	size_t ft_lost;			/* Packets not folded, both tables full */
+	size_t ft_reported_lost;
+	size_t ft_records;		/* Records written */
+	size_t ft_files;		/* Files opened */
+	size_t ft_removed;		/* Files removed for age */
+	size_t ft_errors;		/* Records that could not be written */
+};
+
+/* Flows not written yet */
+#define flow_active(f)	((f)->ft_cur->fs_nflows + \
+	(((f)->ft_full != NULL) ? (f)->ft_full->fs_nflows : 0))
+
+/* flow.c */
+extern struct flowtab *flow_init(const char *, time_t, int, int);
+extern void flow_evicted(const void *, size_t, void *);
+extern void flow_write(struct flowtab *);
+extern void flow_flush(struct flowtab *);
+extern void flow_close(struct flowtab *);
+
+#endif /* _FLOW_H */
@@ -0,0 +1,126 @@
+/*
+ * hist.c - Low overhead latency histograms
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "print.h"
+#include "hist.h"
+
+/* Ticks per nanosecond */
+static double ticks_ns = 1.0;
+
+
+/*
+ * Measure the rate of the tick counter against the monotonic clock
+ */
+void
+hist_init(void)
+{
+	struct timespec t0, t1, nap;
+	u_int64_t start, end;
+	double ns;
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = 20000000;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	start = hist_now();
+	nanosleep(&nap, NULL);
+	end = hist_now();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	if ((ns > 0) && (end > start))
+		ticks_ns = (end - start) / ns;
+	verbose(1, "Latency clock runs at %.3f ticks per ns\n", ticks_ns);
+}
+
+
+/*
+ * Convert ticks to nanoseconds
+ */
+double
+hist_ns(u_int64_t ticks)
+{
+	return(ticks / ticks_ns);
+}
+
+
+/*
+ * Returns the largest value of the bucket holding quantile q 
+ * (0 to 1) of the samples, in ticks. 
+ */
+u_int64_t
+hist_quantile(const struct hist *h, double q)
+{
+	u_int64_t rank, seen;
+	u_int64_t upper;
+	int i, msb;
+
+	if (h->h_count == 0)
+		return(0);
+	
+	rank = q * h->h_count;
+	if (rank >= h->h_count)
+		rank = h->h_count - 1;
+	
+	for (seen = 0, i = 0; i < HIST_BUCKETS; i++) {
+		if ( (seen += h->h_buckets[i]) > rank)
+			break;
+	}
+
+	if (i < (1 << HIST_SUBBITS))
+		upper = i;
+	else {
+		msb = i >> HIST_SUBBITS;
+		upper = ((u_int64_t)((1 << HIST_SUBBITS) | (i & ((1 << HIST_SUBBITS) - 1)))
+			<< (msb - HIST_SUBBITS)) + ((u_int64_t)1 << (msb - HIST_SUBBITS)) - 1;
+	}
+	return((upper < h->h_max) ? upper : h->h_max);
+}
+
+
+/*
+ * Clear all samples
+ */
+void
+hist_reset(struct hist *h)
+{
+	const char *name;
+
+	name = h->h_name;
+	memset(h, 0x00, sizeof(struct hist));
+	h->h_name = name;
+}
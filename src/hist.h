@@ -0,0 +1,104 @@
+/*
+ * hist.h - Low overhead latency histograms
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* 
+ * Samples are counted in buckets of logarithmic size, four per power
+ * of two, which keeps the error below 25% for any value. Values are
+ * recorded in ticks of the cycle counter and converted when reported.
+ */
+#define HIST_SUBBITS	2
+#define HIST_BUCKETS	(64 << HIST_SUBBITS)
+
+struct hist {
+	const char *h_name;
+	u_int64_t h_count;			/* Number of samples */
+	u_int64_t h_sum;			/* Sum of samples in ticks */
+	u_int64_t h_max;			/* Largest sample in ticks */
+	u_int64_t h_buckets[HIST_BUCKETS];
+};
+
+/* Read the time in ticks */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static __inline__ u_int64_t
+hist_now(void)
+{
+	u_int32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return(((u_int64_t)hi << 32) | lo);
+}
+#else
+static __inline__ u_int64_t
+hist_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+#endif
+
+/* Record the ticks passed since start */
+static __inline__ void
+hist_add(struct hist *h, u_int64_t start)
+{
+	u_int64_t v;
+	int msb, idx;
+
+	v = hist_now() - start;
+	if (v < (1 << HIST_SUBBITS))
+		idx = v;
+	else {
+		msb = 63 - __builtin_clzll(v);
+		idx = (msb << HIST_SUBBITS) | 
+			((v >> (msb - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1));
+	}
+	h->h_buckets[idx]++;
+	h->h_count++;
+	h->h_sum += v;
+	if (v > h->h_max)
+		h->h_max = v;
+}
+
+/* hist.c */
+extern void hist_init(void);
+extern double hist_ns(u_int64_t);
+extern u_int64_t hist_quantile(const struct hist *, double);
+extern void hist_reset(struct hist *);
+
+#endif /* _HIST_H */
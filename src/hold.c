@@ -0,0 +1,306 @@
+/*
+ * hold.c - Keep ranges of packets past their eviction
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "ringbuf.h"
+#include "hold.h"
+
+/* Local routines */
+static void hold_clear(struct hold *);
+static int hold_match(struct hold *, const void *);
+
+
+/*
+ * Create an empty set of holds sharing budget bytes.
+ * Returns a holds pointer on success, NULL on error.
+ */
+struct holds *
+hold_init(size_t budget)
+{
+	struct holds *hs;
+
+	if ( (hs = calloc(1, sizeof(struct holds))) == NULL) {
+		err_errno("hold_init: calloc()");
+		return(NULL);
+	}
+	hs->hs_budget = budget;
+	return(hs);
+}
+
+
+/*
+ * Hold packets from second from to second to, of size bytes at most
+ * for expire seconds. A size of 0 takes a share of the budget. Only
+ * packets matching filter are held, if it is not NULL, the filter 
+ * is compiled for capture p.
+ * Returns the hold on success, NULL on error.
+ */
+struct hold *
+hold_add(struct holds *hs, const char *name, time_t from, time_t to, 
+	size_t size, time_t expire, const char *filter, pcap_t *p, bpf_u_int32 net)
+{
+	struct hold *ho;
+	char left[32];
+
+	if (hs->hs_n >= HOLD_MAX) {
+		err("Too many holds, maximum is %u\n", HOLD_MAX);
+		return(NULL);
+	}
+
+	if (hold_find(hs, name) != NULL) {
+		err("Hold '%s' exists\n", name);
+		return(NULL);
+	}
+
+	if ((to != 0) && (from > to)) {
+		err("Hold '%s' ends before it starts\n", name);
+		return(NULL);
+	}
+
+	if (size == 0) {
+		size = hs->hs_budget / HOLD_SHARE;
+		if (size > hs->hs_budget - hs->hs_used)
+			size = hs->hs_budget - hs->hs_used;
+	}
+	if ((size == 0) || (size > hs->hs_budget - hs->hs_used)) {
+		/* str_hsize() returns a static buffer */
+		snprintf(left, sizeof(left), "%s", str_hsize(hs->hs_budget - hs->hs_used));
+		err("Hold '%s' does not fit, %s of %s bytes left\n", name, 
+			left, str_hsize(hs->hs_budget));
+		return(NULL);
+	}
+
+	ho = &hs->hs_hold[hs->hs_n];
+	memset(ho, 0x00, sizeof(struct hold));
+	ho->ho_from = from;
+	ho->ho_to = to;
+	ho->ho_size = size;
+	ho->ho_created = time(NULL);
+	ho->ho_expires = ho->ho_created + expire;
+
+	if (((ho->ho_name = strdup(name)) == NULL) || 
+			((filter != NULL) && ((ho->ho_filter = strdup(filter)) == NULL))) {
+		err_errno("hold_add: strdup()");
+		hold_clear(ho);
+		return(NULL);
+	}
+
+	if ((filter != NULL) && (pcap_compile(p, &ho->ho_bpf, filter, 1, net) < 0)) {
+		err("Hold '%s': %s\n", name, pcap_geterr(p));
+		hold_clear(ho);
+		return(NULL);
+	}
+
+	/* Memory is only taken as packets are saved */
+	if ( (ho->ho_rbuf = ringbuf_init(size, size, 0)) == NULL) {
+		hold_clear(ho);
+		return(NULL);
+	}
+
+	hs->hs_used += size;
+	hs->hs_n++;
+	return(ho);
+}
+
+
+/*
+ * Returns non-zero if the buffered packet elem is in the 
+ * time range of the hold and matches its filter
+ */
+static int
+hold_match(struct hold *ho, const void *elem)
+{
+	const struct pcap_pkthdr *pkthdr;
+
+	pkthdr = (const struct pcap_pkthdr *)elem;
+	if (!hold_range(ho, pkthdr->ts.tv_sec))
+		return(0);
+	if ((ho->ho_filter != NULL) && (bpf_filter(ho->ho_bpf.bf_insns, 
+			(u_char *)elem + sizeof(struct pcap_pkthdr), 
+			pkthdr->len, pkthdr->caplen) == 0))
+		return(0);
+	return(1);
+}
+
+
+/*
+ * Returns non-zero if any hold keeps the buffered packet elem
+ */
+int
+hold_held(struct holds *hs, const void *elem)
+{
+	int i;
+
+	for (i = 0; i < hs->hs_n; i++) {
+		if (hold_match(&hs->hs_hold[i], elem))
+			return(1);
+	}
+	return(0);
+}
+
+
+/*
+ * Evict function of the buffers, saves a packet that is held
+ */
+void
+hold_evicted(const void *elem, size_t size, void *arg)
+{
+	struct holds *hs;
+	struct hold *ho;
+	int i;
+
+	hs = (struct holds *)arg;
+	for (i = 0; i < hs->hs_n; i++) {
+		ho = &hs->hs_hold[i];
+		if (!hold_match(ho, elem))
+			continue;
+
+		if (ringbuf_add(ho->ho_rbuf, elem, size) == 0) {
+			ho->ho_kept++;
+			ho->ho_bytes += size;
+		}
+	}
+}
+
+
+/*
+ * Save the held packets of a buffer that is about to be 
+ * emptied without evicting
+ */
+void
+hold_keep(struct holds *hs, struct ringbuf *rbuf)
+{
+	struct ringbuf_cursor rc;
+	const void *elem;
+	size_t size;
+
+	ringbuf_cursor_init(rbuf, &rc);
+	while ( (elem = ringbuf_cursor_next(&rc, &size)) != NULL)
+		hold_evicted(elem, size, hs);
+}
+
+
+/*
+ * Free what a hold has allocated
+ */
+static void
+hold_clear(struct hold *ho)
+{
+	if (ho->ho_bpf.bf_insns != NULL)
+		pcap_freecode(&ho->ho_bpf);
+	if (ho->ho_rbuf != NULL)
+		ringbuf_free(ho->ho_rbuf);
+	free(ho->ho_name);
+	free(ho->ho_filter);
+	memset(ho, 0x00, sizeof(struct hold));
+}
+
+
+/*
+ * Release a hold, the packets it saved are freed
+ */
+void
+hold_release(struct holds *hs, struct hold *ho)
+{
+	int i;
+
+	i = ho - hs->hs_hold;
+	hs->hs_used -= ho->ho_size;
+	hold_clear(ho);
+
+	/* Keep the holds packed */
+	memmove(&hs->hs_hold[i], &hs->hs_hold[i + 1], 
+		(hs->hs_n - i - 1) * sizeof(struct hold));
+	hs->hs_n--;
+}
+
+
+/*
+ * Release holds that have expired at time now.
+ * Returns the number of holds released.
+ */
+int
+hold_expire(struct holds *hs, time_t now)
+{
+	int i, n;
+
+	for (n = 0, i = 0; i < hs->hs_n; ) {
+		if (now < hs->hs_hold[i].ho_expires) {
+			i++;
+			continue;
+		}
+
+		verbose(0, "Hold '%s' expired, %u saved packets released\n", 
+			hs->hs_hold[i].ho_name, (u_int)ringbuf_elements(hs->hs_hold[i].ho_rbuf));
+		hold_release(hs, &hs->hs_hold[i]);
+		n++;
+	}
+	return(n);
+}
+
+
+/*
+ * Returns the hold called name, or NULL if there is none
+ */
+struct hold *
+hold_find(struct holds *hs, const char *name)
+{
+	int i;
+
+	for (i = 0; i < hs->hs_n; i++) {
+		if (!strcmp(hs->hs_hold[i].ho_name, name))
+			return(&hs->hs_hold[i]);
+	}
+	return(NULL);
+}
+
+
+/*
+ * Free holds and their buffers
+ */
+void
+hold_free(struct holds *hs)
+{
+	int i;
+
+	for (i = 0; i < hs->hs_n; i++)
+		hold_clear(&hs->hs_hold[i]);
+	free(hs);
+}
@@ -0,0 +1,98 @@
+/*
+ * hold.h - Keep ranges of packets past their eviction
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _HOLD_H
+#define _HOLD_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "ringbuf.h"
+
+/* Maximum number of holds */
+#define HOLD_MAX		8
+
+/* Default seconds a hold is kept before it is released */
+#define HOLD_EXPIRE		(24*3600)
+
+/* Default size of a hold is this part of the budget */
+#define HOLD_SHARE		4
+
+/*
+ * A hold pins packets of a time range, and optionally of a filter,
+ * in the buffer. Eviction itself is not changed, a held packet that 
+ * is evicted is moved to the buffer of the hold instead of being 
+ * lost, at the cost of one copy. Packets of the range still in the 
+ * buffer stay where they are. The holds share a byte budget, and 
+ * are released on request or when they expire.
+ */
+struct hold {
+	char *ho_name;
+	char *ho_filter;		/* Filter expression, NULL for all packets */
+	struct bpf_program ho_bpf;
+	time_t ho_from;			/* First second held, 0 for the oldest */
+	time_t ho_to;			/* Last second held, 0 for no end */
+	time_t ho_created;
+	time_t ho_expires;		/* Released at this time */
+	size_t ho_size;			/* Byte budget */
+	struct ringbuf *ho_rbuf;	/* Packets saved from eviction */
+	size_t ho_kept;			/* Packets saved */
+	size_t ho_bytes;		/* Bytes saved */
+};
+
+struct holds {
+	int hs_n;
+	size_t hs_budget;		/* Bytes for all holds */
+	size_t hs_used;			/* Bytes given to holds */
+	struct hold hs_hold[HOLD_MAX];
+};
+
+/* Returns non-zero if there are holds */
+#define hold_active(h)	((h)->hs_n > 0)
+
+/* Returns non-zero if the packet is in the time range of the hold */
+#define hold_range(ho, sec)	((((ho)->ho_from == 0) || ((sec) >= (ho)->ho_from)) && \
+	(((ho)->ho_to == 0) || ((sec) <= (ho)->ho_to)))
+
+/* hold.c */
+extern struct holds *hold_init(size_t);
+extern struct hold *hold_add(struct holds *, const char *, time_t, time_t, 
+	size_t, time_t, const char *, pcap_t *, bpf_u_int32);
+extern int hold_held(struct holds *, const void *);
+extern void hold_evicted(const void *, size_t, void *);
+extern void hold_keep(struct holds *, struct ringbuf *);
+extern void hold_release(struct holds *, struct hold *);
+extern int hold_expire(struct holds *, time_t);
+extern struct hold *hold_find(struct holds *, const char *);
+extern void hold_free(struct holds *);
+
+#endif /* _HOLD_H */
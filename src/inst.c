@@ -0,0 +1,358 @@
+/*
+ * inst.c - Instances of the buffer sharing one capture
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "ringbuf.h"
+#include "pkt.h"
+#include "inst.h"
+
+/* Local routines */
+static int inst_add(struct instances *, char **, const char *);
+
+
+/*
+ * Create an empty set of instances.
+ * Returns an instances pointer on success, NULL on error.
+ */
+struct instances *
+inst_init(void)
+{
+	struct instances *is;
+
+	if ( (is = calloc(1, sizeof(struct instances))) == NULL) {
+		err_errno("inst_init: calloc()");
+		return(NULL);
+	}
+	return(is);
+}
+
+
+/*
+ * Add an instance from the fields name, size, age and dump 
+ * directory, and a filter expression that is empty for all 
+ * packets. The buffer is created here, the filter is compiled
+ * later by inst_compile().
+ * Returns 0 on success, -1 on error.
+ */
+static int
+inst_add(struct instances *is, char **field, const char *expr)
+{
+	struct instance *in;
+	unsigned long ul;
+	int i;
+
+	if (is->is_n >= INST_MAX) {
+		err("Too many instances, maximum is %u\n", INST_MAX);
+		return(-1);
+	}
+	in = &is->is_inst[is->is_n];
+	memset(in, 0x00, sizeof(struct instance));
+
+	for (i = 0; i < is->is_n; i++) {
+		if (!strcmp(is->is_inst[i].in_name, field[0])) {
+			err("Instance '%s' given twice\n", field[0]);
+			return(-1);
+		}
+	}
+
+	if ( (in->in_size = str_to_size(field[1])) == 0) {
+		err("Bad size '%s' of instance '%s'\n", field[1], field[0]);
+		return(-1);
+	}
+
+	if (!str_isnum(field[2], &ul)) {
+		err("Bad age '%s' of instance '%s'\n", field[2], field[0]);
+		return(-1);
+	}
+	in->in_age = ul;
+
+	if (((in->in_name = strdup(field[0])) == NULL) || 
+			((in->in_dumpdir = strdup(field[3])) == NULL) ||
+			((*expr != '\0') && ((in->in_filter = strdup(expr)) == NULL))) {
+		err_errno("inst_add: strdup()");
+		free(in->in_name);
+		free(in->in_dumpdir);
+		return(-1);
+	}
+
+	/* A fixed budget, no room to grow */
+	if ( (in->in_rbuf = ringbuf_init(in->in_size, in->in_size, 0)) == NULL) {
+		free(in->in_name);
+		free(in->in_dumpdir);
+		free(in->in_filter);
+		return(-1);
+	}
+	is->is_n++;
+	return(0);
+}
+
+
+/*
+ * Read instances from a file with one instance per line:
+ *
+ *   <name> <size> <age> <dumpdir> [expression]
+ *
+ * Age is in seconds, 0 for none. A missing expression takes all
+ * packets. Empty lines and everything after a '#' are ignored.
+ * Returns 0 on success, -1 on error.
+ */
+int
+inst_load(struct instances *is, const char *path)
+{
+	char line[INST_LINEMAX];
+	char *field[4];
+	char *p, *end;
+	FILE *f;
+	int lineno, n;
+
+	if ( (f = fopen(path, "r")) == NULL) {
+		err_errno("Failed to open instance file '%s'", path);
+		return(-1);
+	}
+
+	for (lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++) {
+		if ( (p = strchr(line, '\n')) != NULL)
+			*p = '\0';
+		else if (!feof(f)) {
+			err("%s:%d: Line too long\n", path, lineno);
+			fclose(f);
+			return(-1);
+		}
+		if ( (p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		p = line;
+		for (n = 0; n < 4; n++) {
+			while (isspace((int)*p))
+				p++;
+			if (*p == '\0')
+				break;
+			field[n] = p;
+			while ((*p != '\0') && !isspace((int)*p))
+				p++;
+			if (*p != '\0')
+				*p++ = '\0';
+		}
+
+		if (n == 0)
+			continue;
+		if (n < 4) {
+			err("%s:%d: Expected name, size, age and dump directory\n", 
+				path, lineno);
+			fclose(f);
+			return(-1);
+		}
+
+		/* The rest of the line is the expression */
+		while (isspace((int)*p))
+			p++;
+		for (end = p + strlen(p); (end > p) && isspace((int)end[-1]); end--)
+			end[-1] = '\0';
+
+		if (inst_add(is, field, p) < 0) {
+			err("%s:%d: Bad instance\n", path, lineno);
+			fclose(f);
+			return(-1);
+		}
+	}
+	fclose(f);
+
+	if (is->is_n == 0) {
+		err("No instances in '%s'\n", path);
+		return(-1);
+	}
+	return(0);
+}
+
+
+/*
+ * Compile the filters of the instances for the open capture.
+ * Returns 0 on success, -1 on error.
+ */
+int
+inst_compile(struct instances *is, pcap_t *p, bpf_u_int32 net)
+{
+	struct instance *in;
+	int i;
+
+	for (i = 0; i < is->is_n; i++) {
+		in = &is->is_inst[i];
+
+		if (in->in_filter == NULL)
+			continue;
+		if (pcap_compile(p, &in->in_bpf, in->in_filter, 1, net) < 0) {
+			err("Instance '%s': %s\n", in->in_name, pcap_geterr(p));
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+
+/*
+ * Build the filter of the capture, the packets of the main buffer
+ * given by main, and those of all instances. The kernel then passes
+ * each packet once, whatever the number of instances it goes to.
+ * Returns an allocated expression, or NULL if all packets are taken.
+ */
+char *
+inst_filter(struct instances *is, const char *main)
+{
+	char *expr;
+	size_t len;
+	int i;
+
+	if (main == NULL)
+		return(NULL);
+
+	len = strlen(main) + 3;
+	for (i = 0; i < is->is_n; i++) {
+		if (is->is_inst[i].in_filter == NULL)
+			return(NULL);
+		len += strlen(is->is_inst[i].in_filter) + 6;
+	}
+
+	if ( (expr = malloc(len)) == NULL) {
+		err_errno("inst_filter: malloc()");
+		return(NULL);
+	}
+
+	snprintf(expr, len, "(%s)", main);
+	for (i = 0; i < is->is_n; i++) {
+		snprintf(&expr[strlen(expr)], len - strlen(expr), " or (%s)",
+			is->is_inst[i].in_filter);
+	}
+	return(expr);
+}
+
+
+/*
+ * Add a packet, stored as elem of size len, to the buffer 
+ * of every instance whose filter matches.
+ * Returns the number of instances that took the packet.
+ */
+int
+inst_packet(struct instances *is, const struct pcap_pkthdr *pkthdr, 
+	const u_char *packet, const void *elem, size_t len)
+{
+	struct instance *in;
+	int i, n;
+
+	for (n = 0, i = 0; i < is->is_n; i++) {
+		in = &is->is_inst[i];
+
+		if ((in->in_filter != NULL) && (bpf_filter(in->in_bpf.bf_insns, 
+				(u_char *)packet, pkthdr->len, pkthdr->caplen) == 0))
+			continue;
+		
+		in->in_packets++;
+		in->in_bytes += pkthdr->len;
+		if (ringbuf_add(in->in_rbuf, elem, len) < 0) {
+			in->in_refused++;
+			continue;
+		}
+		n++;
+	}
+	return(n);
+}
+
+
+/*
+ * Remove packets past the age budget of their instance, now is the
+ * time of the newest packet. Checked once a second of packet time.
+ */
+void
+inst_expire(struct instances *is, time_t now)
+{
+	struct instance *in;
+	int i;
+
+	if (now == is->is_sec)
+		return;
+	is->is_sec = now;
+
+	for (i = 0; i < is->is_n; i++) {
+		in = &is->is_inst[i];
+		if (in->in_age == 0)
+			continue;
+
+		in->in_expired += pkt_expire(in->in_rbuf, now - in->in_age);
+	}
+}
+
+
+/*
+ * Returns the instance called name, or NULL if there is none
+ */
+struct instance *
+inst_find(struct instances *is, const char *name)
+{
+	int i;
+
+	for (i = 0; i < is->is_n; i++) {
+		if (!strcmp(is->is_inst[i].in_name, name))
+			return(&is->is_inst[i]);
+	}
+	return(NULL);
+}
+
+
+/*
+ * Free instances and their buffers
+ */
+void
+inst_free(struct instances *is)
+{
+	struct instance *in;
+	int i;
+
+	for (i = 0; i < is->is_n; i++) {
+		in = &is->is_inst[i];
+		
+		if (in->in_bpf.bf_insns != NULL)
+			pcap_freecode(&in->in_bpf);
+		ringbuf_free(in->in_rbuf);
+		free(in->in_name);
+		free(in->in_filter);
+		free(in->in_dumpdir);
+	}
+	free(is);
+}
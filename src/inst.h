@@ -0,0 +1,88 @@
+/*
+ * inst.h - Instances of the buffer sharing one capture
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _INST_H
+#define _INST_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "ringbuf.h"
+
+/* Maximum number of instances, not counting the main buffer */
+#define INST_MAX		16
+
+/* Longest line of the instance file */
+#define INST_LINEMAX	1024
+
+/*
+ * An instance is a buffer of its own, with its own filter, size,
+ * age budget and dump directory, as if another ringcapd had been
+ * started on the interface. All instances are fed from the one 
+ * capture of the daemon, a packet goes to every instance whose 
+ * filter matches it.
+ */
+struct instance {
+	char *in_name;
+	char *in_filter;		/* Filter expression, NULL for all packets */
+	char *in_dumpdir;		/* Where dumps of the instance go */
+	size_t in_size;			/* Byte budget */
+	time_t in_age;			/* Age budget in seconds, 0 for none */
+	struct bpf_program in_bpf;
+	struct ringbuf *in_rbuf;
+	size_t in_packets;		/* Packets matched */
+	size_t in_bytes;		/* Bytes matched */
+	size_t in_refused;		/* Packets not added to the buffer */
+	size_t in_expired;		/* Packets removed for their age */
+};
+
+struct instances {
+	int is_n;
+	time_t is_sec;			/* Second of last age check */
+	struct instance is_inst[INST_MAX];
+};
+
+/* Returns non-zero if there are instances */
+#define inst_active(i)	((i)->is_n > 0)
+
+/* inst.c */
+extern struct instances *inst_init(void);
+extern int inst_load(struct instances *, const char *);
+extern int inst_compile(struct instances *, pcap_t *, bpf_u_int32);
+extern char *inst_filter(struct instances *, const char *);
+extern int inst_packet(struct instances *, const struct pcap_pkthdr *, 
+	const u_char *, const void *, size_t);
+extern void inst_expire(struct instances *, time_t);
+extern struct instance *inst_find(struct instances *, const char *);
+extern void inst_free(struct instances *);
+
+#endif /* _INST_H */
@@ -0,0 +1,509 @@
+/*
+ * libringcap.c - Read the shared buffer of a running ringcapd
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+/*
+ * The library is linked into other programs, errors are 
+ * returned with errno set rather than printed. Nothing here
+ * writes to the segment or waits for the writer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include "ringcap.h"
+
+/* Offset of a cursor that has nothing more in its block */
+#define RCAP_END			(~(u_int64_t)0)
+
+#define RCAP_BLOCK(rc, i)	(&(rc)->r_blocks[(i)])
+#define RCAP_DATA(rc, i)	((rc)->r_arena + (i) * (rc)->r_hdr->h_blksize)
+
+/* Local routines */
+static struct rcap *rcap_map(struct rcap *);
+static int rcap_same(const struct rcap_block *, u_int64_t);
+static int rcap_enter(struct rcap *, struct rcap_cursor *, int64_t, u_int64_t);
+static int rcap_start(struct rcap *, struct rcap_cursor *);
+static void rcap_overrun(struct rcap *, struct rcap_cursor *);
+static int rcap_get(struct rcap *, struct rcap_cursor *, 
+	const struct rcap_pkthdr **, const u_char **, size_t *);
+static int rcap_peek(struct rcap *, int64_t, struct timeval *);
+
+
+/*
+ * Open the shared buffer of ringcapd -X name.
+ * Returns a pointer on success, NULL on error.
+ */
+struct rcap *
+rcap_open(const char *name)
+{
+	char path[NAME_MAX];
+	struct rcap *rc;
+
+	if ((*name == '\0') || (strchr(name, '/') != NULL) || 
+			(strlen(name) + 2 > sizeof(path))) {
+		errno = EINVAL;
+		return(NULL);
+	}
+	snprintf(path, sizeof(path), "/%s", name);
+
+	if ( (rc = calloc(1, sizeof(struct rcap))) == NULL)
+		return(NULL);
+	rc->r_map = MAP_FAILED;
+
+	if ( (rc->r_fd = shm_open(path, O_RDONLY, 0)) < 0) {
+		rcap_close(rc);
+		return(NULL);
+	}
+	return(rcap_map(rc));
+}
+
+
+/*
+ * Open a shared buffer from a descriptor of its segment, such as 
+ * one without a name handed over by the writer. The descriptor is
+ * duplicated and can be closed by the caller.
+ * Returns a pointer on success, NULL on error.
+ */
+struct rcap *
+rcap_attach(int fd)
+{
+	struct rcap *rc;
+
+	if ( (rc = calloc(1, sizeof(struct rcap))) == NULL)
+		return(NULL);
+	rc->r_map = MAP_FAILED;
+
+	if ( (rc->r_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		rcap_close(rc);
+		return(NULL);
+	}
+	return(rcap_map(rc));
+}
+
+
+/*
+ * Map the segment open in r_fd and check that it is a buffer.
+ * Returns rc on success, NULL on error with rc closed.
+ */
+static struct rcap *
+rcap_map(struct rcap *rc)
+{
+	const struct rcap_header *h;
+	struct stat st;
+	int saved;
+
+	if (fstat(rc->r_fd, &st) < 0)
+		goto fail;
+	
+	if (st.st_size < (off_t)sizeof(struct rcap_header)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	rc->r_maplen = st.st_size;
+
+	rc->r_map = mmap(NULL, rc->r_maplen, PROT_READ, MAP_SHARED, rc->r_fd, 0);
+	if (rc->r_map == MAP_FAILED)
+		goto fail;
+	h = (const struct rcap_header *)rc->r_map;
+
+	/* The magic is written last by the writer */
+	if (memcmp(h->h_magic, RCAP_MAGIC, sizeof(h->h_magic))) {
+		errno = EINVAL;
+		goto fail;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if ((h->h_version != RCAP_VERSION) || 
+			(h->h_hdrlen < sizeof(struct rcap_header))) {
+		errno = EPROTONOSUPPORT;
+		goto fail;
+	}
+
+	if ((h->h_blksize == 0) || (h->h_table + h->h_nblocks * 
+			sizeof(struct rcap_block) > rc->r_maplen) ||
+			(h->h_arena + h->h_nblocks * h->h_blksize > rc->r_maplen)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	rc->r_hdr = h;
+	rc->r_blocks = (const struct rcap_block *)(rc->r_map + h->h_table);
+	rc->r_arena = rc->r_map + h->h_arena;
+	return(rc);
+
+fail:
+	saved = errno;
+	rcap_close(rc);
+	errno = saved;
+	return(NULL);
+}
+
+
+/*
+ * Close a shared buffer, packets returned 
+ * from it can no longer be used.
+ */
+void
+rcap_close(struct rcap *rc)
+{
+	if (rc->r_map != MAP_FAILED)
+		munmap(rc->r_map, rc->r_maplen);
+	if (rc->r_fd >= 0)
+		close(rc->r_fd);
+	free(rc);
+}
+
+
+/*
+ * Check that the generation of a block is still gen, 
+ * after everything read from it before the call.
+ */
+static int
+rcap_same(const struct rcap_block *b, u_int64_t gen)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return(__atomic_load_n(&b->b_gen, __ATOMIC_RELAXED) == gen);
+}
+
+
+/*
+ * Move the cursor to the start of block idx, if the block is in use 
+ * and was filled after block seq. Blocks read before an overrun are
+ * passed over.
+ * Returns 0 on success, -1 if the block could not be entered.
+ */
+static int
+rcap_enter(struct rcap *rc, struct rcap_cursor *cur, int64_t idx, u_int64_t seq)
+{
+	const struct rcap_block *b;
+	u_int64_t gen, bseq;
+
+	if ((idx < 0) || ((u_int64_t)idx >= rc->r_hdr->h_nblocks))
+		return(-1);
+
+	b = RCAP_BLOCK(rc, idx);
+	gen = __atomic_load_n(&b->b_gen, __ATOMIC_ACQUIRE);
+	bseq = b->b_seq;
+	if ((gen & 1) || !rcap_same(b, gen) || (bseq == 0) || (bseq <= seq))
+		return(-1);
+
+	cur->c_block = idx;
+	cur->c_gen = gen;
+	cur->c_seq = bseq;
+	cur->c_off = (bseq <= cur->c_skip) ? RCAP_END : 0;
+	return(0);
+}
+
+
+/*
+ * Move the cursor to the oldest block. The block is the oldest if
+ * its sequence number is the one of the oldest block after it was
+ * entered, otherwise it was reused in between.
+ * Returns 0 on success, -1 if the buffer is empty.
+ */
+static int
+rcap_start(struct rcap *rc, struct rcap_cursor *cur)
+{
+	int64_t idx;
+
+	for (;;) {
+		idx = __atomic_load_n(&rc->r_hdr->h_first, __ATOMIC_ACQUIRE);
+		if (idx < 0) {
+			cur->c_block = -1;
+			return(-1);
+		}
+
+		if ((rcap_enter(rc, cur, idx, 0) == 0) && (cur->c_seq == 
+				__atomic_load_n(&rc->r_hdr->h_first_seq, __ATOMIC_ACQUIRE)))
+			return(0);
+	}
+}
+
+
+/*
+ * The block of the cursor changed under it. Everything older is gone
+ * as well, so start over at the oldest block but pass over blocks up
+ * to the one being read. The rest of that block is lost if it was
+ * compacted rather than evicted.
+ */
+static void
+rcap_overrun(struct rcap *rc, struct rcap_cursor *cur)
+{
+	cur->c_lost++;
+	if (cur->c_seq > cur->c_skip)
+		cur->c_skip = cur->c_seq;
+	rcap_start(rc, cur);
+}
+
+
+/*
+ * Start reading at the oldest packet in the buffer
+ */
+void
+rcap_first(struct rcap *rc, struct rcap_cursor *cur)
+{
+	memset(cur, 0x00, sizeof(struct rcap_cursor));
+	cur->c_block = -1;
+}
+
+
+/*
+ * Start reading at the next packet added to the buffer
+ */
+void
+rcap_tail(struct rcap *rc, struct rcap_cursor *cur)
+{
+	const struct rcap_block *b;
+	int64_t idx;
+
+	rcap_first(rc, cur);
+	for (;;) {
+		idx = __atomic_load_n(&rc->r_hdr->h_last, __ATOMIC_ACQUIRE);
+		if (idx < 0)
+			return;
+
+		if ((rcap_enter(rc, cur, idx, 0) < 0) || (cur->c_seq != 
+				__atomic_load_n(&rc->r_hdr->h_seq, __ATOMIC_ACQUIRE)))
+			continue;
+
+		b = RCAP_BLOCK(rc, idx);
+		cur->c_off = __atomic_load_n(&b->b_used, __ATOMIC_ACQUIRE);
+		if (rcap_same(b, cur->c_gen))
+			return;
+	}
+}
+
+
+/*
+ * Return the packet at the cursor and advance it.
+ * Returns 1 on success, 0 if there is no packet yet.
+ */
+static int
+rcap_get(struct rcap *rc, struct rcap_cursor *cur, 
+	const struct rcap_pkthdr **hdr, const u_char **pkt, size_t *caplen)
+{
+	const struct rcap_block *b;
+	const struct rcap_elem *re;
+	struct rcap_cursor prev;
+	u_int64_t used, size;
+	int64_t next;
+
+	for (;;) {
+		if ((cur->c_block < 0) && (rcap_start(rc, cur) < 0))
+			return(0);
+		
+		b = RCAP_BLOCK(rc, cur->c_block);
+		used = __atomic_load_n(&b->b_used, __ATOMIC_ACQUIRE);
+
+		if (cur->c_off < used) {
+			re = (const struct rcap_elem *)(RCAP_DATA(rc, cur->c_block) + 
+				cur->c_off);
+			size = re->e_size;
+			
+			/* Size is trusted only if the block is unchanged */
+			if (!rcap_same(b, cur->c_gen) || 
+					(size < sizeof(struct rcap_pkthdr)) ||
+					(cur->c_off + RCAP_ELEMLEN(size) > used)) {
+				rcap_overrun(rc, cur);
+				continue;
+			}
+
+			cur->c_off += RCAP_ELEMLEN(size);
+			*hdr = (const struct rcap_pkthdr *)(re + 1);
+			*pkt = (const u_char *)(re + 1) + sizeof(struct rcap_pkthdr);
+			*caplen = size - sizeof(struct rcap_pkthdr);
+			return(1);
+		}
+
+		/* Blocks are linked before they get any packets */
+		next = __atomic_load_n(&b->b_next, __ATOMIC_ACQUIRE);
+		if (!rcap_same(b, cur->c_gen)) {
+			rcap_overrun(rc, cur);
+			continue;
+		}
+		if (next < 0)
+			return(0);
+		
+		/* The next block can not be reused while this one is intact */
+		prev = *cur;
+		if ((rcap_enter(rc, cur, next, cur->c_seq) < 0) || 
+				!rcap_same(b, prev.c_gen)) {
+			*cur = prev;
+			rcap_overrun(rc, cur);
+		}
+	}
+}
+
+
+/*
+ * Return the packet at the cursor and advance it. The header and 
+ * packet point into the buffer, and must be checked with rcap_valid()
+ * after they have been used since the writer might have reused the
+ * memory meanwhile. Returns 1 on success, 0 if all packets have been
+ * read, more might be added later.
+ */
+int
+rcap_next(struct rcap *rc, struct rcap_cursor *cur, 
+	const struct rcap_pkthdr **hdr, const u_char **pkt)
+{
+	size_t caplen;
+
+	return(rcap_get(rc, cur, hdr, pkt, &caplen));
+}
+
+
+/*
+ * Check that the packet last returned by rcap_next() was intact
+ * while it was read. Returns 1 if so, 0 if it was overwritten.
+ */
+int
+rcap_valid(struct rcap *rc, const struct rcap_cursor *cur)
+{
+	if (cur->c_block < 0)
+		return(0);
+	return(rcap_same(RCAP_BLOCK(rc, cur->c_block), cur->c_gen));
+}
+
+
+/*
+ * Copy the packet at the cursor and advance it, packets overwritten
+ * while being copied are passed over. At most len bytes are copied,
+ * the caplen of the header is set to the number copied.
+ * Returns 1 on success, 0 if all packets have been read.
+ */
+int
+rcap_copy(struct rcap *rc, struct rcap_cursor *cur, 
+	struct rcap_pkthdr *hdr, u_char *buf, size_t len)
+{
+	const struct rcap_pkthdr *h;
+	const u_char *p;
+	size_t caplen;
+
+	for (;;) {
+		if (rcap_get(rc, cur, &h, &p, &caplen) == 0)
+			return(0);
+
+		memcpy(hdr, h, sizeof(struct rcap_pkthdr));
+		if (caplen > hdr->caplen)
+			caplen = hdr->caplen;
+		if (caplen > len)
+			caplen = len;
+		memcpy(buf, p, caplen);
+		hdr->caplen = caplen;
+
+		if (rcap_valid(rc, cur))
+			return(1);
+		rcap_overrun(rc, cur);
+	}
+}
+
+
+/*
+ * Get the time of the first packet of block idx.
+ * Returns 0 on success, -1 if the block is empty or changed.
+ */
+static int
+rcap_peek(struct rcap *rc, int64_t idx, struct timeval *tv)
+{
+	const struct rcap_block *b;
+	const struct rcap_pkthdr *h;
+	u_int64_t gen;
+
+	b = RCAP_BLOCK(rc, idx);
+	gen = __atomic_load_n(&b->b_gen, __ATOMIC_ACQUIRE);
+	if ((gen & 1) || (__atomic_load_n(&b->b_used, __ATOMIC_ACQUIRE) == 0))
+		return(-1);
+
+	h = (const struct rcap_pkthdr *)(RCAP_DATA(rc, idx) + 
+		sizeof(struct rcap_elem));
+	*tv = h->ts;
+	return(rcap_same(b, gen) ? 0 : -1);
+}
+
+
+/*
+ * Move the cursor to the first packet at or after time tv, whole
+ * blocks are passed over by the time of their first packet.
+ * Returns 1 on success, 0 if there is no such packet yet.
+ */
+int
+rcap_seek(struct rcap *rc, struct rcap_cursor *cur, const struct timeval *tv)
+{
+	const struct rcap_block *b;
+	const struct rcap_pkthdr *h;
+	struct rcap_cursor prev;
+	struct timeval first;
+	const u_char *p;
+	size_t caplen;
+	int64_t next;
+
+	rcap_first(rc, cur);
+	if (rcap_start(rc, cur) < 0)
+		return(0);
+
+	for (;;) {
+		b = RCAP_BLOCK(rc, cur->c_block);
+		next = __atomic_load_n(&b->b_next, __ATOMIC_ACQUIRE);
+		if (!rcap_same(b, cur->c_gen)) {
+			if (rcap_start(rc, cur) < 0)
+				return(0);
+			continue;
+		}
+
+		if ((next < 0) || (rcap_peek(rc, next, &first) < 0) || 
+				!timercmp(&first, tv, <))
+			break;
+		
+		prev = *cur;
+		if (((rcap_enter(rc, cur, next, cur->c_seq) < 0) || 
+				!rcap_same(b, prev.c_gen)) && (rcap_start(rc, cur) < 0))
+			return(0);
+	}
+
+	for (;;) {
+		prev = *cur;
+		if (rcap_get(rc, cur, &h, &p, &caplen) == 0)
+			return(0);
+		if (!timercmp(&h->ts, tv, <) && rcap_valid(rc, cur)) {
+			*cur = prev;
+			return(1);
+		}
+	}
+}
@@ -0,0 +1,190 @@
+/*
+ * link.c - Link state of the capture interface
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <net/if.h>
+#include "print.h"
+#include "link.h"
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#define HAVE_RTNETLINK
+#endif
+
+
+/*
+ * Watch the link of interface dev. Changes are read by 
+ * link_read() when the descriptor is readable.
+ * Returns a pointer on success, NULL on error or if
+ * the system can not tell.
+ */
+struct link *
+link_open(const char *dev)
+{
+#ifdef HAVE_RTNETLINK
+	struct sockaddr_nl sa;
+	struct link *lk;
+
+	if ((dev == NULL) || (strlen(dev) >= IF_NAMESIZE))
+		return(NULL);
+
+	if ( (lk = calloc(1, sizeof(struct link))) == NULL) {
+		err_errno("link_open: calloc()");
+		return(NULL);
+	}
+	snprintf(lk->lk_dev, sizeof(lk->lk_dev), "%s", dev);
+	lk->lk_up = -1;
+
+	if ( (lk->lk_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 
+			NETLINK_ROUTE)) < 0) {
+		err_errno("link_open: socket()");
+		free(lk);
+		return(NULL);
+	}
+
+	memset(&sa, 0x00, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK;
+	if (bind(lk->lk_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		err_errno("link_open: bind()");
+		close(lk->lk_fd);
+		free(lk);
+		return(NULL);
+	}
+	return(lk);
+#else
+	return(NULL);
+#endif
+}
+
+
+/*
+ * Store the descriptor to poll for changes in pfd.
+ * Returns the number of descriptors stored.
+ */
+int
+link_setpoll(struct link *lk, struct pollfd *pfd)
+{
+	if (lk == NULL)
+		return(0);
+	pfd->fd = lk->lk_fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+	return(1);
+}
+
+
+/*
+ * Read the changes of links from the n descriptors in pfd, 
+ * as stored by link_setpoll(). 
+ * Returns 1 if the interface came up, 0 otherwise.
+ */
+int
+link_read(struct link *lk, const struct pollfd *pfd, int n)
+{
+#ifdef HAVE_RTNETLINK
+	char buf[16384];
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int len, alen, up, came_up;
+	const char *name;
+
+	if ((lk == NULL) || (n < 1) || !(pfd->revents & (POLLIN | POLLERR)))
+		return(0);
+
+	came_up = 0;
+	while ( (len = recv(lk->lk_fd, buf, sizeof(buf), 0)) != 0) {
+		if (len < 0) {
+			
+			/* Changes were dropped, reopening is tried anyway */
+			if (errno == ENOBUFS)
+				continue;
+			if ((errno != EAGAIN) && (errno != EINTR))
+				err_errno("link_read: recv()");
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (u_int)len); 
+				nh = NLMSG_NEXT(nh, len)) {
+			if ((nh->nlmsg_type != RTM_NEWLINK) && (nh->nlmsg_type != RTM_DELLINK))
+				continue;
+			
+			ifi = NLMSG_DATA(nh);
+			alen = IFLA_PAYLOAD(nh);
+			name = NULL;
+			for (rta = IFLA_RTA(ifi); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+				if (rta->rta_type == IFLA_IFNAME) {
+					name = RTA_DATA(rta);
+					break;
+				}
+			}
+			if ((name == NULL) || strncmp(name, lk->lk_dev, sizeof(lk->lk_dev)))
+				continue;
+
+			up = (nh->nlmsg_type == RTM_NEWLINK) && 
+				((ifi->ifi_flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING));
+			if (up != lk->lk_up) {
+				verbose(1, "Link of %s is %s\n", lk->lk_dev, up ? "up" : "down");
+				lk->lk_changes++;
+				if (up)
+					came_up = 1;
+			}
+			lk->lk_up = up;
+		}
+	}
+	return(came_up);
+#else
+	return(0);
+#endif
+}
+
+
+/*
+ * Stop watching the link
+ */
+void
+link_close(struct link *lk)
+{
+	if (lk == NULL)
+		return;
+	close(lk->lk_fd);
+	free(lk);
+}
@@ -0,0 +1,63 @@
+/*
+ * link.h - Link state of the capture interface
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _LINK_H
+#define _LINK_H
+
+#include <sys/types.h>
+#include <poll.h>
+#include <net/if.h>
+
+/* Milliseconds before the first attempt to reopen a capture, 
+ * doubled after each failure up to the maximum. An interface 
+ * that comes back is reopened at once when its link is watched. */
+#define LINK_RETRY_MIN		250
+#define LINK_RETRY_MAX		10000
+
+/*
+ * Link state of an interface, followed with rtnetlink(7) while 
+ * the capture on it is down. Only available on Linux.
+ */
+struct link {
+	int lk_fd;					/* Netlink socket */
+	char lk_dev[IF_NAMESIZE];	/* Interface watched */
+	int lk_up;					/* Up and running when last seen */
+	size_t lk_changes;			/* Changes of state seen */
+};
+
+/* link.c */
+extern struct link *link_open(const char *);
+extern int link_setpoll(struct link *, struct pollfd *);
+extern int link_read(struct link *, const struct pollfd *, int);
+extern void link_close(struct link *);
+
+#endif /* _LINK_H */
@@ -0,0 +1,106 @@
+/*
+ * metrics.c - OpenMetrics text output
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "print.h"
+#include "metrics.h"
+
+
+/*
+ * Write a counter, the sample gets the _total suffix
+ */
+void
+metric_counter(FILE *f, const char *name, const char *help, double val)
+{
+	fprintf(f, "# TYPE %s%s counter\n", METRICS_PREFIX, name);
+	fprintf(f, "# HELP %s%s %s\n", METRICS_PREFIX, name, help);
+	fprintf(f, "%s%s_total %.15g\n", METRICS_PREFIX, name, val);
+}
+
+
+/*
+ * Write a gauge
+ */
+void
+metric_gauge(FILE *f, const char *name, const char *help, double val)
+{
+	fprintf(f, "# TYPE %s%s gauge\n", METRICS_PREFIX, name);
+	fprintf(f, "# HELP %s%s %s\n", METRICS_PREFIX, name, help);
+	fprintf(f, "%s%s %.15g\n", METRICS_PREFIX, name, val);
+}
+
+
+/*
+ * Terminate the exposition
+ */
+void
+metric_end(FILE *f)
+{
+	fprintf(f, "# EOF\n");
+}
+
+
+/*
+ * Write metrics to path with func, through a temporary file that is
+ * renamed into place, so a collector never reads a partial file.
+ * Returns 0 on success, -1 on error.
+ */
+int
+metrics_file(const char *path, void (*func)(FILE *))
+{
+	char tmp[2048];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if ( (f = fopen(tmp, "w")) == NULL) {
+		err_errno("metrics_file: fopen(%s)", tmp);
+		return(-1);
+	}
+
+	func(f);
+	
+	if (ferror(f) | fclose(f)) {
+		err_errno("metrics_file: Failed to write '%s'", tmp);
+		unlink(tmp);
+		return(-1);
+	}
+
+	if (rename(tmp, path) < 0) {
+		err_errno("metrics_file: rename(%s, %s)", tmp, path);
+		unlink(tmp);
+		return(-1);
+	}
+	return(0);
+}
@@ -0,0 +1,306 @@
+/*
+ * pkt.c - Parse IPv4/IPv6 and transport headers of captured packets
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pcap.h>
+#include "ringbuf.h"
+#include "pkt.h"
+
+/* Ethernet types */
+#define ETYPE_IPV4		0x0800
+#define ETYPE_IPV6		0x86dd
+#define ETYPE_VLAN		0x8100
+#define ETYPE_QINQ		0x88a8
+
+/* Maximum number of IPv6 extension headers to walk */
+#define IPV6_MAXEXT		8
+
+#define GET16(p)	((u_int16_t)(((p)[0] << 8) | (p)[1]))
+
+
+/*
+ * Parse the transport header at offset off, if present.
+ */
+static void
+pkt_parse_l4(const u_char *pkt, size_t caplen, size_t off, struct pktinfo *pi)
+{
+	pi->pi_l4off = off;
+	pi->pi_payoff = off;
+
+	switch (pi->pi_proto) {
+		case IPPROTO_TCP:
+			if (off + 20 > caplen)
+				return;
+			pi->pi_sport = GET16(&pkt[off]);
+			pi->pi_dport = GET16(&pkt[off+2]);
+			pi->pi_tcpflags = pkt[off+13];
+			pi->pi_payoff = off + ((pkt[off+12] >> 4) << 2);
+			break;
+
+		case IPPROTO_UDP:
+			if (off + 8 > caplen)
+				return;
+			pi->pi_sport = GET16(&pkt[off]);
+			pi->pi_dport = GET16(&pkt[off+2]);
+			pi->pi_payoff = off + 8;
+			break;
+
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			if (off + 8 > caplen)
+				return;
+			pi->pi_payoff = off + 8;
+			break;
+	}
+
+	if (pi->pi_payoff > caplen)
+		pi->pi_payoff = caplen;
+}
+
+
+/*
+ * Parse the link, network and transport headers of a captured packet.
+ * Arguments:
+ *  datalink - Datalink type of the capture (DLT_*)
+ *  linkoff  - Link layer offset, as resolved by cap_open()
+ *  pkt      - Packet data
+ *  caplen   - Number of bytes captured
+ *  pi       - Parsed header information is stored here
+ * Returns 0 if the packet is IPv4 or IPv6, -1 otherwise.
+ */
+int
+pkt_parse(int datalink, int linkoff, const u_char *pkt, 
+	size_t caplen, struct pktinfo *pi)
+{
+	size_t off;
+	u_int16_t etype;
+	u_char version;
+	
+	memset(pi, 0x00, sizeof(struct pktinfo));
+	off = linkoff;
+	etype = 0;
+
+	/* Use the link layer type field where we know where it is,
+	 * otherwise trust the IP version nibble */
+	if (datalink == DLT_EN10MB) {
+		if (caplen < 14)
+			return(-1);
+		etype = GET16(&pkt[12]);
+		off = 14;
+		
+		while ((etype == ETYPE_VLAN) || (etype == ETYPE_QINQ)) {
+			if (off + 4 > caplen)
+				return(-1);
+			etype = GET16(&pkt[off+2]);
+			off += 4;
+		}
+	}
+#ifdef DLT_LINUX_SLL
+	else if (datalink == DLT_LINUX_SLL) {
+		if (caplen < 16)
+			return(-1);
+		etype = GET16(&pkt[14]);
+	}
+#endif
+
+	if (off >= caplen)
+		return(-1);
+	version = pkt[off] >> 4;
+
+	if ((etype == ETYPE_IPV4) || ((etype == 0) && (version == 4))) {
+		size_t hlen;
+
+		if ((version != 4) || (off + 20 > caplen))
+			return(-1);
+		
+		hlen = (pkt[off] & 0x0f) << 2;
+		if (hlen < 20)
+			return(-1);
+
+		pi->pi_family = AF_INET;
+		pi->pi_alen = 4;
+		pi->pi_l3off = off;
+		pi->pi_proto = pkt[off+9];
+		memcpy(pi->pi_src, &pkt[off+12], 4);
+		memcpy(pi->pi_dst, &pkt[off+16], 4);
+
+		/* Only the first fragment carries the transport header */
+		if ((GET16(&pkt[off+6]) & 0x1fff) == 0)
+			pkt_parse_l4(pkt, caplen, off + hlen, pi);
+		else
+			pi->pi_l4off = pi->pi_payoff = off + hlen;
+		return(0);
+	}
+	
+	if ((etype == ETYPE_IPV6) || ((etype == 0) && (version == 6))) {
+		u_char nxt;
+		size_t hlen;
+		int i;
+
+		if ((version != 6) || (off + 40 > caplen))
+			return(-1);
+
+		pi->pi_family = AF_INET6;
+		pi->pi_alen = 16;
+		pi->pi_l3off = off;
+		memcpy(pi->pi_src, &pkt[off+8], 16);
+		memcpy(pi->pi_dst, &pkt[off+24], 16);
+		nxt = pkt[off+6];
+		off += 40;
+
+		/* Skip extension headers */
+		for (i = 0; i < IPV6_MAXEXT; i++) {
+			
+			if ((nxt != IPPROTO_HOPOPTS) && (nxt != IPPROTO_ROUTING) &&
+					(nxt != IPPROTO_DSTOPTS) && (nxt != IPPROTO_FRAGMENT) &&
+					(nxt != IPPROTO_AH))
+				break;
+			
+			if (off + 8 > caplen) {
+				pi->pi_proto = nxt;
+				pi->pi_l4off = pi->pi_payoff = caplen;
+				return(0);
+			}
+
+			/* Non-first fragment, no transport header */
+			if ((nxt == IPPROTO_FRAGMENT) && 
+					(GET16(&pkt[off+2]) & 0xfff8) != 0) {
+				pi->pi_proto = pkt[off];
+				pi->pi_l4off = pi->pi_payoff = off + 8;
+				return(0);
+			}
+			
+			hlen = off;
+			if (nxt == IPPROTO_FRAGMENT)
+				off += 8;
+			else if (nxt == IPPROTO_AH)
+				off += (pkt[off+1] + 2) << 2;
+			else
+				off += (pkt[off+1] + 1) << 3;
+			nxt = pkt[hlen];
+		}
+
+		pi->pi_proto = nxt;
+		pkt_parse_l4(pkt, caplen, off, pi);
+		return(0);
+	}
+
+	return(-1);
+}
+
+
+/*
+ * Convert a dotted decimal IPv4 or a textual IPv6 address to 
+ * network byte order, storing it in addr (which must hold 16 bytes).
+ * The address length (4 or 16) is stored in alen.
+ * Returns 0 on success, -1 if str is not an address.
+ */
+int
+pkt_addr(const char *str, u_char *addr, int *alen)
+{
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		*alen = 4;
+		return(0);
+	}
+	
+	if (inet_pton(AF_INET6, str, addr) == 1) {
+		*alen = 16;
+		return(0);
+	}
+	return(-1);
+}
+
+
+/*
+ * Convert an IPv4 (alen 4) or IPv6 (alen 16) address to a string.
+ * Returns a pointer to a static buffer.
+ */
+const char *
+pkt_ntoa(const u_char *addr, int alen)
+{
+	static char astr[INET6_ADDRSTRLEN];
+
+	if (inet_ntop(alen == 4 ? AF_INET : AF_INET6, 
+			addr, astr, sizeof(astr)) == NULL)
+		snprintf(astr, sizeof(astr), "?");
+	return(astr);
+}
+
+
+/*
+ * FNV-1a of an address or other key with a final avalanche
+ */
+u_int64_t
+pkt_hash(const u_char *key, int len)
+{
+	u_int64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	h ^= (u_int64_t)len;
+	h *= 0x100000001b3ULL;
+	for (i = 0; i < len; i++) {
+		h ^= key[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return(h);
+}
+
+
+/*
+ * Returns non-zero if the buffered packet elem is older 
+ * than the time in arg
+ */
+int
+pkt_older(const void *elem, void *arg)
+{
+	return(((const struct pcap_pkthdr *)elem)->ts.tv_sec < *(time_t *)arg);
+}
+
+
+/*
+ * Remove packets older than limit from the front of a buffer.
+ * Returns the number of packets removed.
+ */
+size_t
+pkt_expire(struct ringbuf *rbuf, time_t limit)
+{
+	return(ringbuf_expire(rbuf, pkt_older, &limit));
+}
@@ -0,0 +1,66 @@
+/*
+ * pkt.h - Packet header parsing
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _PKT_H
+#define _PKT_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "ringbuf.h"
+
+/*
+ * Addresses, ports and offsets of a parsed IPv4/IPv6 packet.
+ * Ports are in host byte order, addresses in network byte order.
+ */
+struct pktinfo {
+	int pi_family;			/* AF_INET or AF_INET6 */
+	u_char pi_alen;			/* Length of address, 4 or 16 */
+	u_char pi_proto;		/* Transport protocol */
+	u_char pi_tcpflags;		/* TCP flags, 0 if not TCP */
+	u_int16_t pi_sport;		/* Source port, 0 if none */
+	u_int16_t pi_dport;		/* Destination port, 0 if none */
+	u_char pi_src[16];
+	u_char pi_dst[16];
+	size_t pi_l3off;		/* Offset of IP header */
+	size_t pi_l4off;		/* Offset of transport header */
+	size_t pi_payoff;		/* Offset of payload */
+};
+
+/* pkt.c */
+extern int pkt_parse(int, int, const u_char *, size_t, struct pktinfo *);
+extern int pkt_addr(const char *, u_char *, int *);
+extern const char *pkt_ntoa(const u_char *, int);
+extern u_int64_t pkt_hash(const u_char *, int);
+extern int pkt_older(const void *, void *);
+extern size_t pkt_expire(struct ringbuf *, time_t);
+
+#endif /* _PKT_H */
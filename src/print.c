@@ -35,39 +35,265 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
-#include "ringcapd.h" /* For opt.verbose */
 #include <time.h>
 #include <unistd.h>
-#include "str.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include "print.h"
 
 /* Local routines */
-static void err_v(const char *, va_list);
-static void warn_v(const char *, va_list);
+static void print_v(FILE *, const char *, const char *, va_list, int);
+static void print_out(FILE *, time_t, const char *);
+static void *print_writer(void *);
 
-/* Global variables */
-extern struct options opt;
+/* Messages above this level are not printed */
+unsigned int print_level;
+
+/*
+ * Messages waiting for the writer thread. Any thread, or signal 
+ * handler, reserves a slot by moving the head and marks it ready 
+ * when the text is in place. The writer is the only one to move 
+ * the tail, so no locks are needed.
+ */
+static struct print_msg {
+	int pm_ready;				/* Set when message is complete */
+	FILE *pm_stream;			/* stdout or stderr */
+	time_t pm_time;				/* Time message was printed */
+	char pm_text[PRINT_MSGLEN];
+} queue[PRINT_QUEUE];
+
+static unsigned long q_head;	/* Next slot to fill */
+static unsigned long q_tail;	/* Next slot to write */
+static size_t q_dropped;		/* Messages lost when queue was full */
+static int q_sleeping;			/* Writer waits for q_wake */
+static int q_wake[2] = {-1, -1};
+static int async;				/* Writer thread is running */
+
+
+/*
+ * Write a message with time and PID, the time 
+ * string is only formatted once a second
+ */
+static void
+print_out(FILE *stream, time_t t, const char *text)
+{
+	static char stamp[64];
+	static time_t cached = -1;
+	static pid_t pid;
+	struct tm tm;
+
+	if (t != cached) {
+		if ((localtime_r(&t, &tm) == NULL) || 
+				(strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm) == 0))
+			stamp[0] = '\0';
+		cached = t;
+		pid = getpid();
+	}
+	fprintf(stream, "%s [%d] %s", stamp, (int)pid, text);
+}
+
+
+/*
+ * Format a message and queue it for the writer thread,
+ * or print it directly if there is none.
+ * The error string of errnum is appended if errnum is non-zero.
+ */
+static void
+print_v(FILE *stream, const char *prefix, const char *fmt, va_list ap, int errnum)
+{
+	char buf[PRINT_MSGLEN];
+	struct print_msg *pm;
+	unsigned long head;
+	char *text;
+	size_t n;
+
+	pm = NULL;
+	text = buf;
+	
+	if (async) {
+		
+		/* Reserve a slot */
+		head = __atomic_load_n(&q_head, __ATOMIC_RELAXED);
+		do {
+			if (head - __atomic_load_n(&q_tail, __ATOMIC_ACQUIRE) >= PRINT_QUEUE) {
+				__atomic_add_fetch(&q_dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+		} while (!__atomic_compare_exchange_n(&q_head, &head, head + 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		
+		pm = &queue[head % PRINT_QUEUE];
+		pm->pm_stream = stream;
+		pm->pm_time = time(NULL);
+		text = pm->pm_text;
+	}
+
+	n = snprintf(text, PRINT_MSGLEN, "%s", prefix);
+	vsnprintf(&text[n], PRINT_MSGLEN - n, fmt, ap);
+	if (errnum != 0) {
+		n = strlen(text);
+		snprintf(&text[n], PRINT_MSGLEN - n, ": %s\n", strerror(errnum));
+	}
+
+	if (pm == NULL) {
+		print_out(stream, time(NULL), text);
+		fflush(stream);
+		return;
+	}
+
+	/* Hand over, and wake writer if it sleeps */
+	__atomic_store_n(&pm->pm_ready, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&q_sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(q_wake[1], "", 1) < 0)
+			;
+	}
+}
 
 
 /*
- * Only print if verbose level is high enough
+ * Writer thread, writes queued messages in order and
+ * flushes the streams when the queue is empty.
+ */
+static void *
+print_writer(void *arg)
+{
+	struct print_msg *pm;
+	struct pollfd pfd;
+	char buf[64];
+
+	pfd.fd = q_wake[0];
+	pfd.events = POLLIN;
+	
+	for (;;) {
+		pm = &queue[q_tail % PRINT_QUEUE];
+		
+		if (__atomic_load_n(&pm->pm_ready, __ATOMIC_ACQUIRE)) {
+			print_out(pm->pm_stream, pm->pm_time, pm->pm_text);
+			__atomic_store_n(&pm->pm_ready, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&q_tail, q_tail + 1, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+
+		/* Check again after announcing sleep, so no wakeup is lost */
+		__atomic_store_n(&q_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pm->pm_ready, __ATOMIC_SEQ_CST))
+			continue;
+		
+		if ((poll(&pfd, 1, 1000) > 0) && (pfd.revents & POLLIN)) {
+			while (read(q_wake[0], buf, sizeof(buf)) > 0)
+				;
+		}
+	}
+	return(NULL);
+}
+
+
+/*
+ * Start writing messages from a background thread.
+ * Should be called after the process has become a daemon,
+ * and after descriptors have been closed.
+ * Returns 0 on success, -1 on error.
+ */
+int
+print_async(void)
+{
+	sigset_t all, old;
+	pthread_t tid;
+	int ret;
+
+	if (async)
+		return(0);
+	
+	if (pipe(q_wake) < 0) {
+		err_errno("print_async: pipe()");
+		return(-1);
+	}
+	fcntl(q_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(q_wake[1], F_SETFL, O_NONBLOCK);
+
+	/* Signals are for the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&tid, NULL, print_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		errno = ret;
+		err_errno("print_async: pthread_create()");
+		close(q_wake[0]);
+		close(q_wake[1]);
+		return(-1);
+	}
+	pthread_detach(tid);
+	
+	async = 1;
+	atexit(print_flush);
+	return(0);
+}
+
+
+/*
+ * Wait a while for queued messages to be written
  */
 void
-verbose(unsigned int level, char *fmt, ...)
+print_flush(void)
 {
-    va_list ap;
+	struct timespec nap;
+	int i;
 
-    if (opt.verbose < level)
-        return;
+	if (!async)
+		return;
 	
-	printf("%s [%d] ", str_time(time(NULL), NULL), getpid());
+	nap.tv_sec = 0;
+	nap.tv_nsec = 1000000;
+	
+	for (i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&q_tail, __ATOMIC_ACQUIRE) == 
+				__atomic_load_n(&q_head, __ATOMIC_ACQUIRE))
+			break;
+		if (__atomic_exchange_n(&q_sleeping, 0, __ATOMIC_SEQ_CST)) {
+			if (write(q_wake[1], "", 1) < 0)
+				;
+		}
+		nanosleep(&nap, NULL);
+	}
+	fflush(stdout);
+	fflush(stderr);
+}
+
+
+/*
+ * Number of messages dropped due to a full queue
+ */
+size_t
+print_dropped(void)
+{
+	return(__atomic_load_n(&q_dropped, __ATOMIC_RELAXED));
+}
+
 
+/*
+ * Print if verbose level is high enough,
+ * use the verbose() macro to skip arguments otherwise.
+ */
+void
+verbose_print(unsigned int level, const char *fmt, ...)
+{
+    va_list ap;
+	char prefix[32];
+
+	prefix[0] = '\0';
 	if (level > 0)
-		printf("[verbose %u] ", level);
+		snprintf(prefix, sizeof(prefix), "[verbose %u] ", level);
    	
 	va_start(ap, fmt);
-    vfprintf(stdout, fmt, ap);
+	print_v(stdout, prefix, fmt, ap, 0);
     va_end(ap);
-	fflush(stdout);
 }
 
 
@@ -78,11 +304,11 @@ void
 warn_errno(const char *fmt, ...)
 {
     va_list ap;
+	int errnum = errno;
 
     va_start(ap, fmt);
-    warn_v(fmt, ap);
+    print_v(stderr, "** Warning: ", fmt, ap, errnum);
     va_end(ap);
-	fprintf(stderr, ": %s\n", strerror(errno));
 }
 
 
@@ -94,11 +320,11 @@ void
 warn_errnox(const char *fmt, ...)
 {
     va_list ap;
+	int errnum = errno;
 
     va_start(ap, fmt);
-    warn_v(fmt, ap);
+    print_v(stderr, "** Warning: ", fmt, ap, errnum);
     va_end(ap);
-    fprintf(stderr, ": %s\n", strerror(errno));
 	exit(EXIT_FAILURE);
 }
 
@@ -110,11 +336,11 @@ void
 err_errno(const char *fmt, ...)
 {
     va_list ap;
+	int errnum = errno;
 
     va_start(ap, fmt);
-    err_v(fmt, ap);
+    print_v(stderr, "** Error: ", fmt, ap, errnum);
     va_end(ap);
-	fprintf(stderr, ": %s\n", strerror(errno));
 }
 
 /*
@@ -125,11 +351,11 @@ void
 err_errnox(const char *fmt, ...)
 {
     va_list ap;
+	int errnum = errno;
 
     va_start(ap, fmt);
-    err_v(fmt, ap);
+    print_v(stderr, "** Error: ", fmt, ap, errnum);
     va_end(ap);
-    fprintf(stderr, ": %s\n", strerror(errno));
 	exit(EXIT_FAILURE);
 }
 
@@ -143,7 +369,7 @@ warn(const char *fmt, ...)
     va_list ap;
 
     va_start(ap, fmt);
-    warn_v(fmt, ap);
+    print_v(stderr, "** Warning: ", fmt, ap, 0);
     va_end(ap);
 }
 
@@ -156,7 +382,7 @@ warnx(const char *fmt, ...)
     va_list ap;
 
     va_start(ap, fmt);
-    warn_v(fmt, ap);
+    print_v(stderr, "** Warning: ", fmt, ap, 0);
     va_end(ap);
 	exit(EXIT_FAILURE);
 }
@@ -170,7 +396,7 @@ err(const char *fmt, ...)
     va_list ap;
 
 	va_start(ap, fmt);
-    err_v(fmt, ap);
+    print_v(stderr, "** Error: ", fmt, ap, 0);
 	va_end(ap);
 }
 
@@ -184,34 +410,7 @@ errx(const char *fmt, ...)
     va_list ap;
 
     va_start(ap, fmt);
-    err_v(fmt, ap);
+    print_v(stderr, "** Error: ", fmt, ap, 0);
     va_end(ap);
 	exit(EXIT_FAILURE);
 }
-
-
-/*
- * Print warning
- */
-static void
-warn_v(const char *fmt, va_list ap)
-{
-	fprintf(stderr, "%s [%d] ", str_time(time(NULL), NULL), getpid());
-    fprintf(stderr, "** Warning: ");
-    vfprintf(stderr, fmt, ap);
-	fflush(stderr);
-}
-
-
-/*
- * Print error message
- */
-static void
-err_v(const char *fmt, va_list ap)
-{
-	fprintf(stderr, "%s [%d] ", str_time(time(NULL), NULL), getpid());
-    fprintf(stderr, "** Error: ");
-    vfprintf(stderr, fmt, ap);
-	fflush(stderr);
-}
-
@@ -46,7 +46,30 @@
 #endif
 */
 
-extern void verbose(unsigned int level, char *, ...);
+#include <sys/types.h>
+
+/* Longer messages are truncated */
+#define PRINT_MSGLEN	512
+
+/* Messages waiting to be written before new ones are dropped */
+#define PRINT_QUEUE		1024
+
+/* Current verbose level */
+extern unsigned int print_level;
+
+/*
+ * Print if verbose level is high enough. A disabled level costs 
+ * a single compare, the arguments are not evaluated.
+ */
+#define verbose(level, ...) do { \
+		if ((unsigned int)(level) <= print_level) \
+			verbose_print((level), __VA_ARGS__); \
+	} while (0)
+
+extern void verbose_print(unsigned int, const char *, ...);
+extern int print_async(void);
+extern void print_flush(void);
+extern size_t print_dropped(void);
 extern void warn(const char *, ...);
 extern void warnx(const char *, ...);
 extern void warn_errno(const char *, ...);
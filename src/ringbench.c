@@ -0,0 +1,424 @@
+/*
+ * ringbench.c - Ring buffer microbenchmark
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "ringcapd.h"
+#include "ringbuf.h"
+#include "hist.h"
+
+/* Default ring sizes to run */
+#define BENCH_SIZES		"1M,16M,256M"
+
+/* Element sizes are drawn from a table of this many entries */
+#define BENCH_TABLE		4096
+
+/* Largest element */
+#define BENCH_MAXELEM	9018
+
+/* Entries of the working set touched per insert with -w */
+#define BENCH_TOUCH		8
+
+/* Inserts between syncs, as packets read in one batch by the daemon */
+#define BENCH_BATCH		64
+
+/* Local routines */
+static void usage(const char *);
+static int mktable(const char *, size_t *);
+static size_t rss(void);
+static int counter_open(u_int32_t, u_int64_t);
+static int tlb_open(int);
+static void counter_start(int);
+static double counter_read(int);
+static void bench(size_t, const char *, const size_t *, u_long, int, size_t);
+
+
+static void
+usage(const char *pname)
+{
+	printf("\n-=[ Ring buffer microbenchmark ]=-\n");
+	printf("Usage: %s [Option(s)]\n", pname);
+	printf("Options:\n");
+	printf("  -H opts  - Ring storage as for ringcapd -H, thp, 2m or 1g pages,\n");
+	printf("             lock, prefault, cached and stream\n");
+	printf("  -d dist  - Element sizes, fixed (64 bytes), imix (7:4:1 of 64, 594\n");
+	printf("             and 1518 bytes), jumbo (9018 bytes) or a size, default imix\n");
+	printf("  -n count - Inserts per run, default is enough to fill the ring\n");
+	printf("             three times, at least one million\n");
+	printf("  -s sizes - Comma separated ring sizes, default is %s\n", BENCH_SIZES);
+	printf("  -w size  - Update %d entries of a table of size bytes for each\n", BENCH_TOUCH);
+	printf("             insert, as the index and flow table of the daemon\n");
+	printf("Each run is reported on one line of key=value pairs.\n");
+	printf("\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Fill table with element sizes of the distribution.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+mktable(const char *dist, size_t *table)
+{
+	unsigned long ul;
+	size_t tmp;
+	int i, j;
+
+	if (!strcmp(dist, "fixed"))
+		ul = 64;
+	else if (!strcmp(dist, "jumbo"))
+		ul = 9018;
+	else if (!strcmp(dist, "imix")) {
+		
+		/* Simple IMIX, shuffled with a fixed seed */
+		for (i = 0; i < BENCH_TABLE; i++) {
+			j = i % 12;
+			table[i] = (j < 7) ? 64 : ((j < 11) ? 594 : 1518);
+		}
+		srand48(1);
+		for (i = BENCH_TABLE - 1; i > 0; i--) {
+			j = lrand48() % (i + 1);
+			tmp = table[i];
+			table[i] = table[j];
+			table[j] = tmp;
+		}
+		return(0);
+	}
+	else if (!str_isnum(dist, &ul) || (ul == 0) || (ul > BENCH_MAXELEM))
+		return(-1);
+
+	for (i = 0; i < BENCH_TABLE; i++)
+		table[i] = ul;
+	return(0);
+}
+
+
+/*
+ * Resident memory of the process in bytes, 0 if unknown
+ */
+static size_t
+rss(void)
+{
+	unsigned long pages, resident;
+	FILE *f;
+	int n;
+
+	if ( (f = fopen("/proc/self/statm", "r")) == NULL)
+		return(0);
+	n = fscanf(f, "%lu %lu", &pages, &resident);
+	fclose(f);
+	
+	if (n != 2)
+		return(0);
+	return(resident * sysconf(_SC_PAGESIZE));
+}
+
+
+/*
+ * Open a hardware counter of events by this process in user mode.
+ * Returns a descriptor, or -1 if the counter is not available.
+ */
+static int
+counter_open(u_int32_t type, u_int64_t config)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+	struct perf_event_attr pea;
+
+	memset(&pea, 0x00, sizeof(pea));
+	pea.type = type;
+	pea.size = sizeof(pea);
+	pea.config = config;
+	pea.disabled = 1;
+	pea.exclude_kernel = 1;
+	pea.exclude_hv = 1;
+	return(syscall(SYS_perf_event_open, &pea, 0, -1, -1, 0));
+#else
+	return(-1);
+#endif
+}
+
+
+/*
+ * Open a counter of data TLB misses on reads or writes.
+ * Returns a descriptor, or -1 if the counter is not available.
+ */
+static int
+tlb_open(int write)
+{
+#ifdef __linux__
+	return(counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | 
+		((write ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ) << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)));
+#else
+	return(-1);
+#endif
+}
+
+
+/*
+ * Reset and start a counter
+ */
+static void
+counter_start(int fd)
+{
+#ifdef __linux__
+	if (fd < 0)
+		return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+
+/*
+ * Stop a counter and read it.
+ * Returns the count, or -1 if not available.
+ */
+static double
+counter_read(int fd)
+{
+	u_int64_t val;
+
+	if (fd < 0)
+		return(-1);
+#ifdef __linux__
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	if (read(fd, &val, sizeof(val)) != sizeof(val))
+		return(-1);
+	return((double)val);
+}
+
+
+/*
+ * Insert count elements into a ring of size bytes, then walk it.
+ * With a working set, entries of it are updated between inserts
+ * and timed apart, to show what the inserts evict from the cache.
+ */
+static void
+bench(size_t size, const char *dist, const size_t *table, u_long count, 
+	int storage, size_t wset)
+{
+	static u_char elem[BENCH_MAXELEM];
+	struct hist h, hw;
+	struct ringbuf *rbuf;
+	struct ringbuf_cursor rc;
+	struct timeval start, end;
+	u_int64_t t, bytes, *ws, rnd;
+	size_t rss_base, rss_full, walked, esize, nws;
+	double sec, wsec, tlb_r, tlb_w, llc;
+	char tlb[64], misses[64], touch[64];
+	long init_usec;
+	int fd_r, fd_w, fd_c;
+	u_long i;
+	int j;
+
+	memset(&h, 0x00, sizeof(h));
+	memset(&hw, 0x00, sizeof(hw));
+	
+	ws = NULL;
+	nws = wset / sizeof(u_int64_t);
+	if ((nws > 0) && ((ws = calloc(nws, sizeof(u_int64_t))) == NULL))
+		err_errnox("calloc()");
+	rnd = 1;
+	rss_base = rss();
+	
+	gettimeofday(&start, NULL);
+	if ( (rbuf = ringbuf_init(size, size, storage)) == NULL)
+		exit(EXIT_FAILURE);
+	gettimeofday(&end, NULL);
+	init_usec = (end.tv_sec - start.tv_sec) * 1000000 + 
+		(end.tv_usec - start.tv_usec);
+	
+	fd_r = tlb_open(0);
+	fd_w = tlb_open(1);
+#ifdef __linux__
+	fd_c = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+	fd_c = -1;
+#endif
+
+	/* Default is to wrap the ring three times */
+	if (count == 0) {
+		for (i = 0, bytes = 0; i < BENCH_TABLE; i++)
+			bytes += table[i];
+		count = 3 * (size / (bytes / BENCH_TABLE));
+		if (count < 1000000)
+			count = 1000000;
+	}
+
+	bytes = 0;
+	counter_start(fd_r);
+	counter_start(fd_w);
+	counter_start(fd_c);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		esize = table[i & (BENCH_TABLE - 1)];
+		t = hist_now();
+		if (ringbuf_add(rbuf, elem, esize) < 0)
+			exit(EXIT_FAILURE);
+		hist_add(&h, t);
+		bytes += esize;
+		if ((i % BENCH_BATCH) == BENCH_BATCH - 1)
+			ringbuf_sync(rbuf);
+		
+		if (ws == NULL)
+			continue;
+		t = hist_now();
+		for (j = 0; j < BENCH_TOUCH; j++) {
+			rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+			ws[(rnd >> 33) % nws]++;
+		}
+		hist_add(&hw, t);
+	}
+	gettimeofday(&end, NULL);
+	tlb_r = counter_read(fd_r);
+	tlb_w = counter_read(fd_w);
+	llc = counter_read(fd_c);
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	rss_full = rss();
+
+	/* Not all systems count TLB misses */
+	if ((tlb_r < 0) && (tlb_w < 0))
+		snprintf(tlb, sizeof(tlb), "-");
+	else
+		snprintf(tlb, sizeof(tlb), "%.4f", ((tlb_r > 0 ? tlb_r : 0) + 
+			(tlb_w > 0 ? tlb_w : 0)) / count);
+	if (llc < 0)
+		snprintf(misses, sizeof(misses), "-");
+	else
+		snprintf(misses, sizeof(misses), "%.3f", llc / count);
+	if (ws == NULL)
+		snprintf(touch, sizeof(touch), "-");
+	else
+		snprintf(touch, sizeof(touch), "%.1f", hist_ns(hw.h_sum) / hw.h_count);
+	if (fd_r >= 0)
+		close(fd_r);
+	if (fd_w >= 0)
+		close(fd_w);
+	if (fd_c >= 0)
+		close(fd_c);
+
+	/* Walk as a dump does */
+	walked = 0;
+	gettimeofday(&start, NULL);
+	ringbuf_cursor_init(rbuf, &rc);
+	while (ringbuf_cursor_next(&rc, NULL) != NULL)
+		walked++;
+	gettimeofday(&end, NULL);
+	wsec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("ring=%lu dist=%s inserts=%lu sec=%.3f inserts_per_sec=%.0f "
+		"mbytes_per_sec=%.1f ns_mean=%.1f ns_p50=%.0f ns_p90=%.0f ns_p99=%.0f "
+		"ns_p999=%.0f ns_max=%.0f evictions=%lu evictions_per_sec=%.0f "
+		"walk_elems=%lu walk_ns_per_elem=%.1f memory=%lu rss=%lu budget=%lu "
+		"rss_per_budget=%.3f storage=%s locked=%d init_usec=%ld "
+		"dtlb_misses_per_insert=%s stream_min=%lu cache_misses_per_insert=%s "
+		"wset=%lu wset_ns_mean=%s\n",
+		(u_long)size, dist, count, sec, count / sec, 
+		bytes / sec / (1024*1024), hist_ns(h.h_sum) / h.h_count,
+		hist_ns(hist_quantile(&h, 0.50)), hist_ns(hist_quantile(&h, 0.90)),
+		hist_ns(hist_quantile(&h, 0.99)), hist_ns(hist_quantile(&h, 0.999)),
+		hist_ns(h.h_max), (u_long)rbuf->num_evicted, rbuf->num_evicted / sec,
+		(u_long)walked, walked ? wsec * 1e9 / walked : 0.0, 
+		(u_long)ringbuf_memsize(rbuf), (u_long)(rss_full - rss_base), 
+		(u_long)size, (double)(rss_full - rss_base) / size, 
+		ringbuf_storage(storage), (storage & RINGBUF_LOCK) != 0, init_usec, tlb,
+		(u_long)rbuf->stream_min, misses, (u_long)wset, touch);
+	fflush(stdout);
+
+	ringbuf_free(rbuf);
+	free(ws);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t table[BENCH_TABLE];
+	char *sizes = BENCH_SIZES;
+	char *dist = "imix";
+	unsigned long count = 0;
+	char *pt, *next;
+	size_t size, wset = 0;
+	int storage = 0;
+	int i;
+
+	while ( (i = getopt(argc, argv, "d:n:s:H:w:")) != -1) {
+		switch (i) {
+			case 'd': dist = optarg; break;
+			case 'H':
+				if ( (storage = ringbuf_flags(optarg)) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			case 'n':
+				if (!str_isnum(optarg, &count) || (count == 0))
+					errx("Bad number of inserts '%s'\n", optarg);
+				break;
+			case 's': sizes = optarg; break;
+			case 'w':
+				if ( (wset = str_to_size(optarg)) < sizeof(u_int64_t))
+					errx("Bad working set size '%s'\n", optarg);
+				break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (mktable(dist, table) < 0)
+		errx("Unknown distribution '%s'\n", dist);
+
+	hist_init();
+
+	if ( (sizes = strdup(sizes)) == NULL)
+		err_errnox("strdup()");
+	
+	for (pt = sizes; pt != NULL; pt = next) {
+		if ( (next = strchr(pt, ',')) != NULL)
+			*next++ = '\0';
+		
+		if ( (size = str_to_size(pt)) == 0)
+			errx("Bad ring size '%s'\n", pt);
+		bench(size, dist, table, count, storage, wset);
+	}
+	free(sizes);
+	exit(EXIT_SUCCESS);
+}
@@ -34,139 +34,1085 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define HAVE_STREAM
+#endif
 #include "print.h"
 #include "str.h"
 #include "ringbuf.h"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* Shared memory is only given back when removed */
+#ifndef MADV_REMOVE
+#define MADV_REMOVE		MADV_DONTNEED
+#endif
+
+/* Anonymous shared memory, called through syscall() 
+ * since older libc lacks memfd_create() */
+#if defined(SYS_memfd_create) && !defined(MFD_CLOEXEC)
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+/* Page size of explicit huge pages, older headers lack them */
+#ifdef MAP_HUGETLB
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+/* Blocks touched by one prefault thread */
+struct r_touch {
+	struct r_block **blocks;
+	size_t nblocks;
+	size_t blksize;
+	size_t stride;
+	pthread_t tid;
+	int started;
+};
+
+/*
+ * Each element is stored after a small header,
+ * padded to keep the next header aligned.
+ */
+struct r_elem {
+	u_int32_t size;
+	u_int32_t pad;
+};
+#define R_ALIGN				8
+#define R_ELEMLEN(size)		(sizeof(struct r_elem) + (((size) + R_ALIGN-1) & ~(R_ALIGN-1)))
+#define R_ELEMDATA(e)		((u_char *)(e) + sizeof(struct r_elem))
+
+/* Cache line size */
+#define R_LINE				64
+
+/* Entry of a block in the table of a shared buffer */
+#define R_SHBLK(r, b)		(&(r)->shm_blocks[(b) - (r)->blocks])
+#define R_INDEX(r, b)		((b) ? (int64_t)((b) - (r)->blocks) : -1)
+
+/* State of a shared block after a change */
+#define R_SHM_UNUSED		0	/* Evicted or emptied */
+#define R_SHM_USED			1	/* Keeps its place */
+#define R_SHM_NEW			2	/* Appended last */
+
+/* 
+ * State of a shared buffer handed to another process, followed
+ * by the name of the segment and one struct r_bstate per block
+ */
+#define R_STATE_MAGIC		0x52425354	/* "RBST" */
+#define R_STATE_VERSION		1
+
+struct r_state {
+	u_int32_t rs_magic;
+	u_int32_t rs_version;
+	int32_t rs_fd;			/* Descriptor of the segment */
+	int32_t rs_flags;
+	u_int64_t rs_size_max;
+	u_int64_t rs_size_curr;
+	u_int64_t rs_num_elems;
+	u_int64_t rs_num_evicted;
+	u_int64_t rs_size_evicted;
+	u_int64_t rs_blksize;
+	u_int64_t rs_nblocks;
+	u_int64_t rs_blk_max;
+	u_int64_t rs_maplen;
+	int64_t rs_prefault_usec;
+	int64_t rs_first;		/* Index of blocks, -1 if none */
+	int64_t rs_last;
+	int64_t rs_free;
+	u_int32_t rs_namelen;	/* 0 if anonymous */
+	u_int32_t rs_pad;
+};
+
+struct r_bstate {
+	u_int64_t bs_used;
+	u_int64_t bs_elems;
+	u_int64_t bs_size;
+	int64_t bs_next;
+	int64_t bs_compacted;
+};
+
+/* Local routines */
+static struct ringbuf *ringbuf_create(size_t, size_t, int, const char *);
+static int ringbuf_shm_open(struct ringbuf *, const char *);
+static void ringbuf_shm_begin(struct ringbuf *, struct r_block *);
+static void ringbuf_shm_end(struct ringbuf *, struct r_block *, int);
+static struct r_block *ringbuf_newblock(struct ringbuf *);
+static void ringbuf_evict(struct ringbuf *, int);
+static int ringbuf_map(struct ringbuf *, struct r_block *);
+static void ringbuf_unmap(struct ringbuf *, struct r_block *);
+static int ringbuf_prefault(struct ringbuf *);
+static void *ringbuf_touch(void *);
+static int ringbuf_adopt_map(struct ringbuf *, u_char *);
+static size_t ringbuf_stream_min(int, size_t);
+#ifdef HAVE_STREAM
+static void ringbuf_stream8(u_char *, const u_char *);
+static void ringbuf_stream(u_char *, const void *, size_t);
+static void ringbuf_stream_fence(void);
+#endif
+
+
+/*
+ * Parse storage options, a comma separated list of
+ * thp, 2m, 1g, lock, prefault, cached and stream.
+ * Returns RINGBUF_* flags, or -1 on error.
+ */
+int
+ringbuf_flags(const char *spec)
+{
+	char *copy, *pt, *next;
+	int flags;
+
+	if ( (copy = strdup(spec)) == NULL) {
+		err_errno("ringbuf_flags: strdup()");
+		return(-1);
+	}
+
+	flags = 0;
+	for (pt = copy; pt != NULL; pt = next) {
+		if ( (next = strchr(pt, ',')) != NULL)
+			*next++ = '\0';
+
+		if (!strcmp(pt, "4k"))
+			flags &= ~(RINGBUF_THP | RINGBUF_HUGETLB);
+		else if (!strcmp(pt, "thp"))
+			flags = (flags & ~RINGBUF_HUGETLB) | RINGBUF_THP;
+		else if (!strcmp(pt, "2m"))
+			flags = (flags & ~(RINGBUF_THP | RINGBUF_HUGETLB)) | RINGBUF_HUGE2M;
+		else if (!strcmp(pt, "1g"))
+			flags = (flags & ~(RINGBUF_THP | RINGBUF_HUGETLB)) | RINGBUF_HUGE1G;
+		else if (!strcmp(pt, "lock"))
+			flags |= RINGBUF_LOCK;
+		else if (!strcmp(pt, "prefault"))
+			flags |= RINGBUF_PREFAULT;
+		else if (!strcmp(pt, "cached"))
+			flags = (flags & ~RINGBUF_STREAM) | RINGBUF_CACHED;
+		else if (!strcmp(pt, "stream"))
+			flags = (flags & ~RINGBUF_CACHED) | RINGBUF_STREAM;
+		else {
+			err("Unknown buffer storage '%s'\n", pt);
+			free(copy);
+			return(-1);
+		}
+	}
+	free(copy);
+	return(flags);
+}
+
+
+/*
+ * Name of the page size used by storage flags
+ */
+const char *
+ringbuf_storage(int flags)
+{
+	if (flags & RINGBUF_HUGE1G)
+		return("1g");
+	if (flags & RINGBUF_HUGE2M)
+		return("2m");
+	if (flags & RINGBUF_THP)
+		return("thp");
+	return("4k");
+}
+
+
+/*
+ * Initialize a ring buffer for a maximum of size bytes, that can 
+ * later be resized up to reserve bytes without moving any elements.
+ * Only address space is reserved, memory is allocated as it is used,
+ * unless flags ask for it to be allocated up front. Blocks are at
+ * least one huge page when huge pages are used. Explicit huge pages
+ * are reserved by the kernel when mapped, such a buffer can not grow
+ * beyond its size.
+ * Returns a ringbuf pointer on success, NULL on error.
+ */
+struct ringbuf *
+ringbuf_init(size_t size, size_t reserve, int flags)
+{
+	return(ringbuf_create(size, reserve, flags & ~RINGBUF_SHARED, NULL));
+}
+
 
 /*
- * Initialize a ring buffer for a maximum of size bytes.
+ * Initialize a ring buffer like ringbuf_init(), kept in the shared
+ * memory segment /name where other processes can read it while 
+ * elements are added. Any old segment of the same name is replaced.
+ * If name is NULL the segment is anonymous, it can only be reached
+ * through the descriptor in shm_fd.
  * Returns a ringbuf pointer on success, NULL on error.
  */
 struct ringbuf *
-ringbuf_init(size_t size)
+ringbuf_init_shared(size_t size, size_t reserve, int flags, const char *name)
+{
+	return(ringbuf_create(size, reserve, flags | RINGBUF_SHARED, name));
+}
+
+
+static struct ringbuf *
+ringbuf_create(size_t size, size_t reserve, int flags, const char *name)
 {
 	struct ringbuf *rbuf;
+	size_t i, minblk;
+	int prot, mflags;
 
 	if (size == 0) {
 		err("ringbuf_init: Got bad size (0) of maximum buffer\n");
 		return(NULL);
 	}
 	
+	if (reserve < size)
+		reserve = size;
+
+	/* Only memory that is there can be locked */
+	if (flags & RINGBUF_LOCK)
+		flags |= RINGBUF_PREFAULT;
+	
+	minblk = RINGBUF_BLKSIZE_MIN;
+	if (flags & RINGBUF_HUGE1G)
+		minblk = RINGBUF_HUGE_1G;
+	else if (flags & (RINGBUF_HUGE2M | RINGBUF_THP))
+		minblk = RINGBUF_HUGE_2M;
+
+	/* Readers map the segment with pages of their own */
+	if ((flags & RINGBUF_SHARED) && (flags & (RINGBUF_THP | RINGBUF_HUGETLB))) {
+		err("ringbuf_init: Huge pages can not be used for a shared buffer\n");
+		return(NULL);
+	}
+
+	if (flags & RINGBUF_HUGETLB) {
+		if (size < 4 * minblk) {
+			err("ringbuf_init: Buffer of %s bytes is too small for huge pages\n",
+				str_hsize(size));
+			return(NULL);
+		}
+		if (reserve > size)
+			verbose(1, "Buffer of huge pages can not be resized beyond %s bytes\n", 
+				str_hsize(size));
+		reserve = size;
+	}
+
 	if ( (rbuf = calloc(1, sizeof(struct ringbuf))) == NULL) {
 		err_errno("ringbuf_init: Failed to allocate ringbuf structure");
 		return(NULL);
 	}
+	rbuf->flags = flags;
+	rbuf->shm_fd = -1;
+	rbuf->stream_min = ringbuf_stream_min(flags, size);
 
-	verbose(1, "Initiated buffer with %s bytes.\n", str_hsize(size));
+	/* Keep enough blocks for eviction to be fine grained */
+	rbuf->blksize = (RINGBUF_BLKSIZE > minblk) ? RINGBUF_BLKSIZE : minblk;
+	while ((rbuf->blksize > minblk) && 
+			(size / rbuf->blksize < RINGBUF_MINBLOCKS))
+		rbuf->blksize /= 2;
+	
+	rbuf->nblocks = (reserve + rbuf->blksize - 1) / rbuf->blksize;
 	rbuf->size_max = size;
+	rbuf->blk_max = size / rbuf->blksize;
+	if (rbuf->blk_max == 0)
+		rbuf->blk_max = 1;
+
+	if ( (rbuf->blocks = calloc(rbuf->nblocks, sizeof(struct r_block))) == NULL) {
+		err_errno("ringbuf_init: Failed to allocate block list");
+		free(rbuf);
+		return(NULL);
+	}
+
+	if (flags & RINGBUF_SHARED) {
+		if (ringbuf_shm_open(rbuf, name) < 0) {
+			free(rbuf->blocks);
+			free(rbuf);
+			return(NULL);
+		}
+		goto mapped;
+	}
+
+	/* Reserve address space only, but explicit huge pages are 
+	 * taken from the pool at once */
+	prot = PROT_NONE;
+	mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	rbuf->maplen = rbuf->nblocks * rbuf->blksize;
+	if (flags & RINGBUF_HUGETLB) {
+#ifdef MAP_HUGETLB
+		prot = PROT_READ | PROT_WRITE;
+		mflags |= MAP_HUGETLB | 
+			((flags & RINGBUF_HUGE1G) ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+#else
+		err("ringbuf_init: Huge pages are not supported on this system\n");
+		free(rbuf->blocks);
+		free(rbuf);
+		return(NULL);
+#endif
+	}
+	else if (flags & RINGBUF_THP) {
+		/* Room to align blocks to huge pages */
+		rbuf->maplen += RINGBUF_HUGE_2M;
+	}
+
+	rbuf->map = mmap(NULL, rbuf->maplen, prot, mflags, -1, 0);
+	if (rbuf->map == MAP_FAILED) {
+		err_errno("ringbuf_init: Failed to reserve %s bytes%s", 
+			str_hsize(rbuf->nblocks * rbuf->blksize), 
+			(flags & RINGBUF_HUGETLB) ? " of huge pages" : "");
+		free(rbuf->blocks);
+		free(rbuf);
+		return(NULL);
+	}
+	rbuf->arena = rbuf->map;
+
+	if (flags & RINGBUF_THP) {
+		rbuf->arena = (u_char *)(((unsigned long)rbuf->map + 
+			RINGBUF_HUGE_2M - 1) & ~((unsigned long)RINGBUF_HUGE_2M - 1));
+#ifdef MADV_HUGEPAGE
+		if (madvise(rbuf->arena, rbuf->nblocks * rbuf->blksize, 
+				MADV_HUGEPAGE) < 0)
+			err_errno("ringbuf_init: madvise(MADV_HUGEPAGE)");
+#else
+		err("ringbuf_init: Transparent huge pages are not supported on this system\n");
+#endif
+	}
+
+mapped:
+	/* All blocks start out unmapped, lowest address first */
+	for (i = rbuf->nblocks; i > 0; i--) {
+		rbuf->blocks[i-1].data = rbuf->arena + (i-1) * rbuf->blksize;
+		rbuf->blocks[i-1].next = rbuf->unmapped;
+		rbuf->unmapped = &rbuf->blocks[i-1];
+	}
+
+	verbose(1, "Initiated buffer with %s bytes.\n", str_hsize(size));
+	verbose(1, "Reserved %u blocks of %s bytes.\n", 
+		(u_int)rbuf->nblocks, str_hsize(rbuf->blksize));
+
+	if ((flags & RINGBUF_PREFAULT) && (ringbuf_prefault(rbuf) < 0)) {
+		ringbuf_free(rbuf);
+		return(NULL);
+	}
 	return(rbuf);	
 }
 
 
 /*
- * Add an element to the ring buffer.
- * If the buffer reaches its maximum size, buffers are removed in
- * the insert order until sufficent size are available.
- * Returns0 on success, -1 on error.
+ * Create the shared memory segment of a buffer and map it, the
+ * arena is reserved like a private one. Pages of the segment are
+ * only allocated as blocks are used, but the file system must have
+ * room for the buffer or the writer gets SIGBUS. An anonymous 
+ * segment is created when name is NULL. The descriptor is kept
+ * open for processes the segment is handed to.
+ * Returns 0 on success, -1 on error.
  */
-int
-ringbuf_add(struct ringbuf *rbuf, void *elem, size_t size)
+static int
+ringbuf_shm_open(struct ringbuf *rbuf, const char *name)
 {
-	void *tmp;
-	struct r_list *new;
+	struct rcap_header *h;
+	struct statvfs vfs;
+	size_t pagesize, table, arena, i;
+	char path[NAME_MAX];
+	int fd;
+
+	if (name == NULL) {
+		/* Only named until it is open where memfd is missing */
+		snprintf(path, sizeof(path), "/ringcap.%u", (u_int)getpid());
+#ifdef SYS_memfd_create
+		if ( (fd = syscall(SYS_memfd_create, path + 1, MFD_CLOEXEC)) < 0) {
+			err_errno("ringbuf_init: Failed to create anonymous shared memory");
+			return(-1);
+		}
+#else
+		if ( (fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+			err_errno("ringbuf_init: Failed to create shared memory '%s'", path);
+			return(-1);
+		}
+		shm_unlink(path);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+	}
+	else {
+		if ((*name == '\0') || (strchr(name, '/') != NULL) || 
+				(strlen(name) + 2 > sizeof(path))) {
+			err("ringbuf_init: Bad name of shared buffer '%s'\n", name);
+			return(-1);
+		}
+		snprintf(path, sizeof(path), "/%s", name);
+
+		if ( (fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0640)) < 0) {
+			err_errno("ringbuf_init: Failed to create shared memory '%s'", path);
+			return(-1);
+		}
+		
+		if ( (rbuf->shm_name = strdup(path)) == NULL) {
+			err_errno("ringbuf_init: strdup()");
+			goto fail;
+		}
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	table = (sizeof(struct rcap_header) + pagesize - 1) & ~(pagesize - 1);
+	arena = (table + rbuf->nblocks * sizeof(struct rcap_block) + 
+		pagesize - 1) & ~(pagesize - 1);
+	rbuf->maplen = arena + rbuf->nblocks * rbuf->blksize;
+
+	/* A file system without a size, like that of memfd, has no limit */
+	if ((fstatvfs(fd, &vfs) == 0) && (vfs.f_blocks != 0) &&
+			((double)vfs.f_bavail * vfs.f_frsize < rbuf->size_max)) {
+		err("ringbuf_init: Shared memory has room for %s bytes only\n",
+			str_hsize((size_t)vfs.f_bavail * vfs.f_frsize));
+		goto fail;
+	}
+
+	if (ftruncate(fd, rbuf->maplen) < 0) {
+		err_errno("ringbuf_init: Failed to size shared memory '%s'", path);
+		goto fail;
+	}
 	
-	if (rbuf == NULL) {
-		err("ringbuf_add: Got NULL pointer as buffer\n");
-		return(-1);
+	rbuf->map = mmap(NULL, rbuf->maplen, PROT_NONE, MAP_SHARED, fd, 0);
+	if (rbuf->map == MAP_FAILED) {
+		err_errno("ringbuf_init: Failed to map %s bytes of shared memory", 
+			str_hsize(rbuf->maplen));
+		goto fail;
+	}
+
+	if (mprotect(rbuf->map, arena, PROT_READ | PROT_WRITE) < 0) {
+		err_errno("ringbuf_init: mprotect()");
+		munmap(rbuf->map, rbuf->maplen);
+		goto fail;
 	}
+
+	rbuf->shm_fd = fd;
+	rbuf->arena = rbuf->map + arena;
+	rbuf->shm = (struct rcap_header *)rbuf->map;
+	rbuf->shm_blocks = (struct rcap_block *)(rbuf->map + table);
 	
-	/* Element can never fit if it's bigger than the 
-	 * maximum allowed size */
-	if (size > ringbuf_maxsize(rbuf)) {
-		err("ringbuf_add: Element size (%u) exceeds maximum "
-			"possible value (%u)\n", size, ringbuf_maxsize(rbuf));
-		return(-1);
+	for (i = 0; i < rbuf->nblocks; i++)
+		rbuf->shm_blocks[i].b_next = -1;
+
+	h = rbuf->shm;
+	h->h_version = RCAP_VERSION;
+	h->h_hdrlen = sizeof(struct rcap_header);
+	h->h_blksize = rbuf->blksize;
+	h->h_nblocks = rbuf->nblocks;
+	h->h_table = table;
+	h->h_arena = arena;
+	h->h_pid = getpid();
+	h->h_first = -1;
+	h->h_last = -1;
+
+	/* Readers check the magic before anything else */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(h->h_magic, RCAP_MAGIC, sizeof(h->h_magic));
+
+	if (rbuf->shm_name != NULL)
+		verbose(1, "Shared buffer in %s\n", path);
+	else
+		verbose(1, "Shared buffer in anonymous memory\n");
+	return(0);
+
+fail:
+	close(fd);
+	if (rbuf->shm_name != NULL) {
+		shm_unlink(rbuf->shm_name);
+		free(rbuf->shm_name);
+		rbuf->shm_name = NULL;
 	}
+	return(-1);
+}
+
+
+/*
+ * Start changing a block of a shared buffer, readers see
+ * an odd generation and stop trusting what they read.
+ */
+static void
+ringbuf_shm_begin(struct ringbuf *rbuf, struct r_block *blk)
+{
+	struct rcap_block *sb;
+
+	/* What readers are told next includes streamed elements */
+	ringbuf_sync(rbuf);
+
+	sb = R_SHBLK(rbuf, blk);
+	__atomic_store_n(&sb->b_gen, sb->b_gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	while (ringbuf_sizeleft(rbuf) < size) {
-		void *elem;
-		verbose(4, "Buffer to small, %u bytes, need %u bytes. Removing element.\n",
-			ringbuf_sizeleft(rbuf), size);
+
+/*
+ * Publish a block of a shared buffer after a change, state is one
+ * of R_SHM_*. New blocks are numbered after all others, blocks
+ * no longer in use are published as empty.
+ */
+static void
+ringbuf_shm_end(struct ringbuf *rbuf, struct r_block *blk, int state)
+{
+	struct rcap_header *h;
+	struct rcap_block *sb;
 	
-		if ( (elem = ringbuf_first(rbuf, NULL)) == NULL) {
-			err("ringbuf_add: Failed to remove element\n");
-			return(-1);
-		}
-		free(elem);
+	h = rbuf->shm;
+	sb = R_SHBLK(rbuf, blk);
+	if (state == R_SHM_NEW) {
+		sb->b_seq = h->h_seq + 1;
+		__atomic_store_n(&h->h_seq, sb->b_seq, __ATOMIC_RELEASE);
+	}
+
+	if (state == R_SHM_UNUSED) {
+		sb->b_seq = 0;
+		sb->b_used = 0;
+		sb->b_next = -1;
+	}
+	else {
+		sb->b_used = blk->used;
+		sb->b_next = R_INDEX(rbuf, blk->next);
+	}
+	__atomic_store_n(&sb->b_gen, sb->b_gen + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Write to every page of the blocks of a prefault thread
+ */
+static void *
+ringbuf_touch(void *arg)
+{
+	struct r_touch *rt;
+	volatile u_char *p;
+	size_t i, off;
+
+	rt = (struct r_touch *)arg;
+	for (i = 0; i < rt->nblocks; i++) {
+		p = rt->blocks[i]->data;
+		for (off = 0; off < rt->blksize; off += rt->stride)
+			p[off] = 0;
 	}
+	return(NULL);
+}
+
+
+/*
+ * Allocate memory for all blocks up to the maximum size, and lock 
+ * it if asked to. The blocks are put on the free list. Pages are
+ * touched by one thread per CPU, since the kernel takes faults
+ * on the same address space in parallel.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+ringbuf_prefault(struct ringbuf *rbuf)
+{
+	struct r_touch rt[RINGBUF_PREFAULT_THREADS];
+	struct timeval start, end;
+	struct r_block **bv, *blk;
+	size_t i, n, per;
+	long ncpu;
+	int t, nthr;
+	int ret;
+
+	if (rbuf->blk_used + rbuf->blk_free >= rbuf->blk_max)
+		return(0);
+	n = rbuf->blk_max - (rbuf->blk_used + rbuf->blk_free);
 	
+	if ( (bv = calloc(n, sizeof(struct r_block *))) == NULL) {
+		err_errno("ringbuf_prefault: calloc()");
+		return(-1);
+	}
+
+	gettimeofday(&start, NULL);
+	ret = 0;
+	for (i = 0; (i < n) && ((blk = rbuf->unmapped) != NULL); i++) {
+		if (!(rbuf->flags & RINGBUF_HUGETLB) && (mprotect(blk->data, 
+				rbuf->blksize, PROT_READ | PROT_WRITE) < 0)) {
+			err_errno("ringbuf_prefault: mprotect()");
+			ret = -1;
+			break;
+		}
+		rbuf->unmapped = blk->next;
+		bv[i] = blk;
+	}
+	n = i;
+
+	if ( (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	nthr = (ncpu < RINGBUF_PREFAULT_THREADS) ? ncpu : RINGBUF_PREFAULT_THREADS;
+	if ((size_t)nthr > n)
+		nthr = n;
+	per = nthr ? (n + nthr - 1) / nthr : 0;
+
+	for (t = 0; t < nthr; t++) {
+		rt[t].blocks = &bv[t * per];
+		rt[t].nblocks = (n - t * per < per) ? n - t * per : per;
+		rt[t].blksize = rbuf->blksize;
+		rt[t].stride = (rbuf->flags & RINGBUF_HUGETLB) ? 
+			rbuf->blksize : (size_t)sysconf(_SC_PAGESIZE);
+		rt[t].started = (pthread_create(&rt[t].tid, NULL, 
+			ringbuf_touch, &rt[t]) == 0);
+		if (!rt[t].started)
+			ringbuf_touch(&rt[t]);
+	}
+	for (t = 0; t < nthr; t++) {
+		if (rt[t].started)
+			pthread_join(rt[t].tid, NULL);
+	}
+
+	/* Locking touched memory does not fault */
+	for (i = 0; i < n; i++) {
+		if ((ret == 0) && (rbuf->flags & RINGBUF_LOCK) && 
+				(mlock(bv[i]->data, rbuf->blksize) < 0)) {
+			err_errno("ringbuf_prefault: Failed to lock %s bytes", 
+				str_hsize(rbuf->blksize * n));
+			ret = -1;
+		}
+		bv[i]->next = rbuf->free;
+		rbuf->free = bv[i];
+		rbuf->blk_free++;
+	}
+	free(bv);
+
+	gettimeofday(&end, NULL);
+	rbuf->prefault_usec += (end.tv_sec - start.tv_sec) * 1000000 + 
+		(end.tv_usec - start.tv_usec);
+	verbose(1, "Prefaulted %u blocks with %d threads\n", (u_int)n, nthr);
+	return(ret);
+}
+
+
+/*
+ * Make the memory of a block accessible.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+ringbuf_map(struct ringbuf *rbuf, struct r_block *blk)
+{
+	if (!(rbuf->flags & RINGBUF_HUGETLB) && (mprotect(blk->data, 
+			rbuf->blksize, PROT_READ | PROT_WRITE) < 0)) {
+		err_errno("ringbuf_map: mprotect()");
+		return(-1);
+	}
 
-	if ( (tmp = calloc(1, size + sizeof(struct r_list))) == NULL) {
-		err_errno("ringbuf_add: Failed to allocate memory");
+	if ((rbuf->flags & RINGBUF_LOCK) && (mlock(blk->data, rbuf->blksize) < 0)) {
+		err_errno("ringbuf_map: mlock()");
 		return(-1);
 	}
+	return(0);
+}
 
-	/* Save a call to calloc now, and free later on by using 
-	 * the same chunk for both list information and data */
-	new = (struct r_list *)((char *)tmp + size);
-	new->elem = tmp;
-	new->size = size;
-	memcpy(new->elem, elem, size);
+
+/*
+ * Give the memory of a free block back to the system
+ * and put it on the unmapped list.
+ */
+static void
+ringbuf_unmap(struct ringbuf *rbuf, struct r_block *blk)
+{
+	if ((rbuf->flags & RINGBUF_LOCK) && (munlock(blk->data, rbuf->blksize) < 0))
+		err_errno("ringbuf_unmap: munlock()");
 	
-	/* Count the data to be added */	
-	rbuf->num_elems++;
-	rbuf->size_curr += size;
+	/* Explicit huge pages stay with the buffer */
+	if (!(rbuf->flags & RINGBUF_HUGETLB)) {
+		if (madvise(blk->data, rbuf->blksize, 
+				(rbuf->shm != NULL) ? MADV_REMOVE : MADV_DONTNEED) < 0)
+			err_errno("ringbuf_unmap: madvise()");
+		if (mprotect(blk->data, rbuf->blksize, PROT_NONE) < 0)
+			err_errno("ringbuf_unmap: mprotect()");
+	}
+	
+	blk->next = rbuf->unmapped;
+	rbuf->unmapped = blk;
+}
+
+
+/*
+ * Remove the oldest block and all elements in it, 
+ * the block is put on the free list. Elements that are
+ * lost, not removed on request, are passed to the evict
+ * function first.
+ */
+static void
+ringbuf_evict(struct ringbuf *rbuf, int lost)
+{
+	struct r_block *blk;
+	struct r_elem *re;
+	size_t off;
+
+	if ( (blk = rbuf->first) == NULL)
+		return;
+
+	verbose(4, "Evicting block with %u elements\n", (u_int)blk->elems);
+
+	/* Last look at elements that are not kept anywhere else */
+	if (lost && (rbuf->evict_func != NULL)) {
+		for (off = 0; off < blk->used; off += R_ELEMLEN(re->size)) {
+			re = (struct r_elem *)(blk->data + off);
+			rbuf->evict_func(R_ELEMDATA(re), re->size, rbuf->evict_arg);
+		}
+	}
+	
+	if (rbuf->shm != NULL)
+		ringbuf_shm_begin(rbuf, blk);
+
+	rbuf->first = blk->next;
+	if (rbuf->first == NULL) {
+		rbuf->last = NULL;
+		rbuf->last_elem = NULL;
+	}
+
+	rbuf->num_elems -= blk->elems;
+	rbuf->size_curr -= blk->size;
+	rbuf->num_evicted += blk->elems;
+	rbuf->size_evicted += blk->size;
+	rbuf->blk_used--;
+
+	/* Readers start over at the new first block */
+	if (rbuf->shm != NULL) {
+		ringbuf_shm_end(rbuf, blk, R_SHM_UNUSED);
+		if (rbuf->first != NULL) {
+			__atomic_store_n(&rbuf->shm->h_first_seq, 
+				R_SHBLK(rbuf, rbuf->first)->b_seq, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&rbuf->shm->h_first, R_INDEX(rbuf, rbuf->first), 
+			__ATOMIC_RELEASE);
+		__atomic_store_n(&rbuf->shm->h_last, R_INDEX(rbuf, rbuf->last), 
+			__ATOMIC_RELEASE);
+		rbuf->shm->h_elems = rbuf->num_elems;
+		if (lost)
+			rbuf->shm->h_evicted += blk->elems;
+	}
+
+	blk->used = 0;
+	blk->elems = 0;
+	blk->size = 0;
+	blk->compacted = 0;
+	blk->next = rbuf->free;
+	rbuf->free = blk;
+	rbuf->blk_free++;
+}
+
+
+/*
+ * Get an empty block to append to, evicting the oldest 
+ * block if the buffer is full.
+ * Returns a block pointer on success, NULL on error.
+ */
+static struct r_block *
+ringbuf_newblock(struct ringbuf *rbuf)
+{
+	struct r_block *blk;
+
+	/* Recycle the oldest block */
+	if (rbuf->blk_used >= rbuf->blk_max) 
+		ringbuf_evict(rbuf, 1);
+
+	if ( (blk = rbuf->free) != NULL) {
+		rbuf->free = blk->next;
+		rbuf->blk_free--;
+	}
+	else if ( (blk = rbuf->unmapped) != NULL) {
+		if (ringbuf_map(rbuf, blk) < 0)
+			return(NULL);
+		rbuf->unmapped = blk->next;
+	}
+	else {
+		err("ringbuf_newblock: No free blocks\n");
+		return(NULL);
+	}
+
+	blk->used = 0;
+	blk->elems = 0;
+	blk->size = 0;
+	blk->next = NULL;
+
+	/* Readers can follow the link as soon as it's there */
+	if (rbuf->shm != NULL) {
+		ringbuf_shm_begin(rbuf, blk);
+		ringbuf_shm_end(rbuf, blk, R_SHM_NEW);
+		if (rbuf->last == NULL) {
+			__atomic_store_n(&rbuf->shm->h_first_seq, 
+				R_SHBLK(rbuf, blk)->b_seq, __ATOMIC_RELEASE);
+			__atomic_store_n(&rbuf->shm->h_first, R_INDEX(rbuf, blk), 
+				__ATOMIC_RELEASE);
+		}
+		else {
+			__atomic_store_n(&R_SHBLK(rbuf, rbuf->last)->b_next, 
+				R_INDEX(rbuf, blk), __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&rbuf->shm->h_last, R_INDEX(rbuf, blk), 
+			__ATOMIC_RELEASE);
+#ifdef HAVE_STREAM
+		/* Streamed stores could otherwise pass the new generation */
+		if (rbuf->stream_min)
+			ringbuf_stream_fence();
+#endif
+	}
 	
+	if (rbuf->last == NULL)
+		rbuf->first = blk;
+	else
+		rbuf->last->next = blk;
+	rbuf->last = blk;
+	rbuf->blk_used++;
+	return(blk);
+}
+
+
+/*
+ * Add an element to the ring buffer.
+ * If the buffer reaches its maximum size, the oldest block of 
+ * elements is removed to make room.
+ * Returns 0 on success, -1 on error.
+ */
+int
+ringbuf_add(struct ringbuf *rbuf, const void *elem, size_t size)
+{
+	struct r_block *blk;
+	struct r_elem *re;
+	size_t len;
 	
-	/* We are always at the end */
-	new->next = NULL;
+	if (rbuf == NULL) {
+		err("ringbuf_add: Got NULL pointer as buffer\n");
+		return(-1);
+	}
 	
-	/* First element */	
-	if (ringbuf_elements(rbuf) == 1) {
-		new->prev = NULL;
-		rbuf->first = new;
-		rbuf->last = new;
+	/* Element can never fit if it's bigger than a block */
+	len = R_ELEMLEN(size);
+	if (len > rbuf->blksize) {
+		err("ringbuf_add: Element size (%u) exceeds maximum "
+			"possible value (%u)\n", (u_int)size, 
+			(u_int)(rbuf->blksize - sizeof(struct r_elem)));
+		return(-1);
+	}
+
+	if (((blk = rbuf->last) == NULL) || (blk->used + len > rbuf->blksize)) {
+		if ( (blk = ringbuf_newblock(rbuf)) == NULL)
+			return(-1);
 	}
-	/* Second element */
-	else if (ringbuf_elements(rbuf) == 2) {
-		rbuf->first->next = new;
-		rbuf->last = new;
-		new->prev = rbuf->first;
+
+	re = (struct r_elem *)(blk->data + blk->used);
+#ifdef HAVE_STREAM
+	/* Smaller elements are streamed as well when they continue a 
+	 * cache line that a streamed element started, mixing both kinds 
+	 * of stores in a line is slower than either */
+	if (rbuf->stream_min && ((size >= rbuf->stream_min) || 
+			(((u_char *)re == rbuf->stream_end) && ((u_long)re & (R_LINE - 1))))) {
+		ringbuf_stream((u_char *)re, elem, size);
+		rbuf->streamed = 1;
+		rbuf->stream_end = (u_char *)re + len;
+	}
+	else
+#endif
+	{
+		re->size = size;
+		memcpy(R_ELEMDATA(re), elem, size);
 	}
 	
-	/* n:th element */
-	else {
-		new->prev = rbuf->last;
-		rbuf->last->next = new;
-		rbuf->last = new;
+	blk->used += len;
+	blk->elems++;
+	blk->size += size;
+	rbuf->num_elems++;
+	rbuf->size_curr += size;
+	rbuf->last_elem = R_ELEMDATA(re);
+
+	/* The element is written before readers are told about it. 
+	 * Streamed stores are weakly ordered, they are fenced and told 
+	 * about once for many elements by ringbuf_sync() */
+	if ((rbuf->shm != NULL) && !rbuf->streamed) {
+		__atomic_store_n(&R_SHBLK(rbuf, blk)->b_used, blk->used, 
+			__ATOMIC_RELEASE);
+		rbuf->shm->h_elems = rbuf->num_elems;
 	}
 	
 	verbose(3, "Added element number %u of size %s bytes\n", 
-		ringbuf_elements(rbuf), str_hsize(size));
+		(u_int)ringbuf_elements(rbuf), str_hsize(size));
 	verbose(2, "Ring buffer uses %s [%u] bytes\n", 
-		str_hsize(ringbuf_currsize(rbuf)), ringbuf_currsize(rbuf));
+		str_hsize(ringbuf_currsize(rbuf)), (u_int)ringbuf_currsize(rbuf));
+	return(0);
+}
+
+
+/*
+ * Smallest element copied with non-temporal stores into a buffer
+ * of size bytes, 0 if none are. Unless the flags say otherwise, 
+ * elements are streamed when the buffer does not fit in the last 
+ * level cache, where they would be evicted before they are read 
+ * again anyway. A buffer that fits is written faster through it.
+ */
+static size_t
+ringbuf_stream_min(int flags, size_t size)
+{
+#ifdef HAVE_STREAM
+	static long cache = -1;
+	static int sse2 = -1;
+
+	if (sse2 < 0) {
+		__builtin_cpu_init();
+		sse2 = __builtin_cpu_supports("sse2") ? 1 : 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+		if ( (cache = sysconf(_SC_LEVEL3_CACHE_SIZE)) <= 0)
+			cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		if (cache <= 0)
+			cache = RINGBUF_STREAM_CACHE;
+		verbose(1, "Last level cache is %s bytes, %s\n", str_hsize(cache),
+			sse2 ? "streaming stores supported" : "no streaming stores without SSE2");
+	}
+
+	if (!sse2 || (flags & RINGBUF_CACHED))
+		return(0);
+	if ((flags & RINGBUF_STREAM) || (size > (size_t)cache))
+		return(RINGBUF_STREAM_MIN);
+#endif
 	return(0);
 }
 
 
+/*
+ * Make elements written with non-temporal stores visible to other
+ * threads and processes, and tell readers of a shared buffer about
+ * them. Called after a batch of elements is added, and before the
+ * shared state of any block changes.
+ */
+void
+ringbuf_sync(struct ringbuf *rbuf)
+{
+#ifdef HAVE_STREAM
+	if (!rbuf->streamed)
+		return;
+	ringbuf_stream_fence();
+	rbuf->streamed = 0;
+
+	if ((rbuf->shm != NULL) && (rbuf->last != NULL)) {
+		__atomic_store_n(&R_SHBLK(rbuf, rbuf->last)->b_used, rbuf->last->used, 
+			__ATOMIC_RELEASE);
+		rbuf->shm->h_elems = rbuf->num_elems;
+	}
+#endif
+}
+
+
+#ifdef HAVE_STREAM
+/*
+ * Order non-temporal stores before those that follow
+ */
+__attribute__((target("sse2")))
+static void
+ringbuf_stream_fence(void)
+{
+	_mm_sfence();
+}
+
+
+/*
+ * Store 8 bytes past the cache
+ */
+__attribute__((target("sse2")))
+static void
+ringbuf_stream8(u_char *dst, const u_char *src)
+{
+#ifdef __x86_64__
+	long long q;
+
+	memcpy(&q, src, sizeof(q));
+	_mm_stream_si64((long long *)dst, q);
+#else
+	int l[2];
+
+	memcpy(l, src, sizeof(l));
+	_mm_stream_si32((int *)dst, l[0]);
+	_mm_stream_si32((int *)dst + 1, l[1]);
+#endif
+}
+
+
+/*
+ * Write an element of size bytes, header and data, to dst with 
+ * non-temporal stores. The padding up to the next header is zeroed.
+ * The stores are weakly ordered, see ringbuf_sync().
+ */
+__attribute__((target("sse2")))
+static void
+ringbuf_stream(u_char *dst, const void *elem, size_t size)
+{
+	const u_char *src;
+	struct r_elem re;
+	u_char tail[R_ALIGN];
+	__m128i a, b, c, d;
+
+	memset(&re, 0x00, sizeof(re));
+	re.size = size;
+	ringbuf_stream8(dst, (u_char *)&re);
+	dst += sizeof(re);
+	src = elem;
+
+	/* Elements are R_ALIGN aligned, 16 bytes at most 8 away */
+	if (((u_long)dst & 15) && (size >= 8)) {
+		ringbuf_stream8(dst, src);
+		dst += 8;
+		src += 8;
+		size -= 8;
+	}
+
+	/* Whole cache lines, then what is left 16 bytes at a time */
+	for (; size >= 64; size -= 64, src += 64, dst += 64) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)(src + 16));
+		c = _mm_loadu_si128((const __m128i *)(src + 32));
+		d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	for (; size >= 16; size -= 16, src += 16, dst += 16)
+		_mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+
+	if (size >= 8) {
+		ringbuf_stream8(dst, src);
+		dst += 8;
+		src += 8;
+		size -= 8;
+	}
+	if (size > 0) {
+		memset(tail, 0x00, sizeof(tail));
+		memcpy(tail, src, size);
+		ringbuf_stream8(dst, tail);
+	}
+}
+#endif
+
 
 /*
  * Resize buffer.
- * If the new size is less than the current size, 
- * elements are removed in the order they were inserted
- * until the new limit is reached. 
+ * If the new size is less than the current size, blocks of 
+ * elements are removed in the order they were inserted until 
+ * the new limit is reached, and their memory is returned to
+ * the system. Growing never moves any elements.
  * Returns the number of elements removed, or -1 on error.
  */
 int
 ringbuf_resize(struct ringbuf *rbuf, size_t new_size)
 {
-	size_t deleted = 0;
+	struct r_block *blk;
+	size_t elems, old_size;
+	size_t blk_max;
 
-	verbose(3, "Resizing buffer to %u bytes\n", new_size);
+	verbose(3, "Resizing buffer to %u bytes\n", (u_int)new_size);
 
-    if (rbuf == NULL) {
+	if (rbuf == NULL) {
 		err("ringbuf_resize: Got NULL pointer as buffer\n");
 		return(-1);
 	}
@@ -176,147 +1122,584 @@ ringbuf_resize(struct ringbuf *rbuf, size_t new_size)
 		return(-1);
 	}
 
-	/* Nothing to fix, simply change the maximum size */
-	if (ringbuf_currsize(rbuf) < new_size) {
-		rbuf->size_max = new_size;
-		return(0);
+	if (new_size > ringbuf_reserved(rbuf)) {
+		err("ringbuf_resize: Size %s exceeds the reserved %s\n",
+			str_hsize(new_size), str_hsize(ringbuf_reserved(rbuf)));
+		return(-1);
+	}
+	
+	if ( (blk_max = new_size / rbuf->blksize) == 0)
+		blk_max = 1;
+	
+	old_size = rbuf->size_max;
+	rbuf->size_max = new_size;
+	rbuf->blk_max = blk_max;
+	rbuf->stream_min = ringbuf_stream_min(rbuf->flags, new_size);
+	elems = rbuf->num_elems;
+	
+	/* Remove blocks until the buffer fits the new size */
+	while (rbuf->blk_used > blk_max)
+		ringbuf_evict(rbuf, 1);
+
+	/* Release memory that is no longer needed */
+	while ((rbuf->blk_used + rbuf->blk_free > blk_max) && 
+			((blk = rbuf->free) != NULL)) {
+		rbuf->free = blk->next;
+		rbuf->blk_free--;
+		ringbuf_unmap(rbuf, blk);
 	}
 
-	/* Remove elements until the current size fits the new size */
-	while (ringbuf_currsize(rbuf) > new_size) {
-		void *elem;
-		
-		if ( (elem = ringbuf_first(rbuf, NULL)) == NULL) {
-			err("ringbuf_resize: Failed to remove element from buffer\n");
-			return(0);
-		}
-		deleted++;
-		free(elem);
+	/* Memory of a larger buffer is allocated up front as well */
+	if ((rbuf->flags & RINGBUF_PREFAULT) && (ringbuf_prefault(rbuf) < 0)) {
+		ringbuf_resize(rbuf, old_size);
+		return(-1);
 	}
 
-	return(deleted);	
+	return(elems - rbuf->num_elems);	
 }
 
 
 /*
- * Remove and return the element at the end of the list, 
- * returns NULL if the buffer is empty.
- * Note that you have to free the returned element using free(3),
- * once you have finished using it.
+ * Remove all elements, memory is kept for new elements
  */
-void *
-ringbuf_last(struct ringbuf *rbuf, size_t *elem_size)
+void
+ringbuf_clear(struct ringbuf *rbuf)
 {
-	struct r_list *elem;
-
-	verbose(4, "Removing last element\n");
+	size_t elems, size;
 	
-    if (rbuf == NULL) {
-		err("ringbuf_last: Got NULL pointer as buffer\n");
-		return(NULL);
-	}
+	elems = rbuf->num_evicted;
+	size = rbuf->size_evicted;
 	
-	/* No elements left */
-	if (ringbuf_elements(rbuf) == 0)	
-		return(NULL);
+	while (rbuf->first != NULL)
+		ringbuf_evict(rbuf, 0);
+	
+	/* Not evicted to make room */
+	rbuf->num_evicted = elems;
+	rbuf->size_evicted = size;
+}
 
-	elem = rbuf->last;
-	rbuf->num_elems--;
-	rbuf->size_curr -= elem->size;
+
+/*
+ * Remove the oldest blocks whose elements are all expired, which is 
+ * the case when the first element of the block after is expired.
+ * Elements are checked with the expired function, called with arg.
+ * Returns the number of elements removed.
+ */
+size_t
+ringbuf_expire(struct ringbuf *rbuf, int (*expired)(const void *, void *), 
+	void *arg)
+{
+	const void *elem;
+	size_t elems, size, removed;
+
+	elems = rbuf->num_evicted;
+	size = rbuf->size_evicted;
+	removed = rbuf->num_elems;
 	
+	while (rbuf->first != NULL) {
+		if (rbuf->first->next != NULL)
+			elem = R_ELEMDATA(rbuf->first->next->data);
+		else
+			elem = rbuf->last_elem;
 
-	/* Last element */
-	if (ringbuf_elements(rbuf) == 0) {
-		rbuf->last = NULL;
-		rbuf->first = NULL;
+		if (!expired(elem, arg))
+			break;
+		ringbuf_evict(rbuf, 1);
 	}
 	
-	/* Next last element */
-	else if (ringbuf_elements(rbuf) == 0) {
-		rbuf->last = rbuf->first;
-		rbuf->first->next = NULL;
-		rbuf->first->prev = NULL;
-	}
-	/* N:th element */
-	else {
-		rbuf->last = elem->prev;
-		elem->prev->next = NULL;
+	/* Not evicted to make room */
+	rbuf->num_evicted = elems;
+	rbuf->size_evicted = size;
+	return(removed - rbuf->num_elems);
+}
+
+
+/*
+ * Shrink the elements of old blocks and pack them into as few blocks
+ * as possible, the blocks emptied are put on the free list. A block is
+ * old when the old function says so for the first element of the 
+ * block after it, the block being filled is never compacted. Each 
+ * element is passed to the shrink function, which may cut it in place
+ * and returns its new size. Compacted blocks stay first in the buffer,
+ * at most max blocks are compacted per call. Blocks of a shared buffer
+ * numbered upto or later are left alone, for readers that must see 
+ * them whole, upto is 0 for no limit.
+ * Returns the number of blocks compacted.
+ */
+size_t
+ringbuf_compact(struct ringbuf *rbuf, int (*old)(const void *, void *), 
+	size_t (*shrink)(void *, size_t, void *), void *arg, u_int64_t upto, 
+	size_t max)
+{
+	struct r_block *src, *dst, *prev, *next;
+	struct r_elem *re;
+	size_t off, end, len, size, n;
+
+	/* Fill up the last compacted block first */
+	dst = NULL;
+	for (src = rbuf->first; (src != NULL) && src->compacted; src = src->next)
+		dst = src;
+	
+	for (n = 0; (n < max) && (src != NULL) && (src != rbuf->last); n++) {
+		if (!old(R_ELEMDATA(src->next->data), arg))
+			break;
+		if ((rbuf->shm != NULL) && (upto != 0) && 
+				(R_SHBLK(rbuf, src)->b_seq >= upto))
+			break;
+		next = src->next;
+
+		/* Readers of both blocks lose their place */
+		prev = dst;
+		if (rbuf->shm != NULL) {
+			if (prev != NULL)
+				ringbuf_shm_begin(rbuf, prev);
+			ringbuf_shm_begin(rbuf, src);
+		}
+
+		/* Elements are read from src as they are written to dst */
+		end = src->used;
+		rbuf->size_curr -= src->size;
+		src->used = 0;
+		src->elems = 0;
+		src->size = 0;
+		if (dst == NULL)
+			dst = src;
+
+		for (off = 0; off < end; off += len) {
+			re = (struct r_elem *)(src->data + off);
+			len = R_ELEMLEN(re->size);
+			
+			size = shrink(R_ELEMDATA(re), re->size, arg);
+			if (size < re->size)
+				re->size = size;
+
+			/* Never beyond the element being read */
+			if (dst->used + R_ELEMLEN(re->size) > rbuf->blksize) {
+				dst->compacted = 1;
+				dst = dst->next;
+			}
+
+			memmove(dst->data + dst->used, re, R_ELEMLEN(re->size));
+			dst->used += R_ELEMLEN(re->size);
+			dst->elems++;
+			dst->size += re->size;
+			rbuf->size_curr += re->size;
+		}
+		dst->compacted = 1;
+
+		/* All elements moved to the block before */
+		if (src != dst) {
+			dst->next = next;
+			rbuf->blk_used--;
+			src->compacted = 0;
+			src->next = rbuf->free;
+			rbuf->free = src;
+			rbuf->blk_free++;
+		}
+
+		if (rbuf->shm != NULL) {
+			if (prev != NULL)
+				ringbuf_shm_end(rbuf, prev, R_SHM_USED);
+			ringbuf_shm_end(rbuf, src, (src == dst) ? R_SHM_USED : R_SHM_UNUSED);
+		}
+		src = next;
 	}
+	return(n);
+}
 
-	if (elem_size != NULL)
-		*elem_size = elem->size;
+
+/*
+ * Set a function to be called with each element that is lost
+ * to eviction, for a last look before its memory is reused.
+ * Elements removed by ringbuf_clear() are not passed on.
+ */
+void
+ringbuf_set_evict(struct ringbuf *rbuf, 
+	void (*func)(const void *, size_t, void *), void *arg)
+{
+	rbuf->evict_func = func;
+	rbuf->evict_arg = arg;
+}
+
+
+/*
+ * Free the buffer and give all memory back to the system
+ */
+void
+ringbuf_free(struct ringbuf *rbuf)
+{
+	/* Readers keep what they have mapped */
+	if (rbuf->shm != NULL) {
+		__atomic_store_n(&rbuf->shm->h_pid, 0, __ATOMIC_RELEASE);
+		if ((rbuf->shm_name != NULL) && (shm_unlink(rbuf->shm_name) < 0))
+			err_errno("ringbuf_free: shm_unlink()");
+		free(rbuf->shm_name);
+		close(rbuf->shm_fd);
+	}
 	
-	verbose(3, "Removed element of size %s\n", str_hsize(elem->size));
-	return(elem->elem);
+	if (munmap(rbuf->map, rbuf->maplen) < 0)
+		err_errno("ringbuf_free: munmap()");
+	free(rbuf->blocks);
+	free(rbuf);
 }
 
+
 /*
- * Peek at latest entry in the list.
+ * Write the state of a shared buffer to fp, for another process
+ * given the descriptor of the segment to take it over with
+ * ringbuf_adopt(). Nothing is copied but the list of blocks, the
+ * buffer must not change until the other process has it.
+ * Returns 0 on success, -1 on error.
  */
-const void *
-ringbuf_peek_last(struct ringbuf *rbuf)
+int
+ringbuf_save(struct ringbuf *rbuf, FILE *fp)
 {
-	return(rbuf->last->elem);
+	struct r_state rs;
+	struct r_bstate bs;
+	size_t i;
+
+	if (rbuf->shm == NULL) {
+		err("ringbuf_save: Only a shared buffer can be handed over\n");
+		return(-1);
+	}
+	ringbuf_sync(rbuf);
+
+	memset(&rs, 0x00, sizeof(rs));
+	rs.rs_magic = R_STATE_MAGIC;
+	rs.rs_version = R_STATE_VERSION;
+	rs.rs_fd = rbuf->shm_fd;
+	rs.rs_flags = rbuf->flags;
+	rs.rs_size_max = rbuf->size_max;
+	rs.rs_size_curr = rbuf->size_curr;
+	rs.rs_num_elems = rbuf->num_elems;
+	rs.rs_num_evicted = rbuf->num_evicted;
+	rs.rs_size_evicted = rbuf->size_evicted;
+	rs.rs_blksize = rbuf->blksize;
+	rs.rs_nblocks = rbuf->nblocks;
+	rs.rs_blk_max = rbuf->blk_max;
+	rs.rs_maplen = rbuf->maplen;
+	rs.rs_prefault_usec = rbuf->prefault_usec;
+	rs.rs_first = R_INDEX(rbuf, rbuf->first);
+	rs.rs_last = R_INDEX(rbuf, rbuf->last);
+	rs.rs_free = R_INDEX(rbuf, rbuf->free);
+	if (rbuf->shm_name != NULL)
+		rs.rs_namelen = strlen(rbuf->shm_name);
+
+	if ((fwrite(&rs, sizeof(rs), 1, fp) != 1) || ((rs.rs_namelen > 0) && 
+			(fwrite(rbuf->shm_name, rs.rs_namelen, 1, fp) != 1)))
+		goto fail;
+
+	for (i = 0; i < rbuf->nblocks; i++) {
+		memset(&bs, 0x00, sizeof(bs));
+		bs.bs_used = rbuf->blocks[i].used;
+		bs.bs_elems = rbuf->blocks[i].elems;
+		bs.bs_size = rbuf->blocks[i].size;
+		bs.bs_next = R_INDEX(rbuf, rbuf->blocks[i].next);
+		bs.bs_compacted = rbuf->blocks[i].compacted;
+		if (fwrite(&bs, sizeof(bs), 1, fp) != 1)
+			goto fail;
+	}
+
+	if (fflush(fp) != 0)
+		goto fail;
+	return(0);
+
+fail:
+	err_errno("ringbuf_save: Failed to write buffer state");
+	return(-1);
 }
 
 
 /*
- * Remove and return the element that has spent the longest time 
- * in the buffer, or NULL if the buffer is empty.
- * Note that you have to free the returned element using free(3)
- * once you are finished with it.
+ * Take over a shared buffer from the process that wrote its 
+ * state to fp with ringbuf_save(), and passed on the descriptor
+ * of the segment. The packets stay where they are, only the
+ * list of blocks is rebuilt. The descriptor is closed on error.
+ * Returns a ringbuf pointer on success, NULL on error.
  */
-void *
-ringbuf_first(struct ringbuf *rbuf, size_t *elem_size)
+struct ringbuf *
+ringbuf_adopt(FILE *fp)
 {
-	struct r_list *elem;
-		
-	verbose(4, "Removing first element\n");
+	struct ringbuf *rbuf;
+	struct r_state rs;
+	struct r_bstate bs;
+	struct r_block *blk, *prev;
+	struct stat sb;
+	u_char *mapped;
+	size_t i;
 
-    if (rbuf == NULL) {
-		err("ringbuf_first: Got NULL pointer as buffer\n");
+	if ((fread(&rs, sizeof(rs), 1, fp) != 1) || 
+			(rs.rs_magic != R_STATE_MAGIC)) {
+		err("ringbuf_adopt: No buffer state to adopt\n");
+		return(NULL);
+	}
+	if (rs.rs_version != R_STATE_VERSION) {
+		err("ringbuf_adopt: Buffer state is version %u, expected %u\n",
+			rs.rs_version, R_STATE_VERSION);
+		return(NULL);
+	}
+	
+	if ((fstat(rs.rs_fd, &sb) < 0) || ((u_int64_t)sb.st_size != rs.rs_maplen) || 
+			(rs.rs_maplen < sizeof(struct rcap_header)) || (rs.rs_nblocks == 0) || 
+			(rs.rs_namelen >= NAME_MAX)) {
+		err("ringbuf_adopt: Buffer state does not match segment on fd %d\n", 
+			(int)rs.rs_fd);
+		close(rs.rs_fd);
 		return(NULL);
 	}
 
-	/* No elements left */
-	if (ringbuf_elements(rbuf) == 0)
+	if ( (rbuf = calloc(1, sizeof(struct ringbuf))) == NULL) {
+		err_errno("ringbuf_adopt: Failed to allocate ringbuf structure");
+		close(rs.rs_fd);
 		return(NULL);
+	}
+	rbuf->flags = rs.rs_flags | RINGBUF_SHARED;
+	rbuf->shm_fd = rs.rs_fd;
+	rbuf->size_max = rs.rs_size_max;
+	rbuf->stream_min = ringbuf_stream_min(rbuf->flags, rbuf->size_max);
+	rbuf->size_curr = rs.rs_size_curr;
+	rbuf->num_elems = rs.rs_num_elems;
+	rbuf->num_evicted = rs.rs_num_evicted;
+	rbuf->size_evicted = rs.rs_size_evicted;
+	rbuf->blksize = rs.rs_blksize;
+	rbuf->nblocks = rs.rs_nblocks;
+	rbuf->blk_max = rs.rs_blk_max;
+	rbuf->maplen = rs.rs_maplen;
+	rbuf->prefault_usec = rs.rs_prefault_usec;
+	rbuf->map = MAP_FAILED;
+	mapped = NULL;
+
+	if (rs.rs_namelen > 0) {
+		if ( (rbuf->shm_name = calloc(1, rs.rs_namelen + 1)) == NULL) {
+			err_errno("ringbuf_adopt: calloc()");
+			goto fail;
+		}
+		if (fread(rbuf->shm_name, rs.rs_namelen, 1, fp) != 1) {
+			err("ringbuf_adopt: Truncated buffer state\n");
+			goto fail;
+		}
+	}
+	
+	if (((rbuf->blocks = calloc(rbuf->nblocks, sizeof(struct r_block))) == NULL) ||
+			((mapped = calloc(rbuf->nblocks, 1)) == NULL)) {
+		err_errno("ringbuf_adopt: Failed to allocate block list");
+		goto fail;
+	}
 
-	elem = rbuf->first;
-	rbuf->num_elems--;
-	rbuf->size_curr -= elem->size;
+	for (i = 0; i < rbuf->nblocks; i++) {
+		if ((fread(&bs, sizeof(bs), 1, fp) != 1) || (bs.bs_used > rbuf->blksize) ||
+				(bs.bs_next >= (int64_t)rbuf->nblocks)) {
+			err("ringbuf_adopt: Bad or truncated buffer state\n");
+			goto fail;
+		}
+		rbuf->blocks[i].used = bs.bs_used;
+		rbuf->blocks[i].elems = bs.bs_elems;
+		rbuf->blocks[i].size = bs.bs_size;
+		rbuf->blocks[i].compacted = bs.bs_compacted;
+		if (bs.bs_next >= 0)
+			rbuf->blocks[i].next = &rbuf->blocks[bs.bs_next];
+	}
+	
+	if ((rs.rs_first >= (int64_t)rbuf->nblocks) || 
+			(rs.rs_last >= (int64_t)rbuf->nblocks) ||
+			(rs.rs_free >= (int64_t)rbuf->nblocks)) {
+		err("ringbuf_adopt: Bad buffer state\n");
+		goto fail;
+	}
+	rbuf->first = (rs.rs_first >= 0) ? &rbuf->blocks[rs.rs_first] : NULL;
+	rbuf->last = (rs.rs_last >= 0) ? &rbuf->blocks[rs.rs_last] : NULL;
+	rbuf->free = (rs.rs_free >= 0) ? &rbuf->blocks[rs.rs_free] : NULL;
 
+	/* Blocks in use and free ones hold memory, a loop 
+	 * in the lists is caught by a block seen twice */
+	for (prev = NULL, blk = rbuf->first; (blk != NULL) && 
+			!mapped[blk - rbuf->blocks]; prev = blk, blk = blk->next) {
+		mapped[blk - rbuf->blocks] = 1;
+		rbuf->blk_used++;
+	}
+	if ((blk != NULL) || (prev != rbuf->last)) {
+		err("ringbuf_adopt: Block list of buffer state is broken\n");
+		goto fail;
+	}
+	for (blk = rbuf->free; (blk != NULL) && !mapped[blk - rbuf->blocks]; 
+			blk = blk->next) {
+		mapped[blk - rbuf->blocks] = 1;
+		rbuf->blk_free++;
+	}
+	if (blk != NULL) {
+		err("ringbuf_adopt: Free list of buffer state is broken\n");
+		goto fail;
+	}
 
-	/* Last element */
-	if (ringbuf_elements(rbuf) == 0) {
-		rbuf->first = NULL;
-		rbuf->last = NULL;	
+	/* The rest have no memory, lowest address first */
+	for (i = rbuf->nblocks; i > 0; i--) {
+		if (mapped[i-1])
+			continue;
+		rbuf->blocks[i-1].next = rbuf->unmapped;
+		rbuf->unmapped = &rbuf->blocks[i-1];
 	}
-	/* Next last element */	
-	else if (ringbuf_elements(rbuf) == 1) {
-		rbuf->first = rbuf->last;
-		rbuf->first->prev = NULL;
-		rbuf->first->next = NULL;
+
+	if (ringbuf_adopt_map(rbuf, mapped) < 0)
+		goto fail;
+	free(mapped);
+	mapped = NULL;
+
+	/* Found by walking the last block */
+	if (rbuf->last != NULL) {
+		struct r_elem *re;
+		size_t off;
 		
+		for (off = 0; off < rbuf->last->used; off += R_ELEMLEN(re->size)) {
+			re = (struct r_elem *)(rbuf->last->data + off);
+			rbuf->last_elem = R_ELEMDATA(re);
+		}
 	}
-	/* N:th element */
-	else {
-		rbuf->first = elem->next;
-		rbuf->first->prev = NULL;
+
+	/* Not for any process we start */
+	fcntl(rbuf->shm_fd, F_SETFD, FD_CLOEXEC);
+	__atomic_store_n(&rbuf->shm->h_pid, getpid(), __ATOMIC_RELEASE);
+
+	verbose(1, "Adopted buffer of %s bytes with %u packets in %u blocks\n", 
+		str_hsize(rbuf->size_max), (u_int)rbuf->num_elems, 
+		(u_int)rbuf->blk_used);
+	return(rbuf);
+
+fail:
+	if (rbuf->map != MAP_FAILED)
+		munmap(rbuf->map, rbuf->maplen);
+	close(rbuf->shm_fd);
+	free(mapped);
+	free(rbuf->blocks);
+	free(rbuf->shm_name);
+	free(rbuf);
+	return(NULL);
+}
+
+
+/*
+ * Map the segment of an adopted buffer, blocks marked in mapped
+ * are made accessible. Adjacent blocks are mapped together, to
+ * take over a large buffer with few system calls.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+ringbuf_adopt_map(struct ringbuf *rbuf, u_char *mapped)
+{
+	struct rcap_header *h;
+	size_t i, run;
+
+	rbuf->map = mmap(NULL, rbuf->maplen, PROT_READ, MAP_SHARED, rbuf->shm_fd, 0);
+	if (rbuf->map == MAP_FAILED) {
+		err_errno("ringbuf_adopt: Failed to map %s bytes of shared memory", 
+			str_hsize(rbuf->maplen));
+		return(-1);
+	}
+	
+	h = (struct rcap_header *)rbuf->map;
+	if (memcmp(h->h_magic, RCAP_MAGIC, sizeof(h->h_magic)) || 
+			(h->h_version != RCAP_VERSION) || (h->h_blksize != rbuf->blksize) || 
+			(h->h_nblocks != rbuf->nblocks) || 
+			(h->h_table + rbuf->nblocks * sizeof(struct rcap_block) > h->h_arena) ||
+			(h->h_arena + rbuf->nblocks * rbuf->blksize != rbuf->maplen)) {
+		err("ringbuf_adopt: Segment does not match buffer state\n");
+		return(-1);
+	}
+
+	if ((mprotect(rbuf->map, h->h_arena, PROT_READ | PROT_WRITE) < 0) ||
+			(mprotect(rbuf->map + h->h_arena, rbuf->maplen - h->h_arena, 
+			PROT_NONE) < 0)) {
+		err_errno("ringbuf_adopt: mprotect()");
+		return(-1);
+	}
+
+	rbuf->shm = h;
+	rbuf->shm_blocks = (struct rcap_block *)(rbuf->map + h->h_table);
+	rbuf->arena = rbuf->map + h->h_arena;
+	for (i = 0; i < rbuf->nblocks; i++)
+		rbuf->blocks[i].data = rbuf->arena + i * rbuf->blksize;
+	
+	for (i = 0; i < rbuf->nblocks; i += run) {
+		for (run = 1; (i + run < rbuf->nblocks) && 
+			(mapped[i + run] == mapped[i]); run++)
+			;
+		if (!mapped[i])
+			continue;
+
+		if (mprotect(rbuf->blocks[i].data, run * rbuf->blksize, 
+				PROT_READ | PROT_WRITE) < 0) {
+			err_errno("ringbuf_adopt: mprotect()");
+			return(-1);
+		}
+		
+		/* Locks are not kept over exec */
+		if ((rbuf->flags & RINGBUF_LOCK) && 
+				(mlock(rbuf->blocks[i].data, run * rbuf->blksize) < 0)) {
+			err_errno("ringbuf_adopt: mlock()");
+			return(-1);
+		}
 	}
+	return(0);
+}
+
 
-	if (elem_size != NULL) 
-		*elem_size = elem->size;
-	verbose(3, "Removed element of size %s\n", str_hsize(elem->size));
-	return(elem->elem);	
+/*
+ * Peek at latest entry in the list, 
+ * returns NULL if the buffer is empty.
+ */
+const void *
+ringbuf_peek_last(struct ringbuf *rbuf)
+{
+	return(rbuf->last_elem);
 }
 
 
 /*
- * Peek at first entry in the list
+ * Peek at first entry in the list,
+ * returns NULL if the buffer is empty.
  */
 const void *
 ringbuf_peek_first(struct ringbuf *rbuf)
 {
-	return(rbuf->first->elem);
+	if (rbuf->first == NULL)
+		return(NULL);
+	return(R_ELEMDATA(rbuf->first->data));
+}
+
+
+/*
+ * Start walking the buffer at the oldest element
+ */
+void
+ringbuf_cursor_init(struct ringbuf *rbuf, struct ringbuf_cursor *rc)
+{
+	rc->rc_block = rbuf->first;
+	rc->rc_off = 0;
+}
+
+
+/*
+ * Return the element at the cursor and advance it, 
+ * or NULL when the newest element has been passed.
+ * The element stays in the buffer.
+ */
+const void *
+ringbuf_cursor_next(struct ringbuf_cursor *rc, size_t *elem_size)
+{
+	struct r_elem *re;
+
+	/* Skip to next block */
+	while ((rc->rc_block != NULL) && (rc->rc_off >= rc->rc_block->used)) {
+		rc->rc_block = rc->rc_block->next;
+		rc->rc_off = 0;
+	}
+
+	if (rc->rc_block == NULL)
+		return(NULL);
+	
+	re = (struct r_elem *)(rc->rc_block->data + rc->rc_off);
+	rc->rc_off += R_ELEMLEN(re->size);
+	
+	if (elem_size != NULL)
+		*elem_size = re->size;
+	return(R_ELEMDATA(re));
 }
@@ -34,6 +34,47 @@
 #define _RINGBUF_H
 
 #include <sys/types.h>
+#include <stdio.h>
+#include "ringcap.h"
+
+/* Elements are stored in blocks of this size, or smaller 
+ * for small buffers. Memory is allocated and evicted one 
+ * block at a time. */
+#define RINGBUF_BLKSIZE		(1024*1024)
+
+/* Smallest block, must hold the largest element */
+#define RINGBUF_BLKSIZE_MIN	(128*1024)
+
+/* Use smaller blocks until the buffer holds this many */
+#define RINGBUF_MINBLOCKS	16
+
+/* Storage of the buffer, flags to ringbuf_init() */
+#define RINGBUF_THP			0x01	/* Transparent huge pages */
+#define RINGBUF_HUGE2M		0x02	/* Explicit 2M huge pages */
+#define RINGBUF_HUGE1G		0x04	/* Explicit 1G huge pages */
+#define RINGBUF_LOCK		0x08	/* Lock memory, implies prefault */
+#define RINGBUF_PREFAULT	0x10	/* Allocate all memory up front */
+#define RINGBUF_SHARED		0x20	/* Shared memory, set by ringbuf_init_shared() */
+#define RINGBUF_CACHED		0x40	/* Copy all elements through the cache */
+#define RINGBUF_STREAM		0x80	/* Stream elements past it, even if it fits */
+#define RINGBUF_HUGETLB		(RINGBUF_HUGE2M | RINGBUF_HUGE1G)
+
+/* Huge page sizes */
+#define RINGBUF_HUGE_2M		(2*1024*1024)
+#define RINGBUF_HUGE_1G		(1024*1024*1024)
+
+/* Most threads touching memory when prefaulting */
+#define RINGBUF_PREFAULT_THREADS	8
+
+/* Elements from this size are copied into a buffer larger than 
+ * the last level cache with non-temporal stores, which do not evict
+ * what the capture needs from the cache, where the CPU has them.
+ * Smaller ones are rare and go through the cache, unless
+ * they continue a line of a streamed element. */
+#define RINGBUF_STREAM_MIN	64
+
+/* Size of the last level cache if the system does not tell */
+#define RINGBUF_STREAM_CACHE	(32*1024*1024)
 
 /* Get current size of buffer */
 #define ringbuf_currsize(r)	((r)->size_curr)
@@ -44,33 +85,100 @@
 /* Get the number of elements in the buffer */
 #define ringbuf_elements(r)	((r)->num_elems)
 
-/* Get the amount of bytes left in the buffer */
-#define ringbuf_sizeleft(r)	(ringbuf_maxsize(r) - ringbuf_currsize(r))
+/* Get the amount of memory held by the buffer, explicit 
+ * huge pages are held from the start */
+#define ringbuf_memsize(r)	(((r)->flags & RINGBUF_HUGETLB) ? ringbuf_reserved(r) : \
+	(((r)->blk_used + (r)->blk_free) * (r)->blksize))
 
+/* Get the largest size the buffer can be resized to */
+#define ringbuf_reserved(r)	((r)->nblocks * (r)->blksize)
 
+/*
+ * The buffer is a reserved range of address space split into blocks.
+ * Blocks holding elements are kept in insert order, elements are 
+ * appended to the last block. When the buffer is full the first 
+ * block is evicted and reused. Only blocks in use, or free but still
+ * resident, take up memory.
+ */
 struct ringbuf {
 	size_t size_max;	/* Maximum size allowed */
 	size_t size_curr;	/* Current size */
 	size_t num_elems;	/* Number of elements in buffer */
+	size_t num_evicted;	/* Elements removed to make room */
+	size_t size_evicted;	/* Bytes removed to make room */
+
+	int flags;			/* Storage, RINGBUF_* */
+	u_char *map;		/* Mapping holding the arena */
+	size_t maplen;
+	u_char *arena;		/* Reserved address space */
+	size_t blksize;		/* Size of each block */
+	size_t nblocks;		/* Number of blocks in arena */
+	size_t blk_max;		/* Maximum number of resident blocks */
+	size_t blk_used;	/* Blocks holding elements */
+	size_t blk_free;	/* Free blocks still resident */
+	const void *last_elem;	/* Most recently added element */
+	size_t stream_min;	/* Smallest element streamed, 0 if none */
+	int streamed;		/* Streamed elements not yet synced */
+	u_char *stream_end;	/* End of the last streamed element */
+	long prefault_usec;	/* Time spent prefaulting */
+
+	/* Shared memory segment readers attach to, see ringcap.h */
+	char *shm_name;				/* NULL if private or anonymous */
+	int shm_fd;					/* Descriptor of the segment */
+	struct rcap_header *shm;	/* NULL if the buffer is private */
+	struct rcap_block *shm_blocks;
+
+	/* Called with elements lost to eviction */
+	void (*evict_func)(const void *, size_t, void *);
+	void *evict_arg;
 
-	struct r_list {
-		void *elem;
-		size_t size;
-		struct r_list *prev;
-		struct r_list *next;
-	} *first;
+	struct r_block {
+		u_char *data;		/* Start of block in arena */
+		size_t used;		/* Bytes used */
+		size_t elems;		/* Number of elements */
+		size_t size;		/* Size of the elements */
+		int compacted;		/* Elements have been shrunk */
+		struct r_block *next;
+	} *blocks;				/* All blocks of the arena */
 
-	struct r_list *last;
+	struct r_block *first;	/* Oldest block */
+	struct r_block *last;	/* Block being filled */
+	struct r_block *free;	/* Free resident blocks */
+	struct r_block *unmapped;	/* Free blocks without memory */
+};
+
+/*
+ * Position when walking the buffer from oldest to newest
+ * element without removing anything. A cursor is only valid
+ * as long as no elements are removed from the buffer.
+ */
+struct ringbuf_cursor {
+	struct r_block *rc_block;
+	size_t rc_off;
 };
 
 
 /* ringbuf.c */
-extern void *ringbuf_last(struct ringbuf *, size_t *);
+extern struct ringbuf *ringbuf_init(size_t, size_t, int);
+extern struct ringbuf *ringbuf_init_shared(size_t, size_t, int, const char *);
+extern int ringbuf_flags(const char *);
+extern const char *ringbuf_storage(int);
+extern int ringbuf_add(struct ringbuf *, const void *, size_t);
+extern void ringbuf_sync(struct ringbuf *);
 extern int ringbuf_resize(struct ringbuf *, size_t);
-extern void *ringbuf_first(struct ringbuf *, size_t *);
-extern int ringbuf_add(struct ringbuf *, void *, size_t);
-extern struct ringbuf *ringbuf_init(size_t);
+extern void ringbuf_clear(struct ringbuf *);
+extern size_t ringbuf_expire(struct ringbuf *, 
+	int (*)(const void *, void *), void *);
+extern size_t ringbuf_compact(struct ringbuf *, int (*)(const void *, void *),
+	size_t (*)(void *, size_t, void *), void *, u_int64_t, size_t);
+extern void ringbuf_set_evict(struct ringbuf *, 
+	void (*)(const void *, size_t, void *), void *);
+extern void ringbuf_free(struct ringbuf *);
+extern int ringbuf_save(struct ringbuf *, FILE *);
+extern struct ringbuf *ringbuf_adopt(FILE *);
 extern const void *ringbuf_peek_last(struct ringbuf *);
 extern const void *ringbuf_peek_first(struct ringbuf *);
+extern void ringbuf_cursor_init(struct ringbuf *, struct ringbuf_cursor *);
+extern const void *ringbuf_cursor_next(struct ringbuf_cursor *, size_t *);
 
 #endif /* _RINGBUF_H */
@@ -0,0 +1,147 @@
+/*
+ * ringcap.h - Layout of a shared buffer and the reader library
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _RINGCAP_H
+#define _RINGCAP_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * ringcapd -X name places its buffer in the POSIX shared memory 
+ * segment /name, where other processes can read packets while they
+ * are captured. The segment is laid out as
+ *
+ *   offset 0         struct rcap_header
+ *   h_table          struct rcap_block, one per block
+ *   h_arena          h_nblocks blocks of h_blksize bytes
+ *
+ * A block holds packets from its start, each packet is a struct
+ * rcap_elem followed by e_size bytes of data, padded to a multiple
+ * of RCAP_ALIGN. The data is a struct rcap_pkthdr followed by the
+ * captured bytes. Blocks in use are linked from h_first through 
+ * b_next in the order they were filled, packets are appended to 
+ * the last block and whole blocks are evicted from the front.
+ *
+ * The writer never waits for readers. Each block has a generation
+ * count b_gen, which is odd while the block is being evicted, reused
+ * or compacted and is incremented again when done. A reader notes 
+ * the generation when entering a block, and packets read from it 
+ * are intact as long as the generation is unchanged afterwards.
+ * b_used only grows while the generation holds, and is stored after
+ * the packet it covers. b_seq numbers blocks as they start to fill,
+ * it is 0 for blocks not in use. All fields are native byte order, 
+ * readers must run on the same host as ringcapd.
+ *
+ * The version is incremented on any incompatible layout change.
+ */
+#define RCAP_MAGIC		"RINGCAP"
+#define RCAP_VERSION	1
+#define RCAP_ALIGN		8
+
+struct rcap_header {
+	char h_magic[8];		/* RCAP_MAGIC */
+	u_int32_t h_version;	/* RCAP_VERSION */
+	u_int32_t h_hdrlen;		/* Size of this header */
+	u_int64_t h_blksize;	/* Size of each block */
+	u_int64_t h_nblocks;	/* Number of blocks */
+	u_int64_t h_table;		/* Offset of the block table */
+	u_int64_t h_arena;		/* Offset of the first block */
+	u_int32_t h_linktype;	/* Link type of packets, DLT_* */
+	u_int32_t h_snaplen;	/* Largest packet captured */
+	int64_t h_pid;			/* Writer, 0 when it has exited */
+	int64_t h_first;		/* Index of oldest block, -1 if empty */
+	int64_t h_last;			/* Index of block being filled, -1 if empty */
+	u_int64_t h_first_seq;	/* Sequence number of oldest block */
+	u_int64_t h_seq;		/* Sequence number of last block */
+	u_int64_t h_elems;		/* Packets in the buffer */
+	u_int64_t h_evicted;	/* Packets evicted so far */
+};
+
+struct rcap_block {
+	u_int64_t b_gen;		/* Odd while the block is changed */
+	u_int64_t b_seq;		/* Fill order of the block, 0 if unused */
+	u_int64_t b_used;		/* Bytes of packets in the block */
+	int64_t b_next;			/* Index of the next block, -1 if last */
+};
+
+struct rcap_elem {
+	u_int32_t e_size;		/* Size of data after this header */
+	u_int32_t e_pad;
+};
+#define RCAP_ELEMLEN(size)	(sizeof(struct rcap_elem) + \
+	(((size) + RCAP_ALIGN-1) & ~(RCAP_ALIGN-1)))
+
+/* Same layout as struct pcap_pkthdr */
+struct rcap_pkthdr {
+	struct timeval ts;
+	u_int32_t caplen;
+	u_int32_t len;
+};
+
+/* An open shared buffer */
+struct rcap {
+	int r_fd;
+	u_char *r_map;
+	size_t r_maplen;
+	const struct rcap_header *r_hdr;
+	const struct rcap_block *r_blocks;
+	const u_char *r_arena;
+};
+
+/*
+ * Position of a reader. Start with rcap_first(), rcap_tail()
+ * or rcap_seek(), packets are then returned by rcap_next().
+ */
+struct rcap_cursor {
+	int64_t c_block;		/* Block of the cursor, -1 before the first */
+	u_int64_t c_gen;		/* Generation of the block when entered */
+	u_int64_t c_seq;		/* Sequence number of the block */
+	u_int64_t c_off;		/* Offset of the next packet in block */
+	u_int64_t c_skip;		/* Blocks up to this one have been read */
+	u_int64_t c_lost;		/* Times the reader was overrun */
+};
+
+/* libringcap.c */
+extern struct rcap *rcap_open(const char *);
+extern struct rcap *rcap_attach(int);
+extern void rcap_close(struct rcap *);
+extern void rcap_first(struct rcap *, struct rcap_cursor *);
+extern void rcap_tail(struct rcap *, struct rcap_cursor *);
+extern int rcap_seek(struct rcap *, struct rcap_cursor *, const struct timeval *);
+extern int rcap_next(struct rcap *, struct rcap_cursor *, 
+	const struct rcap_pkthdr **, const u_char **);
+extern int rcap_valid(struct rcap *, const struct rcap_cursor *);
+extern int rcap_copy(struct rcap *, struct rcap_cursor *, 
+	struct rcap_pkthdr *, u_char *, size_t);
+
+#endif /* _RINGCAP_H */
@@ -11,6 +11,8 @@
 PIDFILE="/var/run/ringcapd.pid"
 LOGFILE="/var/log/ringcapd.log"
 TARGET="/sbin/ringcapd"
+CTL="/sbin/ringcapctl"
+SOCKFILE="/var/run/ringcapd.sock"
 VERBOSE="-v"
 DUMPDIR="/tmp/"
 BUFSIZE="50M"
@@ -19,7 +21,7 @@ FILTER_STRING=""
 
 
 if [ "$1" = "" ]; then
-	echo "Usage `basename $0` <start | stop  | restart>"
+	echo "Usage `basename $0` <start | stop  | restart | status | dump>"
 	exit 1
 fi
 
@@ -33,7 +35,7 @@ function start_ringcap
 	
 	echo "Starting $TARGET"
 	$TARGET $DUMPDIR $VERBOSE -m $BUFSIZE \
-		-i $INTERFACE -f $LOGFILE -p $PIDFILE $FILTER_STRING
+		-i $INTERFACE -f $LOGFILE -p $PIDFILE -s $SOCKFILE $FILTER_STRING
 
 	if [ $? -ne 0 ]; then
 		echo "** Failed to start daemon, look in $LOGFILE"
@@ -66,4 +68,12 @@ case x"$1" in
 		sleep 1
 		start_ringcap
 		;;
+
+	xstatus)
+		$CTL -s $SOCKFILE status
+		;;
+
+	xdump)
+		$CTL -s $SOCKFILE dump
+		;;
 esac
@@ -0,0 +1,422 @@
+/*
+ * ringcapctl.c - Send requests to the ringcapd control socket
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ringcapd.h"
+#include "ctl.h"
+#include "str.h"
+#include "flow.h"
+#include "ringcap.h"
+
+/* Time to wait for new packets when following a shared buffer */
+#define FOLLOW_USEC		10000
+
+/* Local routines */
+static void usage(const char *);
+static void copy_stream(int, const char *, size_t);
+static int print_flows(const char *);
+static int read_shared(const char *, char **);
+
+
+/*
+ * Copy what has been read so far, and the rest of 
+ * the stream, to standard out.
+ */
+static void
+copy_stream(int fd, const char *data, size_t len)
+{
+	char buf[65536];
+	ssize_t n;
+
+	if ((len > 0) && (fwrite(data, 1, len, stdout) != len))
+		exit(EXIT_FAILURE);
+
+	for (;;) {
+		if ( (n = read(fd, buf, sizeof(buf))) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+
+		if (n == 0)
+			break;
+		
+		if (fwrite(buf, 1, n, stdout) != n)
+			exit(EXIT_FAILURE);
+		fflush(stdout);
+	}
+}
+
+
+/*
+ * Print the records of a flow file, one line each.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+print_flows(const char *path)
+{
+	char src[INET6_ADDRSTRLEN];
+	char dst[INET6_ADDRSTRLEN];
+	char first[64];
+	u_char hdr[8];
+	struct flowrec fr;
+	FILE *f;
+	int af;
+
+	if ( (f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "** Error: Failed to open '%s': %s\n", 
+			path, strerror(errno));
+		return(-1);
+	}
+
+	if ((fread(hdr, sizeof(hdr), 1, f) != 1) || memcmp(hdr, FLOW_MAGIC, 4) ||
+			(ntohl(*(u_int32_t *)&hdr[4]) != FLOW_VERSION)) {
+		fprintf(stderr, "** Error: '%s' is not a flow file\n", path);
+		fclose(f);
+		return(-1);
+	}
+
+	while (fread(&fr, sizeof(fr), 1, f) == 1) {
+		src[0] = dst[0] = '\0';
+		if ((fr.fr_alen == 4) || (fr.fr_alen == 16)) {
+			af = (fr.fr_alen == 4) ? AF_INET : AF_INET6;
+			inet_ntop(af, fr.fr_src, src, sizeof(src));
+			inet_ntop(af, fr.fr_dst, dst, sizeof(dst));
+		}
+
+		/* str_time() returns a static buffer */
+		snprintf(first, sizeof(first), "%s", 
+			str_time(ntohl(fr.fr_first), CTL_DATE));
+		printf("flow first=%s last=%s proto=%u src=%s sport=%u dst=%s dport=%u "
+			"packets=%lu bytes=%.0f tcpflags=0x%02x\n", first, 
+			str_time(ntohl(fr.fr_last), CTL_DATE), fr.fr_proto, 
+			src[0] ? src : "-", ntohs(fr.fr_sport), dst[0] ? dst : "-", 
+			ntohs(fr.fr_dport), (u_long)ntohl(fr.fr_packets), 
+			ntohl(fr.fr_bytes_hi) * 4294967296.0 + ntohl(fr.fr_bytes_lo), 
+			fr.fr_tcpflags);
+	}
+	fclose(f);
+	return(0);
+}
+
+
+/*
+ * Write the packets of a shared buffer as pcap to standard out,
+ * optionally from a time and following new packets.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_shared(const char *name, char **args)
+{
+	static u_char pkt[65536];
+	struct rcap_pkthdr hdr;
+	struct rcap_cursor cur;
+	struct timeval from;
+	struct rcap *rc;
+	u_int32_t rec[4];
+	u_int32_t fh[6];
+	unsigned long ul;
+	int follow = 0;
+	time_t t = 0;
+
+	for (; *args != NULL; args++) {
+		if (!strcmp(*args, "follow"))
+			follow = 1;
+		else if (!strcmp(*args, "from") && (args[1] != NULL)) {
+			args++;
+			if (str_isnum(*args, &ul))
+				t = (time_t)ul;
+			else if ( (t = str_to_time(*args)) == (time_t)-1) {
+				fprintf(stderr, "** Error: Bad time '%s'\n", *args);
+				return(-1);
+			}
+		}
+		else {
+			fprintf(stderr, "** Error: Unknown argument '%s'\n", *args);
+			return(-1);
+		}
+	}
+
+	if ( (rc = rcap_open(name)) == NULL) {
+		fprintf(stderr, "** Error: Failed to open shared buffer '%s': %s\n", 
+			name, strerror(errno));
+		return(-1);
+	}
+
+	/* pcap file header, native byte order */
+	fh[0] = 0xa1b2c3d4;
+	fh[1] = 2 | (4 << 16);
+	fh[2] = 0;
+	fh[3] = 0;
+	fh[4] = rc->r_hdr->h_snaplen;
+	fh[5] = rc->r_hdr->h_linktype;
+	if (fwrite(fh, sizeof(fh), 1, stdout) != 1) {
+		rcap_close(rc);
+		return(-1);
+	}
+
+	if (t != 0) {
+		from.tv_sec = t;
+		from.tv_usec = 0;
+		rcap_seek(rc, &cur, &from);
+	}
+	else
+		rcap_first(rc, &cur);
+
+	for (;;) {
+		if (rcap_copy(rc, &cur, &hdr, pkt, sizeof(pkt)) == 0) {
+			if (!follow || (rc->r_hdr->h_pid == 0))
+				break;
+			fflush(stdout);
+			usleep(FOLLOW_USEC);
+			continue;
+		}
+
+		rec[0] = hdr.ts.tv_sec;
+		rec[1] = hdr.ts.tv_usec;
+		rec[2] = hdr.caplen;
+		rec[3] = hdr.len;
+		if ((fwrite(rec, sizeof(rec), 1, stdout) != 1) || 
+				(fwrite(pkt, 1, hdr.caplen, stdout) != hdr.caplen)) {
+			rcap_close(rc);
+			return(-1);
+		}
+	}
+	fflush(stdout);
+
+	if (cur.c_lost > 0)
+		fprintf(stderr, "Overrun %lu times by ringcapd, packets were lost\n", 
+			(u_long)cur.c_lost);
+	rcap_close(rc);
+	return(0);
+}
+
+
+static void
+usage(const char *pname)
+{
+	printf("\n-=[ Control a running ringcapd ]=-\n");
+	printf("Usage: %s [-s sock] <command> [argument(s)]\n", pname);
+	printf("Options:\n");
+	printf("  -s sock - Control socket, default is %s\n", SOCKFILE);
+	printf("Commands:\n");
+	printf("  dump [keep] [from <time>] [to <time>] [instance <name> | hold <name>]\n");
+	printf("           - Write buffer to dump directory, the buffer is emptied\n");
+	printf("             unless keep or a time range is given. Time is seconds\n");
+	printf("             since the epoch, YYYY-mm-ddTHH:MM:SS or -<seconds>\n");
+	printf("             before the newest packet. An instance is written to\n");
+	printf("             its own dump directory, a hold is never emptied\n");
+	printf("  hold <name> [from <time>] [to <time>] [size <size>] [for <sec>]\n");
+	printf("       [filter <expression>]\n");
+	printf("           - Keep packets of the time range when they are evicted,\n");
+	printf("             until released or for sec seconds. Time may also be\n");
+	printf("             +<seconds> after the newest packet\n");
+	printf("  release <name>\n");
+	printf("           - Release a hold and the packets it kept\n");
+	printf("  status   - Show buffer status\n");
+	printf("  stats    - Show counters\n");
+	printf("  metrics  - Show counters in OpenMetrics text format\n");
+	printf("  latency [reset]\n");
+	printf("           - Show latency percentiles, reset them if asked\n");
+	printf("  resize <size>\n");
+	printf("           - Change maximum size of buffer\n");
+	printf("  filter [<expression> | none]\n");
+	printf("           - Show or change the capture filter, without a restart\n");
+	printf("  promisc on | off\n");
+	printf("           - Change promiscuous mode, without missing packets\n");
+	printf("  upgrade [path]\n");
+	printf("           - Execute a new binary of the daemon, default is the one\n");
+	printf("             it was started from, keeping the buffer and the PID\n");
+	printf("  query <address>\n");
+	printf("           - Show time segments where address might have been seen\n");
+	printf("  tail [expression]\n");
+	printf("           - Write new packets matching expression as pcap to\n");
+	printf("             standard out, e.g. '%s tail port 53 | tcpdump -r -'\n", pname);
+	printf("  flows <file> ...\n");
+	printf("           - Print the records of flow files written with ringcapd -F,\n");
+	printf("             read directly without the daemon\n");
+	printf("  read <name> [from <time>] [follow]\n");
+	printf("           - Write packets of the buffer shared with ringcapd -X name\n");
+	printf("             as pcap to standard out, read directly without the daemon\n");
+	printf("  help     - List commands supported by the daemon\n");
+	printf("\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	char *sockfile = SOCKFILE;
+	char buf[8192];
+	char *req;
+	char *line;
+	char *pt;
+	size_t len;
+	ssize_t n;
+	int stream = 0;
+	int fd, i;
+
+	/* Stop at the command, arguments such as "-300" are not options */
+	while ( (i = getopt(argc, argv, "+s:")) != -1) {
+		switch (i) {
+			case 's': sockfile = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (argv[optind] == NULL)
+		usage(argv[0]);
+
+	/* Flow files are read here */
+	if (!strcmp(argv[optind], "flows")) {
+		if (argv[optind + 1] == NULL)
+			usage(argv[0]);
+		for (i = optind + 1; argv[i] != NULL; i++) {
+			if (print_flows(argv[i]) < 0)
+				exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	/* Shared buffers are read here as well */
+	if (!strcmp(argv[optind], "read")) {
+		if (argv[optind + 1] == NULL)
+			usage(argv[0]);
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "** Error: Refusing to write pcap data to a terminal\n");
+			exit(EXIT_FAILURE);
+		}
+		if (read_shared(argv[optind + 1], &argv[optind + 2]) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	/* Live tail is a subscription with a binary reply */
+	if (!strcmp(argv[optind], "tail")) {
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "** Error: Refusing to write pcap data to a terminal\n");
+			exit(EXIT_FAILURE);
+		}
+		argv[optind] = "subscribe";
+		stream = 1;
+	}
+
+	if ( (req = str_join(" ", &argv[optind])) == NULL)
+		exit(EXIT_FAILURE);
+	
+	if (strlen(req) >= CTL_LINEMAX - 1) {
+		fprintf(stderr, "** Error: Request to long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (strlen(sockfile) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "** Error: Socket path to long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", sockfile);
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "** Error: Failed to connect to '%s': %s\n", 
+			sockfile, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(buf, sizeof(buf), "%s\n", req);
+	if (write(fd, buf, strlen(buf)) != strlen(buf)) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Print data lines, the last line tells how it went */
+	len = 0;
+	for (;;) {
+		if ( (n = read(fd, &buf[len], sizeof(buf) - len - 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		
+		if (n == 0)
+			break;
+		len += n;
+		buf[len] = '\0';
+
+		for (line = buf; (pt = strchr(line, '\n')) != NULL; line = pt + 1) {
+			*pt = '\0';
+			
+			if (!strcmp(line, "OK")) {
+				if (stream)
+					copy_stream(fd, pt + 1, &buf[len] - (pt + 1));
+				exit(EXIT_SUCCESS);
+			}
+			
+			if (!strncmp(line, "ERR ", 4)) {
+				fprintf(stderr, "** Error: %s\n", &line[4]);
+				exit(EXIT_FAILURE);
+			}
+			printf("%s\n", line);
+		}
+		
+		len = strlen(line);
+		memmove(buf, line, len + 1);
+		
+		/* Line longer than buffer */
+		if (len == sizeof(buf) - 1) {
+			printf("%s", buf);
+			len = 0;
+		}
+	}
+
+	fprintf(stderr, "** Error: Connection closed before reply was complete\n");
+	exit(EXIT_FAILURE);
+}
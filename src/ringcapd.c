@@ -37,9 +37,31 @@
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include "ringcapd.h"
 #include "capture.h"
+#include "bloom.h"
+#include "pkt.h"
+#include "ctl.h"
+#include "dump.h"
+#include "tail.h"
+#include "trigger.h"
+#include "metrics.h"
+#include "hist.h"
+#include "sketch.h"
+#include "class.h"
+#include "flow.h"
+#include "event.h"
+#include "inst.h"
+#include "adapt.h"
+#include "hold.h"
+#include "ckpt.h"
+#include "link.h"
+#include "upgrade.h"
 
 
 /* Global options */
@@ -48,56 +70,1856 @@ struct options opt;
 /* Local variables */
 static struct ringbuf *rbuf;
 static struct capture *cap;
+static struct bloomidx *bidx;
+static struct sketch *sketch;
+static struct ctl *ctl;
+static struct tail *tail;
+static struct trigset *trig;
+static struct classes *cls;
+static struct flowtab *flows;
+static struct events *events;
+static struct instances *insts;
+static struct adapt *adapt;
+static struct holds *holds;
+static struct ckpt *ckpt;
+
+/* Capture being switched from, read until the new one takes over */
+static struct capture *cap_prev;
+static struct timeval switch_start;
+static size_t switch_packets;
+
+/* Main buffer filter, run here when the capture also takes 
+ * the packets of the instances */
+static struct bpf_program main_bpf;
+static int main_filtered;
+
+/* Default buffer first, then the buffers of the classes */
+static struct ringbuf *rbufs[CLASS_MAX + 1];
+static int nrbufs;
 
 
 /* Local routines */
 static int isdir(const char *);
 static void usage(const char *);
 static void logpid(const char *);
-static void dumppackets(int);
-static void write_status(int);
+static void write_status(void);
+static void handle_events(struct pollfd *, int);
+static int wait_events(long, struct link *);
 static void unlink_pidfile(void);
+static void exit_handler(int);
+static void fatal_handler(int);
+static int capture_loop(void);
+static int apply_filter(struct capture *, const char *);
+static int switch_capture(int);
+static void switch_done(void);
+static void outage_end(const struct timeval *);
+static void upgrade_run(void);
+static void upgrade_end(const struct timeval *);
+static int ckpt_start(const struct rcap_cursor *);
+static int dump(struct instance *, const struct dumpreq *, struct dumpres *);
+static int dump_hold(struct hold *, const struct dumpreq *, struct dumpres *);
+static int dump_bufs(struct ringbuf **, int, const char *, const char *,
+	const struct dumpreq *, struct dumpres *);
+static void evicted(const void *, size_t, void *);
+static void set_evict(void);
+static void snapshot(time_t);
+static void replay_pkts(u_char *, const struct pcap_pkthdr *, const u_char *);
+static void replay_report(const struct timeval *, const struct rusage *);
+static int ctl_query(struct ctl_req *, int, char **);
+static int ctl_dump(struct ctl_req *, int, char **);
+static int ctl_hold(struct ctl_req *, int, char **);
+static int ctl_release(struct ctl_req *, int, char **);
+static int ctl_filter(struct ctl_req *, int, char **);
+static int ctl_promisc(struct ctl_req *, int, char **);
+static int ctl_upgrade(struct ctl_req *, int, char **);
+static int ctl_status(struct ctl_req *, int, char **);
+static int ctl_stats(struct ctl_req *, int, char **);
+static int ctl_resize(struct ctl_req *, int, char **);
+static int ctl_subscribe(struct ctl_req *, int, char **);
+static int ctl_metrics(struct ctl_req *, int, char **);
+static int ctl_latency(struct ctl_req *, int, char **);
+static void write_metrics(FILE *);
+static size_t rss(void);
+static void status_sketch(struct ctl_req *);
+static void status_class(struct ctl_req *);
+static void status_inst(struct ctl_req *);
+static void status_hold(struct ctl_req *);
+static void status_ckpt(struct ctl_req *);
+static void index_trim(void);
+static void index_rebuild(void);
+static size_t strip_pkt(void *, size_t, void *);
+static void strip(void);
+static void adapt_resize(void);
+
+/* Signals handled by the main loop */
+static const int daemon_signals[] = {SIGUSR1, SIGUSR2, SIGTERM, SIGPIPE, 0};
+static const int debug_signals[] = {SIGUSR1, SIGUSR2, SIGTERM, SIGINT, 0};
+
+/* Control socket commands */
+static const struct ctl_cmd ctl_cmds[] = {
+	{"dump", ctl_dump, "dump [keep] [from <time>] [to <time>] [instance <name> | hold <name>]"},
+	{"status", ctl_status, "status"},
+	{"stats", ctl_stats, "stats"},
+	{"resize", ctl_resize, "resize <size>"},
+	{"query", ctl_query, "query <address>"},
+	{"subscribe", ctl_subscribe, "subscribe [expression]"},
+	{"metrics", ctl_metrics, "metrics"},
+	{"latency", ctl_latency, "latency [reset]"},
+	{"hold", ctl_hold, "hold <name> [from <time>] [to <time>] [size <size>] [for <sec>] [filter <expr>]"},
+	{"release", ctl_release, "release <name>"},
+	{"filter", ctl_filter, "filter [<expression> | none]"},
+	{"promisc", ctl_promisc, "promisc on | off"},
+	{"upgrade", ctl_upgrade, "upgrade [path]"},
+	{NULL, NULL, NULL}
+};
+
+/* Counters reported by stats and metrics. Only the capture loop writes 
+ * them, they are kept on cache lines of their own and read on demand. */
+static struct counters {
+	size_t packets;			/* Packets received from pcap */
+	size_t bytes;			/* Bytes received from pcap */
+	size_t refused;			/* Packets not added to buffer */
+	size_t truncated;		/* Packets cut by the snap length */
+	size_t dumps;			/* Number of dumps written */
+	size_t dump_packets;	/* Packets written to dump files */
+	size_t dump_bytes;		/* Bytes written to dump files */
+	u_int64_t dump_usec;	/* Time spent writing dump files */
+	size_t stripped;		/* Packets cut down to headers */
+	size_t stripped_bytes;	/* Bytes of payload removed */
+} counters CACHE_ALIGNED;
+
+/* Capture outages, from the failure of a capture until it is 
+ * reopened, and the gap in packets it left */
+static struct outage {
+	struct timeval last;	/* Last packet captured */
+	struct timeval down;	/* Capture failed */
+	int pending;			/* Gap not yet known */
+	size_t outages;			/* Times the capture was reopened */
+	long recovery_ms;		/* Time to reopen of the last outage */
+	long gap_ms;			/* Time between packets around it */
+} outage;
+
+/* Upgrades of the binary, the new one is run in the same process
+ * and takes over the buffer */
+static struct {
+	char *self;				/* Binary we were started from */
+	char **argv;			/* Command line, run again */
+	char *path;				/* Binary to run when due, NULL if none */
+	int client;				/* Control client waiting for the result */
+	size_t upgrades;		/* Times upgraded */
+	struct timeval stop;	/* Capture stopped by the last upgrade */
+	long resume_ms;			/* Time until capture resumed */
+	long gap_ms;			/* Time between packets around it */
+	int pending;			/* Gap not yet known */
+} upgraded;
+
+/* Handed over to the new binary on upgrade, together with the buffer */
+struct handover {
+	time_t ho_started;
+	struct counters ho_counters;
+	struct outage ho_outage;
+	size_t ho_upgrades;
+	struct timeval ho_stop;			/* Capture stopped */
+	int ho_client;					/* Control client, -1 if none */
+	int ho_promisc;
+	int ho_filtered;				/* ho_filter replaces the command line */
+	char ho_filter[CTL_LINEMAX];	/* Empty for no filter */
+	int ho_ckpt;					/* Checkpoints written up to ho_cur */
+	struct rcap_cursor ho_cur;
+};
+
+/* Latency histograms */
+static struct hist lat_capture = {"capture"};	/* Packet callback */
+static struct hist lat_insert = {"insert"};		/* Buffer insert */
+static struct hist lat_evict = {"evict"};		/* Buffer insert with eviction */
+static struct hist lat_dump = {"dump"};			/* Writing a dump file */
+static struct hist *lats[] = {&lat_capture, &lat_insert, &lat_evict, &lat_dump, NULL};
+
+/* Time we started */
+static time_t started;
+
+/* Time to write the metrics file */
+static time_t metrics_next;
+
+/*
+ * Drop index and summary segments of packets no longer buffered.
+ * The buffers of classes evict apart from the default buffer, then
+ * segments are kept while they might hold any buffered packet.
+ */
+static void
+index_trim(void)
+{
+	const struct pcap_pkthdr *first, *oldest;
+	int i;
+
+	if (!class_active(cls)) {
+		if (bidx != NULL)
+			bloomidx_trim(bidx, ringbuf_elements(rbuf));
+		if (sketch != NULL)
+			sketch_trim(sketch, ringbuf_elements(rbuf));
+		return;
+	}
+
+	for (oldest = NULL, i = 0; i < nrbufs; i++) {
+		first = ringbuf_peek_first(rbufs[i]);
+		if ((first != NULL) && ((oldest == NULL) || 
+				timercmp(&first->ts, &oldest->ts, <)))
+			oldest = first;
+	}
+
+	if (bidx != NULL)
+		bloomidx_expire(bidx, (oldest != NULL) ? &oldest->ts : NULL);
+	if (sketch != NULL)
+		sketch_expire(sketch, (oldest != NULL) ? &oldest->ts : NULL);
+}
+
+
+/*
+ * Index the packets of a buffer taken over on upgrade, the index
+ * and summaries are not handed over. Done before capture resumes,
+ * so they are in step with the buffer.
+ */
+static void
+index_rebuild(void)
+{
+	const struct pcap_pkthdr *pkthdr;
+	struct ringbuf_cursor rc;
+	struct timeval start, end;
+	struct pktinfo pi, *pip;
+	size_t n;
+
+	gettimeofday(&start, NULL);
+	ringbuf_cursor_init(rbuf, &rc);
+	for (n = 0; (pkthdr = ringbuf_cursor_next(&rc, NULL)) != NULL; n++) {
+		pip = NULL;
+		if (pkt_parse(cap->c_datalink, cap->c_offset, (const u_char *)pkthdr + 
+				sizeof(struct pcap_pkthdr), pkthdr->caplen, &pi) == 0)
+			pip = &pi;
+
+		if (pip != NULL)
+			bloomidx_add(bidx, &pkthdr->ts, pi.pi_src, pi.pi_dst, pi.pi_alen);
+		else
+			bloomidx_add(bidx, &pkthdr->ts, NULL, NULL, 0);
+		sketch_add(sketch, &pkthdr->ts, pkthdr->len, pip);
+	}
+	gettimeofday(&end, NULL);
+
+	verbose(0, "Upgrade: Address index rebuilt from %lu packets in %ld ms\n", 
+		(u_long)n, (end.tv_sec - start.tv_sec) * 1000 + 
+		(end.tv_usec - start.tv_usec) / 1000);
+}
+
+
+/*
+ * Cut a buffered packet down to its link, network and transport 
+ * headers. Packets that are not IP, or are held, are left as they are.
+ * Returns the new size of the packet in the buffer.
+ */
+static size_t
+strip_pkt(void *elem, size_t size, void *arg)
+{
+	struct pcap_pkthdr *pkthdr;
+	struct pktinfo pi;
+	size_t newsize;
+
+	pkthdr = (struct pcap_pkthdr *)elem;
+	if (hold_active(holds) && hold_held(holds, elem))
+		return(size);
+	if (pkt_parse(cap->c_datalink, cap->c_offset, (u_char *)elem + 
+			sizeof(struct pcap_pkthdr), pkthdr->caplen, &pi) < 0)
+		return(size);
+
+	newsize = sizeof(struct pcap_pkthdr) + pi.pi_payoff;
+	if (newsize >= size)
+		return(size);
+	
+	pkthdr->caplen = pi.pi_payoff;
+	counters.stripped++;
+	counters.stripped_bytes += size - newsize;
+	return(newsize);
+}
+
+
+/*
+ * Strip the payload of packets older than the strip age, 
+ * measured from the newest packet in the buffer. What one pass 
+ * does not get to is done on the next.
+ */
+static void
+strip(void)
+{
+	const struct pcap_pkthdr *last;
+	static time_t done;
+	time_t limit;
+	size_t n;
+
+	if ( (last = ringbuf_peek_last(rbuf)) == NULL)
+		return;
+
+	/* Once a second of packet time */
+	if (last->ts.tv_sec == done)
+		return;
+	
+	limit = last->ts.tv_sec - opt.strip_age;
+	/* Checkpoints get the packets whole */
+	n = ringbuf_compact(rbuf, pkt_older, strip_pkt, &limit, 
+		(ckpt != NULL) ? ckpt_written(ckpt) : 0, STRIP_MAXBLOCKS);
+	if (n < STRIP_MAXBLOCKS)
+		done = last->ts.tv_sec;
+}
+
+
+/*
+ * Grow or shrink the buffer after the memory pressure of the system
+ */
+static void
+adapt_resize(void)
+{
+	char from[32], to[32];
+	size_t size, old;
+	int removed;
+
+	old = ringbuf_maxsize(rbuf);
+	size = adapt_size(adapt, time(NULL), old, ringbuf_memsize(rbuf),
+		rbuf->blk_used >= rbuf->blk_max);
+	if (size == old)
+		return;
+
+	if ( (removed = ringbuf_resize(rbuf, size)) < 0)
+		return;
+	opt.ringbuf_max = size;
+
+	/* str_hsize() returns a static buffer */
+	snprintf(from, sizeof(from), "%s", str_hsize(old));
+	snprintf(to, sizeof(to), "%s", str_hsize(size));
+	verbose(0, "Buffer %s from %s to %s bytes on %s, %d packets removed\n",
+		(adapt->ad_state == ADAPT_SHRUNK) ? "shrunk" : "grown", from, to,
+		adapt->ad_reason, removed);
+	verbose(1, "Memory psi=%.2f available=%s cgroup_current=%lu "
+		"cgroup_limit=%lu buffer_memory=%lu\n", adapt->ad_psi, 
+		str_hsize(adapt->ad_available), (u_long)adapt->ad_cg_current,
+		(u_long)adapt->ad_cg_limit, (u_long)ringbuf_memsize(rbuf));
+}
+
+
+/*
+ * Capture packets and add them to buffer
+ * Flush buffer to dumpdir when we receive a SIGUSR1
+ */
+static void
+capture_pkts(u_char *arg, 
+	const struct pcap_pkthdr *pkthdr, const u_char *packet)
+{
+	char buf[8192];
+	struct capture *c = (struct capture *)arg;
+	struct pktinfo pi, *pip;
+	struct pktclass *pc;
+	struct ringbuf *rb;
+	u_int64_t start, t;
+	size_t evicted;
+	int ret;
+
+	/* Both handles of a switch see packets around it, 
+	 * each is taken from one of them only */
+	if (timerisset(&c->c_until) && !timercmp(&pkthdr->ts, &c->c_until, <)) {
+		c->c_done = 1;
+		return;
+	}
+	if (timerisset(&c->c_from) && timercmp(&pkthdr->ts, &c->c_from, <))
+		return;
+	if (c == cap_prev)
+		switch_packets++;
+	if (outage.pending)
+		outage_end(&pkthdr->ts);
+	if (upgraded.pending)
+		upgrade_end(&pkthdr->ts);
+	outage.last = pkthdr->ts;
+
+	start = hist_now();
+	counters.packets++;
+	counters.bytes += pkthdr->len;
+	if (pkthdr->caplen < pkthdr->len)
+		counters.truncated++;
+
+	if (pkthdr->len + sizeof(struct pcap_pkthdr) > sizeof(buf)) {
+		warn("Refusing to copy packet, buffer to small!!\n");
+		counters.refused++;
+		hist_add(&lat_capture, start);
+		return;
+	}
+	
+	memcpy(buf, pkthdr, sizeof(struct pcap_pkthdr));
+	memcpy(&buf[sizeof(struct pcap_pkthdr)], packet, pkthdr->len);
+
+	/* Instances filter for themselves, the main buffer takes
+	 * only what its own filter matches */
+	if (inst_active(insts)) {
+		inst_packet(insts, pkthdr, packet, buf, 
+			pkthdr->len + sizeof(struct pcap_pkthdr));
+		inst_expire(insts, pkthdr->ts.tv_sec);
+
+		if (main_filtered && (bpf_filter(main_bpf.bf_insns, 
+				(u_char *)packet, pkthdr->len, pkthdr->caplen) == 0)) {
+			hist_add(&lat_capture, start);
+			return;
+		}
+	}
+
+	/* Buffer of the first matching class, or the default */
+	rb = rbuf;
+	if (class_active(cls) && 
+			((pc = class_match(cls, pkthdr, packet)) != NULL))
+		rb = pc->pc_rbuf;
+
+	/* Inserts that had to evict a block are timed apart */
+	evicted = rb->num_evicted;
+	t = hist_now();
+	ret = ringbuf_add(rb, buf, pkthdr->len + sizeof(struct pcap_pkthdr));
+	hist_add((rb->num_evicted != evicted) ? &lat_evict : &lat_insert, t);
+	
+	if (class_active(cls))
+		class_expire(cls, pkthdr->ts.tv_sec);
+	
+	if (ret < 0) {
+		counters.refused++;
+		hist_add(&lat_capture, start);
+		return;
+	}
+
+	if (tail_active(tail))
+		tail_packet(tail, pkthdr, packet);
+
+	/* Parsed once for the index and the triggers, NULL if not IP */
+	pip = NULL;
+	if (((bidx != NULL) || (sketch != NULL) || trigger_active(trig)) && 
+			(pkt_parse(cap->c_datalink,
+			cap->c_offset, packet, pkthdr->caplen, &pi) == 0))
+		pip = &pi;
+
+	/* Index addresses, non-IP packets are counted to keep the 
+	 * index in step with the buffer */
+	if (bidx != NULL) {
+		if (pip != NULL)
+			bloomidx_add(bidx, &pkthdr->ts, pi.pi_src, pi.pi_dst, pi.pi_alen);
+		else
+			bloomidx_add(bidx, &pkthdr->ts, NULL, NULL, 0);
+	}
+
+	/* Top talkers and distinct hosts */
+	if (sketch != NULL)
+		sketch_add(sketch, &pkthdr->ts, pkthdr->len, pip);
+	index_trim();
+
+	if (trigger_active(trig))
+		trigger_packet(trig, pkthdr, packet, pip);
+	hist_add(&lat_capture, start);
+}
+
+
+/*
+ * Replay a capture file at a multiple of the original speed
+ */
+static void
+replay_pkts(u_char *arg, 
+	const struct pcap_pkthdr *pkthdr, const u_char *packet)
+{
+	static struct timeval first, wall;
+	struct timeval now;
+	struct timespec nap;
+	double due;
+
+	if (counters.packets == 0) {
+		first = pkthdr->ts;
+		gettimeofday(&wall, NULL);
+	}
+	else {
+		
+		/* Microseconds since the first packet, on the replay clock */
+		due = ((pkthdr->ts.tv_sec - first.tv_sec) * 1e6 + 
+			(pkthdr->ts.tv_usec - first.tv_usec)) / opt.replay_speed;
+		gettimeofday(&now, NULL);
+		due -= (now.tv_sec - wall.tv_sec) * 1e6 + (now.tv_usec - wall.tv_usec);
+		
+		if (due > 0) {
+			nap.tv_sec = due / 1e6;
+			nap.tv_nsec = (due - nap.tv_sec * 1e6) * 1000;
+			nanosleep(&nap, NULL);
+		}
+	}
+	capture_pkts(arg, pkthdr, packet);
+}
+
+
+/*
+ * Control socket: List the time segments of the buffer that
+ * might contain packets to or from an address.
+ */
+static int
+ctl_query(struct ctl_req *req, int argc, char **argv)
+{
+	struct bloomseg **segv;
+	struct timeval start, end;
+	u_char addr[16];
+	char first[64];
+	char last[64];
+	size_t i, n;
+	int alen;
+
+	if (argc != 2)
+		return(ctl_error(req, "Usage: query <address>"));
+	
+	if (bidx == NULL)
+		return(ctl_error(req, "Address index is disabled"));
+
+	if (pkt_addr(argv[1], addr, &alen) < 0)
+		return(ctl_error(req, "Bad address '%s'", argv[1]));
+
+	gettimeofday(&start, NULL);
+	index_trim();
+	
+	if ( (segv = calloc(bloomidx_segs(bidx) + 1, sizeof(struct bloomseg *))) == NULL)
+		return(ctl_error(req, "Out of memory"));
+	n = bloomidx_query(bidx, addr, alen, segv, bloomidx_segs(bidx));
+	gettimeofday(&end, NULL);
+
+	for (i = 0; i < n; i++) {
+		snprintf(first, sizeof(first), "%s.%06ld", 
+			str_time(segv[i]->bs_seg.sg_first.tv_sec, CTL_DATE), 
+			(long)segv[i]->bs_seg.sg_first.tv_usec);
+		snprintf(last, sizeof(last), "%s.%06ld", 
+			str_time(segv[i]->bs_seg.sg_last.tv_sec, CTL_DATE), 
+			(long)segv[i]->bs_seg.sg_last.tv_usec);
+		ctl_reply(req, "segment first=%s last=%s packets=%lu\n", 
+			first, last, (u_long)segv[i]->bs_seg.sg_packets);
+	}
+
+	ctl_reply(req, "address=%s matches=%lu segments=%lu usec=%ld\n", 
+		pkt_ntoa(addr, alen), (u_long)n, (u_long)bloomidx_segs(bidx),
+		(long)((end.tv_sec - start.tv_sec) * 1000000 + 
+			(end.tv_usec - start.tv_usec)));
+	free(segv);
+	return(0);
+}
+
+
+/*
+ * Parse a time argument, either seconds since the epoch, 
+ * YYYY-mm-ddTHH:MM:SS in local time, or -<seconds> or +<seconds>
+ * relative to the newest packet in the buffer.
+ * Returns the time, or -1 on error.
+ */
+static time_t
+ctl_timearg(const char *str)
+{
+	const struct pcap_pkthdr *last;
+	unsigned long ul;
+	time_t t;
+
+	if ((str[0] == '-') && str_isnum(&str[1], &ul)) {
+		if ( (last = ringbuf_peek_last(rbuf)) == NULL)
+			return(-1);
+		return(last->ts.tv_sec - (time_t)ul);
+	}
+
+	if ((str[0] == '+') && str_isnum(&str[1], &ul)) {
+		if ( (last = ringbuf_peek_last(rbuf)) == NULL)
+			return(-1);
+		return(last->ts.tv_sec + (time_t)ul);
+	}
+
+	if (str_isnum(str, &ul))
+		return((time_t)ul);
+
+	if ( (t = str_to_time(str)) == (time_t)-1)
+		return(-1);
+	return(t);
+}
+
+
+/*
+ * Control socket: Dump buffer to dumpdir
+ */
+static int
+ctl_dump(struct ctl_req *req, int argc, char **argv)
+{
+	struct instance *in;
+	struct hold *ho;
+	struct dumpreq dreq;
+	struct dumpres dres;
+	char tbuf[64];
+	int i, ret;
+
+	memset(&dreq, 0x00, sizeof(dreq));
+	in = NULL;
+	ho = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "keep"))
+			dreq.dr_keep = 1;
+		else if (!strcmp(argv[i], "from") && (i + 1 < argc)) {
+			if ( (dreq.dr_from = ctl_timearg(argv[++i])) == (time_t)-1)
+				return(ctl_error(req, "Bad time '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "to") && (i + 1 < argc)) {
+			if ( (dreq.dr_to = ctl_timearg(argv[++i])) == (time_t)-1)
+				return(ctl_error(req, "Bad time '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "instance") && (i + 1 < argc)) {
+			if ( (in = inst_find(insts, argv[++i])) == NULL)
+				return(ctl_error(req, "No instance '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "hold") && (i + 1 < argc)) {
+			if ( (ho = hold_find(holds, argv[++i])) == NULL)
+				return(ctl_error(req, "No hold '%s'", argv[i]));
+		}
+		else
+			return(ctl_error(req, "Usage: dump [keep] [from <time>] [to <time>] "
+				"[instance <name> | hold <name>]"));
+	}
+
+	verbose(1, "Control socket: Request to dump %s\n", (in != NULL) ? 
+		in->in_name : ((ho != NULL) ? ho->ho_name : "buffer"));
+	if (ho != NULL)
+		ret = dump_hold(ho, &dreq, &dres);
+	else
+		ret = dump(in, &dreq, &dres);
+	if (ret < 0)
+		return(ctl_error(req, "Dump failed, see log"));
+
+	if (dres.dr_packets > 0) {
+		ctl_reply(req, "file=%s\n", dres.dr_path);
+		snprintf(tbuf, sizeof(tbuf), "%s", str_time(dres.dr_first.tv_sec, CTL_DATE));
+		ctl_reply(req, "first=%s.%06ld\n", tbuf, (long)dres.dr_first.tv_usec);
+		snprintf(tbuf, sizeof(tbuf), "%s", str_time(dres.dr_last.tv_sec, CTL_DATE));
+		ctl_reply(req, "last=%s.%06ld\n", tbuf, (long)dres.dr_last.tv_usec);
+	}
+	ctl_reply(req, "packets=%lu\n", (u_long)dres.dr_packets);
+	ctl_reply(req, "bytes=%lu\n", (u_long)dres.dr_bytes);
+	ctl_reply(req, "usec=%ld\n", dres.dr_usec);
+	return(0);
+}
+
+
+/*
+ * Control socket: Keep packets of a time range, and optionally
+ * of a filter, when they are evicted
+ */
+static int
+ctl_hold(struct ctl_req *req, int argc, char **argv)
+{
+	struct hold *ho;
+	unsigned long ul;
+	time_t from, to, expire;
+	char tfrom[64], tto[64];
+	size_t size;
+	char *filter;
+	int i;
+
+	if (argc < 2)
+		return(ctl_error(req, "Usage: hold <name> [from <time>] [to <time>] "
+			"[size <size>] [for <sec>] [filter <expr>]"));
+
+	from = to = 0;
+	size = 0;
+	expire = HOLD_EXPIRE;
+	filter = NULL;
+
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "from") && (i + 1 < argc)) {
+			if ( (from = ctl_timearg(argv[++i])) == (time_t)-1)
+				return(ctl_error(req, "Bad time '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "to") && (i + 1 < argc)) {
+			if ( (to = ctl_timearg(argv[++i])) == (time_t)-1)
+				return(ctl_error(req, "Bad time '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "size") && (i + 1 < argc)) {
+			if ( (size = str_to_size(argv[++i])) == 0)
+				return(ctl_error(req, "Bad size '%s'", argv[i]));
+		}
+		else if (!strcmp(argv[i], "for") && (i + 1 < argc)) {
+			if (!str_isnum(argv[++i], &ul) || (ul == 0))
+				return(ctl_error(req, "Bad number of seconds '%s'", argv[i]));
+			expire = ul;
+		}
+		else if (!strcmp(argv[i], "filter") && (i + 1 < argc)) {
+			filter = str_join(" ", &argv[i + 1]);
+			break;
+		}
+		else
+			return(ctl_error(req, "Usage: hold <name> [from <time>] [to <time>] "
+				"[size <size>] [for <sec>] [filter <expr>]"));
+	}
+
+	/* Filters are compiled for the link type of the capture */
+	if ((filter != NULL) && (cap == NULL)) {
+		free(filter);
+		return(ctl_error(req, "Capture is down, can not compile filter"));
+	}
+
+	ho = hold_add(holds, argv[1], from, to, size, expire, filter, 
+		(cap != NULL) ? cap->c_pcapd : NULL, (cap != NULL) ? cap->c_net : 0);
+	free(filter);
+	if (ho == NULL)
+		return(ctl_error(req, "Hold failed, see log"));
+	set_evict();
+
+	/* str_time() returns a static buffer */
+	snprintf(tfrom, sizeof(tfrom), "%s", 
+		ho->ho_from ? str_time(ho->ho_from, CTL_DATE) : "the oldest packet");
+	snprintf(tto, sizeof(tto), "%s", 
+		ho->ho_to ? str_time(ho->ho_to, CTL_DATE) : "open end");
+	verbose(0, "Holding '%s' from %s to %s, %s bytes for %s%s%s\n", ho->ho_name,
+		tfrom, tto, str_hsize(ho->ho_size), str_hms(expire), 
+		ho->ho_filter ? ", filter: " : "", ho->ho_filter ? ho->ho_filter : "");
+	ctl_reply(req, "hold=%s\n", ho->ho_name);
+	ctl_reply(req, "max=%lu\n", (u_long)ho->ho_size);
+	ctl_reply(req, "expires=%s\n", str_time(ho->ho_expires, CTL_DATE));
+	ctl_reply(req, "budget_left=%lu\n", (u_long)(holds->hs_budget - holds->hs_used));
+	return(0);
+}
+
+
+/*
+ * Control socket: Release a hold and the packets it saved
+ */
+static int
+ctl_release(struct ctl_req *req, int argc, char **argv)
+{
+	struct hold *ho;
+	size_t n;
+
+	if (argc != 2)
+		return(ctl_error(req, "Usage: release <name>"));
+
+	if ( (ho = hold_find(holds, argv[1])) == NULL)
+		return(ctl_error(req, "No hold '%s'", argv[1]));
+
+	n = ringbuf_elements(ho->ho_rbuf);
+	verbose(0, "Releasing hold '%s', %u saved packets freed\n", 
+		ho->ho_name, (u_int)n);
+	hold_release(holds, ho);
+	set_evict();
+
+	ctl_reply(req, "released=%lu\n", (u_long)n);
+	ctl_reply(req, "budget_left=%lu\n", (u_long)(holds->hs_budget - holds->hs_used));
+	return(0);
+}
+
+
+/*
+ * Resident memory of the process in bytes, 0 if unknown
+ */
+static size_t
+rss(void)
+{
+	unsigned long pages, resident;
+	FILE *f;
+	int n;
+
+	if ( (f = fopen("/proc/self/statm", "r")) == NULL)
+		return(0);
+	n = fscanf(f, "%lu %lu", &pages, &resident);
+	fclose(f);
+	
+	if (n != 2)
+		return(0);
+	return(resident * sysconf(_SC_PAGESIZE));
+}
+
+
+/*
+ * Control socket: Report top talkers and distinct hosts of the buffer
+ */
+static void
+status_sketch(struct ctl_req *req)
+{
+	static const char *names[SKETCH_NTOP] = {"top_src", "top_dst", "top_port"};
+	struct topent tv[STATUS_TOP];
+	struct sketchseg *ss;
+	size_t i, n;
+	int which;
+
+	index_trim();
+	ctl_reply(req, "summary_segments=%lu\n", (u_long)sketch_segs(sketch));
+	ctl_reply(req, "summary_size=%lu\n", (u_long)sketch_memsize(sketch));
+	ctl_reply(req, "hosts_distinct=%.0f\n", sketch_hosts(sketch, NULL));
+
+	for (which = 0; which < SKETCH_NTOP; which++) {
+		n = sketch_top(sketch, which, tv, STATUS_TOP);
+		
+		for (i = 0; i < n; i++) {
+			struct sketchkey *k = &tv[i].te_key;
+			char key[64];
+
+			if (which == SKETCH_PORT)
+				snprintf(key, sizeof(key), "proto=%s port=%u", 
+					(k->sk_key[0] == 6) ? "tcp" : ((k->sk_key[0] == 17) ? 
+					"udp" : "other"), (k->sk_key[1] << 8) | k->sk_key[2]);
+			else
+				snprintf(key, sizeof(key), "addr=%s", pkt_ntoa(k->sk_key, k->sk_len));
+
+			ctl_reply(req, "%s rank=%lu %s bytes=%lu packets=%lu error=%lu\n", 
+				names[which], (u_long)i + 1, key, (u_long)tv[i].te_bytes, 
+				(u_long)tv[i].te_packets, (u_long)tv[i].te_err);
+		}
+	}
+
+	for (ss = sketch_first(sketch); ss != NULL; ss = sketch_next(ss)) {
+		ctl_reply(req, "hosts first=%s packets=%lu bytes=%lu distinct=%.0f\n", 
+			str_time(ss->ss_seg.sg_first.tv_sec, CTL_DATE), (u_long)ss->ss_seg.sg_packets, 
+			(u_long)ss->ss_bytes, sketch_hosts(sketch, ss));
+	}
+}
+
+
+/*
+ * Control socket: Report the buffers of the classes
+ */
+static void
+status_class(struct ctl_req *req)
+{
+	const struct pcap_pkthdr *first, *last;
+	struct pktclass *pc;
+	char tbuf[64];
+	int i;
+
+	for (i = 0; i < cls->cl_n; i++) {
+		pc = &cls->cl_class[i];
+		
+		tbuf[0] = '\0';
+		first = ringbuf_peek_first(pc->pc_rbuf);
+		last = ringbuf_peek_last(pc->pc_rbuf);
+		if ((first != NULL) && (last != NULL))
+			snprintf(tbuf, sizeof(tbuf), "%ld", 
+				(long)(last->ts.tv_sec - first->ts.tv_sec));
+
+		ctl_reply(req, "class name=%s max=%lu age=%lu size=%lu packets=%lu "
+			"memory=%lu backlog_time=%s matched=%lu evicted=%lu expired=%lu "
+			"filter=\"%s\"\n", pc->pc_name, (u_long)pc->pc_size, 
+			(u_long)pc->pc_age, (u_long)ringbuf_currsize(pc->pc_rbuf), 
+			(u_long)ringbuf_elements(pc->pc_rbuf), 
+			(u_long)ringbuf_memsize(pc->pc_rbuf), tbuf[0] ? tbuf : "0",
+			(u_long)pc->pc_packets, (u_long)pc->pc_rbuf->num_evicted,
+			(u_long)pc->pc_expired, pc->pc_filter);
+	}
+}
+
+
+/*
+ * Control socket: Report the buffers of the instances
+ */
+static void
+status_inst(struct ctl_req *req)
+{
+	const struct pcap_pkthdr *first, *last;
+	struct instance *in;
+	char tbuf[64];
+	int i;
+
+	for (i = 0; i < insts->is_n; i++) {
+		in = &insts->is_inst[i];
+		
+		tbuf[0] = '\0';
+		first = ringbuf_peek_first(in->in_rbuf);
+		last = ringbuf_peek_last(in->in_rbuf);
+		if ((first != NULL) && (last != NULL))
+			snprintf(tbuf, sizeof(tbuf), "%ld", 
+				(long)(last->ts.tv_sec - first->ts.tv_sec));
+
+		ctl_reply(req, "instance name=%s max=%lu age=%lu size=%lu packets=%lu "
+			"memory=%lu backlog_time=%s matched=%lu evicted=%lu expired=%lu "
+			"refused=%lu dumpdir=%s filter=\"%s\"\n", in->in_name, 
+			(u_long)in->in_size, (u_long)in->in_age, 
+			(u_long)ringbuf_currsize(in->in_rbuf), 
+			(u_long)ringbuf_elements(in->in_rbuf), 
+			(u_long)ringbuf_memsize(in->in_rbuf), tbuf[0] ? tbuf : "0",
+			(u_long)in->in_packets, (u_long)in->in_rbuf->num_evicted,
+			(u_long)in->in_expired, (u_long)in->in_refused, in->in_dumpdir,
+			in->in_filter ? in->in_filter : "");
+	}
+}
+
+
+/*
+ * Control socket: Report the holds
+ */
+static void
+status_hold(struct ctl_req *req)
+{
+	struct hold *ho;
+	char from[64], to[64];
+	int i;
+
+	ctl_reply(req, "hold_budget=%lu\n", (u_long)holds->hs_budget);
+	ctl_reply(req, "hold_used=%lu\n", (u_long)holds->hs_used);
+	for (i = 0; i < holds->hs_n; i++) {
+		ho = &holds->hs_hold[i];
+		
+		/* str_time() returns a static buffer */
+		snprintf(from, sizeof(from), "%s", 
+			ho->ho_from ? str_time(ho->ho_from, CTL_DATE) : "oldest");
+		snprintf(to, sizeof(to), "%s", 
+			ho->ho_to ? str_time(ho->ho_to, CTL_DATE) : "open");
+		ctl_reply(req, "hold name=%s from=%s to=%s expires=%s max=%lu size=%lu "
+			"packets=%lu memory=%lu kept=%lu lost=%lu filter=\"%s\"\n", 
+			ho->ho_name, from, to, str_time(ho->ho_expires, CTL_DATE), 
+			(u_long)ho->ho_size, (u_long)ringbuf_currsize(ho->ho_rbuf), 
+			(u_long)ringbuf_elements(ho->ho_rbuf), 
+			(u_long)ringbuf_memsize(ho->ho_rbuf), (u_long)ho->ho_kept, 
+			(u_long)ho->ho_rbuf->num_evicted, ho->ho_filter ? ho->ho_filter : "");
+	}
+}
+
+
+/*
+ * Control socket: Report checkpoints
+ */
+static void
+status_ckpt(struct ctl_req *req)
+{
+	char path[sizeof(ckpt->ck_path)];
+	time_t last;
+
+	pthread_mutex_lock(&ckpt->ck_lock);
+	snprintf(path, sizeof(path), "%s", ckpt->ck_path[0] ? ckpt->ck_path : "-");
+	pthread_mutex_unlock(&ckpt->ck_lock);
+
+	ctl_reply(req, "checkpoint_file=%s\n", path);
+	ctl_reply(req, "checkpoint_interval=%d\n", ckpt->ck_sec);
+	if ( (last = __atomic_load_n(&ckpt->ck_last, __ATOMIC_RELAXED)) != 0) {
+		ctl_reply(req, "checkpoint_last=%s\n", str_time(last, CTL_DATE));
+		ctl_reply(req, "checkpoint_usec=%ld\n", 
+			__atomic_load_n(&ckpt->ck_usec, __ATOMIC_RELAXED));
+	}
+	ctl_reply(req, "checkpoint_packets=%lu\n", 
+		(u_long)__atomic_load_n(&ckpt->ck_packets, __ATOMIC_RELAXED));
+	ctl_reply(req, "checkpoint_bytes=%lu\n", 
+		(u_long)__atomic_load_n(&ckpt->ck_bytes, __ATOMIC_RELAXED));
+	ctl_reply(req, "checkpoint_files=%lu\n", 
+		(u_long)__atomic_load_n(&ckpt->ck_files, __ATOMIC_RELAXED));
+	ctl_reply(req, "checkpoint_overruns=%lu\n", 
+		(u_long)__atomic_load_n(&ckpt->ck_overruns, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Control socket: Report buffer status
+ */
+static int
+ctl_status(struct ctl_req *req, int argc, char **argv)
+{
+	const struct pcap_pkthdr *first, *last;
+	char tbuf[64];
+
+	ctl_reply(req, "pid=%d\n", getpid());
+	ctl_reply(req, "started=%s\n", str_time(started, CTL_DATE));
+	ctl_reply(req, "uptime=%ld\n", (long)(time(NULL) - started));
+	ctl_reply(req, "interface=%s\n", 
+		(cap == NULL) ? "down" : (cap->c_dev == NULL ? "any" : cap->c_dev));
+	if (outage.outages > 0) {
+		ctl_reply(req, "outages=%lu\n", (u_long)outage.outages);
+		ctl_reply(req, "outage_last=%s\n", str_time(outage.down.tv_sec, CTL_DATE));
+		ctl_reply(req, "outage_recovery_ms=%ld\n", outage.recovery_ms);
+		if (!outage.pending)
+			ctl_reply(req, "outage_gap_ms=%ld\n", outage.gap_ms);
+	}
+	if (upgraded.upgrades > 0) {
+		ctl_reply(req, "upgrades=%lu\n", (u_long)upgraded.upgrades);
+		ctl_reply(req, "upgrade_last=%s\n", str_time(upgraded.stop.tv_sec, CTL_DATE));
+		ctl_reply(req, "upgrade_resume_ms=%ld\n", upgraded.resume_ms);
+		if (!upgraded.pending)
+			ctl_reply(req, "upgrade_gap_ms=%ld\n", upgraded.gap_ms);
+	}
+	if (upgraded.self != NULL)
+		ctl_reply(req, "binary=%s\n", upgraded.self);
+	ctl_reply(req, "filter=\"%s\"\n", opt.filter ? opt.filter : "");
+	ctl_reply(req, "dumpdir=%s\n", opt.dumpdir);
+	if (flows != NULL)
+		ctl_reply(req, "flow_file=%s\n", flows->ft_path[0] ? flows->ft_path : "-");
+	if (ckpt != NULL)
+		status_ckpt(req);
+	ctl_reply(req, "buffer_max=%lu\n", (u_long)ringbuf_maxsize(rbuf));
+	ctl_reply(req, "buffer_size=%lu\n", (u_long)ringbuf_currsize(rbuf));
+	ctl_reply(req, "buffer_packets=%lu\n", (u_long)ringbuf_elements(rbuf));
+	ctl_reply(req, "buffer_memory=%lu\n", (u_long)ringbuf_memsize(rbuf));
+	ctl_reply(req, "buffer_ceiling=%lu\n", (u_long)ringbuf_reserved(rbuf));
+	ctl_reply(req, "buffer_storage=%s\n", ringbuf_storage(rbuf->flags));
+	ctl_reply(req, "buffer_block=%lu\n", (u_long)rbuf->blksize);
+	ctl_reply(req, "buffer_locked=%d\n", (rbuf->flags & RINGBUF_LOCK) != 0);
+	ctl_reply(req, "buffer_streamed=%d\n", rbuf->stream_min != 0);
+	if (rbuf->shm_name != NULL)
+		ctl_reply(req, "buffer_shared=%s\n", rbuf->shm_name);
+	if (rbuf->flags & RINGBUF_PREFAULT)
+		ctl_reply(req, "buffer_prefault_usec=%ld\n", rbuf->prefault_usec);
+	ctl_reply(req, "rss=%lu\n", (u_long)rss());
+	if (adapt != NULL) {
+		ctl_reply(req, "adapt_floor=%lu\n", (u_long)adapt->ad_floor);
+		ctl_reply(req, "adapt_ceiling=%lu\n", (u_long)adapt->ad_ceil);
+		ctl_reply(req, "adapt_sources=%s\n", adapt_sources(adapt->ad_sources));
+		ctl_reply(req, "adapt_state=%s\n", (adapt->ad_state == ADAPT_GROWN) ? 
+			"grown" : ((adapt->ad_state == ADAPT_SHRUNK) ? "shrunk" : "hold"));
+		ctl_reply(req, "adapt_reason=\"%s\"\n", adapt->ad_reason);
+		ctl_reply(req, "adapt_psi=%.2f\n", adapt->ad_psi);
+		ctl_reply(req, "adapt_available=%lu\n", (u_long)adapt->ad_available);
+		if (adapt->ad_cgroup[0] != '\0') {
+			ctl_reply(req, "adapt_cgroup=%s\n", adapt->ad_cgroup);
+			ctl_reply(req, "adapt_cgroup_current=%lu\n", (u_long)adapt->ad_cg_current);
+			ctl_reply(req, "adapt_cgroup_limit=%lu\n", (u_long)adapt->ad_cg_limit);
+		}
+		ctl_reply(req, "adapt_grows=%lu\n", (u_long)adapt->ad_grows);
+		ctl_reply(req, "adapt_shrinks=%lu\n", (u_long)adapt->ad_shrinks);
+	}
+
+	first = ringbuf_peek_first(rbuf);
+	last = ringbuf_peek_last(rbuf);
+	if ((first != NULL) && (last != NULL)) {
+		snprintf(tbuf, sizeof(tbuf), "%s", str_time(first->ts.tv_sec, CTL_DATE));
+		ctl_reply(req, "backlog_first=%s.%06ld\n", tbuf, (long)first->ts.tv_usec);
+		snprintf(tbuf, sizeof(tbuf), "%s", str_time(last->ts.tv_sec, CTL_DATE));
+		ctl_reply(req, "backlog_last=%s.%06ld\n", tbuf, (long)last->ts.tv_usec);
+		ctl_reply(req, "backlog_time=%ld\n", (long)(last->ts.tv_sec - first->ts.tv_sec));
+	}
+
+	if (class_active(cls))
+		status_class(req);
+	if (inst_active(insts))
+		status_inst(req);
+	if (hold_active(holds))
+		status_hold(req);
+
+	if (bidx != NULL) {
+		index_trim();
+		ctl_reply(req, "index_segments=%lu\n", (u_long)bloomidx_segs(bidx));
+		ctl_reply(req, "index_size=%lu\n", (u_long)bloomidx_memsize(bidx));
+	}
+	
+	if (sketch != NULL)
+		status_sketch(req);
+	return(0);
+}
+
+
+/*
+ * Control socket: Report counters
+ */
+static int
+ctl_stats(struct ctl_req *req, int argc, char **argv)
+{
+	struct pcap_stat ps;
+	struct timeval now;
+	int i;
+
+	ctl_reply(req, "packets=%lu\n", (u_long)counters.packets);
+	ctl_reply(req, "bytes=%lu\n", (u_long)counters.bytes);
+	ctl_reply(req, "refused=%lu\n", (u_long)counters.refused);
+	ctl_reply(req, "truncated=%lu\n", (u_long)counters.truncated);
+	ctl_reply(req, "evicted_packets=%lu\n", (u_long)rbuf->num_evicted);
+	ctl_reply(req, "evicted_bytes=%lu\n", (u_long)rbuf->size_evicted);
+	ctl_reply(req, "dumps=%lu\n", (u_long)counters.dumps);
+	ctl_reply(req, "dump_packets=%lu\n", (u_long)counters.dump_packets);
+	ctl_reply(req, "dump_bytes=%lu\n", (u_long)counters.dump_bytes);
+	ctl_reply(req, "dump_usec=%lu\n", (u_long)counters.dump_usec);
+	ctl_reply(req, "log_dropped=%lu\n", (u_long)print_dropped());
+	if (opt.strip_age > 0) {
+		ctl_reply(req, "stripped_packets=%lu\n", (u_long)counters.stripped);
+		ctl_reply(req, "stripped_bytes=%lu\n", (u_long)counters.stripped_bytes);
+	}
+
+	if ((cap != NULL) && (pcap_stats(cap->c_pcapd, &ps) == 0)) {
+		ctl_reply(req, "pcap_received=%u\n", ps.ps_recv);
+		ctl_reply(req, "pcap_dropped=%u\n", ps.ps_drop);
+		ctl_reply(req, "pcap_ifdropped=%u\n", ps.ps_ifdrop);
+	}
+
+	if (flows != NULL) {
+		ctl_reply(req, "flow_packets=%lu\n", (u_long)flows->ft_packets);
+		ctl_reply(req, "flow_active=%lu\n", (u_long)flow_active(flows));
+		ctl_reply(req, "flow_records=%lu\n", (u_long)flows->ft_records);
+		ctl_reply(req, "flow_errors=%lu\n", (u_long)flows->ft_errors);
+		ctl_reply(req, "flow_lost=%lu\n", (u_long)flows->ft_lost);
+		ctl_reply(req, "flow_files=%lu\n", (u_long)flows->ft_files);
+		ctl_reply(req, "flow_files_removed=%lu\n", (u_long)flows->ft_removed);
+	}
+
+	if (trigger_active(trig)) {
+		ctl_reply(req, "trigger_snapshots=%lu\n", (u_long)trig->tg_snapshots);
+		ctl_reply(req, "trigger_pending=%d\n", trig->tg_event != 0);
+		ctl_reply(req, "trigger_baseline_pps=%.0f\n", trig->tg_avgpkts);
+		ctl_reply(req, "trigger_baseline_bps=%.0f\n", trig->tg_avgbytes);
+	}
+	for (i = 0; i < trig->tg_ntrig; i++) {
+		struct trigger *tr = &trig->tg_trig[i];
+
+		ctl_reply(req, "trigger id=%d fired=%lu last=%s spec=\"%s\"\n", i, 
+			(u_long)tr->tr_fired, 
+			tr->tr_fired ? str_time(tr->tr_last, CTL_DATE) : "-", tr->tr_spec);
+	}
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < TAIL_MAXSUBS; i++) {
+		struct tailsub *ts = &tail->t_subs[i];
+
+		if (ts->ts_fd < 0)
+			continue;
+		ctl_reply(req, "subscriber id=%d since=%s packets=%lu sent=%lu "
+			"dropped=%lu bytes=%lu lag_packets=%lu lag_bytes=%lu lag_usec=%ld "
+			"filter=\"%s\"\n", i, str_time(ts->ts_since, CTL_DATE), 
+			(u_long)ts->ts_queued, (u_long)ts->ts_sent, (u_long)ts->ts_dropped, 
+			(u_long)ts->ts_bytes, (u_long)(ts->ts_queued - ts->ts_sent), 
+			(u_long)ts->ts_len, tail_lag(ts, &now), 
+			ts->ts_filter ? ts->ts_filter : "");
+	}
+	return(0);
+}
+
+
+/*
+ * Write all metrics in OpenMetrics text format
+ */
+static void
+write_metrics(FILE *f)
+{
+	const struct pcap_pkthdr *first, *last;
+	struct pcap_stat ps;
+
+	metric_gauge(f, "start_time_seconds", "Time the daemon was started", started);
+	metric_counter(f, "packets", "Packets received from pcap", counters.packets);
+	metric_counter(f, "bytes", "Bytes received from pcap", counters.bytes);
+	metric_counter(f, "refused", "Packets not added to the buffer", counters.refused);
+	metric_counter(f, "truncated", "Packets cut by the snap length", counters.truncated);
+	metric_counter(f, "evicted_packets", "Packets removed to make room", 
+		rbuf->num_evicted);
+	metric_counter(f, "evicted_bytes", "Bytes removed to make room", 
+		rbuf->size_evicted);
+	metric_counter(f, "outages", "Times the capture failed and was reopened",
+		outage.outages);
+	metric_counter(f, "upgrades", "Times the binary was upgraded without a restart",
+		upgraded.upgrades);
+	
+	if ((cap != NULL) && (pcap_stats(cap->c_pcapd, &ps) == 0)) {
+		metric_counter(f, "pcap_dropped", "Packets dropped by the kernel", 
+			ps.ps_drop);
+		metric_counter(f, "pcap_ifdropped", "Packets dropped by the interface", 
+			ps.ps_ifdrop);
+	}
+	
+	if (opt.strip_age > 0) {
+		metric_counter(f, "stripped_packets", "Packets cut down to headers", 
+			counters.stripped);
+		metric_counter(f, "stripped_bytes", "Bytes of payload removed", 
+			counters.stripped_bytes);
+	}
+	metric_counter(f, "dumps", "Dump files written", counters.dumps);
+	metric_counter(f, "dump_packets", "Packets written to dump files", 
+		counters.dump_packets);
+	metric_counter(f, "dump_bytes", "Bytes written to dump files", 
+		counters.dump_bytes);
+	metric_counter(f, "dump_seconds", "Time spent writing dump files", 
+		counters.dump_usec / 1000000.0);
+
+	metric_gauge(f, "buffer_max_bytes", "Maximum size of the buffer", 
+		ringbuf_maxsize(rbuf));
+	metric_gauge(f, "buffer_bytes", "Size of the packets in the buffer", 
+		ringbuf_currsize(rbuf));
+	metric_gauge(f, "buffer_memory_bytes", "Memory held by the buffer", 
+		ringbuf_memsize(rbuf));
+	metric_gauge(f, "buffer_packets", "Packets in the buffer", 
+		ringbuf_elements(rbuf));
+	if (adapt != NULL) {
+		metric_counter(f, "adapt_grows", "Times the buffer grew on free memory",
+			adapt->ad_grows);
+		metric_counter(f, "adapt_shrinks", "Times the buffer shrunk on memory pressure",
+			adapt->ad_shrinks);
+		metric_gauge(f, "memory_pressure", "Percent of time some task stalled on memory",
+			adapt->ad_psi);
+	}
+
+	/* Retention horizon */
+	first = ringbuf_peek_first(rbuf);
+	last = ringbuf_peek_last(rbuf);
+	metric_gauge(f, "retention_seconds", "Time between the oldest and newest packet", 
+		((first != NULL) && (last != NULL)) ? (last->ts.tv_sec - first->ts.tv_sec) + 
+		(last->ts.tv_usec - first->ts.tv_usec) / 1000000.0 : 0);
+
+	metric_gauge(f, "subscribers", "Connected subscribers", tail->t_nsubs);
+	if (flows != NULL)
+		metric_counter(f, "flow_records", "Flow records written", 
+			flows->ft_records);
+	if (ckpt != NULL) {
+		metric_counter(f, "checkpoint_packets", "Packets written to checkpoints",
+			__atomic_load_n(&ckpt->ck_packets, __ATOMIC_RELAXED));
+		metric_counter(f, "checkpoint_bytes", "Bytes written to checkpoints",
+			__atomic_load_n(&ckpt->ck_bytes, __ATOMIC_RELAXED));
+		metric_counter(f, "checkpoint_overruns", 
+			"Times packets were evicted before a checkpoint",
+			__atomic_load_n(&ckpt->ck_overruns, __ATOMIC_RELAXED));
+	}
+	if (trigger_active(trig))
+		metric_counter(f, "trigger_snapshots", "Snapshots written by triggers", 
+			trig->tg_snapshots);
+	metric_end(f);
+}
+
+
+/*
+ * Control socket: Report metrics in OpenMetrics text format
+ */
+static int
+ctl_metrics(struct ctl_req *req, int argc, char **argv)
+{
+	char *buf;
+	size_t len, off, n;
+	FILE *f;
+
+	if ( (f = open_memstream(&buf, &len)) == NULL)
+		return(ctl_error(req, "Out of memory"));
+	write_metrics(f);
+	fclose(f);
+
+	/* In pieces that fit a reply */
+	for (off = 0; off < len; off += n) {
+		if ( (n = len - off) > 2048)
+			n = 2048;
+		ctl_reply(req, "%.*s", (int)n, &buf[off]);
+	}
+	free(buf);
+	return(0);
+}
+
+
+/*
+ * Control socket: Report latency histograms, and optionally 
+ * reset them after reporting
+ */
+static int
+ctl_latency(struct ctl_req *req, int argc, char **argv)
+{
+	struct hist **h;
+	int reset;
+
+	reset = 0;
+	if ((argc == 2) && !strcmp(argv[1], "reset"))
+		reset = 1;
+	else if (argc != 1)
+		return(ctl_error(req, "Usage: latency [reset]"));
+
+	for (h = lats; *h != NULL; h++) {
+		ctl_reply(req, "latency name=%s count=%lu mean_ns=%.0f p50_ns=%.0f "
+			"p90_ns=%.0f p99_ns=%.0f p999_ns=%.0f max_ns=%.0f\n", (*h)->h_name, 
+			(u_long)(*h)->h_count, 
+			(*h)->h_count ? hist_ns((*h)->h_sum) / (*h)->h_count : 0.0,
+			hist_ns(hist_quantile(*h, 0.50)), hist_ns(hist_quantile(*h, 0.90)), 
+			hist_ns(hist_quantile(*h, 0.99)), hist_ns(hist_quantile(*h, 0.999)), 
+			hist_ns((*h)->h_max));
+		if (reset)
+			hist_reset(*h);
+	}
+	return(0);
+}
+
+
+/*
+ * Control socket: Turn the connection into a pcap stream of
+ * new packets matching the optional filter expression.
+ */
+static int
+ctl_subscribe(struct ctl_req *req, int argc, char **argv)
+{
+	char *filter = NULL;
+	int ret;
+
+	if (cap == NULL)
+		return(ctl_error(req, "No capture device open"));
+	
+	if (argc > 1)
+		filter = str_join(" ", &argv[1]);
+
+	ret = tail_add(tail, req->cr_fd, cap->c_pcapd, filter, cap->c_net);
+	if (filter != NULL)
+		free(filter);
+	
+	if (ret < 0)
+		return(ctl_error(req, "Subscription failed, see log"));
+
+	/* Written directly, ahead of the queued file header */
+	ctl_reply(req, "OK\n");
+	req->cr_fd = -1;
+	return(0);
+}
+
+
+/*
+ * Control socket: Change maximum size of buffer
+ */
+static int
+ctl_resize(struct ctl_req *req, int argc, char **argv)
+{
+	size_t size;
+	int removed;
+
+	if (argc != 2)
+		return(ctl_error(req, "Usage: resize <size>"));
+
+	if ( (size = str_to_size(argv[1])) == 0)
+		return(ctl_error(req, "Bad size '%s'", argv[1]));
+
+	if (size > ringbuf_reserved(rbuf))
+		return(ctl_error(req, "Size exceeds the ceiling of %s bytes, restart with a larger -M",
+			str_hsize(ringbuf_reserved(rbuf))));
+
+	if ( (removed = ringbuf_resize(rbuf, size)) < 0)
+		return(ctl_error(req, "Resize failed, see log"));
+	
+	opt.ringbuf_max = size;
+	verbose(0, "Buffer resized to %s bytes, %d packets removed\n", 
+		str_hsize(size), removed);
+	verbose(0, "Buffer memory in use: %s bytes\n", str_hsize(ringbuf_memsize(rbuf)));
+	
+	ctl_reply(req, "buffer_max=%lu\n", (u_long)ringbuf_maxsize(rbuf));
+	ctl_reply(req, "buffer_size=%lu\n", (u_long)ringbuf_currsize(rbuf));
+	ctl_reply(req, "buffer_memory=%lu\n", (u_long)ringbuf_memsize(rbuf));
+	ctl_reply(req, "rss=%lu\n", (u_long)rss());
+	ctl_reply(req, "removed=%d\n", removed);
+	return(0);
+}
+
+
+/*
+ * Set filter as the filter of the main buffer on capture c. With 
+ * instances the capture takes what any of them wants, and the main
+ * buffer filters its own. Nothing changes if a filter does not compile.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+apply_filter(struct capture *c, const char *filter)
+{
+	struct bpf_program bpf;
+	char *expr;
+	int ret;
+
+	if (!inst_active(insts))
+		return(cap_setfilter(c, (filter != NULL) ? filter : ""));
+
+	memset(&bpf, 0x00, sizeof(bpf));
+	if ((filter != NULL) && 
+			(pcap_compile(c->c_pcapd, &bpf, (char *)filter, 1, c->c_net) < 0)) {
+		err("Filter: %s\n", pcap_geterr(c->c_pcapd));
+		return(-1);
+	}
+
+	expr = inst_filter(insts, filter);
+	ret = cap_setfilter(c, (expr != NULL) ? expr : "");
+	free(expr);
+	if (ret < 0) {
+		if (filter != NULL)
+			pcap_freecode(&bpf);
+		return(-1);
+	}
+
+	if (main_filtered)
+		pcap_freecode(&main_bpf);
+	main_bpf = bpf;
+	main_filtered = (filter != NULL);
+	return(0);
+}
+
+
+/*
+ * Control socket: Show or change the capture filter, 
+ * without reopening the capture
+ */
+static int
+ctl_filter(struct ctl_req *req, int argc, char **argv)
+{
+	struct bpf_program bpf;
+	char *filter;
+
+	if (argc < 2) {
+		ctl_reply(req, "filter=\"%s\"\n", opt.filter ? opt.filter : "");
+		return(0);
+	}
+
+	if (cap == NULL)
+		return(ctl_error(req, "Capture is down, can not change filter"));
+	if (cap_prev != NULL)
+		return(ctl_error(req, "Capture is being switched, try again"));
+	
+	filter = NULL;
+	if ((argc > 2) || strcmp(argv[1], "none")) {
+		if ( (filter = str_join(" ", &argv[1])) == NULL)
+			return(ctl_error(req, "Out of memory"));
+		
+		/* Reported here, the capture is not touched */
+		if (pcap_compile(cap->c_pcapd, &bpf, filter, 1, cap->c_net) < 0) {
+			ctl_error(req, "Bad filter: %s", pcap_geterr(cap->c_pcapd));
+			free(filter);
+			return(-1);
+		}
+		pcap_freecode(&bpf);
+	}
+
+	if (apply_filter(cap, filter) < 0) {
+		free(filter);
+		return(ctl_error(req, "Failed to set filter, see log"));
+	}
+
+	if (filter != NULL)
+		verbose(0, "Filter changed to: %s\n", filter);
+	else
+		verbose(0, "Filter removed\n");
+	free(opt.filter);
+	opt.filter = filter;
+	ctl_reply(req, "filter=\"%s\"\n", opt.filter ? opt.filter : "");
+	return(0);
+}
+
+
+/*
+ * Open a second handle on the interface with the new promiscuous 
+ * mode and switch to it. The old handle is read until it has given
+ * all packets from before the switch, those from after it are taken
+ * from the new handle, so none are lost or seen twice.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+switch_capture(int promisc)
+{
+	char ebuf[PCAP_ERRBUF_SIZE];
+	struct capture *c;
+
+	if ( (c = cap_open(opt.iface, promisc)) == NULL)
+		return(-1);
+
+	if (c->c_datalink != cap->c_datalink) {
+		err("Datalink of %s changed, not switching\n", opt.iface);
+		cap_close(c);
+		return(-1);
+	}
+	
+	if (apply_filter(c, opt.filter) < 0) {
+		cap_close(c);
+		return(-1);
+	}
+	
+	if (pcap_setnonblock(c->c_pcapd, 1, ebuf) < 0) {
+		err("pcap_setnonblock: %s\n", ebuf);
+		cap_close(c);
+		return(-1);
+	}
+
+	gettimeofday(&switch_start, NULL);
+	c->c_from = switch_start;
+	cap->c_until = switch_start;
+	switch_packets = 0;
+	cap_prev = cap;
+	cap = c;
+	return(0);
+}
+
+
+/*
+ * The old handle of a switch has given all it has, close it
+ */
+static void
+switch_done(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	verbose(0, "Capture switched, %lu packets from the old handle in %ld ms\n",
+		(u_long)switch_packets, (long)((now.tv_sec - switch_start.tv_sec) * 1000 + 
+		(now.tv_usec - switch_start.tv_usec) / 1000));
+	cap_close(cap_prev);
+	cap_prev = NULL;
+}
+
+
+/*
+ * Control socket: Change promiscuous mode while capturing
+ */
+static int
+ctl_promisc(struct ctl_req *req, int argc, char **argv)
+{
+	int promisc;
+
+	if ((argc != 2) || (strcmp(argv[1], "on") && strcmp(argv[1], "off")))
+		return(ctl_error(req, "Usage: promisc on | off"));
+	promisc = !strcmp(argv[1], "on");
+
+	if (cap == NULL)
+		return(ctl_error(req, "Capture is down, can not switch"));
+	if (pcap_file(cap->c_pcapd) != NULL)
+		return(ctl_error(req, "Reading a capture file, nothing to switch"));
+	if (cap_prev != NULL)
+		return(ctl_error(req, "Capture is being switched, try again"));
+
+	if (promisc != opt.promisc) {
+		if (switch_capture(promisc) < 0)
+			return(ctl_error(req, "Switch failed, see log"));
+		opt.promisc = promisc;
+	}
+	ctl_reply(req, "promisc=%d\n", opt.promisc);
+	return(0);
+}
+
+
+/*
+ * Control socket: Replace the running binary with the one at path,
+ * or the one we were started from. The new binary takes over the 
+ * buffer, and answers the request once it captures.
+ */
+static int
+ctl_upgrade(struct ctl_req *req, int argc, char **argv)
+{
+	const char *path;
+
+	if (argc > 2)
+		return(ctl_error(req, "Usage: upgrade [path]"));
+	if ( (path = (argc == 2) ? argv[1] : upgraded.self) == NULL)
+		return(ctl_error(req, "Path of the running binary is unknown, give one"));
+	if (*path != '/')
+		return(ctl_error(req, "Path must be absolute"));
+	if (access(path, X_OK) < 0)
+		return(ctl_error(req, "Can not execute '%s': %s", path, strerror(errno)));
+
+	if (opt.replay)
+		return(ctl_error(req, "Replaying a capture file, nothing to upgrade"));
+	if (rbuf->shm == NULL)
+		return(ctl_error(req, "Buffer is not in shared memory, it can not be handed over"));
+	if (cap == NULL)
+		return(ctl_error(req, "Capture is down, try again when it is back"));
+	if (cap_prev != NULL)
+		return(ctl_error(req, "Capture is being switched, try again"));
+	if (hold_active(holds))
+		return(ctl_error(req, "Packets are held, release them first"));
+	if (upgraded.path != NULL)
+		return(ctl_error(req, "Upgrade in progress"));
+
+	if ( (upgraded.path = strdup(path)) == NULL)
+		return(ctl_error(req, "Out of memory"));
+	
+	/* Answered when done */
+	upgraded.client = req->cr_fd;
+	req->cr_fd = -1;
+	return(0);
+}
+
+
+/*
+ * Capture packets and serve the control socket until the capture fails.
+ * Returns 0 at the end of a capture file, -1 on error.
+ */
+static int
+capture_loop(void)
+{
+	struct pollfd pfd[EVENT_MAXFDS + CTL_MAXCLIENTS + TAIL_MAXSUBS + 2];
+	char ebuf[PCAP_ERRBUF_SIZE];
+	int offline;
+	int n;
+
+	offline = (pcap_file(cap->c_pcapd) != NULL);
+	
+	if (!offline && (pcap_setnonblock(cap->c_pcapd, 1, ebuf) < 0)) {
+		err("pcap_setnonblock: %s\n", ebuf);
+		return(-1);
+	}
+
+	for (;;) {
+		struct capture *c;
+		int nev, nctl, ntail;
+		
+		/* A handle switched from is read first, to keep 
+		 * packets in time order */
+		c = (cap_prev != NULL) ? cap_prev : cap;
+		pfd[0].fd = pcap_get_selectable_fd(c->c_pcapd);
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		nev = event_setpoll(events, &pfd[1]);
+		nctl = (ctl != NULL) ? ctl_setpoll(ctl, &pfd[1 + nev]) : 0;
+		ntail = tail_setpoll(tail, &pfd[1 + nev + nctl]);
+		
+		/* A capture file is always readable */
+		if (offline)
+			poll(&pfd[1], nev + nctl + ntail, 0);
+		else if (poll(pfd, nev + nctl + ntail + 1, CAP_TIMEOUT) < 0) {
+			if (errno == EINTR)
+				continue;
+			err_errno("poll()");
+			return(-1);
+		}
+
+		/* Always dispatch, the read timeout of some platforms 
+		 * is not seen by poll(2) */
+		n = pcap_dispatch(c->c_pcapd, offline ? CAP_FILE_BATCH : -1, 
+			(opt.replay_speed > 0) ? replay_pkts : capture_pkts, (u_char *)c);
+		
+		/* Readers see the batch, and nothing below waits on half of it */
+		ringbuf_sync(rbuf);
+		if (c == cap_prev) {
+			struct timeval now;
+
+			/* Anything before the switch is queued by the time a later 
+			 * packet is seen, or at most a read timeout after it */
+			gettimeofday(&now, NULL);
+			if ((n < 0) || c->c_done || ((now.tv_sec - switch_start.tv_sec) * 1000 +
+					(now.tv_usec - switch_start.tv_usec) / 1000 > 2 * CAP_TIMEOUT))
+				switch_done();
+			n = 1;
+		}
+		else if (n < 0)
+			return(-1);
+		
+		/* Write a pending snapshot before the file is reopened */
+		if (trigger_active(trig))
+			snapshot((offline && (n == 0)) ? 0 : time(NULL));
+
+		/* Make room by keeping headers only of old packets */
+		if (opt.strip_age > 0)
+			strip();
+
+		/* Export metrics for the collector */
+		if ((opt.metricsfile != NULL) && (time(NULL) >= metrics_next)) {
+			metrics_file(opt.metricsfile, write_metrics);
+			metrics_next = time(NULL) + METRICS_SEC;
+		}
+
+		/* Follow the memory pressure of the system */
+		if ((adapt != NULL) && adapt_due(adapt, time(NULL)))
+			adapt_resize();
+
+		/* Write flows of packets evicted by the batch */
+		if (flows != NULL)
+			flow_write(flows);
+
+		/* Report what the checkpoint thread did */
+		if (ckpt != NULL)
+			ckpt_check(ckpt);
+
+		/* Release holds that are due */
+		if (hold_active(holds) && (hold_expire(holds, time(NULL)) > 0))
+			set_evict();
+
+		/* Signals and the status timer, between packets */
+		handle_events(&pfd[1], nev);
+
+		if (offline && (n == 0))
+			return(0);
+		
+		if (ntail > 0)
+			tail_handle(tail, &pfd[1 + nev + nctl], ntail);
+		if (nctl > 0)
+			ctl_handle(ctl, &pfd[1 + nev], nctl);
+		
+		/* Between packets, with nothing half done */
+		if (upgraded.path != NULL)
+			upgrade_run();
+	}
+}
+
 
 /*
- * Capture packets and add them to buffer
- * Flush buffer to dumpdir when we receive a SIGUSR1
+ * Act on pending signals and the status timer. This is called from
+ * the main loop only, never while a packet is being added.
  */
 static void
-capture_pkts(u_char *arg, 
-	const struct pcap_pkthdr *pkthdr, const u_char *packet)
+handle_events(struct pollfd *pfd, int n)
 {
-	char buf[8192];
+	struct dumpreq dreq;
+	struct dumpres dres;
+	int sig, i;
 
-	if (pkthdr->len + sizeof(struct pcap_pkthdr) > sizeof(buf)) {
-		warn("Refusing to copy packet, buffer to small!!\n");
+	while ( (sig = event_signal(events, pfd, n)) != 0) {
+		switch (sig) {
+			case SIGUSR1:
+				verbose(1, "Caught signal %u (SIGUSR1) - Request to dump buffer\n", sig);
+				memset(&dreq, 0x00, sizeof(dreq));
+				dump(NULL, &dreq, &dres);
+				for (i = 0; i < insts->is_n; i++)
+					dump(&insts->is_inst[i], &dreq, &dres);
+				break;
+			
+			case SIGUSR2:
+				write_status();
+				break;
+			
+			default:
+				exit_handler(sig);
+		}
+	}
+
+	if (event_expired(events, pfd, n))
+		write_status();
+}
+
+
+/*
+ * Serve signals and the control socket for msec milliseconds,
+ * while there is no capture. Returns early with 1 if the link
+ * watched by lk came up, 0 otherwise.
+ */
+static int
+wait_events(long msec, struct link *lk)
+{
+	struct pollfd pfd[EVENT_MAXFDS + CTL_MAXCLIENTS + 2];
+	struct timeval end, now;
+	int nev, nctl, nlk;
+	long left;
+
+	gettimeofday(&end, NULL);
+	end.tv_sec += msec / 1000;
+	end.tv_usec += (msec % 1000) * 1000;
+	if (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
+
+	for (;;) {
+		gettimeofday(&now, NULL);
+		left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_usec - now.tv_usec) / 1000;
+		if (left <= 0)
+			return(0);
+
+		nev = event_setpoll(events, pfd);
+		nctl = (ctl != NULL) ? ctl_setpoll(ctl, &pfd[nev]) : 0;
+		nlk = link_setpoll(lk, &pfd[nev + nctl]);
+		if (poll(pfd, nev + nctl + nlk, left) < 0) {
+			if (errno == EINTR)
+				continue;
+			err_errno("poll()");
+			usleep(left * 1000);
+			return(0);
+		}
+
+		handle_events(pfd, nev);
+		if (nctl > 0)
+			ctl_handle(ctl, &pfd[nev], nctl);
+		if (link_read(lk, &pfd[nev + nctl], nlk))
+			return(1);
+	}
+}
+
+
+/*
+ * The first packet after an outage, report the gap it left
+ */
+static void
+outage_end(const struct timeval *ts)
+{
+	outage.pending = 0;
+	if (!timerisset(&outage.last))
 		return;
+	outage.gap_ms = (ts->tv_sec - outage.last.tv_sec) * 1000 + 
+		(ts->tv_usec - outage.last.tv_usec) / 1000;
+	verbose(0, "First packet after the outage, %ld ms after the last one before it\n",
+		outage.gap_ms);
+}
+
+
+/*
+ * Run the new binary asked for with ctl_upgrade(). Capture stops 
+ * here, the kernel drops what arrives until the new process has
+ * opened the interface. Checkpoints are left to the new process 
+ * where they stopped, flow records are written first. Returns only
+ * if the new binary could not be started, capture then goes on.
+ */
+static void
+upgrade_run(void)
+{
+	struct handover ho;
+	struct ctl_req req;
+	char *path;
+
+	path = upgraded.path;
+	memset(&ho, 0x00, sizeof(ho));
+	gettimeofday(&ho.ho_stop, NULL);
+	
+	verbose(0, "Upgrading to %s, handing over %lu packets\n", path, 
+		(u_long)ringbuf_elements(rbuf));
+	if (class_active(cls) || inst_active(insts))
+		warn("Upgrade: Buffers of classes and instances are not handed over\n");
+
+	if (ckpt != NULL) {
+		ckpt_detach(ckpt, &ho.ho_cur);
+		ckpt = NULL;
+		ho.ho_ckpt = 1;
+	}
+	if (flows != NULL)
+		flow_flush(flows);
+
+	ho.ho_started = started;
+	ho.ho_counters = counters;
+	ho.ho_outage = outage;
+	ho.ho_upgrades = upgraded.upgrades + 1;
+	ho.ho_client = upgraded.client;
+	ho.ho_promisc = opt.promisc;
+	if ((opt.filter == NULL) || (strlen(opt.filter) < sizeof(ho.ho_filter))) {
+		ho.ho_filtered = 1;
+		if (opt.filter != NULL)
+			snprintf(ho.ho_filter, sizeof(ho.ho_filter), "%s", opt.filter);
 	}
+	print_flush();
+
+	upgrade_exec(path, upgraded.argv, rbuf, &ho, sizeof(ho));
+
+	/* Still here, go on as before */
+	err("Upgrade failed, still running the old binary\n");
+	if (ho.ho_ckpt)
+		ckpt_start(&ho.ho_cur);
 	
-	memcpy(buf, pkthdr, sizeof(struct pcap_pkthdr));
-	memcpy(&buf[sizeof(struct pcap_pkthdr)], packet, pkthdr->len);
-	ringbuf_add(rbuf, buf, pkthdr->len + sizeof(struct pcap_pkthdr));
+	memset(&req, 0x00, sizeof(req));
+	req.cr_fd = upgraded.client;
+	ctl_error(&req, "Upgrade failed, see log");
+	ctl_result(&req, -1);
+	close(upgraded.client);
+	upgraded.client = -1;
+	upgraded.path = NULL;
+	free(path);
 }
 
 
 /*
- * Write status when verbose
+ * Start writing checkpoints, from the oldest packet
+ * or from where they were stopped.
+ * Returns 0 on success, -1 on error.
  */
-static void
-sigalrm_handler(int signo)
+static int
+ckpt_start(const struct rcap_cursor *from)
 {
-	raise(SIGUSR2);
-	alarm(STAT_SEC_INTERVAL);
+	const char *dev;
 
-	/* Set signal handler for status dump */
-	signal(SIGUSR2, write_status);
+	if ( (dev = cap->c_dev) == NULL)
+		dev = "any";
+	else if (strrchr(dev, '/') != NULL)
+		dev = strrchr(dev, '/') + 1;
 	
+	ckpt = ckpt_init(rbuf, opt.ckptdir, dev, opt.ckpt_sec, opt.ckpt_rotate, from);
+	return((ckpt != NULL) ? 0 : -1);
+}
+
+
+/*
+ * The first packet after an upgrade, report the gap it left
+ */
+static void
+upgrade_end(const struct timeval *ts)
+{
+	upgraded.pending = 0;
+	if (!timerisset(&outage.last))
+		return;
+	upgraded.gap_ms = (ts->tv_sec - outage.last.tv_sec) * 1000 + 
+		(ts->tv_usec - outage.last.tv_usec) / 1000;
+	verbose(0, "First packet after the upgrade, %ld ms after the last one before it\n",
+		upgraded.gap_ms);
 }
 
+
 /*
- * Write status when SIGUSR2 is received
+ * Write status when SIGUSR2 is received, 
+ * and every status interval when verbose
  */
 static void
-write_status(int signo)
+write_status(void)
 {
 	struct pcap_pkthdr *first, *last;
 	char buf[8192];
@@ -111,6 +1933,11 @@ write_status(int signo)
 			"backlog_time=%s backlog_packets=%u backlog_size=%s", 
 			str_hms(last->ts.tv_sec - first->ts.tv_sec), 
 			ringbuf_elements(rbuf), str_hsize(ringbuf_currsize(rbuf)));
+		if (bidx != NULL) {
+			snprintf(&buf[strlen(buf)], sizeof(buf) - strlen(buf),
+				" index_segments=%u index_size=%s", (u_int)bloomidx_segs(bidx), 
+				str_hsize(bloomidx_memsize(bidx)));
+		}
 		verbose(0, "Status: %s\n", buf);
 	}
 	else
@@ -119,99 +1946,223 @@ write_status(int signo)
 
 
 /*
- * Dump packets into file when SIGUSR1 is received 
+ * Dump packets from buffer to dumpdir and log the result, 
+ * in is the instance to dump, or NULL for the main buffers.
+ * Returns 0 on success, -1 on error.
  */
-static void
-dumppackets(int signo)
+static int
+dump(struct instance *in, const struct dumpreq *dreq, struct dumpres *dres)
+{
+	char what[128];
+	int drain;
+	int i, ret;
+
+	if (in != NULL) {
+		snprintf(what, sizeof(what), " of instance %s", in->in_name);
+		return(dump_bufs(&in->in_rbuf, 1, in->in_dumpdir, what, dreq, dres));
+	}
+
+	/* Held and unwritten packets are saved before the buffers are emptied */
+	drain = (cap != NULL) && !dreq->dr_keep && (dreq->dr_from == 0) && 
+		(dreq->dr_to == 0) && (dreq->dr_filter == NULL);
+	if (drain) {
+		if (ckpt != NULL)
+			ckpt_pause(ckpt);
+		for (i = 0; hold_active(holds) && (i < nrbufs); i++)
+			hold_keep(holds, rbufs[i]);
+	}
+	ret = dump_bufs(rbufs, nrbufs, opt.dumpdir, "", dreq, dres);
+	if (drain && (ckpt != NULL))
+		ckpt_resume(ckpt);
+	return(ret);
+}
+
+
+/*
+ * Dump the packets of a hold, those it saved and those still in the
+ * main buffers, to dumpdir. The buffers are kept. 
+ * Returns 0 on success, -1 on error.
+ */
+static int
+dump_hold(struct hold *ho, const struct dumpreq *dreq, struct dumpres *dres)
+{
+	struct ringbuf *bufs[CLASS_MAX + 2];
+	struct dumpreq hreq;
+	char what[128];
+	int i;
+
+	bufs[0] = ho->ho_rbuf;
+	for (i = 0; i < nrbufs; i++)
+		bufs[i + 1] = rbufs[i];
+
+	/* The range of the request within the range of the hold */
+	hreq = *dreq;
+	hreq.dr_keep = 1;
+	if (ho->ho_from > hreq.dr_from)
+		hreq.dr_from = ho->ho_from;
+	if ((ho->ho_to != 0) && ((hreq.dr_to == 0) || (ho->ho_to < hreq.dr_to)))
+		hreq.dr_to = ho->ho_to;
+	if (ho->ho_filter != NULL)
+		hreq.dr_filter = &ho->ho_bpf;
+
+	snprintf(what, sizeof(what), " of hold %s", ho->ho_name);
+	return(dump_bufs(bufs, nrbufs + 1, opt.dumpdir, what, &hreq, dres));
+}
+
+
+/*
+ * Dump packets of n buffers to dir and log the result, 
+ * what names the buffers in the log.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+dump_bufs(struct ringbuf **bufs, int n, const char *dir, const char *what,
+	const struct dumpreq *dreq, struct dumpres *dres)
 {
-	char path[2048];	
-	char path2[2048];
 	char first_pkt_time[128];
 	char last_pkt_time[128];
-	size_t packet_count;
-	size_t buffer_size;
-	pcap_dumper_t *pcd;
-	struct pcap_pkthdr *pkthdr;
-
-	first_pkt_time[0] = '\0';
+	u_int64_t start;
+	size_t elems;
+	int ret, i;
 
-	verbose(1, "Caught signal %u (SIGUSR1) - Request to dump buffer\n", signo);
 	/* No packets to dump */
-	if ( (packet_count = ringbuf_elements(rbuf)) == 0) {
-		verbose(0, "Request to dump empty buffer, ignoring\n");
-		signal(SIGUSR1, dumppackets);
-		return;
+	for (elems = 0, i = 0; i < n; i++)
+		elems += ringbuf_elements(bufs[i]);
+	if (elems == 0) {
+		verbose(0, "Request to dump empty buffer%s, ignoring\n", what);
+		memset(dres, 0x00, sizeof(struct dumpres));
+		return(0);
 	}
-	buffer_size = ringbuf_currsize(rbuf);
-	write_status(0);
-	
-#define DUMPDATE	"%Y%m%d_%H:%M:%S"
-	/* Ignore signal while dumping */
-	signal(SIGUSR1, SIG_IGN);
 
-	/* Temporary file */
-	snprintf(path, sizeof(path), "%s/%s_%s.%d", opt.dumpdir, 
-		cap->c_dev == NULL ? "any" : cap->c_dev,
-		str_time(time(NULL), (char *)NULL), getpid());
+	/* Dump files take the link type of the capture */
+	if (cap == NULL) {
+		warn("Capture is down, not dumping\n");
+		memset(dres, 0x00, sizeof(struct dumpres));
+		return(-1);
+	}
+	write_status();
+
+	start = hist_now();
+	ret = dump_ring(bufs, n, cap, dir, dreq, dres);
+	hist_add(&lat_dump, start);
+	if (ret < 0)
+		return(-1);
 
+	counters.dumps++;
+	counters.dump_packets += dres->dr_packets;
+	counters.dump_bytes += dres->dr_bytes;
+	counters.dump_usec += dres->dr_usec;
 
-	/* Open file */
-	if ( (pcd = pcap_dump_open(cap->c_pcapd, path)) == NULL) {
-		err("Failed to open dump file: %s\n", pcap_geterr(cap->c_pcapd));
-		signal(SIGUSR1, dumppackets);
-		return;
+	if (dres->dr_packets == 0) {
+		verbose(0, "No packets in requested time range, nothing dumped\n");
+		return(0);
 	}
 
-	
-	/* Fetch the logged packets from the buffer and write them to the pcap file */
-	while ( (pkthdr = (struct pcap_pkthdr *)ringbuf_first(rbuf, NULL)) != NULL) {
-		
-		/* Save timestamp of first packet in buffer */	
-		if (first_pkt_time[0] == '\0') {
-			snprintf(first_pkt_time, sizeof(first_pkt_time), 
-				"%s", str_time(pkthdr->ts.tv_sec, DUMPDATE));
-		}
-			
-		pcap_dump((u_char *)pcd, pkthdr, (u_char *)((char *)pkthdr + 
-			sizeof(struct pcap_pkthdr)) );
-#ifdef HAVE_PCAP_DUMP_FLUSH
-		pcap_dump_flush(pcd);
-#endif
-	
-		/* Save timestamp of last packet in buffer */
-		if (ringbuf_elements(rbuf) == 0) {
-			snprintf(last_pkt_time, sizeof(last_pkt_time), "%s", 
-				str_time(pkthdr->ts.tv_sec, DUMPDATE));
-		}
+	/* str_time() returns a static buffer */
+	snprintf(first_pkt_time, sizeof(first_pkt_time), "%s", 
+		str_time(dres->dr_first.tv_sec, NULL));
+	snprintf(last_pkt_time, sizeof(last_pkt_time), "%s", 
+		str_time(dres->dr_last.tv_sec, NULL));
+	verbose(0, "Dumped %s bytes with %u packets from %s to %s%s\n",
+		str_hsize(dres->dr_bytes), (u_int)dres->dr_packets, 
+		first_pkt_time, last_pkt_time, what);
+	return(0);
+}
+
+
+/*
+ * Evict function of the buffers, packets that are held are saved
+ * and the rest are recorded as flows
+ */
+static void
+evicted(const void *elem, size_t size, void *arg)
+{
+	if (hold_active(holds))
+		hold_evicted(elem, size, holds);
+	if (flows != NULL)
+		flow_evicted(elem, size, flows);
+}
+
+
+/*
+ * Only look at evicted packets when there are flows or holds,
+ * each packet of an evicted block is visited otherwise
+ */
+static void
+set_evict(void)
+{
+	int i;
 
-		free(pkthdr);
+	for (i = 0; i < nrbufs; i++) {
+		if ((flows != NULL) || hold_active(holds))
+			ringbuf_set_evict(rbufs[i], evicted, NULL);
+		else
+			ringbuf_set_evict(rbufs[i], NULL, NULL);
 	}
-	pcap_dump_close(pcd);
+}
 
-	/* Real file name, start and end time */
-	snprintf(path2, sizeof(path2), "%s/%s_%s-%s.pcap", opt.dumpdir,
-		cap->c_dev == NULL ? "any" : cap->c_dev,
-		first_pkt_time, last_pkt_time);
-	
-	if (rename(path, path2) < 0) {
-		err_errno("Failed to rename '%s' to '%s'\n", path, path2);
-		signal(SIGUSR1, dumppackets);
+
+/*
+ * Write the window around a trigger event once it is due,
+ * now is 0 to write a pending snapshot immediately
+ */
+static void
+snapshot(time_t now)
+{
+	struct dumpreq dreq;
+	struct dumpres dres;
+
+	memset(&dreq, 0x00, sizeof(dreq));
+	if (!trigger_due(trig, now, &dreq.dr_from, &dreq.dr_to))
 		return;
-	}
-#undef DUMPDATE
+	
+	dreq.dr_keep = 1;
+	verbose(0, "Writing snapshot for trigger '%s'\n", trig->tg_fired->tr_spec);
+	dump(NULL, &dreq, &dres);
+}
 
-	{
-		char *str;
 
-		if ( (str = strchr(first_pkt_time, '_')) != NULL)
-			*str = ' ';
-		if ( (str = strchr(last_pkt_time, '_')) != NULL)
-			*str = ' ';
-		verbose(0, "Dumped %s bytes with %u packets from %s to %s\n",
-			str_hsize(buffer_size), packet_count, first_pkt_time, last_pkt_time);
+/*
+ * Dump the buffer and report throughput of a replay
+ */
+static void
+replay_report(const struct timeval *start, const struct rusage *ru_start)
+{
+	struct dumpreq dreq;
+	struct dumpres dres;
+	struct timeval end;
+	struct rusage ru;
+	double sec, user, sys;
+	
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &ru);
+	
+	sec = (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+	user = (ru.ru_utime.tv_sec - ru_start->ru_utime.tv_sec) + 
+		(ru.ru_utime.tv_usec - ru_start->ru_utime.tv_usec) / 1e6;
+	sys = (ru.ru_stime.tv_sec - ru_start->ru_stime.tv_sec) + 
+		(ru.ru_stime.tv_usec - ru_start->ru_stime.tv_usec) / 1e6;
+	if (sec <= 0)
+		sec = 1e-6;
+
+	/* Drain the buffer to measure dump throughput */
+	memset(&dreq, 0x00, sizeof(dreq));
+	memset(&dres, 0x00, sizeof(dres));
+	dump(NULL, &dreq, &dres);
 
-	}
-	signal(SIGUSR1, dumppackets);
+	/* After the log */
+	print_flush();
+	printf("replay file=%s speed=%g packets=%lu bytes=%lu sec=%.3f pps=%.0f "
+		"gbps=%.3f cpu_user=%.3f cpu_sys=%.3f cpu_ns_per_packet=%.0f "
+		"refused=%lu evicted=%lu dump_packets=%lu dump_bytes=%lu dump_sec=%.3f "
+		"dump_mbytes_per_sec=%.1f\n", opt.iface, opt.replay_speed,
+		(u_long)counters.packets, (u_long)counters.bytes, sec, 
+		counters.packets / sec, counters.bytes * 8 / sec / 1e9, user, sys,
+		counters.packets ? (user + sys) * 1e9 / counters.packets : 0.0,
+		(u_long)counters.refused, (u_long)rbuf->num_evicted, 
+		(u_long)dres.dr_packets, (u_long)dres.dr_bytes, dres.dr_usec / 1e6,
+		dres.dr_usec ? dres.dr_bytes / (dres.dr_usec / 1e6) / (1024*1024) : 0.0);
+	fflush(stdout);
 }
 
 
@@ -233,13 +2184,52 @@ exit_handler(int signo)
 		sig = "SIGILL";
 	else if (signo == SIGPIPE)
 		sig = "SIGPIPE";
+	else if (signo == SIGINT)
+		sig = "SIGINT";
 	
 	verbose(0, "Capture ended (received signal %u [%s])\n", 
 		signo, sig);
-	unlink_pidfile();
+	if (ctl != NULL)
+		ctl_close(ctl);
+	if (flows != NULL)
+		flow_close(flows);
+	if (ckpt != NULL)
+		ckpt_close(ckpt);
+	if ((rbuf != NULL) && (rbuf->shm != NULL))
+		ringbuf_free(rbuf);
+	
+	/* Only a daemon writes a PID file */
+	if (!opt.debug)
+		unlink_pidfile();
 	exit(EXIT_SUCCESS);
 }
 
+
+/*
+ * Handler of fatal signals. Nothing else can be trusted after a crash,
+ * so only what is safe in a signal handler is done: write a message,
+ * remove the PID file and exit. The buffer is left to the kernel.
+ */
+static void
+fatal_handler(int signo)
+{
+	const char *msg;
+
+	if (signo == SIGSEGV)
+		msg = "Capture ended (received signal SIGSEGV)\n";
+	else if (signo == SIGBUS)
+		msg = "Capture ended (received signal SIGBUS)\n";
+	else if (signo == SIGILL)
+		msg = "Capture ended (received signal SIGILL)\n";
+	else
+		msg = "Capture ended (received fatal signal)\n";
+
+	if (write(STDERR_FILENO, msg, strlen(msg)) < 0)
+		;
+	unlink(opt.pidfile);
+	_exit(EXIT_FAILURE);
+}
+
 /*
  * Unlink PID file
  */
@@ -253,7 +2243,7 @@ unlink_pidfile(void)
 
 /*
  * Returns 1 if str is a directory, 0 otherwise
- * and -1 on error.
+ * or if it can not be found.
  */
 static int
 isdir(const char *path)
@@ -262,7 +2252,7 @@ isdir(const char *path)
 
 	if (stat(path, &sb) < 0) {
 		err_errno("Failed to stat '%s'", path);
-		return(-1);
+		return(0);
 	}
 
 	if (!S_ISDIR(sb.st_mode)) {
@@ -303,16 +2293,56 @@ usage(const char *pname)
 {
 	printf("\n-=[ Capture packets into a fixed size ring buffer ]=-\n");
 	printf("Usage: %s <dumpdir> [Option(s)] [expression]\n", pname);
-	printf("Buffer will be written to <dumpdir> when SIGUSR1 is received\n");
+	printf("Buffer will be written to <dumpdir> when SIGUSR1 is received,\n");
+	printf("or on request on the control socket (see ringcapctl)\n");
 	printf("Options:\n");
+	printf("  -A sec     - Keep only the headers of packets older than sec seconds,\n");
+	printf("               to make room for more history in the same buffer\n");
+	printf("  -a floor   - Adapt the buffer size to memory pressure, from max (-m)\n");
+	printf("               down to floor or up to the ceiling (-M)\n");
+	printf("  -B sec     - Seconds per address index and summary segment, default is %u,\n",
+		BLOOM_SEG_SEC);
+	printf("               0 disables\n");
+	printf("  -C class   - Keep packets matching a filter in a buffer of their own, given\n");
+	printf("               as name:size[:age]:<expr>, first match wins, max %u classes\n",
+		CLASS_MAX);
+	printf("  -c file    - Feed instances defined in file from the same capture, each\n");
+	printf("               line is <name> <size> <age> <dumpdir> [expression],\n");
+	printf("               max %u instances\n", INST_MAX);
 	printf("  -d         - Debug, do not become daemon\n");
+	printf("  -D dir     - Write new packets of the buffer to pcap files in dir,\n");
+	printf("               without removing them\n");
+	printf("  -E s[:r]   - Checkpoint every s seconds, default is %u, with a new\n",
+		CKPT_SEC);
+	printf("               file every r seconds, default is %u\n", CKPT_ROTATE);
 	printf("  -f logfile - Logfile, default is %s\n", LOGFILE);
+	printf("  -F dir     - Write flow records of evicted packets to dir\n");
+	printf("  -H opts    - Buffer storage, comma separated thp, 2m or 1g for huge\n");
+	printf("               pages, lock to keep it in RAM, prefault to allocate\n");
+	printf("               all memory at startup, cached or stream to copy\n");
+	printf("               packets through or past the CPU cache\n");
 	printf("  -i iface   - Listen for packets on interface iface\n");
+	printf("  -K hours   - Hours to keep flow records, default is %u\n", FLOW_KEEP);
+	printf("  -k size    - Bytes for packets held past eviction, default is max\n");
 	printf("  -m max     - Maximum size of packet buffer, default is %s bytes\n", 
 		str_hsize(DEFAULT_MAX_SIZE_BYTES));
+	printf("  -M ceil    - Largest size the buffer can be resized to, default is %u times max\n",
+		DEFAULT_CEIL_FACTOR);
+	printf("  -O file    - Write metrics to file every %u seconds\n", METRICS_SEC);
+	printf("  -R speed   - Replay the capture file given with -i once and report\n");
+	printf("               throughput, at speed times the original rate or 0 for\n");
+	printf("               as fast as possible\n");
 	printf("  -p pidfile - PID file, default is %s\n", PIDFILE);
 	printf("  -P         - Do not listen in promiscuous mode\n");
+	printf("  -s sock    - Control socket, default is %s\n", SOCKFILE);
+	printf("  -T trigger - Write a snapshot automatically when trigger fires,\n");
+	printf("               bpf=<expr>, pps=<factor>, bps=<factor> or rst=<count>\n");
 	printf("  -v         - Be verbose, repeat to increase\n");
+	printf("  -W p:a:h   - Snapshot p seconds before and a after the event, and\n");
+	printf("               at most one every h seconds, default is %u:%u:%u\n",
+		TRIG_PRE, TRIG_POST, TRIG_HOLDOFF);
+	printf("  -X name    - Keep the buffer in shared memory /name, where other\n");
+	printf("               programs can read it with libringcap\n");
 	printf("\n");
 	exit(EXIT_FAILURE);
 }
@@ -322,9 +2352,13 @@ usage(const char *pname)
 int
 main(int argc, char *argv[])
 {
+	struct handover ho;
+	unsigned long ul;
+	int adopted;
 	int i;
 
 	memset(&opt, 0x00, sizeof(opt));
+	started = time(NULL);
 	opt.ringbuf_max = DEFAULT_MAX_SIZE_BYTES;
 	opt.argv0 = argv[0];
 	opt.iface = NULL;
@@ -333,8 +2367,27 @@ main(int argc, char *argv[])
 	opt.pidfile = PIDFILE;
 	opt.logfile = LOGFILE;
 	opt.filter = NULL;
+	opt.sockfile = SOCKFILE;
+	opt.index_seglen = BLOOM_SEG_SEC;
+	opt.flow_keep = FLOW_KEEP;
+	opt.ckpt_sec = CKPT_SEC;
+	opt.ckpt_rotate = CKPT_ROTATE;
 	opt.debug = 0;
 
+	/* Run again on upgrade, getopt() may reorder argv */
+	upgraded.client = -1;
+	upgraded.self = upgrade_self(argv[0]);
+	if ( (upgraded.argv = calloc(argc + 1, sizeof(char *))) == NULL)
+		err_errnox("calloc()");
+	memcpy(upgraded.argv, argv, argc * sizeof(char *));
+
+	if ( (trig = trigger_init(TRIG_PRE, TRIG_POST, TRIG_HOLDOFF)) == NULL)
+		exit(EXIT_FAILURE);
+	if ( (cls = class_init()) == NULL)
+		exit(EXIT_FAILURE);
+	if ( (insts = inst_init()) == NULL)
+		exit(EXIT_FAILURE);
+
 	if ((argv[1] == NULL) || (argv[1][0] == '-'))
 		usage(opt.argv0);
 
@@ -345,7 +2398,7 @@ main(int argc, char *argv[])
 	if (!isdir(opt.dumpdir))
 		exit(EXIT_FAILURE);
 
-	while ( (i = getopt(argc, argv, "dvp:m:i:Pf:")) != -1) {
+	while ( (i = getopt(argc, argv, "dvp:m:M:i:Pf:B:s:T:W:O:R:C:F:K:A:H:X:c:a:k:D:E:")) != -1) {
 		switch(i) {
 			case 'v': opt.verbose++; break;
 			case 'P': opt.promisc = 0; break;
@@ -354,18 +2407,154 @@ main(int argc, char *argv[])
 				if ( (opt.ringbuf_max = str_to_size(optarg)) == 0)
 					errx("Failed to convert max buffer size\n");
 				break;
+			case 'M':
+				if ( (opt.ringbuf_ceil = str_to_size(optarg)) == 0)
+					errx("Failed to convert buffer ceiling\n");
+				break;
+			case 'a':
+				if ( (opt.adapt_floor = str_to_size(optarg)) == 0)
+					errx("Failed to convert adaptive floor\n");
+				break;
+			case 'k':
+				if ( (opt.hold_budget = str_to_size(optarg)) == 0)
+					errx("Failed to convert hold budget\n");
+				break;
 			case 'p': opt.pidfile = optarg; break;
 			case 'd': opt.debug = 1; break;
 			case 'i': opt.iface = optarg; break;
+			case 's': opt.sockfile = optarg; break;
+			case 'O': opt.metricsfile = optarg; break;
+			case 'F': opt.flowdir = optarg; break;
+			case 'D': opt.ckptdir = optarg; break;
+			case 'X': opt.shm_name = optarg; break;
+			case 'c': opt.instfile = optarg; break;
+			case 'H':
+				if ( (opt.storage = ringbuf_flags(optarg)) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			case 'A':
+				if (!str_isnum(optarg, &ul))
+					errx("Bad number of seconds to keep payload\n");
+				opt.strip_age = ul;
+				break;
+			case 'K':
+				if (!str_isnum(optarg, &ul) || (ul == 0))
+					errx("Bad number of hours to keep flow records\n");
+				opt.flow_keep = ul;
+				break;
+			case 'R': {
+				char *end;
+				
+				opt.replay = 1;
+				opt.replay_speed = strtod(optarg, &end);
+				if ((*optarg == '\0') || (*end != '\0') || (opt.replay_speed < 0))
+					errx("Bad replay speed '%s'\n", optarg);
+				break;
+			}
+			case 'B': 
+				if (!str_isnum(optarg, &ul))
+					errx("Bad number of seconds per index segment\n");
+				opt.index_seglen = ul;
+				break;
+			case 'T':
+				if (trigger_add(trig, optarg) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			case 'C':
+				if (class_add(cls, optarg) < 0)
+					exit(EXIT_FAILURE);
+				break;
+			case 'E': {
+				unsigned long sec, rotate;
+				
+				sec = opt.ckpt_sec;
+				rotate = opt.ckpt_rotate;
+				if ((sscanf(optarg, "%lu:%lu", &sec, &rotate) < 1) || 
+						(sec == 0) || (rotate == 0))
+					errx("Bad checkpoint interval '%s'\n", optarg);
+				opt.ckpt_sec = sec;
+				opt.ckpt_rotate = rotate;
+				break;
+			}
+			case 'W': {
+				unsigned long pre, post, hold;
+				
+				pre = trig->tg_pre;
+				post = trig->tg_post;
+				hold = trig->tg_holdoff;
+				if (sscanf(optarg, "%lu:%lu:%lu", &pre, &post, &hold) < 1)
+					errx("Bad snapshot window '%s'\n", optarg);
+				trig->tg_pre = pre;
+				trig->tg_post = post;
+				trig->tg_holdoff = hold;
+				break;
+			}
 			default: usage(opt.argv0);
 		}
 	}
+	print_level = opt.verbose;
+
+	if ((opt.flowdir != NULL) && !isdir(opt.flowdir))
+		exit(EXIT_FAILURE);
+	if ((opt.ckptdir != NULL) && !isdir(opt.ckptdir))
+		exit(EXIT_FAILURE);
+
+	/* Instances are read before the daemon changes directory */
+	if (opt.instfile != NULL) {
+		if (inst_load(insts, opt.instfile) < 0)
+			exit(EXIT_FAILURE);
+		for (i = 0; i < insts->is_n; i++) {
+			if (!isdir(insts->is_inst[i].in_dumpdir))
+				exit(EXIT_FAILURE);
+		}
+	}
 
-	/* Become daemon and reopen logfile as standard out */
+	if (opt.ringbuf_ceil == 0)
+		opt.ringbuf_ceil = opt.ringbuf_max * DEFAULT_CEIL_FACTOR;
+	if (opt.ringbuf_ceil < opt.ringbuf_max)
+		errx("Buffer ceiling is smaller than the buffer size\n");
+	if (opt.adapt_floor > opt.ringbuf_max)
+		errx("Adaptive floor is larger than the buffer size\n");
+	
+	/* Checkpoints are read from shared memory, which has no huge pages */
+	if ((opt.ckptdir != NULL) && (opt.storage & (RINGBUF_THP | RINGBUF_HUGETLB)))
+		errx("Checkpoints can not be used with huge pages\n");
+
+	/* Explicit huge pages are held from the start, nothing to give back */
+	if (opt.adapt_floor && (opt.storage & RINGBUF_HUGETLB))
+		errx("Adaptive size can not be used with explicit huge pages\n");
+
+	/* Replay runs in the foreground */
+	if (opt.replay) {
+		if (opt.iface == NULL)
+			errx("Replay needs a capture file given with -i\n");
+		opt.debug = 1;
+	}
+
+	/* Take over the buffer from the binary we replace on upgrade,
+	 * what was changed at run time is kept */
+	memset(&ho, 0x00, sizeof(ho));
+	if ( (adopted = upgrade_adopt(&rbuf, &ho, sizeof(ho))) > 0) {
+		started = ho.ho_started;
+		counters = ho.ho_counters;
+		outage = ho.ho_outage;
+		upgraded.upgrades = ho.ho_upgrades;
+		upgraded.stop = ho.ho_stop;
+		upgraded.client = ho.ho_client;
+		upgraded.pending = 1;
+		opt.promisc = ho.ho_promisc;
+		opt.ringbuf_max = ringbuf_maxsize(rbuf);
+		opt.ringbuf_ceil = ringbuf_reserved(rbuf);
+	}
+	else if (adopted < 0)
+		warn("Upgrade: Starting over with an empty buffer\n");
+
+	/* Become daemon and reopen logfile as standard out, 
+	 * an upgraded process already is one */
 	if (opt.debug == 0) {
         int fd;
 
-		if (daemonize() < 0)
+		if ((adopted == 0) && (daemonize() < 0))
 			exit(EXIT_FAILURE);
 	
 		/* printf("[%d]\n", getpid()); */
@@ -382,10 +2571,20 @@ main(int argc, char *argv[])
 		atexit(unlink_pidfile);
     }
 
-    /* Close unused files */
+    /* Close unused files, but those handed over on upgrade */
     close(STDIN_FILENO);
-    for (i=STDERR_FILENO+1; i<1024; i++)
-        close(i);
+    for (i=STDERR_FILENO+1; i<1024; i++) {
+		if (((rbuf == NULL) || (i != rbuf->shm_fd)) && (i != upgraded.client))
+			close(i);
+	}
+
+	/* Signals are read by the main loop, blocked before threads start */
+	if ( (events = event_init(opt.debug ? debug_signals : daemon_signals)) == NULL)
+		exit(EXIT_FAILURE);
+
+	/* Log from a background thread, not to hold up capture */
+	if (print_async() < 0)
+		exit(EXIT_FAILURE);
 		
 	verbose(0, "+-+-+-+-+-+ Capture Started +-+-+-+-+-+\n");
 	/* Open device */
@@ -393,44 +2592,168 @@ main(int argc, char *argv[])
 		errx("Failed to open device.\n");
 
 	/* Build and set filter */
-	if (argv[optind] != NULL) {
+	if (ho.ho_filtered) {
+		if (ho.ho_filter[0] != '\0')
+			opt.filter = strdup(ho.ho_filter);
+	}
+	else if (argv[optind] != NULL)
 		opt.filter = str_join(" ", &argv[optind]);
-		if (cap_setfilter(cap, opt.filter) < 0)
+	if (inst_active(insts) && (inst_compile(insts, cap->c_pcapd, cap->c_net) < 0))
+		exit(EXIT_FAILURE);
+	if ((opt.filter != NULL) || inst_active(insts)) {
+		if (apply_filter(cap, opt.filter) < 0)
 			exit(EXIT_FAILURE);
 	}
 	
+	/* Compile trigger and class filters */
+	if (trigger_compile(trig, cap->c_pcapd, cap->c_net) < 0)
+		exit(EXIT_FAILURE);
+	if (class_compile(cls, cap->c_pcapd, cap->c_net) < 0)
+		exit(EXIT_FAILURE);
+
 	verbose(0, "Dump directory: %s\n", opt.dumpdir);
 	if (!opt.debug) {
 		verbose(0, "Log file: %s\n", opt.logfile);
 		verbose(0, "PID file: %s\n", opt.pidfile);
 	}
+	verbose(0, "Control socket: %s\n", opt.sockfile);
+	if (opt.metricsfile != NULL)
+		verbose(0, "Metrics file: %s\n", opt.metricsfile);
 	verbose(0, "Buffer size: %s bytes\n", str_hsize(opt.ringbuf_max));
+	verbose(0, "Buffer ceiling: %s bytes\n", str_hsize(opt.ringbuf_ceil));
+	if (opt.strip_age > 0)
+		verbose(0, "Payload kept for %s, headers only after that\n", 
+			str_hms(opt.strip_age));
 	if (opt.filter)
 		verbose(0, "Filter: %s\n", opt.filter);
 	else
 		verbose(0, "No capture filter\n");
 
+	for (i = 0; i < cls->cl_n; i++)
+		verbose(0, "Class: %s, %s bytes, %s, filter: %s\n", 
+			cls->cl_class[i].pc_name, str_hsize(cls->cl_class[i].pc_size),
+			cls->cl_class[i].pc_age ? str_hms(cls->cl_class[i].pc_age) : "no age limit",
+			cls->cl_class[i].pc_filter);
+	for (i = 0; i < insts->is_n; i++)
+		verbose(0, "Instance: %s, %s bytes, %s, dumps to %s, filter: %s\n", 
+			insts->is_inst[i].in_name, str_hsize(insts->is_inst[i].in_size),
+			insts->is_inst[i].in_age ? str_hms(insts->is_inst[i].in_age) : "no age limit",
+			insts->is_inst[i].in_dumpdir, insts->is_inst[i].in_filter ? 
+			insts->is_inst[i].in_filter : "all packets");
+	for (i = 0; i < trig->tg_ntrig; i++)
+		verbose(0, "Trigger: %s\n", trig->tg_trig[i].tr_spec);
+	if (trigger_active(trig))
+		verbose(0, "Snapshot window: %u seconds before and %u after, "
+			"hold off %u seconds\n", (u_int)trig->tg_pre, 
+			(u_int)trig->tg_post, (u_int)trig->tg_holdoff);
+
 	if (opt.verbose)
 		verbose(1, "Status log interval %s [%u seconds]\n", 
 			str_hms(STAT_SEC_INTERVAL), STAT_SEC_INTERVAL);
 
-	/* Init ring buffer */
-	if ( (rbuf = ringbuf_init(opt.ringbuf_max)) == NULL)
+	/* Calibrate latency clock */
+	hist_init();
+
+	/* Init ring buffer, unless taken over on upgrade. It is kept in 
+	 * anonymous shared memory unless it has a name, for checkpoints 
+	 * to read and to be handed over, but huge pages are private */
+	if (rbuf == NULL) {
+		if ((opt.shm_name != NULL) || (opt.ckptdir != NULL))
+			rbuf = ringbuf_init_shared(opt.ringbuf_max, opt.ringbuf_ceil, 
+				opt.storage, opt.shm_name);
+		else if (opt.storage & (RINGBUF_THP | RINGBUF_HUGETLB))
+			rbuf = ringbuf_init(opt.ringbuf_max, opt.ringbuf_ceil, opt.storage);
+		else if ( (rbuf = ringbuf_init_shared(opt.ringbuf_max, 
+				opt.ringbuf_ceil, opt.storage, NULL)) == NULL) {
+			warn("Buffer kept in private memory, it can not be handed over on upgrade\n");
+			rbuf = ringbuf_init(opt.ringbuf_max, opt.ringbuf_ceil, opt.storage);
+		}
+		if (rbuf == NULL)
+			exit(EXIT_FAILURE);
+	}
+	if (rbuf->shm != NULL) {
+		rbuf->shm->h_linktype = cap->c_datalink;
+		rbuf->shm->h_snaplen = CAP_SNAPLEN;
+		if (rbuf->shm_name != NULL)
+			verbose(0, "Shared buffer: %s\n", rbuf->shm_name);
+	}
+	rbufs[nrbufs++] = rbuf;
+	if (rbuf->flags & RINGBUF_PREFAULT)
+		verbose(0, "Buffer storage: %s pages%s, %s bytes allocated in %.3f seconds\n",
+			ringbuf_storage(rbuf->flags), (rbuf->flags & RINGBUF_LOCK) ? 
+			", locked" : "", str_hsize(ringbuf_memsize(rbuf)), 
+			rbuf->prefault_usec / 1e6);
+	else if (rbuf->flags & ~RINGBUF_SHARED)
+		verbose(0, "Buffer storage: %s pages\n", ringbuf_storage(rbuf->flags));
+	if (rbuf->stream_min)
+		verbose(1, "Packets are copied into the buffer past the CPU cache\n");
+	for (i = 0; i < cls->cl_n; i++)
+		rbufs[nrbufs++] = cls->cl_class[i].pc_rbuf;
+
+	/* Size the buffer after memory pressure */
+	if (opt.adapt_floor > 0) {
+		char floor[32];
+
+		if ( (adapt = adapt_init(opt.adapt_floor, opt.ringbuf_ceil)) == NULL)
+			exit(EXIT_FAILURE);
+		snprintf(floor, sizeof(floor), "%s", str_hsize(opt.adapt_floor));
+		verbose(0, "Adaptive size: %s to %s bytes, pressure from %s\n", floor,
+			str_hsize(opt.ringbuf_ceil), adapt_sources(adapt->ad_sources));
+		if (adapt->ad_cgroup[0] != '\0')
+			verbose(1, "Memory cgroup: %s\n", adapt->ad_cgroup);
+	}
+
+	/* Summarize packets that are evicted */
+	if (opt.flowdir != NULL) {
+		if ( (flows = flow_init(opt.flowdir, opt.flow_keep * 3600, 
+				cap->c_datalink, cap->c_offset)) == NULL)
+			exit(EXIT_FAILURE);
+		verbose(0, "Flow records: %s, kept %u hours\n", opt.flowdir, 
+			(u_int)opt.flow_keep);
+	}
+
+	/* Write new packets to disk in the background */
+	if (opt.ckptdir != NULL) {
+		if (ckpt_start(ho.ho_ckpt ? &ho.ho_cur : NULL) < 0)
+			exit(EXIT_FAILURE);
+		verbose(0, "Checkpoints: %s, every %u seconds, new file every %s\n", 
+			opt.ckptdir, opt.ckpt_sec, str_hms(opt.ckpt_rotate));
+	}
+
+	/* Packets held past eviction */
+	if (opt.hold_budget == 0)
+		opt.hold_budget = opt.ringbuf_max;
+	if ( (holds = hold_init(opt.hold_budget)) == NULL)
 		exit(EXIT_FAILURE);
-	
-	/* Set signal handler for dumping of packets */
-	signal(SIGUSR1, dumppackets);
+	set_evict();
+
+	/* Init address index and traffic summaries */
+	if (opt.index_seglen > 0) {
+		if ( (bidx = bloomidx_init(opt.index_seglen)) == NULL)
+			exit(EXIT_FAILURE);
+		if ( (sketch = sketch_init(opt.index_seglen)) == NULL)
+			exit(EXIT_FAILURE);
+		verbose(0, "Address index: %s per segment\n", str_hms(opt.index_seglen));
+		if (adopted > 0)
+			index_rebuild();
+	}
+	else
+		verbose(0, "Address index disabled\n");
 
-	/* Set signal handler for status dump */
-	signal(SIGUSR2, write_status);
+	/* Init subscriber list */
+	if ( (tail = tail_init()) == NULL)
+		exit(EXIT_FAILURE);
+
+	/* Open control socket */
+	if ( (ctl = ctl_open(opt.sockfile, ctl_cmds)) == NULL)
+		exit(EXIT_FAILURE);
 	
 	if (!opt.debug) {
-		/* Set exit handler */
-		signal(SIGTERM, exit_handler);
-		signal(SIGSEGV, exit_handler);
-		signal(SIGBUS, exit_handler);
-		signal(SIGILL, exit_handler);
-		signal(SIGPIPE, exit_handler);
+		/* Set handler of crashes, other signals are read by the main 
+		 * loop, which cleans up in exit_handler() */
+		signal(SIGSEGV, fatal_handler);
+		signal(SIGBUS, fatal_handler);
+		signal(SIGILL, fatal_handler);
 
 		/* Signals we ignore */
 		signal(SIGQUIT, SIG_IGN);
@@ -439,50 +2762,111 @@ main(int argc, char *argv[])
 		signal(SIGINT, SIG_IGN);
 	}
 	
-	/* Dump statistics in verbose mode */
-	if (opt.verbose) 
-		signal(SIGALRM, sigalrm_handler);
+	/* Dump statistics in verbose mode, aligned to the interval */
+	if (opt.verbose) {
+		char buf[256];
+			
+		if (event_timer(events, STAT_SEC_INTERVAL) < 0)
+			exit(EXIT_FAILURE);
+		snprintf(buf, sizeof(buf), "%s", str_time(events->ev_next, NULL));
+		verbose(1, "First status output aligned to %s\n", buf);
+	}
 		
-	/* Start capturing packets, restart if the interface goes down */
-	for (;;) {
-		size_t retry_time;
+	/* Replay a capture file once */
+	if (opt.replay) {
+		struct timeval start;
+		struct rusage ru;
+		
+		if (pcap_file(cap->c_pcapd) == NULL)
+			errx("Replay needs a capture file, '%s' is not one\n", opt.iface);
+		
+		if (opt.replay_speed > 0)
+			verbose(0, "Replaying %s at %g times the original rate\n", 
+				opt.iface, opt.replay_speed);
+		else
+			verbose(0, "Replaying %s at full speed\n", opt.iface);
+		gettimeofday(&start, NULL);
+		getrusage(RUSAGE_SELF, &ru);
+		if (capture_loop() < 0)
+			exit(EXIT_FAILURE);
+		replay_report(&start, &ru);
+		if (flows != NULL)
+			flow_close(flows);
+		if (ckpt != NULL)
+			ckpt_close(ckpt);
+		if (rbuf->shm != NULL)
+			ringbuf_free(rbuf);
+		exit(EXIT_SUCCESS);
+	}
 
-		/* Align alarm call */
-		if (opt.verbose) {
-			char buf[256];
-			
-			snprintf(buf, sizeof(buf), "%s", str_time(time(NULL) + 
-				(STAT_SEC_INTERVAL - (time(NULL) % STAT_SEC_INTERVAL)), NULL));
-			
-			verbose(1, "First status output aligned to %s\n", buf);
-			alarm(STAT_SEC_INTERVAL - (time(NULL) % STAT_SEC_INTERVAL));
+	/* Tell whoever asked for the upgrade how it went */
+	if (adopted > 0) {
+		struct ctl_req req;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		upgraded.resume_ms = (now.tv_sec - upgraded.stop.tv_sec) * 1000 +
+			(now.tv_usec - upgraded.stop.tv_usec) / 1000;
+		verbose(0, "Upgraded, capture resumed %ld ms after it stopped, "
+			"%lu packets taken over\n", upgraded.resume_ms, 
+			(u_long)ringbuf_elements(rbuf));
+		
+		if (upgraded.client >= 0) {
+			memset(&req, 0x00, sizeof(req));
+			req.cr_fd = upgraded.client;
+			ctl_reply(&req, "pid=%d\n", getpid());
+			ctl_reply(&req, "binary=%s\n", upgraded.self ? upgraded.self : "-");
+			ctl_reply(&req, "buffer_packets=%lu\n", (u_long)ringbuf_elements(rbuf));
+			ctl_reply(&req, "upgrade_resume_ms=%ld\n", upgraded.resume_ms);
+			ctl_result(&req, 0);
+			close(upgraded.client);
+			upgraded.client = -1;
 		}
-		pcap_loop(cap->c_pcapd, -1, capture_pkts, (u_char *)cap);
-		retry_time = 10;
+	}
 
-		for (;;) {
+	/* Start capturing packets, reopen the capture as soon as the 
+	 * interface is back. The buffer is kept meanwhile. */
+	for (;;) {
+		struct timeval now;
+		struct link *lk;
+		long retry_ms;
+		int tries;
 
-			/* Abort alarm */
-			if (opt.verbose)
-				alarm(0);
+		capture_loop();
+		gettimeofday(&outage.down, NULL);
+		
+		if (cap_prev != NULL)
+			switch_done();
+		lk = link_open(cap->c_dev);
+		warn("Capture stopped: '%s', %s\n", pcap_geterr(cap->c_pcapd), 
+			(lk != NULL) ? "reopening when the link is up" : "retrying");
+		cap_close(cap);
+		cap = NULL;
 
-			warn("pcap_loop: '%s', retrying in %u seconds\n", 
-				pcap_geterr(cap->c_pcapd), retry_time);
-			
-			if (cap != NULL) {
+		for (retry_ms = LINK_RETRY_MIN, tries = 1; ; tries++) {
+			if (wait_events(retry_ms, lk))
+				retry_ms = LINK_RETRY_MIN;
+			else if ( (retry_ms *= 2) > LINK_RETRY_MAX)
+				retry_ms = LINK_RETRY_MAX;
+	
+			/* The filter is kept over a restart */
+			if ( (cap = cap_open(opt.iface, opt.promisc)) != NULL) {
+				if (((opt.filter == NULL) && !inst_active(insts)) ||
+						(apply_filter(cap, opt.filter) == 0))
+					break;
 				cap_close(cap);
 				cap = NULL;
 			}
-			sleep(retry_time);
-	
-			if ( (cap = cap_open(opt.iface, opt.promisc)) != NULL) 
-				break;
-			retry_time += 10;
-
-			/* Wait a maximum of five minutes */
-			if (retry_time > 300)
-				retry_time = 300;
 		}
+		link_close(lk);
+
+		gettimeofday(&now, NULL);
+		outage.recovery_ms = (now.tv_sec - outage.down.tv_sec) * 1000 +
+			(now.tv_usec - outage.down.tv_usec) / 1000;
+		outage.outages++;
+		outage.pending = 1;
+		verbose(0, "Capture reopened %ld ms after it stopped, %d attempts\n",
+			outage.recovery_ms, tries);
 	}
 	exit(EXIT_FAILURE);
 }
@@ -8,8 +8,25 @@
 
 /* Default size of fixed size buffer in bytes */
 #define DEFAULT_MAX_SIZE_BYTES	(50*1024*1024)
+
+/* Default resize ceiling as a multiple of the buffer size */
+#define DEFAULT_CEIL_FACTOR	16
 #define LOGFILE	"/var/log/ringcapd.log"
 #define PIDFILE "/var/run/ringcapd.pid"
+#define SOCKFILE "/var/run/ringcapd.sock"
+
+/* Keep hot data on cache lines of its own */
+#ifdef __GNUC__
+#define CACHE_ALIGNED	__attribute__((aligned(64)))
+#else
+#define CACHE_ALIGNED
+#endif
+
+/* Most blocks stripped of payload in one pass */
+#define STRIP_MAXBLOCKS	64
+
+/* Entries of each top list in status */
+#define STATUS_TOP	10
 
 /* Interval in seconds between status output in verbose mode */
 #define STAT_SEC_INTERVAL	(3600)
@@ -23,10 +40,27 @@ struct options {
 	char *logfile;
 	char *pidfile;
 	char *filter;
+	char *sockfile;
+	char *metricsfile;
+	char *flowdir;			/* Directory of flow records, NULL if none */
+	char *shm_name;			/* Shared memory segment of buffer, NULL if none */
+	char *instfile;			/* File of instances, NULL if none */
+	char *ckptdir;			/* Directory of checkpoints, NULL if none */
 	
 	unsigned int promisc:1;
 	unsigned int debug:1;
+	unsigned int replay:1;	/* Replay capture file once and report */
+	double replay_speed;	/* Multiple of original rate, 0 for full speed */
 	size_t ringbuf_max;
+	size_t ringbuf_ceil;	/* Largest size the buffer can be resized to */
+	size_t adapt_floor;		/* Smallest adaptive size, 0 for a fixed size */
+	size_t hold_budget;		/* Bytes for all holds */
+	time_t index_seglen;	/* Seconds per address index segment, 0 if disabled */
+	time_t flow_keep;		/* Hours to keep flow records */
+	time_t strip_age;		/* Strip payload of packets older than this, 0 never */
+	int ckpt_sec;			/* Seconds between checkpoints */
+	int ckpt_rotate;		/* Seconds of packet time per checkpoint file */
+	int storage;			/* Buffer storage, RINGBUF_* flags */
 };
 
 /* daemonize.c */
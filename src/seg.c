@@ -0,0 +1,142 @@
+/*
+ * seg.c - Time segments of the packets in a buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "print.h"
+#include "seg.h"
+
+
+/*
+ * Initialize an empty list of segments of size bytes,
+ * covering seglen seconds each.
+ */
+void
+seglist_init(struct seglist *sl, time_t seglen, size_t size)
+{
+	sl->sl_seglen = seglen;
+	sl->sl_size = size;
+	sl->sl_packets = 0;
+	sl->sl_segs = 0;
+	sl->sl_first = NULL;
+	sl->sl_last = NULL;
+}
+
+
+/*
+ * Count a packet with timestamp ts in the segment of its time slot.
+ * A new zeroed segment is started on a new time slot, or if split 
+ * is non-zero.
+ * Returns the segment on success, NULL on error.
+ */
+struct seg *
+seglist_add(struct seglist *sl, const struct timeval *ts, int split)
+{
+	struct seg *sg;
+
+	sg = sl->sl_last;
+
+	if ((sg == NULL) || split ||
+			(ts->tv_sec / sl->sl_seglen != sg->sg_first.tv_sec / sl->sl_seglen)) {
+
+		if ( (sg = calloc(1, sl->sl_size)) == NULL) {
+			err_errno("seglist_add: Failed to allocate segment");
+			return(NULL);
+		}
+		sg->sg_first = *ts;
+		
+		if (sl->sl_last == NULL)
+			sl->sl_first = sg;
+		else
+			sl->sl_last->sg_next = sg;
+		sl->sl_last = sg;
+		sl->sl_segs++;
+	}
+
+	sg->sg_last = *ts;
+	sg->sg_packets++;
+	sl->sl_packets++;
+	return(sg);
+}
+
+
+/*
+ * Drop segments whose packets have all left the buffer.
+ * Since packets leave the buffer in the order they were added,
+ * the oldest segment is gone once the younger segments alone
+ * account for all live packets.
+ */
+void
+seglist_trim(struct seglist *sl, size_t live)
+{
+	struct seg *sg;
+
+	while ( (sg = sl->sl_first) != NULL) {
+		
+		if (sl->sl_packets - sg->sg_packets < live)
+			break;
+
+		sl->sl_first = sg->sg_next;
+		if (sl->sl_first == NULL)
+			sl->sl_last = NULL;
+		sl->sl_packets -= sg->sg_packets;
+		sl->sl_segs--;
+		free(sg);
+	}
+}
+
+
+/*
+ * Drop segments that ended before the oldest packet still held, 
+ * for when packets do not leave in the order they were added.
+ * oldest is NULL if no packets are held.
+ */
+void
+seglist_expire(struct seglist *sl, const struct timeval *oldest)
+{
+	struct seg *sg;
+
+	while ( (sg = sl->sl_first) != NULL) {
+		
+		if ((oldest != NULL) && !timercmp(&sg->sg_last, oldest, <))
+			break;
+
+		sl->sl_first = sg->sg_next;
+		if (sl->sl_first == NULL)
+			sl->sl_last = NULL;
+		sl->sl_packets -= sg->sg_packets;
+		sl->sl_segs--;
+		free(sg);
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ * seg.h - Time segments of the packets in a buffer
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _SEG_H
+#define _SEG_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * Packets received during one time segment. The segments of the 
+ * address index and the summaries start with one.
+ */
+struct seg {
+	struct timeval sg_first;	/* Timestamp of first packet */
+	struct timeval sg_last;		/* Timestamp of last packet */
+	size_t sg_packets;			/* Number of packets in segment */
+	struct seg *sg_next;
+};
+
+/*
+ * Segments are kept in the same order as the packets in the ring buffer,
+ * oldest first, and are dropped once all their packets have left it.
+ */
+struct seglist {
+	time_t sl_seglen;			/* Seconds per segment */
+	size_t sl_size;				/* Bytes allocated per segment */
+	size_t sl_packets;			/* Packets covered by all segments */
+	size_t sl_segs;				/* Number of segments */
+	struct seg *sl_first;
+	struct seg *sl_last;
+};
+
+/* seg.c */
+extern void seglist_init(struct seglist *, time_t, size_t);
+extern struct seg *seglist_add(struct seglist *, const struct timeval *, int);
+extern void seglist_trim(struct seglist *, size_t);
+extern void seglist_expire(struct seglist *, const struct timeval *);
+
+#endif /* _SEG_H */
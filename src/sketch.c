@@ -0,0 +1,326 @@
+/*
+ * sketch.c - Top talkers and distinct hosts per time segment
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include "print.h"
+#include "pkt.h"
+#include "sketch.h"
+
+/* Local routines */
+static void topk_add(struct topk *, const u_char *, int, size_t);
+static void hll_add(u_char *, u_int64_t);
+static double hll_count(const u_char *);
+static int topent_cmp(const void *, const void *);
+static int topent_keycmp(const void *, const void *);
+
+
+/*
+ * Count bytes for key, looking it up and finding the
+ * smallest counter in the same pass
+ */
+static void
+topk_add(struct topk *tk, const u_char *key, int len, size_t bytes)
+{
+	u_int32_t h;
+	int i, min;
+
+	h = (u_int32_t)pkt_hash(key, len);
+	
+	for (min = 0, i = 0; i < tk->tk_n; i++) {
+		if ((tk->tk_hash[i] == h) && (tk->tk_keys[i].sk_len == len) &&
+				!memcmp(tk->tk_keys[i].sk_key, key, len)) {
+			tk->tk_bytes[i] += bytes;
+			tk->tk_packets[i]++;
+			return;
+		}
+		if (tk->tk_bytes[i] < tk->tk_bytes[min])
+			min = i;
+	}
+
+	/* Free counter */
+	if (tk->tk_n < SKETCH_TOPK) {
+		i = tk->tk_n++;
+		tk->tk_err[i] = 0;
+		tk->tk_bytes[i] = 0;
+		tk->tk_packets[i] = 0;
+	}
+	
+	/* Replace the smallest */
+	else {
+		i = min;
+		tk->tk_err[i] = tk->tk_bytes[i];
+	}
+
+	tk->tk_hash[i] = h;
+	memcpy(tk->tk_keys[i].sk_key, key, len);
+	tk->tk_keys[i].sk_len = len;
+	tk->tk_bytes[i] += bytes;
+	tk->tk_packets[i]++;
+}
+
+
+/*
+ * Add hash to HyperLogLog registers
+ */
+static void
+hll_add(u_char *regs, u_int64_t h)
+{
+	u_int64_t rest;
+	u_char rank;
+	int idx;
+
+	idx = h >> (64 - SKETCH_HLLBITS);
+	rest = (h << SKETCH_HLLBITS) | ((u_int64_t)1 << (SKETCH_HLLBITS - 1));
+	rank = __builtin_clzll(rest) + 1;
+	if (rank > regs[idx])
+		regs[idx] = rank;
+}
+
+
+/*
+ * Estimate number of distinct values in registers
+ */
+static double
+hll_count(const u_char *regs)
+{
+	double sum, est, alpha;
+	int i, zeros;
+
+	alpha = 0.7213 / (1.0 + 1.079 / SKETCH_HLLREGS);
+	for (sum = 0, zeros = 0, i = 0; i < SKETCH_HLLREGS; i++) {
+		sum += ldexp(1.0, -regs[i]);
+		if (regs[i] == 0)
+			zeros++;
+	}
+	est = alpha * SKETCH_HLLREGS * SKETCH_HLLREGS / sum;
+
+	/* Linear counting is better for small sets */
+	if ((est <= 2.5 * SKETCH_HLLREGS) && (zeros > 0))
+		est = SKETCH_HLLREGS * log((double)SKETCH_HLLREGS / zeros);
+	return(est);
+}
+
+
+/*
+ * Initialize summaries with seglen seconds per segment.
+ * Returns a sketch pointer on success, NULL on error.
+ */
+struct sketch *
+sketch_init(time_t seglen)
+{
+	struct sketch *sk;
+
+	if (seglen <= 0) {
+		err("sketch_init: Got bad segment length (%ld)\n", (long)seglen);
+		return(NULL);
+	}
+
+	if ( (sk = calloc(1, sizeof(struct sketch))) == NULL) {
+		err_errno("sketch_init: Failed to allocate sketch structure");
+		return(NULL);
+	}
+	seglist_init(&sk->sk_list, seglen, sizeof(struct sketchseg));
+	return(sk);
+}
+
+
+/*
+ * Count a packet of len bytes that was added to the ring buffer.
+ * Packets that are not IP are given with a NULL pi, they are still 
+ * counted to keep the segments in sync with the buffer.
+ * Returns 0 on success, -1 on error.
+ */
+int
+sketch_add(struct sketch *sk, const struct timeval *ts, size_t len,
+	const struct pktinfo *pi)
+{
+	struct sketchseg *ss;
+	u_char port[3];
+	u_int16_t p;
+
+	if ( (ss = (struct sketchseg *)seglist_add(&sk->sk_list, ts, 0)) == NULL)
+		return(-1);
+	ss->ss_bytes += len;
+
+	if (pi == NULL)
+		return(0);
+
+	topk_add(&ss->ss_top[SKETCH_SRC], pi->pi_src, pi->pi_alen, len);
+	topk_add(&ss->ss_top[SKETCH_DST], pi->pi_dst, pi->pi_alen, len);
+	hll_add(ss->ss_hll, pkt_hash(pi->pi_src, pi->pi_alen));
+	hll_add(ss->ss_hll, pkt_hash(pi->pi_dst, pi->pi_alen));
+
+	/* The service is usually the lower port */
+	if ((pi->pi_sport != 0) || (pi->pi_dport != 0)) {
+		p = pi->pi_dport;
+		if ((pi->pi_sport != 0) && ((p == 0) || (pi->pi_sport < p)))
+			p = pi->pi_sport;
+		port[0] = pi->pi_proto;
+		port[1] = p >> 8;
+		port[2] = p & 0xff;
+		topk_add(&ss->ss_top[SKETCH_PORT], port, sizeof(port), len);
+	}
+	return(0);
+}
+
+
+/*
+ * Drop segments whose packets have all left the buffer
+ */
+void
+sketch_trim(struct sketch *sk, size_t live)
+{
+	seglist_trim(&sk->sk_list, live);
+}
+
+
+/*
+ * Drop segments that ended before the oldest packet still held
+ */
+void
+sketch_expire(struct sketch *sk, const struct timeval *oldest)
+{
+	seglist_expire(&sk->sk_list, oldest);
+}
+
+
+/* Order by key */
+static int
+topent_keycmp(const void *a, const void *b)
+{
+	const struct topent *ta = a, *tb = b;
+
+	if (ta->te_key.sk_len != tb->te_key.sk_len)
+		return(ta->te_key.sk_len - tb->te_key.sk_len);
+	return(memcmp(ta->te_key.sk_key, tb->te_key.sk_key, ta->te_key.sk_len));
+}
+
+
+/* Order by bytes, largest first */
+static int
+topent_cmp(const void *a, const void *b)
+{
+	const struct topent *ta = a, *tb = b;
+
+	if (ta->te_bytes == tb->te_bytes)
+		return(0);
+	return((ta->te_bytes < tb->te_bytes) ? 1 : -1);
+}
+
+
+/*
+ * Merge the top list of all segments in the buffer,
+ * at most max entries, heaviest first, are stored in tv.
+ * Returns the number of entries stored.
+ */
+size_t
+sketch_top(struct sketch *sk, int which, struct topent *tv, size_t max)
+{
+	struct sketchseg *ss;
+	struct topent *all;
+	struct topk *tk;
+	size_t n, i, j;
+
+	if ( (all = calloc(sketch_segs(sk) * SKETCH_TOPK + 1, sizeof(struct topent))) == NULL) {
+		err_errno("sketch_top: calloc()");
+		return(0);
+	}
+
+	for (n = 0, ss = sketch_first(sk); ss != NULL; ss = sketch_next(ss)) {
+		tk = &ss->ss_top[which];
+		for (i = 0; i < tk->tk_n; i++, n++) {
+			all[n].te_key = tk->tk_keys[i];
+			all[n].te_bytes = tk->tk_bytes[i];
+			all[n].te_packets = tk->tk_packets[i];
+			all[n].te_err = tk->tk_err[i];
+		}
+	}
+
+	/* Sum counts of the same key */
+	qsort(all, n, sizeof(struct topent), topent_keycmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if ((j > 0) && !topent_keycmp(&all[j-1], &all[i])) {
+			all[j-1].te_bytes += all[i].te_bytes;
+			all[j-1].te_packets += all[i].te_packets;
+			all[j-1].te_err += all[i].te_err;
+		}
+		else
+			all[j++] = all[i];
+	}
+	
+	qsort(all, j, sizeof(struct topent), topent_cmp);
+	if (j > max)
+		j = max;
+	memcpy(tv, all, j * sizeof(struct topent));
+	free(all);
+	return(j);
+}
+
+
+/*
+ * Estimate the number of distinct addresses in a segment,
+ * or in all segments if ss is NULL.
+ */
+double
+sketch_hosts(struct sketch *sk, struct sketchseg *ss)
+{
+	u_char regs[SKETCH_HLLREGS];
+	int i;
+
+	if (ss != NULL)
+		return(hll_count(ss->ss_hll));
+
+	memset(regs, 0x00, sizeof(regs));
+	for (ss = sketch_first(sk); ss != NULL; ss = sketch_next(ss)) {
+		for (i = 0; i < SKETCH_HLLREGS; i++) {
+			if (ss->ss_hll[i] > regs[i])
+				regs[i] = ss->ss_hll[i];
+		}
+	}
+	return(hll_count(regs));
+}
+
+
+/*
+ * Free summaries and all segments
+ */
+void
+sketch_free(struct sketch *sk)
+{
+	sketch_trim(sk, 0);
+	free(sk);
+}
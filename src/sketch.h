@@ -0,0 +1,123 @@
+/*
+ * sketch.h - Top talkers and distinct hosts per time segment
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include "pkt.h"
+#include "seg.h"
+
+/* Counters in each top list, the heaviest keys are always kept */
+#define SKETCH_TOPK		32
+
+/* Registers of the distinct host counter, 2^10 gives about 3% error */
+#define SKETCH_HLLBITS	10
+#define SKETCH_HLLREGS	(1 << SKETCH_HLLBITS)
+
+/* Top lists */
+#define SKETCH_SRC		0	/* Source address */
+#define SKETCH_DST		1	/* Destination address */
+#define SKETCH_PORT		2	/* Protocol and destination port */
+#define SKETCH_NTOP		3
+
+/* 
+ * A key is an address, or protocol and port for SKETCH_PORT
+ */
+struct sketchkey {
+	u_char sk_key[16];
+	int sk_len;
+};
+
+/*
+ * Space-Saving summary weighted by bytes. A key that is not counted
+ * replaces the smallest counter, and inherits its count as error,
+ * so any key with more than 1/SKETCH_TOPK of the bytes is kept.
+ */
+struct topk {
+	int tk_n;						/* Counters in use */
+	u_int32_t tk_hash[SKETCH_TOPK];	/* Hash of key, scanned first */
+	u_int64_t tk_bytes[SKETCH_TOPK];
+	u_int64_t tk_packets[SKETCH_TOPK];
+	u_int64_t tk_err[SKETCH_TOPK];	/* Bytes that might belong to others */
+	struct sketchkey tk_keys[SKETCH_TOPK];
+};
+
+/*
+ * Summaries of the packets received during one time segment
+ */
+struct sketchseg {
+	struct seg ss_seg;			/* Time and packets, must be first */
+	u_int64_t ss_bytes;			/* Bytes in segment */
+	struct topk ss_top[SKETCH_NTOP];
+	u_char ss_hll[SKETCH_HLLREGS];	/* HyperLogLog of addresses */
+};
+
+/*
+ * Summaries of the segments of the buffer, see seg.h
+ */
+struct sketch {
+	struct seglist sk_list;
+};
+
+/* 
+ * Entry of a merged top list
+ */
+struct topent {
+	struct sketchkey te_key;
+	u_int64_t te_bytes;
+	u_int64_t te_packets;
+	u_int64_t te_err;
+};
+
+/* Number of segments */
+#define sketch_segs(s)		((s)->sk_list.sl_segs)
+
+/* First segment and the one after ss */
+#define sketch_first(s)		((struct sketchseg *)(s)->sk_list.sl_first)
+#define sketch_next(ss)		((struct sketchseg *)(ss)->ss_seg.sg_next)
+
+/* Memory used by summaries */
+#define sketch_memsize(s)	(sketch_segs(s) * sizeof(struct sketchseg))
+
+/* sketch.c */
+extern struct sketch *sketch_init(time_t);
+extern int sketch_add(struct sketch *, const struct timeval *, size_t, 
+	const struct pktinfo *);
+extern void sketch_trim(struct sketch *, size_t);
+extern void sketch_expire(struct sketch *, const struct timeval *);
+extern size_t sketch_top(struct sketch *, int, struct topent *, size_t);
+extern double sketch_hosts(struct sketch *, struct sketchseg *);
+extern void sketch_free(struct sketch *);
+
+#endif /* _SKETCH_H */
@@ -218,6 +218,29 @@ str_time(time_t caltime, const char *fmt)
 	return(tstr);
 }
 
+/*
+ * Convert a string on the form 'year-month-day hour:min:sec' in local
+ * time to seconds since the epoch. Any single character may separate
+ * date and time, such as the 'T' in ISO 8601.
+ * Returns the time on success, -1 on error.
+ */
+time_t
+str_to_time(const char *str)
+{
+	struct tm tm;
+	char c;
+
+	memset(&tm, 0x00, sizeof(tm));
+	if (sscanf(str, "%d-%d-%d%c%d:%d:%d", &tm.tm_year, &tm.tm_mon, 
+			&tm.tm_mday, &c, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 7)
+		return((time_t)-1);
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	return(mktime(&tm));
+}
+
 /*
  * Generate len bytes of random bytes and store it in buf.
  * Code influed by lib/libkern/random.c (NetBSD 1.6.1).
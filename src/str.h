@@ -38,6 +38,7 @@ extern int str_isnum(const char *str, unsigned long *val);
 extern unsigned int str_to_argv(char *, char **, unsigned int);
 extern int str_isipv4(const char *);
 extern const char *str_time(time_t, const char *);
+extern time_t str_to_time(const char *);
 extern const char *str_lines(char *);
 extern void str_rand(unsigned char *, size_t);
 extern const char *str_hsize(size_t);
@@ -0,0 +1,434 @@
+/*
+ * tail.c - Stream new packets as pcap to local subscribers
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pcap.h>
+#include "print.h"
+#include "tail.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+/* Record header of the pcap file format */
+struct tail_rec {
+	u_int32_t tr_sec;
+	u_int32_t tr_usec;
+	u_int32_t tr_caplen;
+	u_int32_t tr_len;
+};
+
+/* Local routines */
+static void tail_put(struct tailsub *, const void *, size_t);
+static void tail_get(struct tailsub *, void *, size_t);
+static void tail_consume(struct tailsub *, size_t);
+static int tail_flush(struct tailsub *);
+static void tail_drop(struct tail *, struct tailsub *, const char *);
+
+
+/*
+ * Initialize subscriber list.
+ * Returns a tail pointer on success, NULL on error.
+ */
+struct tail *
+tail_init(void)
+{
+	struct tail *t;
+	int i;
+
+	if ( (t = calloc(1, sizeof(struct tail))) == NULL) {
+		err_errno("tail_init: Failed to allocate subscriber list");
+		return(NULL);
+	}
+
+	for (i = 0; i < TAIL_MAXSUBS; i++)
+		t->t_subs[i].ts_fd = -1;
+	return(t);
+}
+
+
+/*
+ * Add subscriber on connected socket fd, receiving the packets 
+ * captured on p that match filter (NULL for all packets).
+ * The pcap file header is queued right away.
+ * Returns 0 on success, -1 on error, in which case fd is left open.
+ */
+int
+tail_add(struct tail *t, int fd, pcap_t *p, const char *filter, bpf_u_int32 net)
+{
+	struct pcap_file_header fh;
+	struct tailsub *ts;
+	int i;
+
+	for (ts = NULL, i = 0; i < TAIL_MAXSUBS; i++) {
+		if (t->t_subs[i].ts_fd < 0) {
+			ts = &t->t_subs[i];
+			break;
+		}
+	}
+
+	if (ts == NULL) {
+		err("tail_add: To many subscribers\n");
+		return(-1);
+	}
+	memset(ts, 0x00, sizeof(struct tailsub));
+
+	if (filter != NULL) {
+		if (pcap_compile(p, &ts->ts_bpf, (char *)filter, 1, net) < 0) {
+			err("tail_add: Filter: %s\n", pcap_geterr(p));
+			ts->ts_fd = -1;
+			return(-1);
+		}
+		ts->ts_filter = strdup(filter);
+	}
+
+	if ( (ts->ts_queue = malloc(TAIL_QUEUE)) == NULL) {
+		err_errno("tail_add: Failed to allocate queue");
+		if (filter != NULL) {
+			pcap_freecode(&ts->ts_bpf);
+			free(ts->ts_filter);
+		}
+		ts->ts_fd = -1;
+		return(-1);
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ts->ts_fd = fd;
+	ts->ts_since = time(NULL);
+	t->t_datalink = pcap_datalink(p);
+	t->t_snaplen = pcap_snapshot(p);
+	t->t_nsubs++;
+
+	memset(&fh, 0x00, sizeof(fh));
+	fh.magic = 0xa1b2c3d4;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.snaplen = t->t_snaplen;
+	fh.linktype = t->t_datalink;
+	tail_put(ts, &fh, sizeof(fh));
+	ts->ts_recleft = sizeof(fh);
+	ts->ts_hdrleft = 1;
+
+	verbose(0, "New subscriber on fd %d%s%s\n", fd, 
+		filter ? ", filter: " : "", filter ? filter : "");
+	return(0);
+}
+
+
+/*
+ * Copy data to the end of the queue, the caller
+ * has made sure that it fits.
+ */
+static void
+tail_put(struct tailsub *ts, const void *data, size_t len)
+{
+	size_t off, n;
+
+	off = (ts->ts_head + ts->ts_len) % TAIL_QUEUE;
+	n = TAIL_QUEUE - off;
+	if (n > len)
+		n = len;
+
+	memcpy(&ts->ts_queue[off], data, n);
+	if (n < len)
+		memcpy(ts->ts_queue, (const u_char *)data + n, len - n);
+	ts->ts_len += len;
+}
+
+
+/*
+ * Copy len bytes from the start of the queue, without consuming them
+ */
+static void
+tail_get(struct tailsub *ts, void *data, size_t len)
+{
+	size_t n;
+
+	n = TAIL_QUEUE - ts->ts_head;
+	if (n > len)
+		n = len;
+
+	memcpy(data, &ts->ts_queue[ts->ts_head], n);
+	if (n < len)
+		memcpy((u_char *)data + n, ts->ts_queue, len - n);
+}
+
+
+/*
+ * Queue a captured packet for every subscriber whose filter matches
+ */
+void
+tail_packet(struct tail *t, const struct pcap_pkthdr *pkthdr, const u_char *packet)
+{
+	struct tail_rec rec;
+	struct tailsub *ts;
+	size_t need;
+	int i;
+
+	rec.tr_sec = pkthdr->ts.tv_sec;
+	rec.tr_usec = pkthdr->ts.tv_usec;
+	rec.tr_caplen = pkthdr->caplen;
+	rec.tr_len = pkthdr->len;
+	need = sizeof(rec) + pkthdr->caplen;
+
+	for (i = 0; i < TAIL_MAXSUBS; i++) {
+		ts = &t->t_subs[i];
+		
+		if (ts->ts_fd < 0)
+			continue;
+
+		if ((ts->ts_filter != NULL) && (bpf_filter(ts->ts_bpf.bf_insns, 
+				(u_char *)packet, pkthdr->len, pkthdr->caplen) == 0))
+			continue;
+
+		/* Never wait for a slow subscriber */
+		if (TAIL_QUEUE - ts->ts_len < need) {
+			ts->ts_dropped++;
+			continue;
+		}
+
+		if (ts->ts_queued == ts->ts_sent)
+			ts->ts_headts = pkthdr->ts;
+
+		tail_put(ts, &rec, sizeof(rec));
+		tail_put(ts, packet, pkthdr->caplen);
+		ts->ts_queued++;
+	}
+}
+
+
+/*
+ * Remove n written bytes from the start of the queue,
+ * keeping track of record boundaries.
+ */
+static void
+tail_consume(struct tailsub *ts, size_t n)
+{
+	struct tail_rec rec;
+	size_t take;
+
+	ts->ts_bytes += n;
+
+	while (n > 0) {
+		
+		/* Next record starts at head */
+		if (ts->ts_recleft == 0) {
+			tail_get(ts, &rec, sizeof(rec));
+			ts->ts_recleft = sizeof(rec) + rec.tr_caplen;
+			ts->ts_headts.tv_sec = rec.tr_sec;
+			ts->ts_headts.tv_usec = rec.tr_usec;
+		}
+
+		take = (n < ts->ts_recleft) ? n : ts->ts_recleft;
+		ts->ts_head = (ts->ts_head + take) % TAIL_QUEUE;
+		ts->ts_len -= take;
+		ts->ts_recleft -= take;
+		n -= take;
+
+		if (ts->ts_recleft == 0) {
+			if (ts->ts_hdrleft)
+				ts->ts_hdrleft = 0;
+			else
+				ts->ts_sent++;
+		}
+	}
+}
+
+
+/*
+ * Write as much of the queue as the subscriber accepts.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+tail_flush(struct tailsub *ts)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t n;
+
+	while (ts->ts_len > 0) {
+		
+		iov[0].iov_base = &ts->ts_queue[ts->ts_head];
+		iov[0].iov_len = TAIL_QUEUE - ts->ts_head;
+		if (iov[0].iov_len > ts->ts_len)
+			iov[0].iov_len = ts->ts_len;
+		iov[1].iov_base = ts->ts_queue;
+		iov[1].iov_len = ts->ts_len - iov[0].iov_len;
+		
+		memset(&msg, 0x00, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+		if ( (n = sendmsg(ts->ts_fd, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return(0);
+			return(-1);
+		}
+		tail_consume(ts, n);
+	}
+	return(0);
+}
+
+
+/*
+ * Store the descriptors to poll in pfd, which must have
+ * room for TAIL_MAXSUBS entries.
+ * Returns the number of entries stored.
+ */
+int
+tail_setpoll(struct tail *t, struct pollfd *pfd)
+{
+	int i, n;
+
+	for (n = 0, i = 0; i < TAIL_MAXSUBS; i++) {
+		if (t->t_subs[i].ts_fd < 0)
+			continue;
+		pfd[n].fd = t->t_subs[i].ts_fd;
+		pfd[n].events = POLLIN;
+		if (t->t_subs[i].ts_len > 0)
+			pfd[n].events |= POLLOUT;
+		pfd[n++].revents = 0;
+	}
+	return(n);
+}
+
+
+/*
+ * Write to the subscribers from tail_setpoll() that are ready,
+ * and drop those that went away.
+ */
+void
+tail_handle(struct tail *t, struct pollfd *pfd, int n)
+{
+	struct tailsub *ts;
+	char buf[512];
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		
+		if (pfd[i].revents == 0)
+			continue;
+
+		for (ts = NULL, j = 0; j < TAIL_MAXSUBS; j++) {
+			if (t->t_subs[j].ts_fd == pfd[i].fd) {
+				ts = &t->t_subs[j];
+				break;
+			}
+		}
+
+		if (ts == NULL)
+			continue;
+
+		if (pfd[i].revents & (POLLERR | POLLNVAL)) {
+			tail_drop(t, ts, "connection error");
+			continue;
+		}
+
+		/* Subscribers should not talk, but they hang up */
+		if (pfd[i].revents & (POLLIN | POLLHUP)) {
+			ssize_t r;
+			
+			r = read(ts->ts_fd, buf, sizeof(buf));
+			if ((r == 0) || ((r < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+				tail_drop(t, ts, "closed by peer");
+				continue;
+			}
+		}
+
+		if ((pfd[i].revents & POLLOUT) && (tail_flush(ts) < 0))
+			tail_drop(t, ts, strerror(errno));
+	}
+}
+
+
+/*
+ * Microseconds between now and the oldest packet waiting 
+ * to be written to subscriber, 0 if the queue is empty.
+ */
+long
+tail_lag(struct tailsub *ts, const struct timeval *now)
+{
+	if (ts->ts_queued == ts->ts_sent)
+		return(0);
+	return((now->tv_sec - ts->ts_headts.tv_sec) * 1000000 + 
+		(now->tv_usec - ts->ts_headts.tv_usec));
+}
+
+
+/*
+ * Remove subscriber
+ */
+static void
+tail_drop(struct tail *t, struct tailsub *ts, const char *why)
+{
+	verbose(0, "Subscriber on fd %d left (%s), %lu packets sent, %lu dropped\n",
+		ts->ts_fd, why, (u_long)ts->ts_sent, (u_long)ts->ts_dropped);
+
+	close(ts->ts_fd);
+	if (ts->ts_filter != NULL) {
+		pcap_freecode(&ts->ts_bpf);
+		free(ts->ts_filter);
+		ts->ts_filter = NULL;
+	}
+	free(ts->ts_queue);
+	ts->ts_queue = NULL;
+	ts->ts_fd = -1;
+	t->t_nsubs--;
+}
+
+
+/*
+ * Remove all subscribers
+ */
+void
+tail_close(struct tail *t)
+{
+	int i;
+
+	for (i = 0; i < TAIL_MAXSUBS; i++) {
+		if (t->t_subs[i].ts_fd >= 0)
+			tail_drop(t, &t->t_subs[i], "shutdown");
+	}
+	free(t);
+}
@@ -0,0 +1,90 @@
+/*
+ * tail.h - Stream new packets to local subscribers
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _TAIL_H
+#define _TAIL_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <pcap.h>
+
+/* Maximum number of subscribers */
+#define TAIL_MAXSUBS	8
+
+/* Bytes queued for each subscriber before packets are dropped */
+#define TAIL_QUEUE		(4*1024*1024)
+
+/*
+ * A subscriber gets a pcap stream through its own queue.
+ * Packets that do not fit in the queue are dropped, so a slow
+ * subscriber never holds up capture.
+ */
+struct tailsub {
+	int ts_fd;				/* -1 if slot is free */
+	time_t ts_since;		/* Time of subscription */
+	char *ts_filter;		/* Filter expression, NULL for all packets */
+	struct bpf_program ts_bpf;
+	
+	u_char *ts_queue;		/* Circular queue of pcap records */
+	size_t ts_head;			/* Offset of first queued byte */
+	size_t ts_len;			/* Bytes queued */
+	size_t ts_recleft;		/* Bytes left of the record at head */
+	int ts_hdrleft;			/* File header not yet written */
+	struct timeval ts_headts;	/* Time of oldest queued packet */
+	
+	size_t ts_queued;		/* Packets queued */
+	size_t ts_sent;			/* Packets written to subscriber */
+	size_t ts_dropped;		/* Packets dropped due to full queue */
+	size_t ts_bytes;		/* Bytes written to subscriber */
+};
+
+struct tail {
+	int t_nsubs;			/* Active subscribers */
+	int t_datalink;
+	int t_snaplen;
+	struct tailsub t_subs[TAIL_MAXSUBS];
+};
+
+/* Returns non-zero if there are subscribers */
+#define tail_active(t)	((t)->t_nsubs > 0)
+
+/* tail.c */
+extern struct tail *tail_init(void);
+extern int tail_add(struct tail *, int, pcap_t *, const char *, bpf_u_int32);
+extern void tail_packet(struct tail *, const struct pcap_pkthdr *, const u_char *);
+extern int tail_setpoll(struct tail *, struct pollfd *);
+extern void tail_handle(struct tail *, struct pollfd *, int);
+extern long tail_lag(struct tailsub *, const struct timeval *);
+extern void tail_close(struct tail *);
+
+#endif /* _TAIL_H */
@@ -0,0 +1,328 @@
+/*
+ * trigger.c - Automatic snapshots on traffic events
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <pcap.h>
+#include "print.h"
+#include "str.h"
+#include "pkt.h"
+#include "trigger.h"
+
+#ifndef TH_RST
+#define TH_RST	0x04
+#endif
+
+/* Local routines */
+static void trigger_tick(struct trigset *, time_t);
+static void trigger_fire(struct trigset *, struct trigger *, time_t);
+
+
+/*
+ * Create an empty set of triggers.
+ * Returns a trigset pointer on success, NULL on error.
+ */
+struct trigset *
+trigger_init(time_t pre, time_t post, time_t holdoff)
+{
+	struct trigset *tg;
+
+	if ( (tg = calloc(1, sizeof(struct trigset))) == NULL) {
+		err_errno("trigger_init: calloc()");
+		return(NULL);
+	}
+	tg->tg_pre = pre;
+	tg->tg_post = post;
+	tg->tg_holdoff = holdoff;
+	return(tg);
+}
+
+
+/*
+ * Add a trigger given as one of
+ *   bpf=<expression>  - A packet matches the filter
+ *   pps=<factor>      - Packets per second exceeds factor times the baseline
+ *   bps=<factor>      - Bytes per second exceeds factor times the baseline
+ *   rst=<count>       - More than count TCP RST packets per second
+ * Filters are compiled later by trigger_compile().
+ * Returns 0 on success, -1 on error.
+ */
+int
+trigger_add(struct trigset *tg, const char *spec)
+{
+	struct trigger *tr;
+	const char *arg;
+	char *end;
+
+	if (tg->tg_ntrig >= TRIG_MAX) {
+		err("Too many triggers, maximum is %u\n", TRIG_MAX);
+		return(-1);
+	}
+	tr = &tg->tg_trig[tg->tg_ntrig];
+	memset(tr, 0x00, sizeof(struct trigger));
+
+	if ( (arg = strchr(spec, '=')) == NULL) {
+		err("Bad trigger '%s'\n", spec);
+		return(-1);
+	}
+	arg++;
+
+	if (!strncmp(spec, "bpf=", 4))
+		tr->tr_type = TRIG_BPF;
+	else if (!strncmp(spec, "pps=", 4))
+		tr->tr_type = TRIG_PPS;
+	else if (!strncmp(spec, "bps=", 4))
+		tr->tr_type = TRIG_BPS;
+	else if (!strncmp(spec, "rst=", 4))
+		tr->tr_type = TRIG_RST;
+	else {
+		err("Unknown trigger '%s'\n", spec);
+		return(-1);
+	}
+
+	if (tr->tr_type == TRIG_BPF) {
+		if (*arg == '\0') {
+			err("Missing filter expression in trigger '%s'\n", spec);
+			return(-1);
+		}
+	}
+	else {
+		tr->tr_arg = strtod(arg, &end);
+		if ((*arg == '\0') || (*end != '\0') || (tr->tr_arg <= 0) ||
+				((tr->tr_type != TRIG_RST) && (tr->tr_arg <= 1))) {
+			err("Bad value in trigger '%s'\n", spec);
+			return(-1);
+		}
+	}
+
+	/* Rates are armed once there is a baseline */
+	tr->tr_limit = (tr->tr_type == TRIG_RST) ? (u_long)tr->tr_arg : ULONG_MAX;
+	
+	if ( (tr->tr_spec = strdup(spec)) == NULL) {
+		err_errno("trigger_add: strdup()");
+		return(-1);
+	}
+	tg->tg_ntrig++;
+	return(0);
+}
+
+
+/*
+ * Compile the filters of the triggers for the open capture.
+ * Returns 0 on success, -1 on error.
+ */
+int
+trigger_compile(struct trigset *tg, pcap_t *p, bpf_u_int32 net)
+{
+	struct trigger *tr;
+	int i;
+
+	for (i = 0; i < tg->tg_ntrig; i++) {
+		tr = &tg->tg_trig[i];
+		if (tr->tr_type != TRIG_BPF)
+			continue;
+
+		if (pcap_compile(p, &tr->tr_bpf, strchr(tr->tr_spec, '=') + 1, 
+				1, net) < 0) {
+			err("Trigger '%s': %s\n", tr->tr_spec, pcap_geterr(p));
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+
+/*
+ * Start counting a new second, the baselines are
+ * updated with the second that ended
+ */
+static void
+trigger_tick(struct trigset *tg, time_t sec)
+{
+	struct trigger *tr;
+	double limit;
+	time_t gap;
+	int i;
+
+	if (tg->tg_sec != 0) {
+		tg->tg_avgpkts += (tg->tg_pkts - tg->tg_avgpkts) / TRIG_EWMA;
+		tg->tg_avgbytes += (tg->tg_bytes - tg->tg_avgbytes) / TRIG_EWMA;
+		tg->tg_warm++;
+
+		/* Seconds without packets */
+		gap = sec - tg->tg_sec - 1;
+		if (gap >= 16 * TRIG_EWMA)
+			tg->tg_avgpkts = tg->tg_avgbytes = 0;
+		for (; gap > 0 && gap < 16 * TRIG_EWMA; gap--) {
+			tg->tg_avgpkts -= tg->tg_avgpkts / TRIG_EWMA;
+			tg->tg_avgbytes -= tg->tg_avgbytes / TRIG_EWMA;
+		}
+	}
+
+	tg->tg_sec = sec;
+	tg->tg_pkts = 0;
+	tg->tg_bytes = 0;
+	tg->tg_rsts = 0;
+
+	if (tg->tg_warm < TRIG_WARMUP)
+		return;
+
+	for (i = 0; i < tg->tg_ntrig; i++) {
+		tr = &tg->tg_trig[i];
+		
+		if (tr->tr_type == TRIG_PPS) {
+			limit = tg->tg_avgpkts * tr->tr_arg;
+			tr->tr_limit = (limit < TRIG_MINPKTS) ? TRIG_MINPKTS : limit;
+		}
+		else if (tr->tr_type == TRIG_BPS) {
+			limit = tg->tg_avgbytes * tr->tr_arg;
+			tr->tr_limit = (limit < TRIG_MINBYTES) ? TRIG_MINBYTES : limit;
+		}
+	}
+}
+
+
+/*
+ * Record an event, the snapshot is written by trigger_due()
+ */
+static void
+trigger_fire(struct trigset *tg, struct trigger *tr, time_t sec)
+{
+	tr->tr_fired++;
+	tr->tr_last = sec;
+	tg->tg_fired = tr;
+	tg->tg_event = sec;
+	tg->tg_due = time(NULL) + tg->tg_post;
+
+	verbose(0, "Trigger '%s' fired at %s, snapshot in %u seconds\n", 
+		tr->tr_spec, str_time(sec, NULL), (u_int)tg->tg_post);
+}
+
+
+/*
+ * Count a packet and check the triggers, pi is NULL for non-IP packets.
+ * Returns 1 if a trigger fired, 0 otherwise.
+ */
+int
+trigger_packet(struct trigset *tg, const struct pcap_pkthdr *pkthdr,
+	const u_char *packet, const struct pktinfo *pi)
+{
+	struct trigger *tr;
+	time_t sec;
+	int fire;
+	int i;
+
+	sec = pkthdr->ts.tv_sec;
+	if (sec != tg->tg_sec)
+		trigger_tick(tg, sec);
+	
+	tg->tg_now = sec;
+	tg->tg_pkts++;
+	tg->tg_bytes += pkthdr->len;
+	if ((pi != NULL) && (pi->pi_proto == IPPROTO_TCP) && 
+			(pi->pi_tcpflags & TH_RST))
+		tg->tg_rsts++;
+
+	/* Snapshot pending, or hold off */
+	if ((tg->tg_event != 0) || (sec < tg->tg_hold))
+		return(0);
+
+	for (i = 0; i < tg->tg_ntrig; i++) {
+		tr = &tg->tg_trig[i];
+		
+		switch (tr->tr_type) {
+			case TRIG_BPF:
+				fire = (bpf_filter(tr->tr_bpf.bf_insns, (u_char *)packet,
+					pkthdr->len, pkthdr->caplen) != 0);
+				break;
+			case TRIG_PPS: fire = (tg->tg_pkts > tr->tr_limit); break;
+			case TRIG_BPS: fire = (tg->tg_bytes > tr->tr_limit); break;
+			case TRIG_RST: fire = (tg->tg_rsts > tr->tr_limit); break;
+			default: fire = 0; break;
+		}
+
+		if (fire) {
+			trigger_fire(tg, tr, sec);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+
+/*
+ * Check if the snapshot of an event is due, which is when packets
+ * from after the event window have arrived, or the wall clock time
+ * of the window has passed. A now of 0 forces a pending snapshot.
+ * The window to write is returned in from and to.
+ * Returns 1 if a snapshot should be written, 0 otherwise.
+ */
+int
+trigger_due(struct trigset *tg, time_t now, time_t *from, time_t *to)
+{
+	if (tg->tg_event == 0)
+		return(0);
+	
+	if ((now != 0) && (now < tg->tg_due) && 
+			(tg->tg_now <= tg->tg_event + tg->tg_post))
+		return(0);
+
+	*from = tg->tg_event - tg->tg_pre;
+	*to = tg->tg_event + tg->tg_post;
+	tg->tg_hold = tg->tg_event + tg->tg_holdoff;
+	tg->tg_event = 0;
+	tg->tg_snapshots++;
+	return(1);
+}
+
+
+/*
+ * Free triggers
+ */
+void
+trigger_free(struct trigset *tg)
+{
+	int i;
+
+	for (i = 0; i < tg->tg_ntrig; i++) {
+		if (tg->tg_trig[i].tr_type == TRIG_BPF)
+			pcap_freecode(&tg->tg_trig[i].tr_bpf);
+		free(tg->tg_trig[i].tr_spec);
+	}
+	free(tg);
+}
@@ -0,0 +1,118 @@
+/*
+ * trigger.h - Automatic snapshots on traffic events
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _TRIGGER_H
+#define _TRIGGER_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap.h>
+#include "pkt.h"
+
+/* Maximum number of triggers */
+#define TRIG_MAX		8
+
+/* Default seconds before and after the event written to the snapshot */
+#define TRIG_PRE		30
+#define TRIG_POST		10
+
+/* Default minimum seconds between two events */
+#define TRIG_HOLDOFF	60
+
+/* Seconds of traffic in the baseline before rate triggers are armed */
+#define TRIG_WARMUP		10
+
+/* A new second weighs 1/TRIG_EWMA in the rate baseline */
+#define TRIG_EWMA		8
+
+/* Rates never fire below these, whatever the baseline */
+#define TRIG_MINPKTS	100
+#define TRIG_MINBYTES	(64*1024)
+
+/* Trigger types */
+#define TRIG_BPF		1	/* Packet matches filter */
+#define TRIG_PPS		2	/* Packet rate over baseline times factor */
+#define TRIG_BPS		3	/* Byte rate over baseline times factor */
+#define TRIG_RST		4	/* TCP RST packets per second */
+
+struct trigger {
+	int tr_type;
+	char *tr_spec;			/* As given by user */
+	double tr_arg;			/* Factor, or RST packets per second */
+	u_long tr_limit;		/* Count within a second that fires */
+	struct bpf_program tr_bpf;
+	size_t tr_fired;		/* Number of events */
+	time_t tr_last;			/* Packet time of last event */
+};
+
+/*
+ * Triggers are evaluated for each packet. Rates are counted per
+ * second of packet time, the limits are updated once a second.
+ * After an event no trigger fires until the snapshot is written
+ * and the hold off time has passed.
+ */
+struct trigset {
+	int tg_ntrig;
+	time_t tg_pre;			/* Seconds before event to write */
+	time_t tg_post;			/* Seconds after event to wait for */
+	time_t tg_holdoff;		/* Minimum seconds between events */
+
+	time_t tg_sec;			/* Second being counted */
+	u_long tg_pkts;			/* Packets in current second */
+	u_long tg_bytes;		/* Bytes in current second */
+	u_long tg_rsts;			/* TCP RST packets in current second */
+	double tg_avgpkts;		/* Packet rate baseline */
+	double tg_avgbytes;		/* Byte rate baseline */
+	int tg_warm;			/* Seconds in baseline */
+
+	time_t tg_now;			/* Time of latest packet */
+	time_t tg_event;		/* Time of pending event, 0 if none */
+	time_t tg_due;			/* Wall clock time to write at the latest */
+	time_t tg_hold;			/* No events before this packet time */
+	struct trigger *tg_fired;	/* Trigger of latest event */
+	size_t tg_snapshots;	/* Number of snapshots written */
+	struct trigger tg_trig[TRIG_MAX];
+};
+
+/* Returns non-zero if there are triggers */
+#define trigger_active(t)	((t)->tg_ntrig > 0)
+
+/* trigger.c */
+extern struct trigset *trigger_init(time_t, time_t, time_t);
+extern int trigger_add(struct trigset *, const char *);
+extern int trigger_compile(struct trigset *, pcap_t *, bpf_u_int32);
+extern int trigger_packet(struct trigset *, const struct pcap_pkthdr *, 
+	const u_char *, const struct pktinfo *);
+extern int trigger_due(struct trigset *, time_t, time_t *, time_t *);
+extern void trigger_free(struct trigset *);
+
+#endif /* _TRIGGER_H */
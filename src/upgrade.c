@@ -0,0 +1,194 @@
+/*
+ * upgrade.c - Hand the buffer over to a new binary
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "print.h"
+#include "str.h"
+#include "ringbuf.h"
+#include "upgrade.h"
+
+/* Local routines */
+static FILE *upgrade_tmpfile(void);
+
+
+/*
+ * Path of the running binary, read at startup since the file may 
+ * be replaced later. argv0 is used where /proc is missing.
+ * Returns an allocated path, or NULL if it can not be found.
+ */
+char *
+upgrade_self(const char *argv0)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+
+	if ( (n = readlink("/proc/self/exe", path, sizeof(path) - 1)) > 0) {
+		path[n] = '\0';
+		return(strdup(path));
+	}
+	
+	if ((strchr(argv0, '/') != NULL) && (realpath(argv0, path) != NULL))
+		return(strdup(path));
+	return(NULL);
+}
+
+
+/*
+ * Open an unnamed file for the state, in memory where possible
+ */
+static FILE *
+upgrade_tmpfile(void)
+{
+#ifdef SYS_memfd_create
+	FILE *fp;
+	int fd;
+
+	if ( (fd = syscall(SYS_memfd_create, "ringcapd.upgrade", 0)) >= 0) {
+		if ( (fp = fdopen(fd, "w+")) != NULL)
+			return(fp);
+		close(fd);
+	}
+#endif
+	return(tmpfile());
+}
+
+
+/*
+ * Replace the process with the binary at path, run with argv. The
+ * shared buffer is handed over, together with len bytes of data, 
+ * for the new process to take with upgrade_adopt(). Other open
+ * descriptors that are not closed on exec are left to it as well.
+ * Returns -1 if the binary could not be started, the buffer is
+ * then kept as it was.
+ */
+int
+upgrade_exec(const char *path, char * const *argv, struct ringbuf *rbuf, 
+	const void *data, size_t len)
+{
+	struct upgrade_hdr uh;
+	char env[32];
+	FILE *fp;
+
+	if ( (fp = upgrade_tmpfile()) == NULL) {
+		err_errno("upgrade: Failed to create state file");
+		return(-1);
+	}
+	
+	memset(&uh, 0x00, sizeof(uh));
+	memcpy(uh.uh_magic, UPGRADE_MAGIC, sizeof(uh.uh_magic));
+	uh.uh_version = UPGRADE_VERSION;
+	uh.uh_datalen = len;
+	if ((fwrite(&uh, sizeof(uh), 1, fp) != 1) || (fwrite(data, len, 1, fp) != 1)) {
+		err_errno("upgrade: Failed to write state");
+		fclose(fp);
+		return(-1);
+	}
+
+	/* Read from the start by the new process */
+	if ((ringbuf_save(rbuf, fp) < 0) || (fseek(fp, 0, SEEK_SET) < 0)) {
+		fclose(fp);
+		return(-1);
+	}
+
+	snprintf(env, sizeof(env), "%d", fileno(fp));
+	if ((setenv(UPGRADE_ENV, env, 1) < 0) || 
+			(fcntl(fileno(fp), F_SETFD, 0) < 0) || 
+			(fcntl(rbuf->shm_fd, F_SETFD, 0) < 0)) {
+		err_errno("upgrade: Failed to pass on the buffer");
+		goto fail;
+	}
+
+	execv(path, argv);
+	err_errno("upgrade: Failed to execute '%s'", path);
+
+fail:
+	fcntl(rbuf->shm_fd, F_SETFD, FD_CLOEXEC);
+	unsetenv(UPGRADE_ENV);
+	fclose(fp);
+	return(-1);
+}
+
+
+/*
+ * Take over the buffer and data handed over by upgrade_exec(), if
+ * the process was started by an upgrade. len must be that of the
+ * data written.
+ * Returns 1 if a buffer was taken over, 0 if there was no upgrade,
+ * -1 on error, after which the daemon starts with a new buffer.
+ */
+int
+upgrade_adopt(struct ringbuf **rbufp, void *data, size_t len)
+{
+	struct upgrade_hdr uh;
+	unsigned long fd;
+	const char *env;
+	FILE *fp;
+	int ret;
+
+	if ( (env = getenv(UPGRADE_ENV)) == NULL)
+		return(0);
+
+	/* Not passed on to anything we start */
+	fp = NULL;
+	if (str_isnum(env, &fd) && (fd <= INT_MAX))
+		fp = fdopen((int)fd, "r");
+	unsetenv(UPGRADE_ENV);
+	if (fp == NULL) {
+		err("upgrade: No state handed over on descriptor '%s'\n", env);
+		return(-1);
+	}
+
+	ret = -1;
+	if ((fread(&uh, sizeof(uh), 1, fp) != 1) || 
+			memcmp(uh.uh_magic, UPGRADE_MAGIC, sizeof(uh.uh_magic)))
+		err("upgrade: No state handed over on descriptor %lu\n", fd);
+	else if ((uh.uh_version != UPGRADE_VERSION) || (uh.uh_datalen != len))
+		err("upgrade: State is version %u with %u bytes of data, "
+			"expected version %u with %u\n", uh.uh_version, uh.uh_datalen, 
+			UPGRADE_VERSION, (u_int)len);
+	else if (fread(data, len, 1, fp) != 1)
+		err("upgrade: Truncated state\n");
+	else if ( (*rbufp = ringbuf_adopt(fp)) != NULL)
+		ret = 1;
+	
+	fclose(fp);
+	return(ret);
+}
@@ -0,0 +1,64 @@
+/*
+ * upgrade.h - Hand the buffer over to a new binary
+ *
+ *  Copyright (c) 2005 Claes M. Nyberg <pocpon@fuzzpoint.com>
+ *  All rights reserved, all wrongs reversed.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ *  AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ *  THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ *  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ *  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ *  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * $Id$
+ */
+
+#ifndef _UPGRADE_H
+#define _UPGRADE_H
+
+#include <sys/types.h>
+#include "ringbuf.h"
+
+/* Environment variable with the descriptor of the 
+ * state an upgrade hands to the new binary */
+#define UPGRADE_ENV		"RINGCAPD_UPGRADE"
+
+/*
+ * Header of the state handed over, followed by the data of the
+ * daemon and the state of the buffer from ringbuf_save(). The 
+ * version is incremented when the data changes layout, a binary
+ * expecting another starts over with an empty buffer.
+ */
+#define UPGRADE_MAGIC	"RCUPGRD"
+#define UPGRADE_VERSION	1
+
+struct upgrade_hdr {
+	char uh_magic[8];		/* UPGRADE_MAGIC */
+	u_int32_t uh_version;	/* UPGRADE_VERSION */
+	u_int32_t uh_datalen;	/* Bytes of daemon data */
+};
+
+/* upgrade.c */
+extern char *upgrade_self(const char *);
+extern int upgrade_exec(const char *, char * const *, struct ringbuf *, 
+	const void *, size_t);
+extern int upgrade_adopt(struct ringbuf **, void *, size_t);
+
+#endif /* _UPGRADE_H */